@@ -30,10 +30,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "png.h"
 #include "lzss.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define IBOOTIM_ROW_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__arm64__)
+#define IBOOTIM_ROW_NEON
+#include <arm_neon.h>
+#endif
+
 #define IBOOTIM_HEADER_SIZE sizeof(struct ibootim_header)
 
 typedef struct {
@@ -48,30 +60,6 @@ typedef struct {
 	uint8_t alpha;
 } ibootim_argb_pixel;
 
-typedef struct {
-	uint8_t red;
-	uint8_t green;
-	uint8_t blue;
-	uint8_t alpha;
-} pixel_rgba_8;
-
-typedef struct {
-	uint8_t brightness;
-	uint8_t alpha;
-} pixel_grayscale_8;
-
-typedef struct {
-	uint16_t red;
-	uint16_t green;
-	uint16_t blue;
-	uint16_t alpha;
-} pixel_rgba_16;
-
-typedef struct {
-	uint16_t brightness;
-	uint16_t alpha;
-} pixel_grayscale_16;
-
 const char *ibootim_signature = "iBootIm";
 
 struct ibootim_header {
@@ -123,9 +111,8 @@ static unsigned _adler32(unsigned adler, const unsigned char* data, unsigned len
 	return (s2 << 16) | s1;
 }
 
-static void *_ibootim_pixel_ptr_at(ibootim *image, uint16_t x, uint16_t y);
-static void _ibootim_set_pixel_with_params(ibootim *image, void *png_pixel, uint16_t x, uint16_t y, int bit_depth, int has_alpha);
 static inline void *_ibootim_get_row(ibootim *image, unsigned int row);
+static void _ibootim_convert_pixels_in_place(void *pixels, uint32_t count, ibootim_color_space_t targetColorSpace);
 
 static unsigned int _ibootim_pixel_size_for_color_space(ibootim_color_space_t colorSpace) {
 	switch (colorSpace) {
@@ -174,116 +161,155 @@ int ibootim_load(const char *path, ibootim **handle) {
 	return ibootim_load_at_index(path, handle, 0);
 }
 
-int ibootim_load_at_index(const char *path, ibootim **handle, unsigned int targetIndex) {
-	int rc;
-	const char *errorDesc;
-	ssize_t items;
-	FILE *inputFile;
+struct ibootim_container {
+	const uint8_t *map;
+	size_t size;
+	unsigned int count;
+	size_t *offsets;        //of each image header in the mapping
+	bool lastTruncated;     //the data of the last image runs past the end of the file
+	const char *stopReason; //why the walk stopped before the end of the file, if it did
+};
+
+static void _ibootim_read_header(ibootim_container *container, unsigned int index, struct ibootim_header *header) {
+	//headers sit wherever the previous image's data ended, so copy rather than cast
+	memcpy(header, container->map + container->offsets[index], IBOOTIM_HEADER_SIZE);
+}
+
+int ibootim_container_open(const char *path, ibootim_container **handle) {
+	struct stat st;
 	struct ibootim_header header;
-	unsigned int width, height;
-	unsigned int pixelsCount, pixelSize, compressedSize;
-	ssize_t expectedUncompressedSize, actualUncompressedSize;
-	
-	if (targetIndex == UINT_MAX) {
-		printf("[-] INTERNAL ERROR: iBootIm image index is equal to UINT_MAX.");
-		return EINVAL;
-	}
+	const char *errorDesc;
+	size_t offset = 0, capacity = 0;
 	
-	inputFile = fopen(path, "r");
-	if (!inputFile) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
 		printf("[-] Failed to open '%s': %s, aborting.\n", path, strerror(errno));
 		return ENOENT;
 	}
+	if (fstat(fd, &st) != 0) {
+		printf("[-] Failed to stat '%s': %s, aborting.\n", path, strerror(errno));
+		close(fd);
+		return EIO;
+	}
 	
-	for (unsigned int i = 0; i <= targetIndex; i++) {
-		//This complex structure was introduced to handle both errors in one place
-		items = fread(&header, sizeof(header), 1, inputFile);
-		if (items == 1) {
-			//sanity check the header
-			rc = _ibootim_sanity_check_header(&header, &errorDesc);
-			if (rc != 0) {
-				printf("[-] Invalid iBootIm image header: %s.\n", errorDesc);
-				fclose(inputFile);
-				return EFTYPE;
-			}
-			
-			//We don't need to skip the compressed data of the image we are going
-			//to load.
-			if (i != targetIndex) {
-				compressedSize = header.compressedSize;
-				rc = fseek(inputFile, compressedSize, SEEK_CUR);
-			} else {
-				rc = 0;
-			}
-		} else {
-			rc = -1;
+	ibootim_container *container = calloc(1, sizeof(ibootim_container));
+	if (!container) {
+		close(fd);
+		printf("[-] Memory allocation error, aborting.\n");
+		return ENOMEM;
+	}
+	container->size = (size_t)st.st_size;
+	if (container->size) {
+		void *map = mmap(NULL, container->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			printf("[-] Failed to map '%s': %s, aborting.\n", path, strerror(errno));
+			close(fd);
+			free(container);
+			return EIO;
 		}
-		
-		//Check if an error occurred during file I/O and handle report it to the
-		//user if so.
-		if (rc != 0) {
-			if (feof(inputFile)) {
-				printf("[-] iBootIm file is either truncated or image index is out of bounds.\n");
-				rc = EFTYPE;
-			} else {
-				printf("[-] An I/O error occurred while reading iBootIm header at index %u (offset %lu): %s.\n", i, ftell(inputFile), strerror(ferror(inputFile)));
-				rc = EIO;
+		container->map = map;
+	}
+	//the mapping stays valid without the descriptor
+	close(fd);
+	
+	//one pass over the headers
+	while (container->size - offset >= IBOOTIM_HEADER_SIZE) {
+		memcpy(&header, container->map + offset, IBOOTIM_HEADER_SIZE);
+		if (_ibootim_sanity_check_header(&header, &errorDesc) != 0) {
+			container->stopReason = errorDesc;
+			break;
+		}
+		if (container->count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			size_t *offsets = realloc(container->offsets, capacity * sizeof(size_t));
+			if (!offsets) {
+				ibootim_container_close(container);
+				printf("[-] Memory allocation error, aborting.\n");
+				return ENOMEM;
 			}
-			fclose(inputFile);
-			return rc;
+			container->offsets = offsets;
+		}
+		container->offsets[container->count++] = offset;
+		if (header.compressedSize > container->size - offset - IBOOTIM_HEADER_SIZE) {
+			container->lastTruncated = true;
+			break;
 		}
+		offset += IBOOTIM_HEADER_SIZE + header.compressedSize;
 	}
+	if (!container->stopReason && !container->lastTruncated && offset != container->size)
+		container->stopReason = "trailing data is shorter than a header";
 	
-	//No integer overflow should occur, since header.width and header.height
-	//are uint16_t, all the following variables are unsigned int.
-	width = header.width;
-	height = header.height;
-	pixelsCount = width * height;
-	pixelSize = _ibootim_pixel_size_for_color_space(header.colorSpace);
-	//Finally we get to the compressed and uncompressed sizes, not verifying
-	//them yet.
-	compressedSize = header.compressedSize;
-	expectedUncompressedSize = pixelsCount * pixelSize;
-	
-	//Read compressed image data.
-	void *compressedData = malloc(compressedSize);
-	if (!compressedData) {
-		fclose(inputFile);
-		printf("[-] Can not allocate memory for compressed image data, aborting.\n");
-		return ENOMEM;
-	}
-	items = fread(compressedData, 1, compressedSize, inputFile);
-	//nothing else will be read here, so close the file
-	fclose(inputFile);
-	if (items != compressedSize) {
-		//Determine what kind of error has occurred.
-		if (feof(inputFile)) {
-			printf("[-] iBootIm image data is truncated.\n");
-			rc = EFTYPE;
-		} else {
-			printf("[-] An I/O error occurred while reading iBootIm image data: %s.\n", strerror(ferror(inputFile)));
-			rc = EIO;
-		}
-		//clean up and return error code
-		free(compressedData);
-		return rc;
+	*handle = container;
+	return 0;
+}
+
+unsigned int ibootim_container_count(ibootim_container *container) {
+	return container->count;
+}
+
+static int _ibootim_container_check_index(ibootim_container *container, unsigned int index, bool report) {
+	if (index < container->count && !(container->lastTruncated && index == container->count - 1))
+		return 0;
+	if (!report)
+		return EFTYPE;
+	if (index < container->count || (container->lastTruncated && index == container->count)) {
+		printf("[-] iBootIm image data is truncated.\n");
+	} else if (index == container->count && container->stopReason) {
+		printf("[-] Invalid iBootIm image header: %s.\n", container->stopReason);
+	} else {
+		printf("[-] iBootIm image index %u is out of bounds.\n", index);
 	}
+	return EFTYPE;
+}
+
+int ibootim_container_verify(ibootim_container *container, unsigned int index) {
+	struct ibootim_header header;
+	//whatever is wrong with the index gets reported when the image is loaded
+	int rc = _ibootim_container_check_index(container, index, false);
+	if (rc != 0) return rc;
 	
+	_ibootim_read_header(container, index, &header);
 	unsigned headerAdler = _adler32(1,
 									(void *)&header.compressionType,
 									sizeof(header) - offsetof(struct ibootim_header, compressionType));
-	unsigned imageAdler = _adler32(headerAdler, compressedData, compressedSize);
+	unsigned imageAdler = _adler32(headerAdler,
+								   container->map + container->offsets[index] + IBOOTIM_HEADER_SIZE,
+								   header.compressedSize);
 	if (header.adler != imageAdler) {
 		printf("[!] Checksum in the header is not valid (0x%08x != 0x%08x).\n", imageAdler, header.adler);
+		return EFTYPE;
 	}
+	return 0;
+}
+
+int ibootim_container_load(ibootim_container *container, unsigned int index, ibootim **handle) {
+	struct ibootim_header header;
+	unsigned int width, height;
+	unsigned int pixelsCount, pixelSize;
+	ssize_t expectedUncompressedSize, actualUncompressedSize;
+	int rc = _ibootim_container_check_index(container, index, true);
+	if (rc != 0) return rc;
+	
+	_ibootim_read_header(container, index, &header);
+	
+	//No integer overflow should occur, since header.width and header.height
+	//are uint16_t, all the following variables are unsigned int.
+	width = header.width;
+	height = header.height;
+	pixelsCount = width * height;
+	pixelSize = _ibootim_pixel_size_for_color_space(header.colorSpace);
+	expectedUncompressedSize = pixelsCount * pixelSize;
 	
-	//decompress pixel data
+	//decompress pixel data straight out of the mapping
 	void *pixelData = malloc(expectedUncompressedSize);
+	if (!pixelData) {
+		printf("[-] Can not allocate memory for image data, aborting.\n");
+		return ENOMEM;
+	}
 	actualUncompressedSize = lzss_decompress(pixelData,
 											 (unsigned int)expectedUncompressedSize,
-											 compressedData,
-											 compressedSize);
-	free(compressedData);
+											 (uint8_t *)container->map + container->offsets[index] + IBOOTIM_HEADER_SIZE,
+											 header.compressedSize);
 	if (actualUncompressedSize <= 0) {
 		free(pixelData);
 		printf("[-] An error occurred during decompression of pixel data, aborting.\n");
@@ -311,41 +337,51 @@ int ibootim_load_at_index(const char *path, ibootim **handle, unsigned int targe
 	//write handle and return the image gracefully
 	*handle = image;
 	return 0;
-};
+}
+
+void ibootim_container_close(ibootim_container *container) {
+	if (container) {
+		if (container->map) munmap((void *)container->map, container->size);
+		free(container->offsets);
+		free(container);
+	}
+}
+
+int ibootim_load_at_index(const char *path, ibootim **handle, unsigned int targetIndex) {
+	ibootim_container *container;
+	int rc;
+	
+	if (targetIndex == UINT_MAX) {
+		printf("[-] INTERNAL ERROR: iBootIm image index is equal to UINT_MAX.");
+		return EINVAL;
+	}
+	
+	rc = ibootim_container_open(path, &container);
+	if (rc != 0) return rc;
+	
+	//a bad checksum is only worth a warning here
+	ibootim_container_verify(container, targetIndex);
+	rc = ibootim_container_load(container, targetIndex, handle);
+	ibootim_container_close(container);
+	return rc;
+}
 
 int ibootim_convert_to_colorspace(ibootim *image, ibootim_color_space_t targetColorSpace) {
 	int rc;
 	ibootim_color_space_t sourceColorSpace;
-	ibootim_argb_pixel *argbPixelPtr;
-	ibootim_grayscale_pixel *grayscalePixelPtr;
 	size_t pixelsCount, bufferSize;
 	void *pixelBuffer;
 	
 	sourceColorSpace = image->colorSpace;
 	if (sourceColorSpace == targetColorSpace) return 0; // nothing to do here
-	pixelsCount = image->width * image->height;
+	pixelsCount = (size_t)image->width * image->height;
 	
 	if (targetColorSpace == ibootim_color_space_grayscale) {
 		if (sourceColorSpace == ibootim_color_space_argb) {
-			argbPixelPtr = image->pixels.argb;
-			grayscalePixelPtr = image->pixels.grayscale;
-			
 			puts("[*] Converting image from argb to grayscale color space...");
 			
-			uint8_t brightness, alpha;
-			for (unsigned int i = 0; i < pixelsCount; i++) {
-				//first get the values, since structures are in the same buffer
-				alpha = argbPixelPtr->alpha;
-				brightness = ((unsigned int)argbPixelPtr->red +
-							  (unsigned int)argbPixelPtr->green +
-							  (unsigned int)argbPixelPtr->blue) / 3;
-				//then write them down
-				grayscalePixelPtr->brightness = brightness;
-				grayscalePixelPtr->alpha = alpha;
-				//finally advance the pointers
-				argbPixelPtr++;
-				grayscalePixelPtr++;
-			}
+			//brightness is (red + green + blue) / 3, written over the front of the same buffer
+			_ibootim_convert_pixels_in_place(image->pixels.pointer, (uint32_t)pixelsCount, ibootim_color_space_grayscale);
 			
 			//Try to reallocate the buffer and leave it as is if we get an error for
 			//some weird reason.
@@ -366,7 +402,7 @@ int ibootim_convert_to_colorspace(ibootim *image, ibootim_color_space_t targetCo
 	} else if (targetColorSpace == ibootim_color_space_argb) {
 		if (sourceColorSpace == ibootim_color_space_grayscale) {
 			//Try to increase the buffer size and abort if that is not possible.
-			bufferSize = pixelsCount * sizeof(ibootim_grayscale_pixel);
+			bufferSize = pixelsCount * sizeof(ibootim_argb_pixel);
 			pixelBuffer = realloc(image->pixels.pointer, bufferSize);
 			if (pixelBuffer) image->pixels.pointer = pixelBuffer;
 			else {
@@ -374,26 +410,11 @@ int ibootim_convert_to_colorspace(ibootim *image, ibootim_color_space_t targetCo
 				return ENOMEM;
 			}
 			
-			//Assign pointers after the buffer has been reallocated.
-			argbPixelPtr = &image->pixels.argb[pixelsCount];
-			grayscalePixelPtr = &image->pixels.grayscale[pixelsCount];
-			
 			puts("[*] Converting image from grayscale to argb color space...");
 			
-			//Convert pixels from the last one to the first one to not overwrite
+			//Pixels are converted from the last one to the first one to not overwrite
 			//unconverted grayscale pixels with converted argb pixels.
-			uint8_t brightness, alpha;
-			for (size_t i = pixelsCount; i > 0; i--) {
-				//First reduce the pointers.
-				argbPixelPtr--;
-				grayscalePixelPtr--;
-				//Then read alpha and brightness before the may be overwritten.
-				alpha = grayscalePixelPtr->alpha;
-				brightness = grayscalePixelPtr->brightness;
-				//Finally write them down to the argb pixel.
-				argbPixelPtr->red = argbPixelPtr->green = argbPixelPtr->blue = brightness;
-				argbPixelPtr->alpha = alpha;
-			}
+			_ibootim_convert_pixels_in_place(image->pixels.pointer, (uint32_t)pixelsCount, ibootim_color_space_argb);
 			
 			//Set colorSpace field after it's all done and return success.
 			image->colorSpace = ibootim_color_space_argb;
@@ -410,72 +431,115 @@ int ibootim_convert_to_colorspace(ibootim *image, ibootim_color_space_t targetCo
 	return rc;
 }
 
-int ibootim_write(ibootim *image, const char *path) {
-	int rc;
-	FILE *outputFile;
-	struct ibootim_header header;
+/* compresses the pixels into payload, which must hold lzss_compress_bound() of them, and fills in the header */
+static int _ibootim_encode_into(ibootim *image, struct ibootim_header *header, uint8_t *payload, size_t payloadCap) {
 	unsigned int uncompressedSize = _ibootim_get_pixel_buffer_size(image);
-	unsigned int estimatedMaxCompSize = uncompressedSize;
 	ssize_t actualCompSize;
 	
-	outputFile = fopen(path, "w");
-	if (!outputFile) {
-		printf("[-] Failed to open '%s' for writing: %s\n", path, strerror(errno));
-		return ENOENT;
+	memcpy(header->signature, ibootim_signature, 8);
+	header->width = image->width;
+	header->height = image->height;
+	header->offsetX = image->offsetX;
+	header->offsetY = image->offsetY;
+	header->colorSpace = image->colorSpace;
+	header->compressionType = image->compressionType;
+	memset(header->reserved, 0, sizeof(header->reserved));
+	
+	actualCompSize = lzss_compress_level(payload,
+										 (unsigned int)payloadCap,
+										 image->pixels.pointer,
+										 uncompressedSize,
+										 LZSS_LEVEL_ULTRA);
+	if (actualCompSize <= 0) {
+		printf("[-] An error occurred while compressing pixel data: %s.\n", lzss_strerror(lzss_errno));
+		return lzss_errno == LZSS_NOMEM ? ENOMEM : EFAULT;
 	}
-	ftruncate(fileno(outputFile), 0);
 	
-	memcpy(header.signature, ibootim_signature, 8);
-	header.width = image->width;
-	header.height = image->height;
-	header.offsetX = image->offsetX;
-	header.offsetY = image->offsetY;
-	header.colorSpace = image->colorSpace;
-	header.compressionType = image->compressionType;
-	memset(header.reserved, 0, sizeof(header.reserved));
+	header->compressedSize = (uint32_t)actualCompSize;
+	unsigned headerAdler = _adler32(1, (void *)&header->compressionType, sizeof(*header) - offsetof(struct ibootim_header, compressionType));
+	header->adler = _adler32(headerAdler, payload, (unsigned)actualCompSize);
+	return 0;
+}
+
+int ibootim_encode(ibootim *image, void **buf, size_t *len) {
+	size_t payloadCap = lzss_compress_bound(_ibootim_get_pixel_buffer_size(image));
+	struct ibootim_header header;
+	int rc;
+	
+	uint8_t *out = malloc(IBOOTIM_HEADER_SIZE + payloadCap);
+	if (!out) {
+		printf("[-] Memory allocation failed\n");
+		return ENOMEM;
+	}
 	
-	void *compressedDataBuf = malloc(estimatedMaxCompSize);
+	rc = _ibootim_encode_into(image, &header, out + IBOOTIM_HEADER_SIZE, payloadCap);
+	if (rc != 0) {
+		free(out);
+		return rc;
+	}
+	memcpy(out, &header, IBOOTIM_HEADER_SIZE);
+	*len = IBOOTIM_HEADER_SIZE + header.compressedSize;
+	
+	//give back what the worst case did not need
+	void *shrunk = realloc(out, *len);
+	*buf = shrunk ? shrunk : out;
+	return 0;
+}
+
+int ibootim_write(ibootim *image, const char *path) {
+	struct ibootim_header header;
+	size_t payloadCap = lzss_compress_bound(_ibootim_get_pixel_buffer_size(image));
+	int rc;
+	
+	void *compressedDataBuf = malloc(payloadCap);
 	if (!compressedDataBuf) {
 		printf("[-] Memory allocation failed\n");
 		return ENOMEM;
 	}
 	
-	//do this while buffer is not large enough
-	while ((actualCompSize = lzss_compress(compressedDataBuf,
-										   estimatedMaxCompSize,
-										   image->pixels.pointer,
-										   uncompressedSize)) <= 0) {
-		if (lzss_errno != LZSS_NOMEM) {
-			printf("[-] An error occurred while compressing pixel data, aborting.\n");
-			free(compressedDataBuf);
-			return EFAULT;
-		} else {
-			printf("[!] Compressed pixel data is longer than expected, enlarging buffer.\n");
-			estimatedMaxCompSize += 0x100;
-			free(compressedDataBuf);
-			compressedDataBuf = malloc(estimatedMaxCompSize);
-			if (!compressedDataBuf) {
-				printf("[-] Larger buffer allocation failed, aborting.\n");
-				return ENOMEM;
-			}
-		}
+	rc = _ibootim_encode_into(image, &header, compressedDataBuf, payloadCap);
+	if (rc != 0) {
+		free(compressedDataBuf);
+		return rc;
 	}
 	
-	//complete the header and write it along with data
-	header.compressedSize = (uint32_t)actualCompSize;
-	unsigned headerAdler = _adler32(1, (void *)&header.compressionType, sizeof(header) - offsetof(struct ibootim_header, compressionType));
-	unsigned imageAdler = _adler32(headerAdler, compressedDataBuf, (unsigned)actualCompSize);
-	header.adler = imageAdler;
-	rc = (int)fwrite(&header, sizeof(header), 1, outputFile);
-	if (rc != 1) {
-		printf("[-] Failed to write iBootIm header, aborting.\n");
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		printf("[-] Failed to open '%s' for writing: %s\n", path, strerror(errno));
 		free(compressedDataBuf);
-		return EIO;
+		return ENOENT;
+	}
+	
+	//header and data in one call, picking up after short writes
+	struct iovec iov[2] = {
+		{ &header, IBOOTIM_HEADER_SIZE },
+		{ compressedDataBuf, header.compressedSize }
+	};
+	struct iovec *vec = iov;
+	int count = 2;
+	while (count > 0) {
+		ssize_t written = writev(fd, vec, count);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0) {
+			printf("[-] Failed to write iBootIm image: %s\n", strerror(errno));
+			close(fd);
+			free(compressedDataBuf);
+			return EIO;
+		}
+		while (count > 0 && (size_t)written >= vec->iov_len) {
+			written -= vec->iov_len;
+			vec++;
+			count--;
+		}
+		if (count > 0) {
+			vec->iov_base = (uint8_t *)vec->iov_base + written;
+			vec->iov_len -= written;
+		}
 	}
-	rc = (int)fwrite(compressedDataBuf, (uint32_t)actualCompSize, 1, outputFile);
 	free(compressedDataBuf);
-	if (rc != 1) {
-		printf("[-] Failed to write compressed pixel data, aborting.\n");
+	if (close(fd) != 0) {
+		printf("[-] Failed to write iBootIm image: %s\n", strerror(errno));
 		return EIO;
 	}
 	
@@ -483,6 +547,580 @@ int ibootim_write(ibootim *image, const char *path) {
 	return 0;
 }
 
+/* Pixel row conversion
+ *
+ * Rows come out of libpng untransformed and are converted straight into the
+ * image: RGB(A) to BGRA and grey(-alpha) to grey-alpha, 16-bit samples cut
+ * to their high byte, alpha inverted and missing alpha written as 0. This is
+ * what the png_set_* transforms in the fallback path produce. The converter
+ * is picked once per image; the vector versions finish their row with the
+ * scalar one.
+ *
+ * The two colorspace conversions take the whole pixel buffer as one row and
+ * run in place, dst == src: argb to grey front to back, since it shrinks,
+ * and grey to argb back to front. */
+
+typedef void (*_ibootim_row_fn)(uint8_t *dst, const uint8_t *src, uint32_t width);
+
+typedef enum {
+	_ibootim_row_rgba8,
+	_ibootim_row_rgb8,
+	_ibootim_row_rgba16,
+	_ibootim_row_rgb16,
+	_ibootim_row_ga8,
+	_ibootim_row_g8,
+	_ibootim_row_ga16,
+	_ibootim_row_g16,
+	_ibootim_row_argb_to_grey,
+	_ibootim_row_grey_to_argb,
+	_ibootim_row_format_count
+} _ibootim_row_format_t;
+
+struct _ibootim_row_impl {
+	const char *name;
+	_ibootim_row_fn convert[_ibootim_row_format_count];
+};
+
+static void _ibootim_row_rgba8_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 4, dst += 4) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = ~src[3];
+	}
+}
+
+static void _ibootim_row_rgb8_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 3, dst += 4) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = 0;
+	}
+}
+
+static void _ibootim_row_rgba16_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	//16-bit samples are big endian, so the high byte comes first
+	for (uint32_t x = 0; x < width; x++, src += 8, dst += 4) {
+		dst[0] = src[4];
+		dst[1] = src[2];
+		dst[2] = src[0];
+		dst[3] = ~src[6];
+	}
+}
+
+static void _ibootim_row_rgb16_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 6, dst += 4) {
+		dst[0] = src[4];
+		dst[1] = src[2];
+		dst[2] = src[0];
+		dst[3] = 0;
+	}
+}
+
+static void _ibootim_row_ga8_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 2, dst += 2) {
+		dst[0] = src[0];
+		dst[1] = ~src[1];
+	}
+}
+
+static void _ibootim_row_g8_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 1, dst += 2) {
+		dst[0] = src[0];
+		dst[1] = 0;
+	}
+}
+
+static void _ibootim_row_ga16_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 4, dst += 2) {
+		dst[0] = src[0];
+		dst[1] = ~src[2];
+	}
+}
+
+static void _ibootim_row_g16_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 2, dst += 2) {
+		dst[0] = src[0];
+		dst[1] = 0;
+	}
+}
+
+static void _ibootim_row_argb_to_grey_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++, src += 4, dst += 2) {
+		//read the whole pixel first, the first grey pixel overwrites it
+		unsigned int sum = (unsigned int)src[0] + src[1] + src[2];
+		uint8_t alpha = src[3];
+		dst[0] = sum / 3;
+		dst[1] = alpha;
+	}
+}
+
+static void _ibootim_row_grey_to_argb_scalar(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	for (uint32_t x = width; x > 0; x--) {
+		uint8_t brightness = src[2 * x - 2], alpha = src[2 * x - 1];
+		dst[4 * x - 4] = dst[4 * x - 3] = dst[4 * x - 2] = brightness;
+		dst[4 * x - 1] = alpha;
+	}
+}
+
+#ifdef IBOOTIM_ROW_X86
+//SSE2 has no byte shuffle, so RGBA is swizzled with shifts on 32-bit pixels and 3-channel rows stay scalar
+static inline __m128i _ibootim_rgba8_to_bgra_sse2(__m128i v) {
+	const __m128i green = _mm_set1_epi32(0x0000ff00), blue = _mm_set1_epi32(0x000000ff);
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	__m128i ga = _mm_xor_si128(_mm_and_si128(v, _mm_or_si128(green, alpha)), alpha);
+	__m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), blue);
+	__m128i b = _mm_slli_epi32(_mm_and_si128(v, blue), 16);
+	return _mm_or_si128(ga, _mm_or_si128(r, b));
+}
+
+//high bytes of the big endian 16-bit samples of two vectors, in order
+static inline __m128i _ibootim_high_bytes_sse2(__m128i a, __m128i b) {
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	return _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+}
+
+static void _ibootim_row_rgba8_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+		_mm_storeu_si128((__m128i *)(dst + 4 * x), _ibootim_rgba8_to_bgra_sse2(v));
+	}
+	_ibootim_row_rgba8_scalar(dst + 4 * x, src + 4 * x, width - x);
+}
+
+static void _ibootim_row_rgba16_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 8 * x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 8 * x + 16));
+		_mm_storeu_si128((__m128i *)(dst + 4 * x), _ibootim_rgba8_to_bgra_sse2(_ibootim_high_bytes_sse2(a, b)));
+	}
+	_ibootim_row_rgba16_scalar(dst + 4 * x, src + 8 * x, width - x);
+}
+
+static void _ibootim_row_ga8_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m128i alpha = _mm_set1_epi16((short)0xff00);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_xor_si128(v, alpha));
+	}
+	_ibootim_row_ga8_scalar(dst + 2 * x, src + 2 * x, width - x);
+}
+
+static void _ibootim_row_g8_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x + 16), _mm_unpackhi_epi8(v, zero));
+	}
+	_ibootim_row_g8_scalar(dst + 2 * x, src + x, width - x);
+}
+
+static void _ibootim_row_ga16_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m128i alpha = _mm_set1_epi16((short)0xff00);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 4 * x + 16));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_xor_si128(_ibootim_high_bytes_sse2(a, b), alpha));
+	}
+	_ibootim_row_ga16_scalar(dst + 2 * x, src + 4 * x, width - x);
+}
+
+static void _ibootim_row_g16_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	//masking each sample to its first byte leaves exactly the grey-alpha pair
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_and_si128(v, low));
+	}
+	_ibootim_row_g16_scalar(dst + 2 * x, src + 2 * x, width - x);
+}
+
+//(b + g + r) / 3 of four 32-bit BGRA pixels; sums are at most 765 so packs cannot saturate
+static inline __m128i _ibootim_sum_bgr_sse2(__m128i v) {
+	const __m128i low = _mm_set1_epi32(0xff);
+	return _mm_add_epi32(_mm_add_epi32(_mm_and_si128(v, low), _mm_and_si128(_mm_srli_epi32(v, 8), low)),
+						 _mm_and_si128(_mm_srli_epi32(v, 16), low));
+}
+
+static void _ibootim_row_argb_to_grey_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	//x * 0xaaab >> 17 is x / 3 for every x below 2^16
+	const __m128i third = _mm_set1_epi16((short)0xaaab);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 4 * x + 16));
+		__m128i sum = _mm_packs_epi32(_ibootim_sum_bgr_sse2(a), _ibootim_sum_bgr_sse2(b));
+		__m128i brightness = _mm_srli_epi16(_mm_mulhi_epu16(sum, third), 1);
+		__m128i alpha = _mm_packs_epi32(_mm_srli_epi32(a, 24), _mm_srli_epi32(b, 24));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_or_si128(brightness, _mm_slli_epi16(alpha, 8)));
+	}
+	_ibootim_row_argb_to_grey_scalar(dst + 2 * x, src + 4 * x, width - x);
+}
+
+static void _ibootim_row_grey_to_argb_sse2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	//the low half of each output pixel is the brightness twice, the high half the input pixel itself
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	uint32_t x = width;
+	for (; x >= 8; x -= 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * x - 16));
+		__m128i brightness = _mm_and_si128(v, low);
+		brightness = _mm_or_si128(brightness, _mm_slli_epi16(brightness, 8));
+		_mm_storeu_si128((__m128i *)(dst + 4 * x - 32), _mm_unpacklo_epi16(brightness, v));
+		_mm_storeu_si128((__m128i *)(dst + 4 * x - 16), _mm_unpackhi_epi16(brightness, v));
+	}
+	_ibootim_row_grey_to_argb_scalar(dst, src, x);
+}
+
+//two unaligned 16-byte loads into the lanes of one vector
+__attribute__((target("avx2")))
+static inline __m256i _ibootim_load2_avx2(const uint8_t *lo, const uint8_t *hi) {
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)), _mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_rgba8_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m256i swap = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+										  2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * x));
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x), _mm256_xor_si256(_mm256_shuffle_epi8(v, swap), alpha));
+	}
+	_ibootim_row_rgba8_scalar(dst + 4 * x, src + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_rgb8_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	//each lane takes 4 pixels out of a 16-byte load, the second load reads 4 bytes past them
+	const __m256i swap = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+										  2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	uint32_t x = 0;
+	for (; x + 10 <= width; x += 8) {
+		__m256i v = _ibootim_load2_avx2(src + 3 * x, src + 3 * x + 12);
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x), _mm256_shuffle_epi8(v, swap));
+	}
+	_ibootim_row_rgb8_scalar(dst + 4 * x, src + 3 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_rgba16_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m256i low = _mm256_set1_epi16(0x00ff);
+	const __m256i swap = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+										  2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 8 * x)), low);
+		__m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 8 * x + 32)), low);
+		//packus works per lane, put the quadwords back in pixel order
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x), _mm256_xor_si256(_mm256_shuffle_epi8(v, swap), alpha));
+	}
+	_ibootim_row_rgba16_scalar(dst + 4 * x, src + 8 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_rgb16_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	//2 pixels per 16-byte load; the first pair of loads fills the low half of each lane, the second the high half
+	const __m256i lo = _mm256_setr_epi8(4, 2, 0, -1, 10, 8, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+										4, 2, 0, -1, 10, 8, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m256i hi = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 4, 2, 0, -1, 10, 8, 6, -1,
+										-1, -1, -1, -1, -1, -1, -1, -1, 4, 2, 0, -1, 10, 8, 6, -1);
+	uint32_t x = 0;
+	for (; x + 9 <= width; x += 8) {
+		const uint8_t *p = src + 6 * x;
+		__m256i a = _mm256_shuffle_epi8(_ibootim_load2_avx2(p, p + 12), lo);
+		__m256i b = _mm256_shuffle_epi8(_ibootim_load2_avx2(p + 24, p + 36), hi);
+		__m256i v = _mm256_permute4x64_epi64(_mm256_or_si256(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x), v);
+	}
+	_ibootim_row_rgb16_scalar(dst + 4 * x, src + 6 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_ga8_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * x));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * x), _mm256_xor_si256(v, alpha));
+	}
+	_ibootim_row_ga8_scalar(dst + 2 * x, src + 2 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_g8_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + x)));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * x), v);
+	}
+	_ibootim_row_g8_scalar(dst + 2 * x, src + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_ga16_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m256i low = _mm256_set1_epi16(0x00ff);
+	const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 4 * x)), low);
+		__m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 4 * x + 32)), low);
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(dst + 2 * x), _mm256_xor_si256(v, alpha));
+	}
+	_ibootim_row_ga16_scalar(dst + 2 * x, src + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_g16_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m256i low = _mm256_set1_epi16(0x00ff);
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * x));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * x), _mm256_and_si256(v, low));
+	}
+	_ibootim_row_g16_scalar(dst + 2 * x, src + 2 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i _ibootim_sum_bgr_avx2(__m256i v) {
+	const __m256i low = _mm256_set1_epi32(0xff);
+	return _mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(v, low), _mm256_and_si256(_mm256_srli_epi32(v, 8), low)),
+							_mm256_and_si256(_mm256_srli_epi32(v, 16), low));
+}
+
+__attribute__((target("avx2")))
+static void _ibootim_row_argb_to_grey_avx2(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	const __m256i third = _mm256_set1_epi16((short)0xaaab);
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + 4 * x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 4 * x + 32));
+		__m256i sum = _mm256_packs_epi32(_ibootim_sum_bgr_avx2(a), _ibootim_sum_bgr_avx2(b));
+		__m256i brightness = _mm256_srli_epi16(_mm256_mulhi_epu16(sum, third), 1);
+		__m256i alpha = _mm256_packs_epi32(_mm256_srli_epi32(a, 24), _mm256_srli_epi32(b, 24));
+		__m256i v = _mm256_or_si256(brightness, _mm256_slli_epi16(alpha, 8));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * x), _mm256_permute4x64_epi64(v, 0xd8));
+	}
+	_ibootim_row_argb_to_grey_scalar(dst + 2 * x, src + 4 * x, width - x);
+}
+#endif
+
+#ifdef IBOOTIM_ROW_NEON
+//the structure loads and stores do the interleaving; a little endian load of a 16-bit sample has its high byte in the low half
+static void _ibootim_row_rgba8_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t v = vld4q_u8(src + 4 * x), o;
+		o.val[0] = v.val[2];
+		o.val[1] = v.val[1];
+		o.val[2] = v.val[0];
+		o.val[3] = vmvnq_u8(v.val[3]);
+		vst4q_u8(dst + 4 * x, o);
+	}
+	_ibootim_row_rgba8_scalar(dst + 4 * x, src + 4 * x, width - x);
+}
+
+static void _ibootim_row_rgb8_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x3_t v = vld3q_u8(src + 3 * x);
+		uint8x16x4_t o;
+		o.val[0] = v.val[2];
+		o.val[1] = v.val[1];
+		o.val[2] = v.val[0];
+		o.val[3] = vdupq_n_u8(0);
+		vst4q_u8(dst + 4 * x, o);
+	}
+	_ibootim_row_rgb8_scalar(dst + 4 * x, src + 3 * x, width - x);
+}
+
+static void _ibootim_row_rgba16_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		uint16x8x4_t v = vld4q_u16((const uint16_t *)(src + 8 * x));
+		uint8x8x4_t o;
+		o.val[0] = vmovn_u16(v.val[2]);
+		o.val[1] = vmovn_u16(v.val[1]);
+		o.val[2] = vmovn_u16(v.val[0]);
+		o.val[3] = vmvn_u8(vmovn_u16(v.val[3]));
+		vst4_u8(dst + 4 * x, o);
+	}
+	_ibootim_row_rgba16_scalar(dst + 4 * x, src + 8 * x, width - x);
+}
+
+static void _ibootim_row_rgb16_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		uint16x8x3_t v = vld3q_u16((const uint16_t *)(src + 6 * x));
+		uint8x8x4_t o;
+		o.val[0] = vmovn_u16(v.val[2]);
+		o.val[1] = vmovn_u16(v.val[1]);
+		o.val[2] = vmovn_u16(v.val[0]);
+		o.val[3] = vdup_n_u8(0);
+		vst4_u8(dst + 4 * x, o);
+	}
+	_ibootim_row_rgb16_scalar(dst + 4 * x, src + 6 * x, width - x);
+}
+
+static void _ibootim_row_ga8_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x2_t v = vld2q_u8(src + 2 * x);
+		v.val[1] = vmvnq_u8(v.val[1]);
+		vst2q_u8(dst + 2 * x, v);
+	}
+	_ibootim_row_ga8_scalar(dst + 2 * x, src + 2 * x, width - x);
+}
+
+static void _ibootim_row_g8_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x2_t o;
+		o.val[0] = vld1q_u8(src + x);
+		o.val[1] = vdupq_n_u8(0);
+		vst2q_u8(dst + 2 * x, o);
+	}
+	_ibootim_row_g8_scalar(dst + 2 * x, src + x, width - x);
+}
+
+static void _ibootim_row_ga16_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		uint16x8x2_t v = vld2q_u16((const uint16_t *)(src + 4 * x));
+		uint8x8x2_t o;
+		o.val[0] = vmovn_u16(v.val[0]);
+		o.val[1] = vmvn_u8(vmovn_u16(v.val[1]));
+		vst2_u8(dst + 2 * x, o);
+	}
+	_ibootim_row_ga16_scalar(dst + 2 * x, src + 4 * x, width - x);
+}
+
+static void _ibootim_row_g16_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t v = vandq_u8(vld1q_u8(src + 2 * x), vreinterpretq_u8_u16(vdupq_n_u16(0x00ff)));
+		uint8x16_t w = vandq_u8(vld1q_u8(src + 2 * x + 16), vreinterpretq_u8_u16(vdupq_n_u16(0x00ff)));
+		vst1q_u8(dst + 2 * x, v);
+		vst1q_u8(dst + 2 * x + 16, w);
+	}
+	_ibootim_row_g16_scalar(dst + 2 * x, src + 2 * x, width - x);
+}
+
+static void _ibootim_row_argb_to_grey_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t v = vld4q_u8(src + 4 * x);
+		uint16x8_t lo = vaddw_u8(vaddl_u8(vget_low_u8(v.val[0]), vget_low_u8(v.val[1])), vget_low_u8(v.val[2]));
+		uint16x8_t hi = vaddw_u8(vaddl_u8(vget_high_u8(v.val[0]), vget_high_u8(v.val[1])), vget_high_u8(v.val[2]));
+		//x * 0xaaab >> 17 is x / 3 for every x below 2^16
+		uint16x4_t l0 = vshrn_n_u32(vmull_n_u16(vget_low_u16(lo), 0xaaab), 16);
+		uint16x4_t l1 = vshrn_n_u32(vmull_n_u16(vget_high_u16(lo), 0xaaab), 16);
+		uint16x4_t h0 = vshrn_n_u32(vmull_n_u16(vget_low_u16(hi), 0xaaab), 16);
+		uint16x4_t h1 = vshrn_n_u32(vmull_n_u16(vget_high_u16(hi), 0xaaab), 16);
+		uint8x16x2_t o;
+		o.val[0] = vcombine_u8(vshrn_n_u16(vcombine_u16(l0, l1), 1), vshrn_n_u16(vcombine_u16(h0, h1), 1));
+		o.val[1] = v.val[3];
+		vst2q_u8(dst + 2 * x, o);
+	}
+	_ibootim_row_argb_to_grey_scalar(dst + 2 * x, src + 4 * x, width - x);
+}
+
+static void _ibootim_row_grey_to_argb_neon(uint8_t *dst, const uint8_t *src, uint32_t width) {
+	uint32_t x = width;
+	for (; x >= 16; x -= 16) {
+		uint8x16x2_t v = vld2q_u8(src + 2 * x - 32);
+		uint8x16x4_t o;
+		o.val[0] = o.val[1] = o.val[2] = v.val[0];
+		o.val[3] = v.val[1];
+		vst4q_u8(dst + 4 * x - 64, o);
+	}
+	_ibootim_row_grey_to_argb_scalar(dst, src, x);
+}
+#endif
+
+static const struct _ibootim_row_impl _ibootim_row_impls[] = {
+	{ "scalar", {
+		_ibootim_row_rgba8_scalar, _ibootim_row_rgb8_scalar, _ibootim_row_rgba16_scalar, _ibootim_row_rgb16_scalar,
+		_ibootim_row_ga8_scalar, _ibootim_row_g8_scalar, _ibootim_row_ga16_scalar, _ibootim_row_g16_scalar,
+		_ibootim_row_argb_to_grey_scalar, _ibootim_row_grey_to_argb_scalar } },
+#ifdef IBOOTIM_ROW_X86
+	{ "sse2", {
+		_ibootim_row_rgba8_sse2, _ibootim_row_rgb8_scalar, _ibootim_row_rgba16_sse2, _ibootim_row_rgb16_scalar,
+		_ibootim_row_ga8_sse2, _ibootim_row_g8_sse2, _ibootim_row_ga16_sse2, _ibootim_row_g16_sse2,
+		_ibootim_row_argb_to_grey_sse2, _ibootim_row_grey_to_argb_sse2 } },
+	//grey to argb is a widening copy bound by memory, where 32-byte stores only add line splits
+	{ "avx2", {
+		_ibootim_row_rgba8_avx2, _ibootim_row_rgb8_avx2, _ibootim_row_rgba16_avx2, _ibootim_row_rgb16_avx2,
+		_ibootim_row_ga8_avx2, _ibootim_row_g8_avx2, _ibootim_row_ga16_avx2, _ibootim_row_g16_avx2,
+		_ibootim_row_argb_to_grey_avx2, _ibootim_row_grey_to_argb_sse2 } },
+#endif
+#ifdef IBOOTIM_ROW_NEON
+	{ "neon", {
+		_ibootim_row_rgba8_neon, _ibootim_row_rgb8_neon, _ibootim_row_rgba16_neon, _ibootim_row_rgb16_neon,
+		_ibootim_row_ga8_neon, _ibootim_row_g8_neon, _ibootim_row_ga16_neon, _ibootim_row_g16_neon,
+		_ibootim_row_argb_to_grey_neon, _ibootim_row_grey_to_argb_neon } },
+#endif
+};
+
+static const struct _ibootim_row_impl *_ibootim_row_chosen;
+
+static void _ibootim_row_choose(void) {
+	//the table is ordered from slowest to fastest
+	unsigned int i = sizeof(_ibootim_row_impls) / sizeof(_ibootim_row_impls[0]) - 1;
+#ifdef IBOOTIM_ROW_X86
+	if (!__builtin_cpu_supports("avx2")) i--;
+#endif
+	_ibootim_row_chosen = &_ibootim_row_impls[i];
+}
+
+static const struct _ibootim_row_impl *_ibootim_row_select(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, _ibootim_row_choose);
+	return _ibootim_row_chosen;
+}
+
+//the buffer must be large enough for 'count' pixels in whichever colorspace is bigger
+static void _ibootim_convert_pixels_in_place(void *pixels, uint32_t count, ibootim_color_space_t targetColorSpace) {
+	_ibootim_row_format_t format = targetColorSpace == ibootim_color_space_grayscale ? _ibootim_row_argb_to_grey : _ibootim_row_grey_to_argb;
+	_ibootim_row_select()->convert[format](pixels, pixels, count);
+}
+
+//NULL when the image needs libpng's own transforms: palettes, sub-byte depths and interlacing
+static _ibootim_row_fn _ibootim_row_converter_for_png(uint8_t colorType, uint8_t bitDepth, uint8_t interlaceType) {
+	_ibootim_row_format_t format;
+	
+	if (interlaceType != PNG_INTERLACE_NONE) return NULL;
+	if (bitDepth != 8 && bitDepth != 16) return NULL;
+	switch (colorType) {
+		case PNG_COLOR_TYPE_RGBA:
+			format = bitDepth == 8 ? _ibootim_row_rgba8 : _ibootim_row_rgba16;
+			break;
+		case PNG_COLOR_TYPE_RGB:
+			format = bitDepth == 8 ? _ibootim_row_rgb8 : _ibootim_row_rgb16;
+			break;
+		case PNG_COLOR_TYPE_GA:
+			format = bitDepth == 8 ? _ibootim_row_ga8 : _ibootim_row_ga16;
+			break;
+		case PNG_COLOR_TYPE_GRAY:
+			format = bitDepth == 8 ? _ibootim_row_g8 : _ibootim_row_g16;
+			break;
+		default:
+			return NULL;
+	}
+	return _ibootim_row_select()->convert[format];
+}
+
 int ibootim_load_png(const char *path, ibootim **handle) {
 	FILE *f = fopen(path, "rb");
 	if (!f) {
@@ -522,9 +1160,13 @@ int ibootim_load_png(const char *path, ibootim **handle) {
 		return -1;
 	}
 	
+	//scratch row for the converters, freed if libpng bails out while reading into it
+	uint8_t *volatile rowBuffer = NULL;
+	
 	//setup error handling
 	if (setjmp(png_jmpbuf(read_struct)))
 	{
+		free(rowBuffer);
 		png_destroy_read_struct(&read_struct, &info_struct, NULL);
 		fclose(f);
 		puts("libpng error");
@@ -543,23 +1185,29 @@ int ibootim_load_png(const char *path, ibootim **handle) {
 	uint32_t height = png_get_image_height(read_struct, info_struct);
 	uint8_t color_type = png_get_color_type(read_struct, info_struct);
 	uint8_t bit_depth = png_get_bit_depth(read_struct, info_struct);
+	uint8_t interlace_type = png_get_interlace_type(read_struct, info_struct);
 	
-	//convert 16-bit colors to 8-bit
-	if (bit_depth == 16) {
-		png_set_strip_16(read_struct);
-	}
-	
-	//add alpha if not present
-	if ((color_type & PNG_COLOR_MASK_ALPHA) == 0) {
-		png_set_add_alpha(read_struct, 0, PNG_FILLER_AFTER);
-	}
-	png_set_invert_alpha(read_struct);
-	
-	//if we have RGB colors, convert them to bgr
-	if ((color_type == PNG_COLOR_TYPE_RGB) || (color_type == PNG_COLOR_TYPE_RGBA)) {
-	    png_set_bgr(read_struct);
-	} else if (color_type == PNG_COLOR_TYPE_GA) {
-		//png_set_swap_alpha(read_struct);
+	//common layouts are read raw and converted a row at a time, the rest goes through libpng transforms
+	_ibootim_row_fn convertRow = _ibootim_row_converter_for_png(color_type, bit_depth, interlace_type);
+	if (!convertRow) {
+		//convert 16-bit colors to 8-bit
+		if (bit_depth == 16) {
+			png_set_strip_16(read_struct);
+		}
+		
+		//add alpha if not present
+		if ((color_type & PNG_COLOR_MASK_ALPHA) == 0) {
+			png_set_add_alpha(read_struct, 0, PNG_FILLER_AFTER);
+		}
+		png_set_interlace_handling(read_struct);
+		png_set_invert_alpha(read_struct);
+		
+		//if we have RGB colors, convert them to bgr
+		if ((color_type == PNG_COLOR_TYPE_RGB) || (color_type == PNG_COLOR_TYPE_RGBA)) {
+		    png_set_bgr(read_struct);
+		} else if (color_type == PNG_COLOR_TYPE_GA) {
+			//png_set_swap_alpha(read_struct);
+		}
 	}
 	
 	//update structures after setting properties
@@ -581,21 +1229,39 @@ int ibootim_load_png(const char *path, ibootim **handle) {
 	}
 	image->pixels.pointer = malloc(width * height * pixelSize);
 	
-	//allocate and fill in array for rows
-	void **rows = (void **)malloc(height * sizeof(void *));
-	if (!rows) {
-		printf("Failed to alloc rows\n");
-		return -1;
+	if (convertRow) {
+		rowBuffer = malloc(png_get_rowbytes(read_struct, info_struct));
+		if (!rowBuffer) {
+			printf("Failed to alloc rows\n");
+			return -1;
+		}
+		
+		//read color data
+		for (uint16_t y = 0; y < height; y++) {
+			png_read_row(read_struct, rowBuffer, NULL);
+			convertRow(_ibootim_get_row(image, y), rowBuffer, width);
+		}
+		
+		free(rowBuffer);
+		rowBuffer = NULL;
+	} else {
+		//allocate and fill in array for rows
+		void **rows = (void **)malloc(height * sizeof(void *));
+		if (!rows) {
+			printf("Failed to alloc rows\n");
+			return -1;
+		}
+		for (uint16_t y = 0; y < height; y++)
+			rows[y] = _ibootim_get_row(image, y);
+		
+		//read color data
+		png_read_image(read_struct, (png_bytepp)rows);
+		
+		free(rows);
 	}
-	for (uint16_t y = 0; y < height; y++)
-		rows[y] = _ibootim_get_row(image, y);
-	
-	//read color data
-	png_read_image(read_struct, (png_bytepp)rows);
-	
-	free(rows);
 	png_read_end(read_struct, NULL);
 	png_destroy_read_struct(&read_struct, &info_struct, NULL);
+	fclose(f);
 	
 	*handle = image;
 	return 0;
@@ -805,82 +1471,21 @@ unsigned int ibootim_get_pixel_size(ibootim *image) {
 
 /* Private functions */
 
-static void _ibootim_set_pixel_with_params(ibootim *image, void *png_pixel, uint16_t x, uint16_t y, int bit_depth, int has_alpha) {
-	int png_pixel_size = bit_depth / 8;
-	
-	if (image->colorSpace == ibootim_color_space_argb) {
-		png_pixel_size *= 3 + (has_alpha != 0);
-		
-		if (bit_depth == 8) {
-			pixel_rgba_8 *png_rgba_pixel = png_pixel;
-			ibootim_argb_pixel *pixel = _ibootim_pixel_ptr_at(image, x, y);
-			
-			pixel->red = png_rgba_pixel->red;
-			pixel->green = png_rgba_pixel->green;
-			pixel->blue = png_rgba_pixel->blue;
-			if (has_alpha) pixel->alpha = ~png_rgba_pixel->alpha;
-			else pixel->alpha = 0xff;
-		}
-		else if (bit_depth == 16) {
-			pixel_rgba_16 *png_rgba_pixel = png_pixel;
-			ibootim_argb_pixel *pixel = _ibootim_pixel_ptr_at(image, x, y);
-			
-			pixel->red = png_rgba_pixel->red / 0x100;
-			pixel->green = png_rgba_pixel->green / 0x100;
-			pixel->blue = png_rgba_pixel->blue / 0x100;
-			if (has_alpha) pixel->alpha = png_rgba_pixel->alpha / 0x100;
-			else pixel->alpha = 0xff;
-		}
-	} else {
-		if (has_alpha) png_pixel_size *= 2;
-		
-		if (bit_depth == 8) {
-			pixel_grayscale_8 *png_rgba_pixel = png_pixel;
-			ibootim_grayscale_pixel *pixel = _ibootim_pixel_ptr_at(image, x, y);
-			
-			pixel->brightness = png_rgba_pixel->brightness;
-			if (has_alpha) pixel->alpha = png_rgba_pixel->alpha;
-			else pixel->alpha = 0xff;
-		}
-		else if (bit_depth == 16) {
-			pixel_grayscale_16 *png_rgba_pixel = png_pixel;
-			ibootim_grayscale_pixel *pixel = _ibootim_pixel_ptr_at(image, x, y);
-			
-			pixel->brightness = png_rgba_pixel->brightness / 0x100;
-			if (has_alpha) pixel->alpha = png_rgba_pixel->alpha / 0x100;
-			else pixel->alpha = 0xff;
-		}
-	}
-}
-
 int ibootim_count_images_in_file(const char *path, int *error) {
-	FILE *file;
-	int ret = -1;
-	struct ibootim_header header;
-	
-	file = fopen(path, "r");
-	if (!file) {
-		if (error) *error = ENOENT;
+	ibootim_container *container;
+	int rc = ibootim_container_open(path, &container);
+	if (rc != 0) {
+		if (error) *error = rc;
 		return -1;
 	}
 	
-	unsigned int count = 0;
-	while (fread(&header, sizeof(header), 1, file) == 1) {
-		if (_ibootim_sanity_check_header(&header, NULL) != 0) break;
-		if (fseek(file, header.compressedSize, SEEK_CUR) == -1) break;
-		count++;
-	}
-	ret = count;
+	int ret = (int)ibootim_container_count(container);
 	if (error) *error = 0;
 	
-	fclose(file);
+	ibootim_container_close(container);
 	return ret;
 }
 
-static inline void *_ibootim_pixel_ptr_at(ibootim *image, uint16_t x, uint16_t y) {
-	return (void *)image->pixels.pointer + (y * image->width + x) * ibootim_get_pixel_size(image);
-}
-
 static inline void *_ibootim_get_row(ibootim *image, unsigned int row) {
 	int offset = image->width * ibootim_get_pixel_size(image);
 	return image->pixels.pointer + offset * row;
@@ -27,6 +27,7 @@
 #ifndef __ibootim_h__
 #define __ibootim_h__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
@@ -107,6 +108,18 @@ extern unsigned int ibootim_get_pixel_size(ibootim *image);
 
 extern int ibootim_write(ibootim *image, const char *path);
 
+/*!
+ @function ibootim_encode
+ @abstract Encodes iBoot Embedded Image into memory.
+ @discussion Compresses 'image' and returns the same bytes ibootim_write() would write to a file, without touching the filesystem.
+ @param image The image.
+ @param buf A pointer where a buffer holding the encoded image is written on success. It must be released with free().
+ @param len A pointer where the length of the encoded image is written on success.
+ @result 0 on success or an error code on error.
+ */
+
+extern int ibootim_encode(ibootim *image, void **buf, size_t *len);
+
 /*!
  @function ibootim_write_png
  @abstract Writes iBoot Embedded Image to a file.
@@ -150,4 +163,58 @@ extern ibootim_compression_type_t ibootim_get_compression_type(ibootim *image);
 extern int ibootim_convert_to_colorspace(ibootim *image, ibootim_color_space_t targetColorSpace);
 extern int ibootim_count_images_in_file(const char *path, int *error);
 
+/* Containers */
+
+typedef struct ibootim_container ibootim_container;
+
+/*!
+ @function ibootim_container_open
+ @abstract Opens a file of one or more concatenated iBoot Embedded Images.
+ @discussion Maps the file at path 'path' and indexes every image header in one pass. Images are only decompressed when loaded, straight out of the mapping. The handle must be closed with ibootim_container_close(); images already loaded from it stay valid.
+ @param path Path to the iBoot Embedded Image file.
+ @param handle A pointer where the handle is written on success.
+ @result UNIX error code or 0 on success.
+ */
+
+extern int ibootim_container_open(const char *path, ibootim_container **handle);
+
+/*!
+ @function ibootim_container_count
+ @abstract Returns the number of images in the container, including a truncated last one.
+ @param container The container handle.
+ @result Number of images.
+ */
+
+extern unsigned int ibootim_container_count(ibootim_container *container);
+
+/*!
+ @function ibootim_container_load
+ @abstract Loads the image at given index from a container.
+ @discussion Decompresses the image at index 'index' without reading any other image or checking its checksum; see ibootim_container_verify(). The image must be closed with ibootim_close().
+ @param container The container handle.
+ @param index Index of the image in the container.
+ @param handle A pointer where the image handle is written on success.
+ @result UNIX error code or 0 on success.
+ */
+
+extern int ibootim_container_load(ibootim_container *container, unsigned int index, ibootim **handle);
+
+/*!
+ @function ibootim_container_verify
+ @abstract Checks the Adler-32 checksum of the image at given index.
+ @param container The container handle.
+ @param index Index of the image in the container.
+ @result 0 if the checksum matches, EFTYPE if it does not or there is no complete image at that index.
+ */
+
+extern int ibootim_container_verify(ibootim_container *container, unsigned int index);
+
+/*!
+ @function ibootim_container_close
+ @abstract Unmaps the file and destroys the container handle.
+ @param container The container handle.
+ */
+
+extern void ibootim_container_close(ibootim_container *container);
+
 #endif /* defined(__ibootim__ibootim__) */
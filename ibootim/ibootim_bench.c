@@ -0,0 +1,247 @@
+//
+//  ibootim_bench.c
+//  ibootim
+//
+//  Speed of the argb <-> grey colorspace conversions on a 2048x2732 logo. The
+//  per pixel loop ibootim_convert_to_colorspace() used to run is timed first,
+//  then every row converter version this machine can run, in place as
+//  ibootim_convert_to_colorspace() calls them, then that call itself, which
+//  also resizes the buffer. Every result is compared with the per pixel one;
+//  the exit status is non-zero if any of them differ.
+//
+//    ibootim_bench [-r repeats] [-W width] [-H height]
+//
+
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+// EFTYPE is BSD only; the bench only needs it to be some non-zero error
+#ifndef EFTYPE
+#define EFTYPE EINVAL
+#endif
+
+// the converters are static, so the bench is built with the library itself
+#include "ibootim.c"
+
+#define IMPL_COUNT (sizeof(_ibootim_row_impls) / sizeof(_ibootim_row_impls[0]))
+
+static int repeats = 5;
+static bool failed = false;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift32, so every run converts the same pixels
+static uint32_t rng_state = 0x2545f491;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+// A logo-like screen: flat background with a few solid rectangles and an
+// antialiased border around each, in BGRA with the alpha inverted.
+static void fill_logo(uint8_t *pixels, unsigned int width, unsigned int height) {
+	memset(pixels, 0, (size_t)width * height * 4);
+	for (int i = 0; i < 8; i++) {
+		unsigned int x0 = rng() % width, y0 = rng() % height;
+		unsigned int w = 1 + rng() % (width / 4 + 1), h = 1 + rng() % (height / 4 + 1);
+		uint8_t b = rng(), g = rng(), r = rng();
+
+		for (unsigned int y = y0; y < y0 + h && y < height; y++) {
+			for (unsigned int x = x0; x < x0 + w && x < width; x++) {
+				uint8_t *p = pixels + ((size_t)y * width + x) * 4;
+				bool edge = x == x0 || y == y0 || x == x0 + w - 1 || y == y0 + h - 1;
+
+				p[0] = b;
+				p[1] = g;
+				p[2] = r;
+				p[3] = edge ? rng() : 0;
+			}
+		}
+	}
+}
+
+// The loops ibootim_convert_to_colorspace() ran before the row converters
+
+static void per_pixel_to_grey(void *pixels, uint32_t count) {
+	ibootim_argb_pixel *argbPixelPtr = pixels;
+	ibootim_grayscale_pixel *grayscalePixelPtr = pixels;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t alpha = argbPixelPtr->alpha;
+		uint8_t brightness = ((unsigned int)argbPixelPtr->red +
+							  (unsigned int)argbPixelPtr->green +
+							  (unsigned int)argbPixelPtr->blue) / 3;
+		grayscalePixelPtr->brightness = brightness;
+		grayscalePixelPtr->alpha = alpha;
+		argbPixelPtr++;
+		grayscalePixelPtr++;
+	}
+}
+
+static void per_pixel_to_argb(void *pixels, uint32_t count) {
+	ibootim_argb_pixel *argbPixelPtr = (ibootim_argb_pixel *)pixels + count;
+	ibootim_grayscale_pixel *grayscalePixelPtr = (ibootim_grayscale_pixel *)pixels + count;
+
+	for (uint32_t i = count; i > 0; i--) {
+		argbPixelPtr--;
+		grayscalePixelPtr--;
+		uint8_t alpha = grayscalePixelPtr->alpha;
+		uint8_t brightness = grayscalePixelPtr->brightness;
+		argbPixelPtr->red = argbPixelPtr->green = argbPixelPtr->blue = brightness;
+		argbPixelPtr->alpha = alpha;
+	}
+}
+
+// Timing
+
+struct times {
+	double toGrey, toArgb;
+};
+
+static void report(const char *name, struct times t, struct times base, size_t count) {
+	printf("%-28s %8.2f %9.1f %6.2fx   %8.2f %9.1f %6.2fx\n", name,
+		   t.toGrey * 1e3, count * 4 / t.toGrey / 1e6, base.toGrey / t.toGrey,
+		   t.toArgb * 1e3, count * 2 / t.toArgb / 1e6, base.toArgb / t.toArgb);
+}
+
+// fastest of the repeats, each converting a fresh copy of the logo to grey and back
+static struct times time_rows(void (*toGrey)(void *, uint32_t), void (*toArgb)(void *, uint32_t),
+							  const struct _ibootim_row_impl *impl, const uint8_t *logo, uint8_t *buf,
+							  uint32_t count, const uint8_t *expectGrey, const uint8_t *expectArgb) {
+	struct times best = { 1e9, 1e9 };
+
+	for (int r = 0; r < repeats; r++) {
+		double t0, t1, t2;
+
+		memcpy(buf, logo, (size_t)count * 4);
+		t0 = now();
+		if (impl) impl->convert[_ibootim_row_argb_to_grey](buf, buf, count);
+		else toGrey(buf, count);
+		t1 = now() - t0;
+		if (expectGrey && memcmp(buf, expectGrey, (size_t)count * 2) != 0) failed = true;
+
+		t0 = now();
+		if (impl) impl->convert[_ibootim_row_grey_to_argb](buf, buf, count);
+		else toArgb(buf, count);
+		t2 = now() - t0;
+		if (expectArgb && memcmp(buf, expectArgb, (size_t)count * 4) != 0) failed = true;
+
+		if (t1 < best.toGrey) best.toGrey = t1;
+		if (t2 < best.toArgb) best.toArgb = t2;
+	}
+	return best;
+}
+
+// the same through the public call, with its [*] messages sent to /dev/null
+static struct times time_public(const uint8_t *logo, unsigned int width, unsigned int height,
+								const uint8_t *expectGrey, const uint8_t *expectArgb) {
+	struct times best = { 1e9, 1e9 };
+	size_t count = (size_t)width * height;
+	int devnull = open("/dev/null", O_WRONLY), saved = dup(STDOUT_FILENO);
+
+	for (int r = 0; r < repeats; r++) {
+		ibootim image = { .width = width, .height = height, .colorSpace = ibootim_color_space_argb };
+		double t0, t1, t2;
+		int rc1, rc2;
+
+		image.pixels.pointer = malloc(count * 4);
+		memcpy(image.pixels.pointer, logo, count * 4);
+
+		fflush(stdout);
+		dup2(devnull, STDOUT_FILENO);
+		t0 = now();
+		rc1 = ibootim_convert_to_colorspace(&image, ibootim_color_space_grayscale);
+		t1 = now() - t0;
+		if (rc1 == 0 && memcmp(image.pixels.pointer, expectGrey, count * 2) != 0) rc1 = -1;
+		t0 = now();
+		rc2 = ibootim_convert_to_colorspace(&image, ibootim_color_space_argb);
+		t2 = now() - t0;
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+
+		if (rc1 != 0 || rc2 != 0 || memcmp(image.pixels.pointer, expectArgb, count * 4) != 0) failed = true;
+		free(image.pixels.pointer);
+
+		if (t1 < best.toGrey) best.toGrey = t1;
+		if (t2 < best.toArgb) best.toArgb = t2;
+	}
+
+	close(saved);
+	close(devnull);
+	return best;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-r repeats] [-W width] [-H height]\n", name);
+	fprintf(stderr, "  -r  timed runs per version, the fastest is reported (default 5)\n");
+	fprintf(stderr, "  -W  -H  screen size in pixels (default 2048x2732)\n");
+}
+
+int main(int argc, char **argv) {
+	unsigned int width = 2048, height = 2732;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:W:H:h")) != -1) {
+		switch (ch) {
+			case 'r': repeats = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+			case 'W': width = atoi(optarg); break;
+			case 'H': height = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (width < 1 || width > UINT16_MAX || height < 1 || height > UINT16_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	uint32_t count = width * height;
+	uint8_t *logo = malloc((size_t)count * 4), *buf = malloc((size_t)count * 4);
+	uint8_t *grey = malloc((size_t)count * 4), *argb = malloc((size_t)count * 4);
+
+	fill_logo(logo, width, height);
+	memcpy(grey, logo, (size_t)count * 4);
+	per_pixel_to_grey(grey, count);
+	memcpy(argb, grey, (size_t)count * 2);
+	per_pixel_to_argb(argb, count);
+
+	printf("%ux%u, fastest of %d runs, in place\n", width, height, repeats);
+	printf("%-28s %8s %9s %7s   %8s %9s %7s\n", "version", "to grey", "MB/s", "", "to argb", "MB/s", "");
+
+	struct times base = time_rows(per_pixel_to_grey, per_pixel_to_argb, NULL, logo, buf, count, NULL, NULL);
+	report("per pixel", base, base, count);
+
+	for (size_t i = 0; i < IMPL_COUNT; i++) {
+		const struct _ibootim_row_impl *impl = &_ibootim_row_impls[i];
+
+#ifdef IBOOTIM_ROW_X86
+		if (strcmp(impl->name, "avx2") == 0 && !__builtin_cpu_supports("avx2")) {
+			printf("%-28s not supported here\n", impl->name);
+			continue;
+		}
+#endif
+		report(impl->name, time_rows(NULL, NULL, impl, logo, buf, count, grey, argb), base, count);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "convert_to_colorspace %s", _ibootim_row_select()->name);
+	report(name, time_public(logo, width, height, grey, argb), base, count);
+
+	free(logo);
+	free(buf);
+	free(grey);
+	free(argb);
+
+	if (failed)
+		printf("\nsome conversions differ from the per pixel loop\n");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,300 @@
+//
+//  ibootim_test.c
+//  ibootim
+//
+//  Checks the pixel row converters in ibootim.c. Every vector version this
+//  machine can run is compared with the scalar one at widths 1 to 2048, then
+//  every version is compared with the png_set_* transforms that
+//  ibootim_load_png() falls back to: an interlaced PNG takes that path and the
+//  same pixels uninterlaced take the row converters. Last, the colorspace
+//  conversions are run in place, as ibootim_convert_to_colorspace() runs them,
+//  up to a 2048x2732 screen. The exit status is non-zero if any check fails.
+//
+//    ibootim_test [-s seed] [-w max width]
+//
+
+#include <errno.h>
+#include <getopt.h>
+
+// EFTYPE is BSD only; the test only needs it to be some non-zero error
+#ifndef EFTYPE
+#define EFTYPE EINVAL
+#endif
+
+// the converters are static, so the test is built with the library itself
+#include "ibootim.c"
+
+#define MAX_WIDTH  2048
+#define PNG_ROWS   3
+#define GUARD      64
+#define GUARD_BYTE 0x5a
+#define SCREEN_WIDTH  2048
+#define SCREEN_HEIGHT 2732
+
+static unsigned int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		if (failures++ < 10) { \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+		} \
+	} \
+} while (0)
+
+// xorshift32, so a failure can be replayed with -s
+static uint32_t rng_state = 0x2545f491;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void fill_random(uint8_t *p, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		p[i] = (uint8_t)rng();
+}
+
+static const struct {
+	const char *name;
+	_ibootim_row_format_t format;
+	int colorType, bitDepth;   // -1 for the colorspace conversions, which have no PNG
+	unsigned int inSize, outSize;
+} formats[] = {
+	{ "rgba8",        _ibootim_row_rgba8,        PNG_COLOR_TYPE_RGBA,  8, 4, 4 },
+	{ "rgb8",         _ibootim_row_rgb8,         PNG_COLOR_TYPE_RGB,   8, 3, 4 },
+	{ "rgba16",       _ibootim_row_rgba16,       PNG_COLOR_TYPE_RGBA, 16, 8, 4 },
+	{ "rgb16",        _ibootim_row_rgb16,        PNG_COLOR_TYPE_RGB,  16, 6, 4 },
+	{ "ga8",          _ibootim_row_ga8,          PNG_COLOR_TYPE_GA,    8, 2, 2 },
+	{ "g8",           _ibootim_row_g8,           PNG_COLOR_TYPE_GRAY,  8, 1, 2 },
+	{ "ga16",         _ibootim_row_ga16,         PNG_COLOR_TYPE_GA,   16, 4, 2 },
+	{ "g16",          _ibootim_row_g16,          PNG_COLOR_TYPE_GRAY, 16, 2, 2 },
+	{ "argb to grey", _ibootim_row_argb_to_grey, -1,                  -1, 4, 2 },
+	{ "grey to argb", _ibootim_row_grey_to_argb, -1,                  -1, 2, 4 },
+};
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+#define IMPL_COUNT   (sizeof(_ibootim_row_impls) / sizeof(_ibootim_row_impls[0]))
+
+static bool impl_runs_here(const struct _ibootim_row_impl *impl) {
+#ifdef IBOOTIM_ROW_X86
+	if (strcmp(impl->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return true;
+}
+
+// Vector against scalar
+
+static void test_rows(unsigned int maxWidth) {
+	uint8_t *src = malloc(8 * maxWidth), *ref = malloc(4 * maxWidth + GUARD), *out = malloc(4 * maxWidth + GUARD);
+
+	for (size_t i = 1; i < IMPL_COUNT; i++) {
+		const struct _ibootim_row_impl *impl = &_ibootim_row_impls[i];
+		unsigned int before = failures;
+
+		if (!impl_runs_here(impl)) {
+			printf("rows: %s not supported here, skipped\n", impl->name);
+			continue;
+		}
+		for (size_t f = 0; f < FORMAT_COUNT; f++) {
+			for (unsigned int width = 1; width <= maxWidth; width++) {
+				size_t outLen = (size_t)formats[f].outSize * width;
+
+				fill_random(src, (size_t)formats[f].inSize * width);
+				memset(ref, GUARD_BYTE, outLen + GUARD);
+				memset(out, GUARD_BYTE, outLen + GUARD);
+				_ibootim_row_impls[0].convert[formats[f].format](ref, src, width);
+				impl->convert[formats[f].format](out, src, width);
+
+				CHECK(memcmp(out, ref, outLen) == 0, "%s %s width %u: differs from scalar", impl->name, formats[f].name, width);
+				CHECK(memcmp(out + outLen, ref + outLen, GUARD) == 0, "%s %s width %u: wrote past the row", impl->name, formats[f].name, width);
+			}
+		}
+		printf("rows: %s against scalar, widths 1-%u, %s\n", impl->name, maxWidth, failures > before ? "FAILED" : "ok");
+	}
+
+	free(src);
+	free(ref);
+	free(out);
+}
+
+// Against libpng's transforms
+
+static bool write_png(const char *path, const uint8_t *raw, size_t rowBytes, unsigned int width, unsigned int height, int colorType, int bitDepth, int interlace) {
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return false;
+
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	if (!info || setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		fclose(f);
+		return false;
+	}
+
+	png_init_io(png, f);
+	png_set_compression_level(png, 1);
+	png_set_IHDR(png, info, width, height, bitDepth, colorType, interlace, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+
+	// interlaced rows go in once per pass
+	for (int pass = png_set_interlace_handling(png); pass > 0; pass--)
+		for (unsigned int y = 0; y < height; y++)
+			png_write_row(png, raw + rowBytes * y);
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+	return fclose(f) == 0;
+}
+
+static void test_png(unsigned int maxWidth) {
+	char plain[] = "/tmp/ibootim_test_XXXXXX", interlaced[] = "/tmp/ibootim_test_XXXXXX";
+	int fd1 = mkstemp(plain), fd2 = mkstemp(interlaced);
+	uint8_t *raw = malloc((size_t)8 * maxWidth * PNG_ROWS), *out = malloc((size_t)4 * maxWidth * PNG_ROWS);
+	unsigned int before = failures;
+
+	if (fd1 < 0 || fd2 < 0) {
+		CHECK(0, "could not make temporary files");
+		return;
+	}
+	close(fd1);
+	close(fd2);
+
+	for (size_t f = 0; f < FORMAT_COUNT; f++) {
+		if (formats[f].colorType < 0)
+			continue;
+		for (unsigned int width = 1; width <= maxWidth; width++) {
+			size_t rowBytes = (size_t)formats[f].inSize * width, outRow = (size_t)formats[f].outSize * width;
+			ibootim *viaTransforms = NULL, *viaRows = NULL;
+
+			fill_random(raw, rowBytes * PNG_ROWS);
+			if (!write_png(plain, raw, rowBytes, width, PNG_ROWS, formats[f].colorType, formats[f].bitDepth, PNG_INTERLACE_NONE) ||
+				!write_png(interlaced, raw, rowBytes, width, PNG_ROWS, formats[f].colorType, formats[f].bitDepth, PNG_INTERLACE_ADAM7)) {
+				CHECK(0, "%s width %u: could not write the PNGs", formats[f].name, width);
+				continue;
+			}
+			if (ibootim_load_png(interlaced, &viaTransforms) != 0 || ibootim_load_png(plain, &viaRows) != 0) {
+				CHECK(0, "%s width %u: ibootim_load_png failed", formats[f].name, width);
+				continue;
+			}
+
+			CHECK(viaRows->colorSpace == viaTransforms->colorSpace && viaRows->width == width && viaTransforms->width == width,
+				  "%s width %u: loaded as colorspace %u/%u, width %u/%u", formats[f].name, width,
+				  viaRows->colorSpace, viaTransforms->colorSpace, viaRows->width, viaTransforms->width);
+			CHECK(memcmp(viaRows->pixels.pointer, viaTransforms->pixels.pointer, outRow * PNG_ROWS) == 0,
+				  "%s width %u: ibootim_load_png differs between the row converters and the transforms", formats[f].name, width);
+
+			for (size_t i = 0; i < IMPL_COUNT; i++) {
+				if (!impl_runs_here(&_ibootim_row_impls[i]))
+					continue;
+				for (unsigned int y = 0; y < PNG_ROWS; y++)
+					_ibootim_row_impls[i].convert[formats[f].format](out + outRow * y, raw + rowBytes * y, width);
+				CHECK(memcmp(out, viaTransforms->pixels.pointer, outRow * PNG_ROWS) == 0,
+					  "%s %s width %u: differs from the png_set_* transforms", _ibootim_row_impls[i].name, formats[f].name, width);
+			}
+
+			ibootim_close(viaTransforms);
+			ibootim_close(viaRows);
+		}
+	}
+	printf("png: every version against the png_set_* transforms, widths 1-%u, %s\n", maxWidth, failures > before ? "FAILED" : "ok");
+
+	unlink(plain);
+	unlink(interlaced);
+	free(raw);
+	free(out);
+}
+
+// In place
+
+// dst == src, against the scalar version writing to a separate buffer
+static bool in_place_matches(const struct _ibootim_row_impl *impl, uint8_t *buf, uint8_t *ref, uint32_t count, bool toGrey) {
+	size_t inLen = (size_t)(toGrey ? 4 : 2) * count, outLen = (size_t)(toGrey ? 2 : 4) * count;
+
+	fill_random(buf, inLen);
+	memset(buf + inLen, GUARD_BYTE, 4 * (size_t)count + GUARD - inLen);
+	_ibootim_row_impls[0].convert[toGrey ? _ibootim_row_argb_to_grey : _ibootim_row_grey_to_argb](ref, buf, count);
+	impl->convert[toGrey ? _ibootim_row_argb_to_grey : _ibootim_row_grey_to_argb](buf, buf, count);
+
+	for (size_t i = 0; i < GUARD; i++)
+		if (buf[4 * (size_t)count + i] != GUARD_BYTE)
+			return false;
+	return memcmp(buf, ref, outLen) == 0;
+}
+
+static void test_in_place(unsigned int maxWidth) {
+	const uint32_t screen = SCREEN_WIDTH * SCREEN_HEIGHT;
+	uint8_t *buf = malloc(4 * (size_t)screen + GUARD), *ref = malloc(4 * (size_t)screen), *orig = malloc(4 * (size_t)screen);
+	unsigned int before = failures;
+
+	for (size_t i = 0; i < IMPL_COUNT; i++) {
+		const struct _ibootim_row_impl *impl = &_ibootim_row_impls[i];
+
+		if (!impl_runs_here(impl))
+			continue;
+		for (uint32_t count = 1; count <= maxWidth + 1; count++) {
+			// the last pass is a whole screen
+			uint32_t n = count > maxWidth ? screen : count;
+
+			CHECK(in_place_matches(impl, buf, ref, n, true), "%s argb to grey, %u pixels in place: differs from scalar", impl->name, n);
+			CHECK(in_place_matches(impl, buf, ref, n, false), "%s grey to argb, %u pixels in place: differs from scalar", impl->name, n);
+		}
+	}
+
+	// and through the public call, which resizes the buffer around the conversion
+	ibootim *image = calloc(1, sizeof(ibootim));
+	image->width = SCREEN_WIDTH;
+	image->height = SCREEN_HEIGHT;
+	image->colorSpace = ibootim_color_space_argb;
+	image->pixels.pointer = malloc(4 * (size_t)screen);
+	fill_random(image->pixels.pointer, 4 * (size_t)screen);
+	memcpy(orig, image->pixels.pointer, 4 * (size_t)screen);
+
+	_ibootim_row_impls[0].convert[_ibootim_row_argb_to_grey](ref, orig, screen);
+	CHECK(ibootim_convert_to_colorspace(image, ibootim_color_space_grayscale) == 0 && image->colorSpace == ibootim_color_space_grayscale &&
+		  memcmp(image->pixels.pointer, ref, 2 * (size_t)screen) == 0, "ibootim_convert_to_colorspace to grey: differs from scalar");
+	_ibootim_row_impls[0].convert[_ibootim_row_grey_to_argb](orig, ref, screen);
+	CHECK(ibootim_convert_to_colorspace(image, ibootim_color_space_argb) == 0 && image->colorSpace == ibootim_color_space_argb &&
+		  memcmp(image->pixels.pointer, orig, 4 * (size_t)screen) == 0, "ibootim_convert_to_colorspace to argb: differs from scalar");
+	ibootim_close(image);
+
+	printf("in place: every version, 1-%u pixels and %ux%u, %s\n", maxWidth, SCREEN_WIDTH, SCREEN_HEIGHT, failures > before ? "FAILED" : "ok");
+
+	free(buf);
+	free(ref);
+	free(orig);
+}
+
+int main(int argc, char **argv) {
+	unsigned int maxWidth = MAX_WIDTH;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "s:w:h")) != -1) {
+		switch (ch) {
+			case 's': rng_state = (uint32_t)strtoul(optarg, NULL, 0) | 1; break;
+			case 'w': maxWidth = (unsigned int)strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-s seed] [-w max width]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (maxWidth < 1 || maxWidth > UINT16_MAX)
+		maxWidth = MAX_WIDTH;
+
+	printf("row converters: ");
+	for (size_t i = 0; i < IMPL_COUNT; i++)
+		printf("%s%s", i ? ", " : "", _ibootim_row_impls[i].name);
+	printf("; ibootim_load_png uses %s\n", _ibootim_row_select()->name);
+
+	test_rows(maxWidth);
+	test_png(maxWidth);
+	test_in_place(maxWidth);
+
+	if (failures)
+		printf("\n%u checks failed\n", failures);
+	return failures ? 1 : 0;
+}
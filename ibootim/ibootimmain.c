@@ -249,8 +249,16 @@ int ibootimMain(const char *inFile, const char *outFile) {
 		png_path = output_path;
 		
 		ibootim *image   = NULL;
+		ibootim_container *container = NULL;
 		char *path		 = alloca(strlen(png_path) + 7);
-		unsigned int images_count = ibootim_count_images_in_file(ibootim_path, NULL);
+		
+		//one mapping and one pass over the headers for all images
+		if ((rc = ibootim_container_open(ibootim_path, &container)) != 0) {
+			if (rc == ENOMEM) puts("ERROR: Not enough memory.");
+			else printf("ERROR: Failed to open '%s' for reading.\n", ibootim_path);
+			return 1;
+		}
+		unsigned int images_count = ibootim_container_count(container);
 		
 		if (images_count == 1) {
 			warning_fmt_len_less = warning_fmt_len_less_o;
@@ -265,7 +273,8 @@ int ibootimMain(const char *inFile, const char *outFile) {
 		}
 		
 		for (unsigned int i = 0; i < images_count; i++) {
-			if ((rc = ibootim_load_at_index(ibootim_path, &image, i)) != 0) {
+			ibootim_container_verify(container, i); //only warns
+			if ((rc = ibootim_container_load(container, i, &image)) != 0) {
 				switch (rc) {
 					case ENOMEM:
 						puts("ERROR: Not enough memory.");
@@ -273,14 +282,12 @@ int ibootimMain(const char *inFile, const char *outFile) {
 					case EFTYPE:
 						printf(error_fmt_image_corrupt, i);
 						break;
-					case ENOENT:
-						printf("ERROR: Failed to open '%s' for reading: %s.\n", ibootim_path, strerror(errno));
-						break;
 					default:
 						printf("ERROR: Unknown error (code %i).\n", rc);
 						break;
 				}
 				
+				ibootim_container_close(container);
 				return 1;
 			}
 			
@@ -289,6 +296,7 @@ int ibootimMain(const char *inFile, const char *outFile) {
 				if (rc != 0) {
 					puts("[-] Failed to convert image to the requested color space.");
 					ibootim_close(image);
+					ibootim_container_close(container);
 					return 1;
 				}
 			} else if (force_grayscale) {
@@ -296,6 +304,7 @@ int ibootimMain(const char *inFile, const char *outFile) {
 				if (rc != 0) {
 					puts("[-] Failed to convert image to the requested color space.");
 					ibootim_close(image);
+					ibootim_container_close(container);
 					return 1;
 				}
 			}
@@ -321,6 +330,7 @@ int ibootimMain(const char *inFile, const char *outFile) {
 			
 			ibootim_close(image);
 		}
+		ibootim_container_close(container);
 	} else {
 		puts("Input file must be a PNG or an iBoot Image File (legacy images \n"
 			 "decoding is not supported yet).");
@@ -41,56 +41,101 @@ const char *lzss_strerror(lzss_error_t error) {
 #define THRESHOLD 2     /* encode string into position and length if match_length is greater than this */
 #define NIL       N     /* index for root of binary search trees */
 
+/* Bytes of a match whose source starts before the first output byte. The
+ * decoder's ring starts as N - F spaces; the F slots after them are never
+ * written before they are read, so they decode as zeros here.
+ */
+static void lzss_window_copy(uint8_t *dst, const uint8_t *dststart, size_t dist, unsigned int len) {
+	ssize_t v = (ssize_t)(dst - dststart) - (ssize_t)dist;
+	unsigned int k;
+	
+	for (k = 0; k < len; k++, v++) {
+		if (v >= 0)
+			dst[k] = dststart[v];
+		else
+			dst[k] = v >= -(N - F) ? ' ' : 0;
+	}
+}
+
+/* Decodes with the output itself as the window instead of a separate ring
+ * buffer: a match at ring index i from output offset o reads from
+ * o - ((N - F + o - i) mod N). Matches are copied in 16- or 8-byte blocks
+ * whenever the output has room for the overrun, and bounds are checked once
+ * per token rather than once per byte.
+ */
 ssize_t lzss_decompress(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen)
 {
 	if (dst && src && dstlen && srclen) {
-		/* ring buffer of size N, with extra F-1 bytes to aid string comparison */
-		uint8_t text_buf[N + F - 1];
 		uint8_t *dststart = dst;
 		uint8_t *srcend = src + srclen;
 		uint8_t *dstend = dst + dstlen;
-		int  i, j, k, r, c;
-		unsigned int flags;
+		unsigned int flags, len, i;
+		size_t dist, o;
 		
-		srcend = src + srclen;
-		dst = dststart;
-		for (i = 0; i < N - F; i++)
-			text_buf[i] = ' ';
-		r = N - F;
 		flags = 0;
 		
 		while (1) {
 			if (((flags >>= 1) & 0x100) == 0) {
-				if (src < srcend) c = *src++; else break;
-				flags = c | 0xFF00;  /* uses higher byte cleverly */
+				if (src < srcend) flags = *src++ | 0xFF00; else break;  /* uses higher byte cleverly */
+				if (flags == 0xFFFF && srcend - src >= 8 && dstend - dst >= 8) {
+					/* eight literals in a row */
+					memcpy(dst, src, 8);
+					dst += 8;
+					src += 8;
+					flags = 0;
+					continue;
+				}
 			}   /* to count eight */
 			if (flags & 1) {
-				if (src < srcend) c = *src++; else break;
-				if (dst < dstend)
-					*dst++ = c;
-				else {
+				if (src >= srcend)
+					break;
+				if (dst >= dstend) {
 					lzss_errno = LZSS_NOMEM;
 					return -1;
 				}
-				text_buf[r++] = c;
-				r &= (N - 1);
+				*dst++ = *src++;
+				continue;
+			}
+			if (srcend - src < 2)
+				break;
+			i = src[0] | ((src[1] & 0xF0) << 4);
+			len = (src[1] & 0x0F) + THRESHOLD + 1;
+			src += 2;
+			if ((size_t)(dstend - dst) < len) {
+				lzss_errno = LZSS_NOMEM;
+				return -1;
+			}
+			o = dst - dststart;
+			dist = (N - F + o - i) & (N - 1);
+			if (!dist)
+				dist = N;
+			
+			if (dist > o) {
+				lzss_window_copy(dst, dststart, dist, len);
+			} else if (dist >= 16 && dstend - dst >= 32) {
+				memcpy(dst, dst - dist, 16);
+				memcpy(dst + 16, dst - dist + 16, 16);
+			} else if (dist >= 8 && dstend - dst >= 24) {
+				memcpy(dst, dst - dist, 8);
+				memcpy(dst + 8, dst - dist + 8, 8);
+				memcpy(dst + 16, dst - dist + 16, 8);
+			} else if (dstend - dst >= 24) {
+				/* period shorter than a block: seed 8 bytes, then copy from
+				 * the nearest whole number of periods back that is a full block */
+				const uint8_t *match = dst - dist;
+				size_t step = dist;
+				for (i = 0; i < 8; i++)
+					dst[i] = match[i];
+				while (step < 8)
+					step += dist;
+				memcpy(dst + 8, dst + 8 - step, 8);
+				memcpy(dst + 16, dst + 16 - step, 8);
 			} else {
-				if (src < srcend) i = *src++; else break;
-				if (src < srcend) j = *src++; else break;
-				i |= ((j & 0xF0) << 4);
-				j  =  (j & 0x0F) + THRESHOLD;
-				for (k = 0; k <= j; k++) {
-					c = text_buf[(i + k) & (N - 1)];
-					if (dst <= dstend)
-						*dst++ = c;
-					else {
-						lzss_errno = LZSS_NOMEM;
-						return -1;
-					}
-					text_buf[r++] = c;
-					r &= (N - 1);
-				}
+				const uint8_t *match = dst - dist;
+				for (i = 0; i < len; i++)
+					dst[i] = match[i];
 			}
+			dst += len;
 		}
 		
 		lzss_errno = LZSS_OK;
@@ -347,3 +392,657 @@ ssize_t lzss_compress(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned
 		return -1;
 	}
 }
+
+/**************************************************************
+ Hash-chain encoder for levels 1-9. Emits the same stream as the
+ tree encoder above. Positions are counted in the decoder's frame:
+ N - F spaces followed by the text, so the ring index of position v
+ is just v & (N - 1). Matches reach back at most N - F bytes, like
+ the tree encoder, so any decoder of that stream also takes these.
+ **************************************************************/
+
+#define HC_PREFIX   (N - F)  /* spaces the decoder starts with */
+#define HC_MAXDIST  (N - F)
+#define HC_MINMATCH (THRESHOLD + 1)
+#define HC_HASHBITS 13
+#define HC_NIL      0xFFFFFFFFu
+#define HC_NOPERIOD 0xFFu         /* hc_period() not worked out yet */
+
+struct hc_level {
+	unsigned int depth;  /* candidates tried per position */
+	unsigned int nice;   /* stop searching at a match this long */
+	int lazy;            /* check the next position before taking a match */
+};
+
+static const struct hc_level hc_levels[LZSS_LEVEL_MAX + 1] = {
+	{    0,  0, 0 },  /* LZSS_LEVEL_TREE, unused */
+	{    4,  8, 0 },
+	{    8, 12, 0 },
+	{   16,  F, 0 },
+	{   16, 16, 1 },
+	{   32,  F, 1 },
+	{    N,  F, 0 },  /* LZSS_LEVEL_DEFAULT: the tree encoder's parse, so never larger */
+	{  256,  F, 1 },
+	{ 1024,  F, 1 },
+	{    N,  F, 1 },
+};
+
+struct hc_state {
+	uint32_t head[1 << HC_HASHBITS];
+	uint32_t prev[N];  /* older position with the same hash, indexed by ring index */
+	
+	/* the spaces and the first F bytes of text, so a match starting in the spaces is contiguous */
+	uint8_t prefix[HC_PREFIX + F];
+	const uint8_t *src;
+	uint32_t base;     /* position of src[0] */
+	uint32_t end;      /* position just past the text in src */
+};
+
+/* parse state between calls to hc_encode() */
+struct hc_encoder {
+	const struct hc_level *lv;
+	uint32_t v;        /* next position to parse */
+	uint32_t prev_position;
+	unsigned int prev_length;
+	int have_prev;
+};
+
+struct hc_out {
+	uint8_t *dst, *dstend;
+	uint8_t code_buf[17], mask;
+	int code_buf_ptr;
+};
+
+static inline const uint8_t *hc_ptr(const struct hc_state *hs, uint32_t v) {
+	return v < HC_PREFIX ? hs->prefix + v : hs->src + (v - hs->base);
+}
+
+static inline uint32_t hc_hash(const uint8_t *p) {
+	return ((uint32_t)(p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HC_HASHBITS);
+}
+
+static inline void hc_insert(struct hc_state *hs, uint32_t v) {
+	uint32_t h;
+	
+	if (v + HC_MINMATCH > hs->end)
+		return;
+	h = hc_hash(hc_ptr(hs, v));
+	hs->prev[v & (N - 1)] = hs->head[h];
+	hs->head[h] = v;
+}
+
+/* hc_insert() for every position from v up to but not including last */
+static void hc_insert_range(struct hc_state *hs, uint32_t v, uint32_t last) {
+	const uint8_t *p;
+	uint32_t h;
+	
+	if (last > hs->end + 1 - HC_MINMATCH)
+		last = hs->end + 1 - HC_MINMATCH;
+	for ( ; v < last && v < HC_PREFIX; v++)
+		hc_insert(hs, v);
+	if (v >= last)
+		return;
+	for (p = hs->src + (v - hs->base); v < last; v++, p++) {
+		h = hc_hash(p);
+		hs->prev[v & (N - 1)] = hs->head[h];
+		hs->head[h] = v;
+	}
+}
+
+static void hc_reset(struct hc_state *hs) {
+	memset(hs->head, 0xFF, sizeof(hs->head));
+	memset(hs->prefix, ' ', HC_PREFIX);
+	hs->base = HC_PREFIX;
+}
+
+/* first is the start of the text, hs->end must already cover it */
+static void hc_prime(struct hc_state *hs, const uint8_t *first, unsigned int len) {
+	uint32_t v;
+	
+	memcpy(hs->prefix + HC_PREFIX, first, len < F ? len : F);
+	
+	/* the F strings that begin with spaces, as the tree encoder inserts them */
+	for (v = HC_PREFIX - F; v < HC_PREFIX; v++)
+		hc_insert(hs, v);
+}
+
+static struct hc_state *hc_init(const uint8_t *src, unsigned int srclen) {
+	struct hc_state *hs;
+	
+	hs = (struct hc_state *) malloc(sizeof(*hs));
+	if (!hs)
+		return NULL;
+	hc_reset(hs);
+	hs->src = src;
+	hs->end = HC_PREFIX + srclen;
+	hc_prime(hs, src, srclen);
+	return hs;
+}
+
+static void hc_out_init(struct hc_out *o, uint8_t *dst, unsigned int dstlen) {
+	o->dst = dst;
+	o->dstend = dst + dstlen;
+	o->code_buf[0] = 0;
+	o->code_buf_ptr = o->mask = 1;
+}
+
+/*
+ * The shortest period, up to one pixel, that key repeats with for more than one
+ * period, and in *run how far into key that lasts. 0 if none, or if it lasts to maxlen.
+ */
+static unsigned int hc_period(const uint8_t *key, unsigned int maxlen, unsigned int *run) {
+	unsigned int period, r;
+	
+	for (period = 1; period <= 4 && period < maxlen; period++) {
+		for (r = period; r < maxlen && key[r] == key[r - period]; r++)
+			;
+		if (r > period) {
+			*run = r;
+			return r < maxlen ? period : 0;
+		}
+	}
+	return 0;
+}
+
+/* the first position, no lower than lowest, of the run with this period that p starts in */
+static uint32_t hc_run_start(const struct hc_state *hs, uint32_t p, unsigned int period, uint32_t lowest) {
+	const uint8_t *s = hs->src + (p - hs->base);
+	uint64_t a, b;
+	
+	for ( ; p >= lowest + 8; p -= 8, s -= 8) {
+		memcpy(&a, s - 8, 8);
+		memcpy(&b, s - 8 + period, 8);
+		if (a != b)
+			break;
+	}
+	for ( ; p > lowest && s[-1] == s[period - 1]; p--, s--)
+		;
+	return p;
+}
+
+/* longest match for the text at v among positions already inserted, at most maxlen long */
+static unsigned int hc_longest(const struct hc_state *hs, const struct hc_level *lv, uint32_t v, unsigned int maxlen, uint32_t *match_position) {
+	const uint8_t *key = hs->src + (v - hs->base);
+	uint32_t p = hs->head[hc_hash(key)], start;
+	uint32_t lowest = v - HC_MAXDIST > HC_PREFIX ? v - HC_MAXDIST : HC_PREFIX;
+	unsigned int best = 0, depth = lv->depth, i, run = 0, period = HC_NOPERIOD;
+	
+	for ( ; p != HC_NIL && v - p <= HC_MAXDIST && depth; depth--) {
+		const uint8_t *m = hc_ptr(hs, p);
+		
+		i = 0;
+		if (m[best] == key[best] && m[0] == key[0]) {
+			for (i = 1; i < maxlen && m[i] == key[i]; i++)
+				;
+			if (i > best) {
+				best = i;
+				*match_position = p;
+				if (best >= lv->nice || best >= maxlen)
+					break;
+			}
+		}
+		
+		/*
+		 * Images are full of runs of one pixel, and every byte of a run is in the
+		 * chains. When the text at v repeats for run bytes and this candidate
+		 * matches that far but its run goes on, every older position of the run in
+		 * the same phase matches exactly as far too; go on from before the run.
+		 * No other phase can match further, as period is the shortest.
+		 */
+		if (period == HC_NOPERIOD)
+			period = hc_period(key, maxlen, &run);
+		if (period && best >= run && p >= lowest && m[run] == m[run - period]
+		    && (i == run || (i == 0 && !memcmp(m, key, run)))) {
+			start = hc_run_start(hs, p, period, lowest);
+			p = hs->prev[(start + (p - start) % period) & (N - 1)];
+			continue;
+		}
+		p = hs->prev[p & (N - 1)];
+	}
+	return best;
+}
+
+static int hc_next(struct hc_out *o) {
+	if ((o->mask <<= 1) == 0) {
+		/* Send at most 8 units of code together */
+		if (o->dstend - o->dst < o->code_buf_ptr)
+			return -1;
+		memcpy(o->dst, o->code_buf, o->code_buf_ptr);
+		o->dst += o->code_buf_ptr;
+		o->code_buf[0] = 0;
+		o->code_buf_ptr = o->mask = 1;
+	}
+	return 0;
+}
+
+static int hc_literal(struct hc_out *o, uint8_t c) {
+	o->code_buf[0] |= o->mask;
+	o->code_buf[o->code_buf_ptr++] = c;
+	return hc_next(o);
+}
+
+static int hc_match(struct hc_out *o, uint32_t match_position, unsigned int match_length) {
+	match_position &= N - 1;
+	o->code_buf[o->code_buf_ptr++] = (uint8_t) match_position;
+	o->code_buf[o->code_buf_ptr++] = (uint8_t)
+	( ((match_position >> 4) & 0xF0)
+	 |  (match_length - (THRESHOLD + 1)) );
+	return hc_next(o);
+}
+
+static int hc_finish(struct hc_out *o) {
+	if (o->code_buf_ptr > 1) {  /* Send remaining code. */
+		if (o->dstend - o->dst < o->code_buf_ptr)
+			return -1;
+		memcpy(o->dst, o->code_buf, o->code_buf_ptr);
+		o->dst += o->code_buf_ptr;
+	}
+	return 0;
+}
+
+/* parses positions up to limit, which must leave F bytes of lookahead
+ * unless it is the end of the text; -1 if the output ran out of room */
+static int hc_encode(struct hc_state *hs, struct hc_encoder *e, struct hc_out *o, uint32_t limit) {
+	const struct hc_level *lv = e->lv;
+	uint32_t v = e->v, match_position = 0;
+	unsigned int maxlen, match_length;
+	int err = 0;
+	
+	while (v < limit && !err) {
+		maxlen = hs->end - v < F ? hs->end - v : F;
+		match_length = 0;
+		if (maxlen >= HC_MINMATCH && !(e->have_prev && e->prev_length >= lv->nice))
+			match_length = hc_longest(hs, lv, v, maxlen, &match_position);
+		hc_insert(hs, v);
+		
+		if (!lv->lazy) {
+			if (match_length >= HC_MINMATCH) {
+				err = hc_match(o, match_position, match_length);
+				hc_insert_range(hs, v + 1, v + match_length);
+				v += match_length;
+			} else {
+				err = hc_literal(o, *hc_ptr(hs, v));
+				v++;
+			}
+			continue;
+		}
+		
+		/* the match found at v - 1 stands unless v has one at least 2 longer;
+		 * deferring costs a 9-bit literal, which one more byte does not pay for */
+		if (e->have_prev) {
+			if (e->prev_length >= HC_MINMATCH && match_length < e->prev_length + 2) {
+				err = hc_match(o, e->prev_position, e->prev_length);
+				hc_insert_range(hs, v + 1, v + e->prev_length - 1);
+				v += e->prev_length - 1;
+				e->have_prev = 0;
+				continue;
+			}
+			err = hc_literal(o, *hc_ptr(hs, v - 1));
+		}
+		e->prev_length = match_length;
+		e->prev_position = match_position;
+		e->have_prev = 1;
+		v++;
+	}
+	e->v = v;
+	return err;
+}
+
+/* after the last hc_encode(): the byte held back for a lazy match, then the last flag group */
+static int hc_encode_end(struct hc_state *hs, struct hc_encoder *e, struct hc_out *o) {
+	if (e->have_prev) {  /* a single byte was left, too short for a match */
+		e->have_prev = 0;
+		if (hc_literal(o, *hc_ptr(hs, e->v - 1)))
+			return -1;
+	}
+	return hc_finish(o);
+}
+
+static ssize_t lzss_compress_hc(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen, const struct hc_level *lv) {
+	struct hc_state *hs;
+	struct hc_encoder e = { lv, HC_PREFIX, 0, 0, 0 };
+	struct hc_out o;
+	int err;
+	
+	hs = hc_init(src, srclen);
+	if (!hs) {
+		lzss_errno = LZSS_NOMEM;
+		return -1;
+	}
+	hc_out_init(&o, dst, dstlen);
+	
+	err = hc_encode(hs, &e, &o, hs->end);
+	if (!err)
+		err = hc_encode_end(hs, &e, &o);
+	
+	free(hs);
+	if (err) {
+		lzss_errno = LZSS_NOMEM;
+		return -1;
+	}
+	lzss_errno = LZSS_OK;
+	return (ssize_t)o.dst - (ssize_t)dst;
+}
+
+/**************************************************************
+ Optimal parse for LZSS_LEVEL_ULTRA. A match costs 17 bits and a
+ literal 9 wherever they are, and every length from 3 up to the
+ longest match at a position is also a match there. So it is enough
+ to find the longest match at every byte with an exhaustive chain
+ walk, then take the cheapest path back from the end of the text.
+ **************************************************************/
+
+#define OPT_LITERAL_BITS 9
+#define OPT_MATCH_BITS   17
+#define OPT_MAXLEN       (UINT32_MAX / OPT_MATCH_BITS)  /* keeps cost[] in 32 bits */
+
+static const struct hc_level hc_ultra = { N, F, 0 };
+
+static ssize_t lzss_compress_optimal(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen) {
+	struct hc_state *hs;
+	struct hc_out o;
+	uint8_t *length;     /* longest match at each byte, then the step taken from it */
+	uint16_t *position;  /* ring index of that match */
+	uint32_t *cost;      /* bits from each byte to the end */
+	uint32_t i, match_position = 0, best, c;
+	unsigned int maxlen, l, step;
+	int err = 0;
+	
+	hs = hc_init(src, srclen);
+	length = (uint8_t *) malloc(srclen);
+	position = (uint16_t *) malloc((size_t)srclen * sizeof(uint16_t));
+	cost = (uint32_t *) malloc(((size_t)srclen + 1) * sizeof(uint32_t));
+	if (!hs || !length || !position || !cost) {
+		free(hs);
+		free(length);
+		free(position);
+		free(cost);
+		lzss_errno = LZSS_NOMEM;
+		return -1;
+	}
+	
+	for (i = 0; i < srclen; i++) {
+		maxlen = srclen - i < F ? srclen - i : F;
+		length[i] = 0;
+		if (maxlen >= HC_MINMATCH)
+			length[i] = hc_longest(hs, &hc_ultra, HC_PREFIX + i, maxlen, &match_position);
+		position[i] = match_position & (N - 1);
+		hc_insert(hs, HC_PREFIX + i);
+	}
+	free(hs);
+	
+	cost[srclen] = 0;
+	for (i = srclen; i-- > 0; ) {
+		best = cost[i + 1] + OPT_LITERAL_BITS;
+		step = 1;
+		for (l = HC_MINMATCH; l <= length[i]; l++) {
+			c = cost[i + l] + OPT_MATCH_BITS;
+			if (c <= best) {
+				best = c;
+				step = l;
+			}
+		}
+		cost[i] = best;
+		length[i] = step;
+	}
+	free(cost);
+	
+	hc_out_init(&o, dst, dstlen);
+	for (i = 0; i < srclen && !err; i += length[i]) {
+		if (length[i] == 1)
+			err = hc_literal(&o, src[i]);
+		else
+			err = hc_match(&o, position[i], length[i]);
+	}
+	if (!err)
+		err = hc_finish(&o);
+	free(length);
+	free(position);
+	
+	if (err) {
+		lzss_errno = LZSS_NOMEM;
+		return -1;
+	}
+	lzss_errno = LZSS_OK;
+	return (ssize_t)o.dst - (ssize_t)dst;
+}
+
+ssize_t lzss_compress_level(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen, int level) {
+	if (level == LZSS_LEVEL_TREE)
+		return lzss_compress(dst, dstlen, src, srclen);
+	if (level == LZSS_LEVEL_ULTRA && srclen > OPT_MAXLEN)
+		level = LZSS_LEVEL_MAX;
+	if (dst && src && dstlen && srclen && level > LZSS_LEVEL_TREE && level <= LZSS_LEVEL_MAX) {
+		return lzss_compress_hc(dst, dstlen, src, srclen, &hc_levels[level]);
+	} else if (dst && src && dstlen && srclen && level == LZSS_LEVEL_ULTRA) {
+		return lzss_compress_optimal(dst, dstlen, src, srclen);
+	} else {
+		lzss_errno = LZSS_INVARG;
+		return -1;
+	}
+}
+
+/**************************************************************
+ Streaming interface. Decompression keeps the decoder's ring of N
+ bytes, the flags of the current group and whatever token or match
+ was cut off by the end of the input or output. Compression keeps a
+ few windows of text, slides them as input arrives and only parses
+ positions with F + 1 bytes of lookahead buffered, so its output is
+ byte for byte what lzss_compress_level() gives for the whole text.
+ **************************************************************/
+
+#define STREAM_TEXT    (4 * N)  /* compressor text buffer */
+#define STREAM_STEP    64       /* positions per hc_encode() call, so pending[] cannot overflow */
+#define STREAM_PENDING 256
+#define STREAM_MAXPOS  (UINT32_MAX - 2 * N)  /* positions are 32-bit */
+
+struct lzss_stream {
+	lzss_stream_mode_t mode;
+	
+	/* decompression */
+	uint8_t ring[N];
+	unsigned int r, flags;
+	uint8_t token[2];
+	unsigned int token_len;
+	unsigned int match_position, match_left;
+	
+	/* compression */
+	struct hc_state hs;
+	struct hc_encoder e;
+	struct hc_out o;   /* writes into pending[] */
+	uint8_t text[STREAM_TEXT];
+	uint8_t pending[STREAM_PENDING];
+	size_t pending_pos;
+	int primed, ended;
+};
+
+lzss_stream *lzss_stream_init(lzss_stream_mode_t mode, int level) {
+	lzss_stream *stream;
+	
+	if ((mode != LZSS_STREAM_DECOMPRESS && mode != LZSS_STREAM_COMPRESS) ||
+		(mode == LZSS_STREAM_COMPRESS && (level <= LZSS_LEVEL_TREE || level > LZSS_LEVEL_MAX))) {
+		lzss_errno = LZSS_INVARG;
+		return NULL;
+	}
+	stream = (lzss_stream *) malloc(sizeof(*stream));
+	if (!stream) {
+		lzss_errno = LZSS_NOMEM;
+		return NULL;
+	}
+	stream->mode = mode;
+	stream->primed = stream->ended = 0;
+	if (mode == LZSS_STREAM_DECOMPRESS) {
+		memset(stream->ring, ' ', N - F);
+		memset(stream->ring + N - F, 0, F);
+		stream->r = N - F;
+		stream->flags = 0;
+		stream->token_len = 0;
+		stream->match_position = stream->match_left = 0;
+	} else {
+		hc_reset(&stream->hs);
+		stream->hs.src = stream->text;
+		stream->hs.end = HC_PREFIX;
+		stream->e.lv = &hc_levels[level];
+		stream->e.v = HC_PREFIX;
+		stream->e.prev_position = stream->e.prev_length = 0;
+		stream->e.have_prev = 0;
+		hc_out_init(&stream->o, stream->pending, STREAM_PENDING);
+		stream->pending_pos = 0;
+	}
+	lzss_errno = LZSS_OK;
+	return stream;
+}
+
+static void stream_decompress(lzss_stream *stream, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap, size_t *consumed, size_t *produced) {
+	size_t ip = *consumed, op = *produced;
+	unsigned int c;
+	
+	while (1) {
+		/* a match the output had no room for last time */
+		for ( ; stream->match_left && op < out_cap; stream->match_left--) {
+			c = stream->ring[stream->match_position++ & (N - 1)];
+			out[op++] = c;
+			stream->ring[stream->r++] = c;
+			stream->r &= (N - 1);
+		}
+		if (stream->match_left)
+			break;
+		if (!stream->flags) {
+			if (ip >= in_len)
+				break;
+			stream->flags = in[ip++] | 0xFF00;
+		}
+		if (stream->flags & 1) {
+			if (ip >= in_len || op >= out_cap)
+				break;
+			c = in[ip++];
+			out[op++] = c;
+			stream->ring[stream->r++] = c;
+			stream->r &= (N - 1);
+		} else {
+			while (stream->token_len < 2 && ip < in_len)
+				stream->token[stream->token_len++] = in[ip++];
+			if (stream->token_len < 2)
+				break;
+			stream->token_len = 0;
+			stream->match_position = stream->token[0] | ((stream->token[1] & 0xF0) << 4);
+			stream->match_left = (stream->token[1] & 0x0F) + THRESHOLD + 1;
+		}
+		if (((stream->flags >>= 1) & 0x100) == 0)
+			stream->flags = 0;
+	}
+	*consumed = ip;
+	*produced = op;
+}
+
+static size_t stream_drain(lzss_stream *stream, uint8_t *out, size_t out_cap) {
+	size_t n = (size_t)(stream->o.dst - stream->pending) - stream->pending_pos;
+	
+	if (n > out_cap)
+		n = out_cap;
+	memcpy(out, stream->pending + stream->pending_pos, n);
+	stream->pending_pos += n;
+	if (stream->pending + stream->pending_pos == stream->o.dst) {
+		stream->o.dst = stream->pending;
+		stream->pending_pos = 0;
+	}
+	return n;
+}
+
+/* drops text more than a window behind the parse position once the buffer is full */
+static void stream_slide(lzss_stream *stream) {
+	struct hc_state *hs = &stream->hs;
+	uint32_t keep;
+	
+	if (hs->end - hs->base < STREAM_TEXT || stream->e.v < hs->base + N)
+		return;
+	keep = stream->e.v - N;
+	memmove(stream->text, stream->text + (keep - hs->base), hs->end - keep);
+	hs->base = keep;
+}
+
+static lzss_error_t stream_compress(lzss_stream *stream, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap, size_t *consumed, size_t *produced) {
+	struct hc_state *hs = &stream->hs;
+	struct hc_encoder *e = &stream->e;
+	size_t fill, n;
+	uint32_t limit;
+	
+	while (1) {
+		*produced += stream_drain(stream, out + *produced, out_cap - *produced);
+		if (stream->o.dst != stream->pending)
+			break;
+		if (stream->primed && hs->end - e->v > F + 1) {
+			limit = hs->end - (F + 1);
+			if (limit - e->v > STREAM_STEP)
+				limit = e->v + STREAM_STEP;
+			hc_encode(hs, e, &stream->o, limit);
+			continue;
+		}
+		if (*consumed == in_len)
+			break;
+		stream_slide(stream);
+		fill = hs->end - hs->base;
+		n = in_len - *consumed;
+		if (n > STREAM_TEXT - fill)
+			n = STREAM_TEXT - fill;
+		if (n > STREAM_MAXPOS - hs->end)
+			return LZSS_INVARG;
+		memcpy(stream->text + fill, in + *consumed, n);
+		hs->end += n;
+		*consumed += n;
+		if (!stream->primed && hs->end - HC_PREFIX >= F) {
+			hc_prime(hs, stream->text, F);
+			stream->primed = 1;
+		}
+	}
+	return LZSS_OK;
+}
+
+lzss_error_t lzss_stream_feed(lzss_stream *stream, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap, size_t *consumed, size_t *produced) {
+	if (!stream || !consumed || !produced || (in_len && !in) || (out_cap && !out) || stream->ended)
+		return lzss_errno = LZSS_INVARG;
+	*consumed = *produced = 0;
+	if (stream->mode == LZSS_STREAM_DECOMPRESS) {
+		stream_decompress(stream, in, in_len, out, out_cap, consumed, produced);
+		return lzss_errno = LZSS_OK;
+	}
+	return lzss_errno = stream_compress(stream, in, in_len, out, out_cap, consumed, produced);
+}
+
+lzss_error_t lzss_stream_finish(lzss_stream *stream, uint8_t *out, size_t out_cap, size_t *produced) {
+	struct hc_state *hs;
+	size_t consumed = 0;
+	
+	if (!stream || !produced || (out_cap && !out))
+		return lzss_errno = LZSS_INVARG;
+	*produced = 0;
+	if (stream->mode == LZSS_STREAM_DECOMPRESS) {
+		/* a token cut off by the end of the input is dropped, as lzss_decompress() does */
+		stream_decompress(stream, NULL, 0, out, out_cap, &consumed, produced);
+		return lzss_errno = stream->match_left ? LZSS_NOMEM : LZSS_OK;
+	}
+	
+	hs = &stream->hs;
+	if (!stream->primed && hs->end > HC_PREFIX) {
+		hc_prime(hs, stream->text, hs->end - HC_PREFIX);
+		stream->primed = 1;
+	}
+	while (1) {
+		*produced += stream_drain(stream, out + *produced, out_cap - *produced);
+		if (stream->o.dst != stream->pending)
+			return lzss_errno = LZSS_NOMEM;  /* call again with more room */
+		if (stream->e.v < hs->end) {
+			uint32_t limit = hs->end - stream->e.v > STREAM_STEP ? stream->e.v + STREAM_STEP : hs->end;
+			hc_encode(hs, &stream->e, &stream->o, limit);
+		} else if (!stream->ended) {
+			hc_encode_end(hs, &stream->e, &stream->o);
+			stream->ended = 1;
+		} else {
+			return lzss_errno = LZSS_OK;
+		}
+	}
+}
+
+void lzss_stream_free(lzss_stream *stream) {
+	free(stream);
+}
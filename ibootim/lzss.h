@@ -27,6 +27,7 @@
 #ifndef __ibootim__lzss__
 #define __ibootim__lzss__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -49,6 +50,38 @@ typedef enum {
 
 extern ssize_t lzss_compress(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen);
 
+/*!
+ @function lzss_compress_bound
+ @abstract Largest output lzss_compress() or lzss_compress_level() can produce
+ @discussion The worst case is every byte sent as a literal: the byte itself plus one flag bit.
+ @param srclen Length of data to compress
+ @result Destination buffer size that is always large enough.
+ */
+
+static inline size_t lzss_compress_bound(size_t srclen) {
+	return srclen + (srclen + 7) / 8;
+}
+
+#define LZSS_LEVEL_TREE    0  /* the original binary-tree encoder, same as lzss_compress() */
+#define LZSS_LEVEL_FAST    1  /* hash chains, shortest chain walk */
+#define LZSS_LEVEL_DEFAULT 6  /* hash chains, whole window searched: same size as LZSS_LEVEL_TREE */
+#define LZSS_LEVEL_MAX     9  /* hash chains, whole window searched with lazy matching */
+#define LZSS_LEVEL_ULTRA   10 /* optimal parse: smallest output, several times slower than LZSS_LEVEL_MAX */
+
+/*!
+ @function lzss_compress_level
+ @abstract Compresses data using LZSS compression algorithm at a given level
+ @discussion Output is in the same format as lzss_compress() and decodes with lzss_decompress(). Levels 1-9 search hash chains over 3-byte prefixes instead of binary trees; higher levels walk longer chains. LZSS_LEVEL_DEFAULT takes the longest match in the window at every step as the tree encoder does, so its output is never larger than lzss_compress(). Levels 4-5 and 7-9 look one byte ahead before taking a match, which is usually smaller but not on every input. LZSS_LEVEL_ULTRA finds the longest match at every byte and picks the parse with the fewest bits; it needs 7 bytes of scratch memory per input byte.
+ @param src Data to compress
+ @param dst Buffer for the compressed data
+ @param srclen Length of data to compress
+ @param dstlen Length of the destination buffer
+ @param level LZSS_LEVEL_TREE to LZSS_LEVEL_ULTRA
+ @result Size of compressed data or -1 on failure.
+ */
+
+extern ssize_t lzss_compress_level(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen, int level);
+
 /*!
  @function lzss_decompress
  @abstract Decompresses LZSS compressed data
@@ -61,6 +94,65 @@ extern ssize_t lzss_compress(uint8_t *dst, unsigned int dstlen, uint8_t *src, un
 
 extern ssize_t lzss_decompress(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen);
 
+/*!
+ @typedef lzss_stream
+ @abstract State of an incremental compression or decompression
+ @discussion Holds at most a few windows of data whatever the size of the stream, so a payload can go from a file or socket to its consumer in fixed-size chunks. Compressed output is identical to lzss_compress_level() at the same level. Streams are limited to about 4 GB.
+ */
+
+typedef struct lzss_stream lzss_stream;
+
+typedef enum {
+	LZSS_STREAM_DECOMPRESS,
+	LZSS_STREAM_COMPRESS
+} lzss_stream_mode_t;
+
+/*!
+ @function lzss_stream_init
+ @abstract Starts an incremental compression or decompression
+ @param mode LZSS_STREAM_COMPRESS or LZSS_STREAM_DECOMPRESS
+ @param level For compression, LZSS_LEVEL_FAST to LZSS_LEVEL_MAX; ignored for decompression
+ @result A stream to be released with lzss_stream_free() or NULL on failure.
+ */
+
+extern lzss_stream *lzss_stream_init(lzss_stream_mode_t mode, int level);
+
+/*!
+ @function lzss_stream_feed
+ @abstract Consumes input and produces output as far as the buffers allow
+ @discussion Returns when the input is used up or the output is full. Call again with the rest of the input and a drained output buffer; input that was not consumed has not been looked at.
+ @param stream The stream
+ @param in Next input bytes
+ @param in_len Length of the input
+ @param out Buffer for output bytes
+ @param out_cap Length of the output buffer
+ @param consumed Set to the number of input bytes used
+ @param produced Set to the number of output bytes written
+ @result LZSS_OK or an error.
+ */
+
+extern lzss_error_t lzss_stream_feed(lzss_stream *stream, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap, size_t *consumed, size_t *produced);
+
+/*!
+ @function lzss_stream_finish
+ @abstract Produces the output still held by the stream after the last input
+ @discussion Returns LZSS_NOMEM when the output buffer filled up first; drain it and call again. No more input may be fed once this has been called.
+ @param stream The stream
+ @param out Buffer for output bytes
+ @param out_cap Length of the output buffer
+ @param produced Set to the number of output bytes written
+ @result LZSS_OK once all output has been produced, LZSS_NOMEM if more remains.
+ */
+
+extern lzss_error_t lzss_stream_finish(lzss_stream *stream, uint8_t *out, size_t out_cap, size_t *produced);
+
+/*!
+ @function lzss_stream_free
+ @abstract Releases a stream
+ @param stream The stream
+ */
+
+extern void lzss_stream_free(lzss_stream *stream);
 
 extern lzss_error_t lzss_errno;
 extern const char *lzss_strerror(lzss_error_t error);
@@ -0,0 +1,405 @@
+//
+//  lzss_bench.c
+//  ibootim
+//
+//  Compression ratio and speed of each LZSS encoder level on boot logos and
+//  on a kernelcache-sized buffer. Every result is decoded again and compared
+//  with the input; the exit status is non-zero if any of them differ. A last
+//  table sets LZSS_LEVEL_ULTRA, which ibootim_write uses, against the tree
+//  encoder it replaced and against LZSS_LEVEL_DEFAULT.
+//
+//    lzss_bench [-r repeats] [-k megabytes] [image.png | raw file ...]
+//
+//  PNG files are decoded to the pixel layout ibootim stores (BGRA, or grey
+//  and alpha for greyscale images); any other file is compressed as is.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+
+#include "png.h"
+#include "lzss.h"
+
+static const int levels[] = { LZSS_LEVEL_TREE, LZSS_LEVEL_FAST, LZSS_LEVEL_DEFAULT, LZSS_LEVEL_MAX, LZSS_LEVEL_ULTRA };
+#define LEVEL_COUNT (sizeof(levels) / sizeof(levels[0]))
+#define LEVEL_TREE_INDEX    0
+#define LEVEL_DEFAULT_INDEX 2
+#define LEVEL_ULTRA_INDEX   4
+
+// one row of the ULTRA report
+struct ultra_result {
+	char name[64];
+	ssize_t packed[LEVEL_COUNT];
+	double time[LEVEL_COUNT];
+};
+
+#define ULTRA_MAX 64
+static struct ultra_result ultra_results[ULTRA_MAX];
+static size_t ultra_count = 0;
+
+static int repeats = 3;
+static bool failed = false;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char *level_name(int level) {
+	static char name[8];
+
+	switch (level) {
+		case LZSS_LEVEL_TREE:  return "tree";
+		case LZSS_LEVEL_ULTRA: return "ultra";
+		default:
+			snprintf(name, sizeof(name), "%d", level);
+			return name;
+	}
+}
+
+// xorshift32, so every run compresses the same synthetic data
+static uint32_t rng_state = 0x2545f491;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+// Inputs
+
+// Coverage of the pixel at (x, y) by an apple-like shape: a disc of radius r
+// with a bite taken out of its right side and a leaf above it. Edges are
+// antialiased over one pixel, as in the logos shipped with iOS.
+static uint8_t logo_coverage(int x, int y, int cx, int cy, int r) {
+	double dx = x - cx, dy = y - cy;
+	double body = r - sqrt(dx * dx + dy * dy);
+	double bx = x - (cx + r * 1.05), by = y - cy;
+	double bite = sqrt(bx * bx + by * by) - r * 0.35;
+	double lx = x - (cx + r * 0.15), ly = y - (cy - r * 1.25);
+	double leaf = r * 0.25 - sqrt(lx * lx * 2 + ly * ly * 0.5);
+	double d = body < bite ? body : bite;
+
+	if (leaf > d) d = leaf;
+	if (d <= -0.5) return 0;
+	if (d >= 0.5) return 255;
+	return (uint8_t)((d + 0.5) * 255);
+}
+
+static uint8_t *logo_argb(unsigned int width, unsigned int height, size_t *size) {
+	uint8_t *pixels = malloc((size_t)width * height * 4);
+	int r = width / 6;
+
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			uint8_t *p = pixels + ((size_t)y * width + x) * 4;
+			uint8_t c = logo_coverage(x, y, width / 2, height / 2, r);
+
+			p[0] = p[1] = p[2] = c;
+			p[3] = 0xff;
+		}
+	}
+
+	*size = (size_t)width * height * 4;
+	return pixels;
+}
+
+static uint8_t *logo_grey(unsigned int width, unsigned int height, size_t *size) {
+	uint8_t *pixels = malloc((size_t)width * height * 2);
+	int r = width / 6;
+
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			uint8_t *p = pixels + ((size_t)y * width + x) * 2;
+
+			p[0] = logo_coverage(x, y, width / 2, height / 2, r);
+			p[1] = 0xff;
+		}
+	}
+
+	*size = (size_t)width * height * 2;
+	return pixels;
+}
+
+static size_t put32(uint8_t *p, size_t at, size_t end, uint32_t value) {
+	if (at + 4 <= end) memcpy(p + at, &value, 4);
+	return at + 4;
+}
+
+// Instruction-like text: function prologues and epilogues around runs of
+// register moves, loads, stores and calls with random operands.
+static void fill_code(uint8_t *p, size_t at, size_t end) {
+	while (at < end) {
+		unsigned int body = 4 + rng() % 40;
+
+		at = put32(p, at, end, 0xa9bf7bfd);  // stp x29, x30, [sp, #-0x10]!
+		at = put32(p, at, end, 0x910003fd);  // mov x29, sp
+		for (unsigned int i = 0; i < body && at < end; i++) {
+			uint32_t rd = rng() % 29, rn = rng() % 29, rm = rng() % 29;
+
+			switch (rng() % 8) {
+				case 0: at = put32(p, at, end, 0xaa0003e0 | rm << 16 | rd); break;                          // mov
+				case 1: at = put32(p, at, end, 0xf9400000 | (rng() % 64) << 10 | rn << 5 | rd); break;      // ldr
+				case 2: at = put32(p, at, end, 0xf9000000 | (rng() % 64) << 10 | rn << 5 | rd); break;      // str
+				case 3: at = put32(p, at, end, 0x94000000 | (rng() & 0x3ffffff)); break;                   // bl
+				case 4: at = put32(p, at, end, 0x90000000 | (rng() & 0x7fffe0) | rd); break;                // adrp
+				case 5: at = put32(p, at, end, 0x91000000 | (rng() % 4096) << 10 | rd << 5 | rd); break;    // add
+				case 6: at = put32(p, at, end, 0xb4000000 | (rng() % 64) << 5 | rd); break;                 // cbz
+				default: at = put32(p, at, end, 0xeb00001f | rm << 16 | rn << 5); break;                    // cmp
+			}
+		}
+		at = put32(p, at, end, 0xa8c17bfd);  // ldp x29, x30, [sp], #0x10
+		at = put32(p, at, end, 0xd65f03c0);  // ret
+	}
+}
+
+static void fill_strings(uint8_t *p, size_t at, size_t end) {
+	static const char *words[] = {
+		"IOService", "com.apple.", "kext", "driver", "AppleARM", "IOKit", "failed", "%s: ",
+		"0x%llx", "panic", "memory", "interrupt", "provider", "property", "matching", "start",
+	};
+
+	while (at < end) {
+		unsigned int count = 1 + rng() % 5;
+
+		for (unsigned int i = 0; i < count && at < end; i++) {
+			const char *word = words[rng() % (sizeof(words) / sizeof(words[0]))];
+			size_t len = strlen(word);
+
+			if (len > end - at) len = end - at;
+			memcpy(p + at, word, len);
+			at += len;
+		}
+		if (at < end) p[at++] = 0;
+	}
+}
+
+static void fill_pointers(uint8_t *p, size_t at, size_t end) {
+	for (; at + 8 <= end; at += 8) {
+		uint64_t value = 0xfffffff007004000ULL + ((rng() % 0x1000000) & ~7ULL);
+
+		if (rng() % 4 == 0) value = 0;
+		memcpy(p + at, &value, 8);
+	}
+}
+
+// A buffer laid out like a kernelcache: per-kext code, strings and pointer
+// tables, with zero-filled page padding between the segments.
+static uint8_t *kernelcache(size_t size) {
+	uint8_t *p = calloc(size, 1);
+	size_t at = 0;
+
+	while (at < size) {
+		size_t code = (16 + rng() % 240) * 1024, strings = (2 + rng() % 30) * 1024;
+		size_t pointers = (1 + rng() % 16) * 1024, pad = rng() % 16384;
+		size_t end;
+
+		end = at + code < size ? at + code : size;
+		fill_code(p, at, end);
+		at = (end + 0x3fff) & ~(size_t)0x3fff;
+
+		end = at + strings < size ? at + strings : size;
+		fill_strings(p, at, end);
+		at = end;
+
+		end = at + pointers < size ? at + pointers : size;
+		fill_pointers(p, at, end);
+		at = (end + pad + 0x3fff) & ~(size_t)0x3fff;
+	}
+
+	return p;
+}
+
+static uint8_t *load_png(const char *path, size_t *size, unsigned int *width, unsigned int *height) {
+	png_image image;
+	uint8_t *pixels;
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&image, path)) return NULL;
+
+	image.format = (image.format & PNG_FORMAT_FLAG_COLOR) ? PNG_FORMAT_BGRA : PNG_FORMAT_GA;
+	*size = PNG_IMAGE_SIZE(image);
+	pixels = malloc(*size);
+	if (!pixels || !png_image_finish_read(&image, NULL, pixels, 0, NULL)) {
+		png_image_free(&image);
+		free(pixels);
+		return NULL;
+	}
+
+	*width = image.width;
+	*height = image.height;
+	return pixels;
+}
+
+static uint8_t *load_file(const char *path, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	uint8_t *buffer = NULL;
+	long len;
+
+	if (!f) return NULL;
+	if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+		buffer = malloc(len);
+		if (buffer && fread(buffer, 1, len, f) != (size_t)len) {
+			free(buffer);
+			buffer = NULL;
+		}
+		*size = len;
+	}
+	fclose(f);
+	return buffer;
+}
+
+// Benchmark
+
+static void bench(const char *name, const uint8_t *src, size_t srclen) {
+	size_t bound = lzss_compress_bound(srclen);
+	uint8_t *packed = malloc(bound), *unpacked = malloc(srclen);
+	struct ultra_result result = { .packed = { -1 } };
+	double tree_time = 0;
+	// one timed run is plenty for inputs that take seconds to compress
+	int runs = srclen > (4 << 20) ? 1 : repeats;
+
+	for (size_t i = 0; i < LEVEL_COUNT; i++) {
+		double best = 0, unpack_best = 0;
+		ssize_t len = -1, back = -1;
+
+		for (int run = 0; run < runs; run++) {
+			double t = now();
+			len = lzss_compress_level(packed, (unsigned int)bound, (uint8_t *)src, (unsigned int)srclen, levels[i]);
+			t = now() - t;
+			if (run == 0 || t < best) best = t;
+		}
+		if (len < 0) {
+			printf("%-28s %10zu  %-5s  compression failed\n", name, srclen, level_name(levels[i]));
+			result.packed[i] = -1;
+			failed = true;
+			continue;
+		}
+		result.packed[i] = len;
+		result.time[i] = best;
+
+		for (int run = 0; run < runs; run++) {
+			double t = now();
+			back = lzss_decompress(unpacked, (unsigned int)srclen, packed, (unsigned int)len);
+			t = now() - t;
+			if (run == 0 || t < unpack_best) unpack_best = t;
+		}
+
+		bool ok = back == (ssize_t)srclen && memcmp(unpacked, src, srclen) == 0;
+		if (!ok) failed = true;
+		if (levels[i] == LZSS_LEVEL_TREE) tree_time = best;
+
+		printf("%-28s %10zu  %-5s  %10zd  %6.2f%%  %9.1f  %8.1f  %6.2fx%s\n",
+			   name, srclen, level_name(levels[i]), len, 100.0 * len / srclen,
+			   srclen / best / 1e6, srclen / unpack_best / 1e6,
+			   tree_time > 0 ? tree_time / best : 0, ok ? "" : "  ROUND TRIP FAILED");
+	}
+
+	if (ultra_count < ULTRA_MAX) {
+		snprintf(result.name, sizeof(result.name), "%s", name);
+		ultra_results[ultra_count++] = result;
+	}
+
+	free(packed);
+	free(unpacked);
+}
+
+// Bytes ULTRA saves over another level, and how many times longer it takes.
+static void ultra_report(void) {
+	printf("\nLZSS_LEVEL_ULTRA against the tree encoder and LZSS_LEVEL_DEFAULT\n");
+	printf("%-28s %10s  %10s  %7s  %6s  %10s  %7s  %6s\n",
+		   "input", "ultra", "tree", "saved", "time", "default", "saved", "time");
+
+	for (size_t i = 0; i < ultra_count; i++) {
+		const struct ultra_result *r = &ultra_results[i];
+		ssize_t ultra = r->packed[LEVEL_ULTRA_INDEX];
+		ssize_t tree = r->packed[LEVEL_TREE_INDEX], def = r->packed[LEVEL_DEFAULT_INDEX];
+
+		if (ultra < 0 || tree < 0 || def < 0) {
+			printf("%-28s  not compressed at every level\n", r->name);
+			continue;
+		}
+		printf("%-28s %10zd  %10zd  %6.2f%%  %5.1fx  %10zd  %6.2f%%  %5.1fx\n",
+			   r->name, ultra,
+			   tree, 100.0 * (tree - ultra) / tree, r->time[LEVEL_ULTRA_INDEX] / r->time[LEVEL_TREE_INDEX],
+			   def, 100.0 * (def - ultra) / def, r->time[LEVEL_ULTRA_INDEX] / r->time[LEVEL_DEFAULT_INDEX]);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-r repeats] [-k megabytes] [image.png | file ...]\n", name);
+	fprintf(stderr, "  -r  timed runs per level, the fastest is reported (default 3)\n");
+	fprintf(stderr, "  -k  size of the synthetic kernelcache (default 24, 0 to skip)\n");
+}
+
+int main(int argc, char **argv) {
+	static const struct { unsigned int width, height; } screens[] = {
+		{ 640, 960 }, { 750, 1334 }, { 1242, 2208 }, { 1536, 2048 },
+	};
+	unsigned int kernel_mb = 24;
+	char name[64];
+	uint8_t *data;
+	size_t size;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:k:h")) != -1) {
+		switch (ch) {
+			case 'r': repeats = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+			case 'k': kernel_mb = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	printf("%-28s %10s  %-5s  %10s  %7s  %9s  %8s  %7s\n",
+		   "input", "bytes", "level", "packed", "ratio", "pack MB/s", "unpack", "vs tree");
+
+	for (size_t i = 0; i < sizeof(screens) / sizeof(screens[0]); i++) {
+		snprintf(name, sizeof(name), "logo argb %ux%u", screens[i].width, screens[i].height);
+		data = logo_argb(screens[i].width, screens[i].height, &size);
+		bench(name, data, size);
+		free(data);
+
+		snprintf(name, sizeof(name), "logo grey %ux%u", screens[i].width, screens[i].height);
+		data = logo_grey(screens[i].width, screens[i].height, &size);
+		bench(name, data, size);
+		free(data);
+	}
+
+	if (kernel_mb) {
+		size = (size_t)kernel_mb << 20;
+		snprintf(name, sizeof(name), "kernelcache %uMB", kernel_mb);
+		data = kernelcache(size);
+		bench(name, data, size);
+		free(data);
+	}
+
+	for (int i = optind; i < argc; i++) {
+		unsigned int width, height;
+		const char *base = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+
+		if ((data = load_png(argv[i], &size, &width, &height))) {
+			snprintf(name, sizeof(name), "%.40s %ux%u", base, width, height);
+		} else if ((data = load_file(argv[i], &size))) {
+			snprintf(name, sizeof(name), "%.60s", base);
+		} else {
+			fprintf(stderr, "%s: cannot read\n", argv[i]);
+			failed = true;
+			continue;
+		}
+		bench(name, data, size);
+		free(data);
+	}
+
+	ultra_report();
+	return failed ? 1 : 0;
+}
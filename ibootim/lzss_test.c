@@ -0,0 +1,478 @@
+//
+//  lzss_test.c
+//  ibootim
+//
+//  Checks lzss_decompress against the decoder it replaced, then round-trips
+//  data through every encoder level and the stream API, and finally times
+//  both decoders on the same payloads. The exit status is non-zero if any
+//  check fails.
+//
+//    lzss_test [-n random streams] [-s seed] [-t]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "lzss.h"
+
+#define N         4096
+#define F         18
+#define THRESHOLD 2
+
+#define GUARD      64
+#define GUARD_BYTE 0x5a
+
+static unsigned int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		if (failures++ < 10) { \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+		} \
+	} \
+} while (0)
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift32, so a failure can be replayed with -s
+static uint32_t rng_state = 0x2545f491;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+// Reference decoder
+
+// lzss_decompress as it was before it decoded straight into the output
+// buffer, with two changes. The F bytes of text_buf after the spaces were
+// never initialised, so a stream that referenced them decoded to whatever was
+// on the stack; they are zero here, as the window copy of the new decoder
+// has them. The match path checked dst <= dstend and so wrote one byte past
+// the output buffer; it checks dst < dstend here like the literal path.
+static ssize_t reference_decompress(uint8_t *dst, unsigned int dstlen, uint8_t *src, unsigned int srclen)
+{
+	if (dst && src && dstlen && srclen) {
+		/* ring buffer of size N, with extra F-1 bytes to aid string comparison */
+		uint8_t text_buf[N + F - 1];
+		uint8_t *dststart = dst;
+		uint8_t *srcend = src + srclen;
+		uint8_t *dstend = dst + dstlen;
+		int  i, j, k, r, c;
+		unsigned int flags;
+
+		for (i = 0; i < N - F; i++)
+			text_buf[i] = ' ';
+		memset(text_buf + N - F, 0, F + F - 1);
+		r = N - F;
+		flags = 0;
+
+		while (1) {
+			if (((flags >>= 1) & 0x100) == 0) {
+				if (src < srcend) c = *src++; else break;
+				flags = c | 0xFF00;  /* uses higher byte cleverly */
+			}   /* to count eight */
+			if (flags & 1) {
+				if (src < srcend) c = *src++; else break;
+				if (dst < dstend)
+					*dst++ = c;
+				else {
+					lzss_errno = LZSS_NOMEM;
+					return -1;
+				}
+				text_buf[r++] = c;
+				r &= (N - 1);
+			} else {
+				if (src < srcend) i = *src++; else break;
+				if (src < srcend) j = *src++; else break;
+				i |= ((j & 0xF0) << 4);
+				j  =  (j & 0x0F) + THRESHOLD;
+				for (k = 0; k <= j; k++) {
+					c = text_buf[(i + k) & (N - 1)];
+					if (dst < dstend)
+						*dst++ = c;
+					else {
+						lzss_errno = LZSS_NOMEM;
+						return -1;
+					}
+					text_buf[r++] = c;
+					r &= (N - 1);
+				}
+			}
+		}
+
+		lzss_errno = LZSS_OK;
+		return (ssize_t)dst - (ssize_t)dststart;
+	} else {
+		lzss_errno = LZSS_INVARG;
+		return -1;
+	}
+}
+
+// Inputs
+
+// Random bytes, or bytes with most flag bits set so that the stream is mostly
+// literals, or mostly flag bits clear so that it is mostly matches, many of
+// them reaching back before the start of the output.
+static void random_stream(uint8_t *p, size_t len) {
+	unsigned int mode = rng() % 3;
+
+	for (size_t i = 0; i < len; i++) {
+		p[i] = rng();
+		if (mode == 1 && rng() % 3) p[i] |= 0xff;
+		if (mode == 2 && rng() % 3) p[i] &= 0x11;
+	}
+}
+
+// Data that compresses the way images and code do: runs, short periods,
+// repeats from far back in the window and some noise.
+static void compressible(uint8_t *p, size_t len) {
+	size_t i = 0;
+
+	while (i < len) {
+		size_t run = 1 + rng() % 300;
+
+		if (run > len - i) run = len - i;
+		switch (rng() % 5) {
+			case 0:
+				memset(p + i, rng(), run);
+				break;
+			case 1: {
+				size_t period = 1 + rng() % 12;
+				for (size_t k = 0; k < run; k++)
+					p[i + k] = k < period ? rng() : p[i + k - period];
+				break;
+			}
+			case 2:
+				if (i > 0) {
+					size_t back = 1 + rng() % (i < 2 * N ? i : 2 * N);
+					for (size_t k = 0; k < run; k++)
+						p[i + k] = p[i + k - back];
+					break;
+				}
+				// fall through
+			case 3:
+				for (size_t k = 0; k < run; k++)
+					p[i + k] = rng();
+				break;
+			default:
+				for (size_t k = 0; k < run; k++)
+					p[i + k] = (k & 3) == 3 ? 0xff : (uint8_t)((i + k) / 640);
+				break;
+		}
+		i += run;
+	}
+}
+
+// Tests
+
+// Both decoders on the same random bytes, with an output buffer that is
+// sometimes roomy and sometimes too small; guard bytes after it catch writes
+// past the end.
+static void test_random_streams(unsigned int count) {
+	static uint8_t in[4096], expect[65536 + GUARD], out[65536 + GUARD];
+	unsigned int mismatches = 0;
+
+	for (unsigned int n = 0; n < count; n++) {
+		unsigned int len = 1 + rng() % (n % 10 ? 64 : sizeof(in));
+		unsigned int cap = n % 5 ? 65536 : 1 + rng() % 300;
+		ssize_t a, b;
+		lzss_error_t a_err;
+
+		random_stream(in, len);
+		memset(expect, GUARD_BYTE, cap + GUARD);
+		memset(out, GUARD_BYTE, cap + GUARD);
+
+		a = reference_decompress(expect, cap, in, len);
+		a_err = lzss_errno;
+		b = lzss_decompress(out, cap, in, len);
+
+		if (a != b || a_err != lzss_errno || (a > 0 && memcmp(expect, out, a))) {
+			if (mismatches++ < 5)
+				CHECK(0, "random stream %u (%u bytes, %u out): reference %zd (%d), decoder %zd (%d)",
+					  n, len, cap, a, a_err, b, lzss_errno);
+		}
+		for (unsigned int i = cap; i < cap + GUARD; i++) {
+			if (out[i] != GUARD_BYTE) {
+				CHECK(0, "random stream %u (%u bytes, %u out): wrote past the output at %u", n, len, cap, i);
+				break;
+			}
+		}
+	}
+	printf("random streams: %u, %u mismatches\n", count, mismatches);
+}
+
+// The stream decoder on the same kind of input, fed in random-sized chunks.
+static void test_random_stream_api(unsigned int count) {
+	static uint8_t in[1024], expect[65536], out[65536];
+
+	for (unsigned int n = 0; n < count; n++) {
+		unsigned int len = 1 + rng() % sizeof(in);
+		size_t at = 0, have = 0, consumed, produced;
+		lzss_stream *stream = lzss_stream_init(LZSS_STREAM_DECOMPRESS, 0);
+		lzss_error_t err = LZSS_OK;
+		ssize_t a;
+
+		random_stream(in, len);
+		a = reference_decompress(expect, sizeof(expect), in, len);
+
+		while (at < len && err == LZSS_OK) {
+			size_t chunk = 1 + rng() % 100;
+			if (chunk > len - at) chunk = len - at;
+			err = lzss_stream_feed(stream, in + at, chunk, out + have, sizeof(out) - have, &consumed, &produced);
+			at += consumed;
+			have += produced;
+		}
+		if (err == LZSS_OK)
+			err = lzss_stream_finish(stream, out + have, sizeof(out) - have, &produced);
+		have += produced;
+		lzss_stream_free(stream);
+
+		CHECK(err == LZSS_OK && a == (ssize_t)have && memcmp(expect, out, have) == 0,
+			  "stream decode %u (%u bytes): reference %zd, stream %zu (%d)", n, len, a, have, err);
+	}
+}
+
+static void round_trip(const char *name, uint8_t *src, unsigned int len) {
+	size_t bound = lzss_compress_bound(len);
+	uint8_t *packed = malloc(bound), *out = malloc(len + GUARD), *ref = malloc(len + GUARD);
+	ssize_t tree_len = 0;
+
+	for (int level = LZSS_LEVEL_TREE; level <= LZSS_LEVEL_ULTRA; level++) {
+		ssize_t packed_len = lzss_compress_level(packed, (unsigned int)bound, src, len, level);
+		ssize_t a, b;
+
+		CHECK(packed_len > 0 && (size_t)packed_len <= bound, "%s level %d: compressed to %zd", name, level, packed_len);
+		if (packed_len <= 0)
+			continue;
+		if (level == LZSS_LEVEL_TREE)
+			tree_len = packed_len;
+		// the default level takes the same longest matches as the tree encoder
+		CHECK(level != LZSS_LEVEL_DEFAULT || packed_len == tree_len,
+			  "%s level %d: %zd bytes, tree encoder %zd", name, level, packed_len, tree_len);
+
+		memset(out, GUARD_BYTE, len + GUARD);
+		b = lzss_decompress(out, len, packed, (unsigned int)packed_len);
+		a = reference_decompress(ref, len, packed, (unsigned int)packed_len);
+		CHECK(b == len && memcmp(out, src, len) == 0, "%s level %d: decoded to %zd bytes", name, level, b);
+		CHECK(a == len && memcmp(ref, src, len) == 0, "%s level %d: reference decoded to %zd bytes", name, level, a);
+		CHECK(out[len] == GUARD_BYTE, "%s level %d: wrote past the output", name, level);
+
+		// one byte short must fail rather than truncate
+		b = lzss_decompress(out, len - 1 ? len - 1 : 1, packed, (unsigned int)packed_len);
+		CHECK(len == 1 || (b == -1 && lzss_errno == LZSS_NOMEM), "%s level %d: short output gave %zd", name, level, b);
+	}
+
+	free(packed);
+	free(out);
+	free(ref);
+}
+
+// The stream encoder must give lzss_compress_level's bytes however the input
+// is split, and the stream decoder must give the input back.
+static void stream_round_trip(const char *name, uint8_t *src, unsigned int len) {
+	size_t bound = lzss_compress_bound(len);
+	uint8_t *packed = malloc(bound), *streamed = malloc(bound), *out = malloc(len);
+
+	for (int level = LZSS_LEVEL_FAST; level <= LZSS_LEVEL_MAX; level++) {
+		ssize_t packed_len = lzss_compress_level(packed, (unsigned int)bound, src, len, level);
+		lzss_stream *stream = lzss_stream_init(LZSS_STREAM_COMPRESS, level);
+		size_t at = 0, have = 0, consumed, produced;
+		lzss_error_t err = LZSS_OK;
+
+		while (at < len && err == LZSS_OK) {
+			size_t chunk = 1 + rng() % 9000, room = 1 + rng() % 5000;
+			if (chunk > len - at) chunk = len - at;
+			if (room > bound - have) room = bound - have;
+			err = lzss_stream_feed(stream, src + at, chunk, streamed + have, room, &consumed, &produced);
+			at += consumed;
+			have += produced;
+		}
+		do {
+			err = lzss_stream_finish(stream, streamed + have, bound - have < 777 ? bound - have : 777, &produced);
+			have += produced;
+		} while (err == LZSS_NOMEM && produced);
+		lzss_stream_free(stream);
+
+		CHECK(err == LZSS_OK && (ssize_t)have == packed_len && memcmp(packed, streamed, have) == 0,
+			  "%s level %d: stream compressed to %zu bytes, lzss_compress_level to %zd", name, level, have, packed_len);
+
+		stream = lzss_stream_init(LZSS_STREAM_DECOMPRESS, 0);
+		at = have = 0;
+		err = LZSS_OK;
+		while (at < (size_t)packed_len && err == LZSS_OK) {
+			size_t chunk = 1 + rng() % 3000;
+			if (chunk > packed_len - at) chunk = packed_len - at;
+			err = lzss_stream_feed(stream, packed + at, chunk, out + have, len - have, &consumed, &produced);
+			at += consumed;
+			have += produced;
+		}
+		if (err == LZSS_OK)
+			err = lzss_stream_finish(stream, out + have, len - have, &produced);
+		have += produced;
+		lzss_stream_free(stream);
+
+		CHECK(err == LZSS_OK && have == len && memcmp(out, src, len) == 0,
+			  "%s level %d: stream decoded to %zu bytes", name, level, have);
+	}
+
+	free(packed);
+	free(streamed);
+	free(out);
+}
+
+// Rows of pixels in short runs, pixel_size bytes each: the runs hc_longest() skips over.
+static void pixel_rows(uint8_t *p, size_t len, unsigned int pixel_size) {
+	uint8_t palette[8][4];
+	size_t i = 0;
+
+	for (unsigned int c = 0; c < 8; c++)
+		for (unsigned int k = 0; k < 4; k++)
+			palette[c][k] = k == 0 ? 0xFF : rng() % 4 * 0x55;
+	while (i < len) {
+		size_t run = (1 + rng() % 40) * pixel_size;
+		const uint8_t *pixel = palette[rng() % 8];
+
+		for (size_t k = 0; k < run && i < len; k++, i++)
+			p[i] = pixel[k % pixel_size];
+	}
+}
+
+static void test_round_trips(void) {
+	static const unsigned int sizes[] = { 1, 2, 3, 17, 18, 19, 100, N - F, N - 1, N, N + 1, 3 * N + 7, 65536, 1 << 20 };
+	char name[64];
+
+	for (unsigned int len = 1; len <= 40; len++) {
+		uint8_t src[40];
+		for (unsigned int i = 0; i < len; i++)
+			src[i] = i % 3 ? ' ' : 'a' + rng() % 2;
+		snprintf(name, sizeof(name), "spaces %u", len);
+		round_trip(name, src, len);
+	}
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		unsigned int len = sizes[i];
+		uint8_t *src = malloc(len);
+
+		compressible(src, len);
+		snprintf(name, sizeof(name), "mixed %u", len);
+		round_trip(name, src, len);
+		if (len >= N)
+			stream_round_trip(name, src, len);
+
+		for (unsigned int k = 0; k < len; k++)
+			src[k] = rng();
+		snprintf(name, sizeof(name), "random %u", len);
+		round_trip(name, src, len);
+
+		memset(src, 0, len);
+		snprintf(name, sizeof(name), "zeros %u", len);
+		round_trip(name, src, len);
+
+		for (unsigned int pixel_size = 2; pixel_size <= 4; pixel_size += 2) {
+			pixel_rows(src, len, pixel_size);
+			snprintf(name, sizeof(name), "pixels %u/%u", pixel_size, len);
+			round_trip(name, src, len);
+			if (len >= N)
+				stream_round_trip(name, src, len);
+		}
+
+		free(src);
+	}
+	printf("round trips: levels %d-%d, %s\n", LZSS_LEVEL_TREE, LZSS_LEVEL_ULTRA, failures ? "FAILED" : "ok");
+}
+
+// Throughput
+
+static void throughput(const char *name, uint8_t *src, unsigned int len) {
+	size_t bound = lzss_compress_bound(len);
+	uint8_t *packed = malloc(bound), *out = malloc(len);
+	ssize_t packed_len = lzss_compress_level(packed, (unsigned int)bound, src, len, LZSS_LEVEL_DEFAULT);
+	double ref_best = 0, new_best = 0;
+
+	for (int run = 0; run < 5; run++) {
+		double t = now();
+		reference_decompress(out, len, packed, (unsigned int)packed_len);
+		t = now() - t;
+		if (run == 0 || t < ref_best) ref_best = t;
+
+		t = now();
+		lzss_decompress(out, len, packed, (unsigned int)packed_len);
+		t = now() - t;
+		if (run == 0 || t < new_best) new_best = t;
+	}
+	CHECK(memcmp(out, src, len) == 0, "%s: throughput run decoded wrongly", name);
+
+	printf("%-24s %10u  %10zd  %9.1f  %9.1f  %6.2fx\n",
+		   name, len, packed_len, len / ref_best / 1e6, len / new_best / 1e6, ref_best / new_best);
+
+	free(packed);
+	free(out);
+}
+
+static void test_throughput(void) {
+	unsigned int width = 1536, height = 2048, len = width * height * 4;
+	uint8_t *src = malloc(len);
+
+	printf("\n%-24s %10s  %10s  %9s  %9s  %7s\n", "decode", "bytes", "packed", "old MB/s", "new MB/s", "speedup");
+
+	// a boot logo: black with an antialiased grey disc, BGRA
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			int dx = x - width / 2, dy = y - height / 2, d = dx * dx + dy * dy;
+			uint8_t *p = src + ((size_t)y * width + x) * 4;
+			p[0] = p[1] = p[2] = d < 256 * 256 ? 255 - d / 300 : 0;
+			p[3] = 0xff;
+		}
+	}
+	throughput("logo 1536x2048", src, len);
+
+	compressible(src, len);
+	throughput("mixed 12MB", src, len);
+
+	for (unsigned int i = 0; i < len; i++)
+		src[i] = rng();
+	throughput("random 12MB", src, len);
+
+	free(src);
+}
+
+int main(int argc, char **argv) {
+	unsigned int count = 200000;
+	bool timing = true;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:s:th")) != -1) {
+		switch (ch) {
+			case 'n': count = (unsigned int)strtoul(optarg, NULL, 0); break;
+			case 's': rng_state = (uint32_t)strtoul(optarg, NULL, 0) | 1; break;
+			case 't': timing = false; break;
+			default:
+				fprintf(stderr, "usage: %s [-n random streams] [-s seed] [-t]\n", argv[0]);
+				fprintf(stderr, "  -t  skip the throughput comparison\n");
+				return 1;
+		}
+	}
+
+	test_random_streams(count);
+	test_random_stream_api(count / 20);
+	test_round_trips();
+	if (timing)
+		test_throughput();
+
+	if (failures)
+		printf("\n%u checks failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,669 @@
+/*
+ * corpus.c - patch a directory of bootloaders, check them against known output and time it
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "corpus.h"
+#include "newpatch.h"
+
+enum golden_state { GOLDEN_NONE, GOLDEN_MATCH, GOLDEN_MISMATCH, GOLDEN_MISSING };
+
+static const char* golden_names[] = { "none", "match", "mismatch", "missing" };
+
+static const char* patch_names[KAIROS_PATCH_COUNT] = {
+	[KAIROS_PATCH_SETUP] = "setup",
+	[KAIROS_PATCH_BOOTARGS] = "bootargs",
+	[KAIROS_PATCH_KDEBUG] = "kdebug",
+	[KAIROS_PATCH_CMDHANDLER] = "cmdhandler",
+	[KAIROS_PATCH_NVRAM] = "nvram",
+	[KAIROS_PATCH_RSA] = "rsa",
+};
+
+// one sample per run: every patch, then the total
+#define SAMPLE_WIDTH (KAIROS_PATCH_COUNT + 1)
+
+struct corpus_image {
+	char name[256];
+	int status;			// kairos_patch_buffer(), or -1 if the file could not be read
+	bool skipped;			// still an IMG4 container
+	uint8_t digest[32];		// of the patched output
+	enum golden_state golden;
+	unsigned runs;
+	uint64_t* samples;		// runs * SAMPLE_WIDTH
+	struct kairos_timings hints;	// hint counters of the first run; later ones would hit on this image's own hints
+};
+
+struct corpus_run {
+	const struct corpus_opts* opts;
+	struct corpus_image* images;
+	size_t count;
+	size_t next;
+};
+
+static void hex_digest(const uint8_t digest[32], char hex[65]) {
+	for(int i = 0; i < 32; i++)
+		snprintf(hex+2*i,3,"%02x",digest[i]);
+}
+
+static void patch_one(const struct corpus_opts* opts, struct corpus_image* img) {
+	char path[1024];
+	snprintf(path,sizeof(path),"%s/%s",opts->dir,img->name);
+	img->status = -1;
+	FILE* fp = fopen(path,"rb");
+	if(!fp)
+		return;
+	fseek(fp,0,SEEK_END);
+	size_t len = ftell(fp);
+	fseek(fp,0,SEEK_SET);
+	uint8_t* orig = (uint8_t*)malloc(len);
+	uint8_t* work = (uint8_t*)malloc(len);
+	unsigned iterations = opts->iterations ? opts->iterations : 1;
+	img->samples = (uint64_t*)calloc(iterations * SAMPLE_WIDTH,sizeof(uint64_t));
+	if(!orig || !work || !img->samples || fread(orig,1,len,fp) != len || len < 0x400) {
+		fclose(fp);
+		free(orig);
+		free(work);
+		return;
+	}
+	fclose(fp);
+	if(has_magic(orig)) {
+		img->skipped = true;
+		img->status = 0;
+		free(orig);
+		free(work);
+		return;
+	}
+	for(unsigned i = 0; i < iterations; i++) {
+		struct iboot64_img iboot_in;
+		struct kairos_timings timings;
+		kairos_opts patch = opts->patch;
+		memcpy(work,orig,len);
+		memset(&iboot_in,0,sizeof(iboot_in));
+		iboot_in.buf = work;
+		iboot_in.len = len;
+		patch.timings = &timings;
+		img->status = kairos_patch_buffer(&iboot_in,&patch);
+		uint64_t* s = img->samples + (size_t)i * SAMPLE_WIDTH;
+		memcpy(s,timings.ns,sizeof(timings.ns));
+		s[KAIROS_PATCH_COUNT] = timings.total_ns;
+		if(!img->runs)
+			img->hints = timings;
+		img->runs++;
+		if(img->status != 0)
+			break;
+	}
+	pf_sha256(work,len,img->digest);
+	free(orig);
+	free(work);
+}
+
+static void* corpus_worker(void* arg) {
+	struct corpus_run* run = (struct corpus_run*)arg;
+	struct kairos_log log = { NULL, 0, 0 };
+	kairos_log_sink = &log; // thousands of patch logs are no use here
+	for(;;) {
+		size_t i = __sync_fetch_and_add(&run->next,1);
+		if(i >= run->count)
+			break;
+		patch_one(run->opts,&run->images[i]);
+		log.len = 0;
+	}
+	kairos_log_sink = NULL;
+	free(log.buf);
+	return NULL;
+}
+
+static int compare_name(const void* a, const void* b) {
+	return strcmp(((const struct corpus_image*)a)->name,((const struct corpus_image*)b)->name);
+}
+
+static int compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static struct corpus_image* list_corpus(const char* dir, size_t* count) {
+	struct corpus_image* images = NULL;
+	size_t cap = 0;
+	struct dirent* ent;
+	DIR* d = opendir(dir);
+	*count = 0;
+	if(!d)
+		return NULL;
+	while((ent = readdir(d))) {
+		char path[1024];
+		struct stat st;
+		if(ent->d_name[0] == '.' || strlen(ent->d_name) >= sizeof(images->name))
+			continue;
+		snprintf(path,sizeof(path),"%s/%s",dir,ent->d_name);
+		if(stat(path,&st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if(*count == cap) {
+			cap = cap ? cap * 2 : 64;
+			struct corpus_image* n = (struct corpus_image*)realloc(images,cap*sizeof(struct corpus_image));
+			if(!n)
+				break;
+			images = n;
+		}
+		memset(&images[*count],0,sizeof(struct corpus_image));
+		strcpy(images[*count].name,ent->d_name);
+		(*count)++;
+	}
+	closedir(d);
+	if(images)
+		qsort(images,*count,sizeof(struct corpus_image),compare_name);
+	return images;
+}
+
+// fills in golden for every image; images without a line are GOLDEN_MISSING
+static void check_manifest(const char* manifest, struct corpus_image* images, size_t count) {
+	char line[1024];
+	FILE* fp = fopen(manifest,"r");
+	for(size_t i = 0; i < count; i++)
+		images[i].golden = GOLDEN_MISSING;
+	if(!fp)
+		return;
+	while(fgets(line,sizeof(line),fp)) {
+		char hex[65], name[256];
+		if(sscanf(line,"%64s %255s",hex,name) != 2)
+			continue;
+		struct corpus_image key;
+		strcpy(key.name,name);
+		struct corpus_image* img = (struct corpus_image*)bsearch(&key,images,count,sizeof(struct corpus_image),compare_name);
+		if(!img || img->skipped || img->status != 0)
+			continue;
+		char have[65];
+		hex_digest(img->digest,have);
+		img->golden = strcasecmp(have,hex) == 0 ? GOLDEN_MATCH : GOLDEN_MISMATCH;
+	}
+	fclose(fp);
+}
+
+static int write_manifest(const char* manifest, const struct corpus_image* images, size_t count) {
+	FILE* fp = fopen(manifest,"w");
+	if(!fp)
+		return -1;
+	for(size_t i = 0; i < count; i++) {
+		char hex[65];
+		if(images[i].skipped || images[i].status != 0)
+			continue;
+		hex_digest(images[i].digest,hex);
+		fprintf(fp,"%s  %s\n",hex,images[i].name);
+	}
+	return fclose(fp);
+}
+
+static void json_string(FILE* fp, const char* s) {
+	fputc('"',fp);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\')
+			fprintf(fp,"\\%c",*s);
+		else if((unsigned char)*s < 0x20)
+			fprintf(fp,"\\u%04x",*s);
+		else
+			fputc(*s,fp);
+	}
+	fputc('"',fp);
+}
+
+// min/median/p99 of column col over every run in images, nearest rank
+static void json_stats(FILE* fp, const struct corpus_image* images, size_t count, size_t col) {
+	size_t n = 0, k = 0;
+	for(size_t i = 0; i < count; i++)
+		n += images[i].runs;
+	uint64_t* v = (uint64_t*)malloc((n ? n : 1) * sizeof(uint64_t));
+	if(!v || !n) {
+		fprintf(fp,"null");
+		free(v);
+		return;
+	}
+	for(size_t i = 0; i < count; i++)
+		for(unsigned r = 0; r < images[i].runs; r++)
+			v[k++] = images[i].samples[(size_t)r * SAMPLE_WIDTH + col];
+	qsort(v,n,sizeof(uint64_t),compare_u64);
+	size_t p99 = (n * 99 + 99) / 100;
+	fprintf(fp,"{\"min_us\": %.1f, \"median_us\": %.1f, \"p99_us\": %.1f}",
+		v[0] / 1e3,v[(n - 1) / 2] / 1e3,v[(p99 ? p99 : 1) - 1] / 1e3);
+	free(v);
+}
+
+static void json_timings(FILE* fp, const struct corpus_image* images, size_t count, const char* indent) {
+	fprintf(fp,"{\n%s  \"total\": ",indent);
+	json_stats(fp,images,count,KAIROS_PATCH_COUNT);
+	for(int p = 0; p < KAIROS_PATCH_COUNT; p++) {
+		fprintf(fp,",\n%s  \"%s\": ",indent,patch_names[p]);
+		json_stats(fp,images,count,p);
+	}
+	fprintf(fp,"\n%s}",indent);
+}
+
+/*
+ * hint hit rate and what the probes cost against the full lookups they
+ * replaced; saved_ns prices every hit at the mean cost of a miss. diverged
+ * counts data-ref hits the full lookup would have answered differently
+*/
+static void json_hints(FILE* fp, const struct corpus_image* images, size_t count) {
+	uint64_t hits = 0, misses = 0, diverged = 0, probe_ns = 0, full_ns = 0;
+	for(size_t i = 0; i < count; i++) {
+		hits += images[i].hints.hint_hits;
+		misses += images[i].hints.hint_misses;
+		diverged += images[i].hints.hint_diverged;
+		probe_ns += images[i].hints.hint_probe_ns;
+		full_ns += images[i].hints.hint_full_ns;
+	}
+	fprintf(fp,"{\"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.3f, \"diverged\": %llu, \"probe_ns\": %llu, \"full_ns\": %llu",
+		(unsigned long long)hits,(unsigned long long)misses,hits + misses ? (double)hits / (hits + misses) : 0.0,
+		(unsigned long long)diverged,(unsigned long long)probe_ns,(unsigned long long)full_ns);
+	if(misses)
+		fprintf(fp,", \"saved_ns\": %lld",(long long)(hits * (full_ns / misses)) - (long long)probe_ns);
+	fprintf(fp,"}");
+}
+
+static void write_json(FILE* fp, const struct corpus_opts* opts, const struct corpus_image* images, size_t count) {
+	fprintf(fp,"{\n  \"corpus\": ");
+	json_string(fp,opts->dir);
+	fprintf(fp,",\n  \"iterations\": %u,\n  \"images\": [",opts->iterations ? opts->iterations : 1);
+	for(size_t i = 0; i < count; i++) {
+		const struct corpus_image* img = &images[i];
+		char hex[65];
+		hex_digest(img->digest,hex);
+		fprintf(fp,"%s\n    {\"name\": ",i ? "," : "");
+		json_string(fp,img->name);
+		if(img->skipped) {
+			fprintf(fp,", \"skipped\": true}");
+			continue;
+		}
+		fprintf(fp,", \"status\": %d, \"sha256\": \"%s\", \"golden\": \"%s\",\n     \"timings\": ",
+			img->status,img->status == 0 ? hex : "",golden_names[img->golden]);
+		json_timings(fp,img,1,"     ");
+		if(opts->patch.hintDir) {
+			fprintf(fp,",\n     \"hints\": ");
+			json_hints(fp,img,1);
+		}
+		fprintf(fp,"}");
+	}
+	fprintf(fp,"\n  ],\n  \"summary\": ");
+	json_timings(fp,images,count,"  ");
+	if(opts->patch.hintDir) {
+		fprintf(fp,",\n  \"hints\": ");
+		json_hints(fp,images,count);
+	}
+	fprintf(fp,"\n}\n");
+}
+
+int kairos_corpus_run(const struct corpus_opts* opts) {
+	struct corpus_run run;
+	size_t count = 0;
+	int failed = 0;
+	struct corpus_image* images = list_corpus(opts->dir,&count);
+	if(!images)
+		return -1;
+	unsigned threads = opts->threads;
+	if(!threads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? (unsigned)n : 1;
+	}
+	if(threads > count)
+		threads = count ? (unsigned)count : 1;
+	run.opts = opts;
+	run.images = images;
+	run.count = count;
+	run.next = 0;
+	pthread_t* pool = (pthread_t*)calloc(threads,sizeof(pthread_t));
+	unsigned started = 0;
+	for(unsigned i = 0; pool && i < threads; i++) {
+		if(pthread_create(&pool[started],NULL,corpus_worker,&run) == 0)
+			started++;
+	}
+	if(!started) // no threads to be had, do it all here
+		corpus_worker(&run);
+	for(unsigned i = 0; i < started; i++)
+		pthread_join(pool[i],NULL);
+	free(pool);
+
+	if(opts->manifest) {
+		if(opts->update_manifest) {
+			if(write_manifest(opts->manifest,images,count) != 0)
+				failed = -1;
+		} else {
+			check_manifest(opts->manifest,images,count);
+		}
+	}
+	if(opts->json) {
+		FILE* fp = strcmp(opts->json,"-") ? fopen(opts->json,"w") : stdout;
+		if(fp) {
+			write_json(fp,opts,images,count);
+			if(fp != stdout)
+				fclose(fp);
+		} else {
+			failed = -1;
+		}
+	}
+	for(size_t i = 0; i < count; i++) {
+		// an image the manifest does not know is as suspect as one it disagrees with
+		bool bad = images[i].status != 0 || images[i].golden == GOLDEN_MISMATCH || images[i].golden == GOLDEN_MISSING;
+		if(failed >= 0 && !images[i].skipped && bad)
+			failed++;
+		free(images[i].samples);
+	}
+	free(images);
+	return failed;
+}
+
+/*
+ * Synthetic bootloaders. Each image is random filler code with one
+ * instruction template per patch site dropped in at roughly the same
+ * relative position, plus the strings, pointer lists and header fields
+ * the patches look for. They are nothing like a real iBoot, but every
+ * patch has to find its site the same way it would in one, so the runner
+ * can cover the whole patch path on a box without Apple firmware.
+*/
+
+#define SYNTH_STP_FP_LR		0xA9BF7BFD	// stp x29, x30, [sp, #-0x10]!
+#define SYNTH_MOV_FP_SP		0x910003FD	// mov x29, sp
+#define SYNTH_LDP_FP_LR		0xA8C17BFD	// ldp x29, x30, [sp], #0x10
+#define SYNTH_RET		0xD65F03C0
+#define SYNTH_NOP		0xD503201F
+#define SYNTH_ADD_X3_SP		0x910083E3	// add x3, sp, #0x20
+#define SYNTH_CSEL_X0_X8_X9_NE	0x9A891100
+#define SYNTH_DATA_SIZE		0x8000		// strings and pointer lists at the end of the image
+#define SYNTH_CODE_START	0x400
+
+static const uint32_t synth_versions[] = { 5540, 6603 }; // iOS 13, and iOS 14 with the base address at 0x300
+static const char* synth_kinds[] = { "iBSS", "iBEC", "iBoot" };
+
+enum synth_site { SYNTH_STUB, SYNTH_BOOTARGS, SYNTH_KDEBUG, SYNTH_SETENV, SYNTH_ENV, SYNTH_COM_APPLE,
+	SYNTH_IMG4_PARTIAL, SYNTH_IMG4_CALLER, SYNTH_VERIFY, SYNTH_SITE_COUNT };
+
+struct synth_image {
+	uint8_t* buf;
+	size_t len;
+	uint64_t base;
+	uint32_t rng;
+	addr_t site[SYNTH_SITE_COUNT];	// where each template's function starts
+	addr_t data;			// next free byte in the data area
+};
+
+static uint32_t synth_rand(struct synth_image* img) {
+	uint32_t x = img->rng; // xorshift32, so a seed gives the same corpus everywhere
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	img->rng = x;
+	return x;
+}
+
+static void synth_put(struct synth_image* img, addr_t at, uint32_t op) {
+	memcpy(img->buf + at,&op,sizeof(op));
+}
+
+static uint32_t synth_adr(addr_t at, uint8_t rd, addr_t target) {
+	return new_insn_adr(at,rd,target);
+}
+
+static uint32_t synth_bl(addr_t at, addr_t target) {
+	return 0x94000000 | ((uint32_t)((int64_t)(target - at) / 4) & 0x3FFFFFF);
+}
+
+// data area allocations, aligned so pointers and lists stay 8-byte aligned
+static addr_t synth_data(struct synth_image* img, const void* what, size_t len) {
+	addr_t at = img->data;
+	memcpy(img->buf + at,what,len);
+	img->data = (at + len + 7) & ~7ULL;
+	return at;
+}
+
+static addr_t synth_string(struct synth_image* img, const char* str) {
+	return synth_data(img,str,strlen(str) + 1);
+}
+
+static addr_t synth_pointer(struct synth_image* img, addr_t target) {
+	uint64_t ptr = img->base + target;
+	return synth_data(img,&ptr,sizeof(ptr));
+}
+
+/*
+ * filler: small functions of moves, immediates and short forward branches,
+ * some calling the stub. none of it reads memory or builds an address, so
+ * it cannot look like a reference to anything a patch searches for
+*/
+static void synth_filler(struct synth_image* img, addr_t from, addr_t to) {
+	addr_t at = from;
+	while(at + 16 <= to) {
+		unsigned body = 4 + synth_rand(img) % 40;
+		synth_put(img,at,SYNTH_STP_FP_LR);
+		synth_put(img,at + 4,SYNTH_MOV_FP_SP);
+		at += 8;
+		for(unsigned i = 0; i < body && at + 12 <= to; i++, at += 4) {
+			uint32_t r = synth_rand(img);
+			uint8_t rd = r % 28, rm = (r >> 5) % 28;
+			switch((r >> 10) % 6) {
+				case 0: synth_put(img,at,new_mov_immediate_insn(rd,(uint16_t)(r >> 16),1)); break;
+				case 1: synth_put(img,at,new_mov_register_insn(rd,-1,rm,0)); break;
+				case 2: synth_put(img,at,0x54000000 | ((2 + (r >> 16) % 3) << 5) | ((r >> 20) % 14)); break; // b.cond
+				case 3: synth_put(img,at,0xB4000000 | ((2 + (r >> 16) % 3) << 5) | rd); break; // cbz
+				case 4: synth_put(img,at,synth_bl(at,img->site[SYNTH_STUB])); break;
+				default: synth_put(img,at,SYNTH_NOP); break;
+			}
+		}
+		synth_put(img,at,SYNTH_LDP_FP_LR);
+		synth_put(img,at + 4,SYNTH_RET);
+		at += 8;
+	}
+	for(; at + 4 <= to; at += 4)
+		synth_put(img,at,SYNTH_NOP);
+}
+
+// epilogue of whatever came before, then a frame; returns where the body goes
+static addr_t synth_prologue(struct synth_image* img, enum synth_site which, addr_t at) {
+	synth_put(img,at,SYNTH_LDP_FP_LR);
+	synth_put(img,at + 4,SYNTH_RET);
+	synth_put(img,at + 8,SYNTH_STP_FP_LR);
+	synth_put(img,at + 12,SYNTH_MOV_FP_SP);
+	img->site[which] = at + 8;
+	return at + 16;
+}
+
+static addr_t synth_epilogue(struct synth_image* img, addr_t at) {
+	synth_put(img,at,SYNTH_LDP_FP_LR);
+	synth_put(img,at + 4,SYNTH_RET);
+	return at + 8;
+}
+
+// one function that hands a data address to a call, like most patch sites
+static void synth_data_ref(struct synth_image* img, enum synth_site which, addr_t at, addr_t target) {
+	at = synth_prologue(img,which,at);
+	synth_put(img,at,synth_adr(at,1,target));
+	synth_put(img,at + 4,synth_bl(at + 4,img->site[SYNTH_STUB]));
+	synth_epilogue(img,at + 8);
+}
+
+static int synth_one(const char* path, uint32_t seed) {
+	struct synth_image img;
+	memset(&img,0,sizeof(img));
+	img.rng = seed ? seed : 1;
+	for(int i = 0; i < 8; i++) // mix the seed in
+		synth_rand(&img);
+	uint32_t vers = synth_versions[synth_rand(&img) % (sizeof(synth_versions) / sizeof(synth_versions[0]))];
+	const char* kind = synth_kinds[synth_rand(&img) % (sizeof(synth_kinds) / sizeof(synth_kinds[0]))];
+	bool kernelLoad = strcmp(kind,"iBSS") != 0;
+	img.len = 0x80000 + (synth_rand(&img) % 4) * 0x10000;
+	img.base = 0x180000000ULL;
+	img.buf = (uint8_t*)malloc(img.len);
+	if(!img.buf)
+		return -1;
+	for(addr_t at = 0; at < SYNTH_CODE_START; at += 4)
+		synth_put(&img,at,SYNTH_NOP);
+	snprintf((char*)img.buf + 0x200,0x80,"%s for synth%uap, Copyright 2007-2020, Apple Inc.",kind,synth_rand(&img) % 100);
+	snprintf((char*)img.buf + 0x280,0x40,"iBoot-%u.0.%u",vers,100 + synth_rand(&img) % 50);
+	memcpy(img.buf + (vers >= 6603 ? 0x300 : 0x318),&img.base,sizeof(img.base));
+
+	// data: one zero run for the boot-args, then strings and the nvram whitelists
+	addr_t dataStart = img.len - SYNTH_DATA_SIZE;
+	memset(img.buf + dataStart,0xFF,SYNTH_DATA_SIZE);
+	memset(img.buf + dataStart,0,0x400);
+	img.data = dataStart + 0x400;
+	addr_t bootargs = synth_string(&img,DEFAULT_BOOTARGS_STRING);
+	addr_t verbose = synth_string(&img,"-v");
+	addr_t debugEnabled = synth_string(&img,"debug-enabled");
+	addr_t img4 = synth_string(&img,"IMG4");
+	addr_t comApple = synth_string(&img,"com.apple.System.");
+	addr_t autoBoot = synth_string(&img,"auto-boot");
+	addr_t debugUarts = synth_string(&img,"debug-uarts");
+	addr_t bootArgsVar = synth_string(&img,"boot-args");
+	addr_t backlight = synth_string(&img,"backlight-level");
+	synth_string(&img,ENTERING_RECOVERY_CONSOLE);
+	if(kernelLoad)
+		synth_string(&img,KERNEL_LOAD_STRING);
+	uint64_t zero = 0;
+	synth_data(&img,&zero,sizeof(zero));
+	addr_t setenvList = synth_pointer(&img,autoBoot);
+	synth_pointer(&img,debugUarts);
+	synth_pointer(&img,bootArgsVar);
+	synth_data(&img,&zero,sizeof(zero));
+	addr_t envList = synth_pointer(&img,autoBoot);
+	synth_pointer(&img,backlight);
+	synth_data(&img,&zero,sizeof(zero));
+	addr_t verifySlot = img.data; // filled in once the function is placed
+	synth_data(&img,&zero,sizeof(zero));
+
+	// code: filler everywhere, then the templates at jittered fractions of it
+	img.site[SYNTH_STUB] = SYNTH_CODE_START + 8;
+	synth_filler(&img,SYNTH_CODE_START,dataStart);
+	synth_epilogue(&img,synth_prologue(&img,SYNTH_STUB,SYNTH_CODE_START));
+	addr_t span = (dataStart - SYNTH_CODE_START) / SYNTH_SITE_COUNT;
+	addr_t at[SYNTH_SITE_COUNT];
+	for(int i = 1; i < SYNTH_SITE_COUNT; i++)
+		at[i] = (SYNTH_CODE_START + i * span + synth_rand(&img) % 0x800) & ~3ULL;
+
+	addr_t p;
+	if(kernelLoad) {
+		p = synth_prologue(&img,SYNTH_BOOTARGS,at[SYNTH_BOOTARGS]);
+		// cbz around the default boot-args, whose ADR feeds a CSEL, and the ADR the branch lands on
+		synth_put(&img,p,0xB4000000 | (5 << 5)); // cbz x0, p + 20
+		synth_put(&img,p + 4,synth_adr(p + 4,8,bootargs));
+		synth_put(&img,p + 8,synth_adr(p + 8,9,verbose));
+		synth_put(&img,p + 12,SYNTH_CSEL_X0_X8_X9_NE);
+		synth_put(&img,p + 16,synth_bl(p + 16,img.site[SYNTH_STUB]));
+		synth_put(&img,p + 20,synth_adr(p + 20,1,verbose));
+		synth_put(&img,p + 24,synth_bl(p + 24,img.site[SYNTH_STUB]));
+		synth_epilogue(&img,p + 28);
+		// debug-enabled, then the second call after it
+		p = synth_prologue(&img,SYNTH_KDEBUG,at[SYNTH_KDEBUG]);
+		synth_put(&img,p,synth_adr(p,0,debugEnabled));
+		synth_put(&img,p + 4,synth_bl(p + 4,img.site[SYNTH_STUB]));
+		synth_put(&img,p + 8,synth_bl(p + 8,img.site[SYNTH_STUB]));
+		synth_epilogue(&img,p + 12);
+	}
+	synth_data_ref(&img,SYNTH_SETENV,at[SYNTH_SETENV],setenvList);
+	synth_data_ref(&img,SYNTH_ENV,at[SYNTH_ENV],envList);
+	synth_data_ref(&img,SYNTH_COM_APPLE,at[SYNTH_COM_APPLE],comApple);
+	synth_data_ref(&img,SYNTH_IMG4_PARTIAL,at[SYNTH_IMG4_PARTIAL],img4);
+	// the verify function, and its caller passing it in x2 next to add x3, sp
+	p = synth_prologue(&img,SYNTH_VERIFY,at[SYNTH_VERIFY]);
+	synth_put(&img,p,new_mov_immediate_insn(0,1,1));
+	synth_epilogue(&img,p + 4);
+	uint64_t verifyPtr = img.base + img.site[SYNTH_VERIFY];
+	memcpy(img.buf + verifySlot,&verifyPtr,sizeof(verifyPtr));
+	p = synth_prologue(&img,SYNTH_IMG4_CALLER,at[SYNTH_IMG4_CALLER]);
+	synth_put(&img,p,synth_adr(p,2,verifySlot));
+	synth_put(&img,p + 4,synth_adr(p + 4,3,verbose));
+	synth_put(&img,p + 8,SYNTH_ADD_X3_SP);
+	synth_put(&img,p + 12,synth_bl(p + 12,img.site[SYNTH_IMG4_PARTIAL]));
+	synth_epilogue(&img,p + 16);
+
+	FILE* fp = fopen(path,"wb");
+	int ok = fp && fwrite(img.buf,1,img.len,fp) == img.len;
+	if(fp && fclose(fp) != 0)
+		ok = 0;
+	free(img.buf);
+	return ok ? 0 : -1;
+}
+
+int kairos_corpus_synth(const char* dir, unsigned count, uint32_t seed) {
+	char path[1024];
+	if(mkdir(dir,0755) != 0) {
+		struct stat st;
+		if(stat(dir,&st) != 0 || !S_ISDIR(st.st_mode))
+			return -1;
+	}
+	for(unsigned i = 0; i < count; i++) {
+		snprintf(path,sizeof(path),"%s/synth-%04u.bin",dir,i);
+		if(synth_one(path,seed ^ ((i + 1) * 0x9E3779B9u)) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+#ifdef CORPUS_MAIN
+
+int
+main(int argc, char** argv)
+{
+	struct corpus_opts opts;
+	int c;
+	memset(&opts,0,sizeof(opts));
+	opts.iterations = 5;
+	opts.json = "-";
+	opts.patch.bootargs = DEFAULT_BOOTARGS_STRING;
+	opts.patch.nvramUnlock = true;
+	unsigned synth = 0;
+	while((c = getopt(argc,argv,"j:n:b:m:uo:H:s:")) != -1) {
+		switch(c) {
+			case 'j': opts.threads = atoi(optarg); break;
+			case 'n': opts.iterations = atoi(optarg); break;
+			case 'b': opts.patch.bootargs = optarg; break;
+			case 'm': opts.manifest = optarg; break;
+			case 'u': opts.update_manifest = true; break;
+			case 'o': opts.json = optarg; break;
+			case 'H': opts.patch.hintDir = optarg; opts.patch.hintVerify = true; break;
+			case 's': synth = atoi(optarg); break;
+			default: optind = argc + 1; break;
+		}
+	}
+	if(optind != argc - 1) {
+		printf("Usage: %s [-j threads] [-n iterations] [-b boot-args] [-m manifest [-u]] [-o report.json] [-H hint_dir] [-s count] corpus_dir\n",argv[0]);
+		printf("Patch every bootloader in corpus_dir, check against the manifest (-u rewrites it) and report timings\n");
+		printf("-H probes patch sites learned by earlier images (use -j 1 to learn in name order) and reports the hit rate,\n   checking every data-ref hit against the full lookup\n");
+		printf("-s first writes count synthetic images into corpus_dir, for when there is no firmware at hand\n");
+		return EXIT_FAILURE;
+	}
+	opts.dir = argv[optind];
+	if(synth && kairos_corpus_synth(opts.dir,synth,1) != 0) {
+		printf("Could not write synthetic images to %s\n",opts.dir);
+		return EXIT_FAILURE;
+	}
+	int failed = kairos_corpus_run(&opts);
+	if(failed < 0) {
+		printf("Could not run corpus %s\n",opts.dir);
+		return EXIT_FAILURE;
+	}
+	if(failed)
+		fprintf(stderr,"%d image(s) failed, did not match the manifest or are missing from it\n",failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
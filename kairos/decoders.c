@@ -20,6 +20,7 @@
 */
 
 #define _GNU_SOURCE
+#include <pthread.h>
 #include "decoders.h"
 
 // thank you tihmstar
@@ -27,71 +28,114 @@ uint64_t BIT_RANGE(uint64_t v, int begin, int end) { return ((v)>>(begin)) % (1
 uint64_t BIT_AT(uint64_t v, int pos){ return (v >> pos) % 2; }
 uint64_t SET_BITS(uint64_t v, int begin) { return ((v)<<(begin));}
 
-insn_type_t get_type(uint32_t data) {
-    enum insn_type type;
-    if(BIT_RANGE(data, 24, 28) == 0x10 && (data>>31))
-        type = adrp;
-    else if(BIT_RANGE(data, 24, 28) == 0x10 && !(data>>31))
-        type = adr;
-    else if(BIT_RANGE(data, 24, 30) == 0x11)
-        type = add;
-    else if(BIT_RANGE(data, 24, 30) == 0x51)
-        type = sub;
-    else if((data>>26) == 0x25)
-        type = bl;
-    else if(BIT_RANGE(data, 24, 30) == 0x34)
-        type = cbz;
-    else if(((0x1F << 5) | data) == 0xD65F03E0)
-        type = ret;
-    else if(BIT_RANGE(data, 24, 30) == 0x37)
-        type = tbnz;
-    else if(((0x1F << 5) | data) == 0xD61F03E0)
-        type = br;
-    else if((((data>>22) | 0x100) == 0x3E1 && ((data>>10) % 4)) || ((data>>22 | 0x100) == 0x3E5) || ((data>>23) == 0x18))
-        type = ldr;
-    else if(BIT_RANGE(data, 24, 30) == 0x35)
-        type = cbnz;
-    else if(BIT_RANGE(data, 23, 30) == 0xE5)
-        type = movk;
-    else if(BIT_RANGE(data, 23, 30) == 0x64)
-        type = orr;
-    else if(BIT_RANGE(data, 23, 30) == 0x24)
-        type = and_;
-    else if(BIT_RANGE(data, 24, 30) == 0x36)
-        type = tbz;
-    else if((BIT_RANGE(data, 24, 29) == 0x8) && (data >> 31) && BIT_AT(data, 22))
-        type = ldxr;
-    else if(BIT_RANGE(data, 21, 31) == 0x1C2 || BIT_RANGE(data, 22, 31) == 0xE5  || (BIT_RANGE(data, 21, 31) == 0x1C3 && BIT_RANGE(data, 10, 11) == 0x2))
-        type = ldrb;
-    else if((BIT_RANGE(data, 22, 29) == 0xE4) && (data >> 31))
-        type = str;
-    else if((BIT_RANGE(data, 25, 30) == 0x14) && !BIT_AT(data, 22))
-        type = stp;
-    else if((BIT_RANGE(data, 23, 30) == 0xA5))
-        type = movz;
-    else if((BIT_RANGE(data, 24, 30) == 0x2A) && (BIT_AT(data, 21) == 0x0))
-        type = mov;
-    else if((BIT_RANGE(data, 24, 31) == 0x54) && !BIT_AT(data, 4))
-        type = bcond;
-    else if((BIT_RANGE(data, 26, 31) == 0x5))
-        type = b;
-    else if((BIT_RANGE(data, 12, 31) == 0xD5032) & (0x1F % (1<<5)))
-        type = nop;
-    else if((BIT_RANGE(data, 21, 30) == 0xD4) && (BIT_RANGE(data, 10, 11) == 0x0))
-        type = csel;
-    else if((BIT_RANGE(data, 20, 31) == 0xD53))
-        type = mrs;
-    else if((BIT_RANGE(data, 21, 30) == 0x359) || (BIT_RANGE(data, 24, 30) == 0x6B) || (BIT_RANGE(data, 24, 30) == 0x71)) 
-        type = subs;
-    else if((BIT_RANGE(data, 21, 30) == 0x3D2))
-        type = ccmp;
-    else
-        type = unknown;
-    return type; 
+/*
+ * Decoder spec: mask/value pairs in the order the old get_type() if/else chain
+ * tested them, first hit wins. A type that needed an OR of conditions gets one
+ * line per condition.
+ */
+#define DECODE_SPEC(X) \
+    X(adrp,  0x9F000000, 0x90000000) \
+    X(adr,   0x9F000000, 0x10000000) \
+    X(add,   0x7F000000, 0x11000000) \
+    X(sub,   0x7F000000, 0x51000000) \
+    X(bl,    0xFC000000, 0x94000000) \
+    X(cbz,   0x7F000000, 0x34000000) \
+    X(ret,   0xFFFFFC1F, 0xD65F0000) \
+    X(tbnz,  0x7F000000, 0x37000000) \
+    X(br,    0xFFFFFC1F, 0xD61F0000) \
+    X(ldr,   0xBFC00400, 0xB8400400) \
+    X(ldr,   0xBFC00800, 0xB8400800) \
+    X(ldr,   0xBFC00000, 0xB9400000) \
+    X(ldr,   0xFF800000, 0x0C000000) \
+    X(cbnz,  0x7F000000, 0x35000000) \
+    X(movk,  0x7F800000, 0x72800000) \
+    X(orr,   0x7F800000, 0x32000000) \
+    X(and_,  0x7F800000, 0x12000000) \
+    X(tbz,   0x7F000000, 0x36000000) \
+    X(ldxr,  0xBF400000, 0x88400000) \
+    X(ldrb,  0xFFE00000, 0x38400000) \
+    X(ldrb,  0xFFC00000, 0x39400000) \
+    X(ldrb,  0xFFE00C00, 0x38600800) \
+    X(str,   0xBFC00000, 0xB9000000) \
+    X(stp,   0x7E400000, 0x28000000) \
+    X(movz,  0x7F800000, 0x52800000) \
+    X(mov,   0x7F200000, 0x2A000000) \
+    X(bcond, 0xFF000010, 0x54000000) \
+    X(b,     0xFC000000, 0x14000000) \
+    X(nop,   0xFFFFF000, 0xD5032000) \
+    X(csel,  0x7FE00C00, 0x1A800000) \
+    X(mrs,   0xFFF00000, 0xD5300000) \
+    X(subs,  0x7FE00000, 0x6B200000) \
+    X(subs,  0x7F000000, 0x6B000000) \
+    X(subs,  0x7F000000, 0x71000000) \
+    X(ccmp,  0x7FE00000, 0x7A400000)
+
+static const struct {
+    insn_type_t type;
+    uint32_t mask;
+    uint32_t value;
+} decode_spec[] = {
+#define DECODE_ENTRY(type, mask, value) { type, mask, value },
+    DECODE_SPEC(DECODE_ENTRY)
+#undef DECODE_ENTRY
+};
+
+#define DECODE_NSPEC (sizeof(decode_spec) / sizeof(decode_spec[0]))
+
+/*
+ * Two-level lookup: bits 21-31 pick the short run of spec entries that can
+ * still match, and only those are tested against the whole word. A run stops
+ * at the first entry that does not look at bits 0-20, since nothing after it
+ * can be reached.
+ */
+static struct {
+    uint16_t first;
+    uint8_t count;
+} decode_l1[1 << 11];
+static uint8_t* decode_l2;
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+static void build_decode_table(void) {
+    size_t total = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t n = 0;
+        for (uint32_t hi = 0; hi < (1 << 11); hi++) {
+            uint32_t top = hi << 21;
+            if (pass)
+                decode_l1[hi].first = n;
+            for (uint8_t k = 0; k < DECODE_NSPEC; k++) {
+                uint32_t mask = decode_spec[k].mask;
+                if ((top & mask & 0xFFE00000) != (decode_spec[k].value & mask & 0xFFE00000))
+                    continue;
+                if (pass)
+                    decode_l2[n] = k;
+                n++;
+                if (!(mask & 0x1FFFFF))
+                    break;
+            }
+            if (pass)
+                decode_l1[hi].count = n - decode_l1[hi].first;
+        }
+        if (!pass) {
+            total = n;
+            decode_l2 = malloc(total ? total : 1);
+            if (!decode_l2)
+                abort();
+        }
+    }
 }
 
-uint8_t get_rn(uint32_t offset){
-    insn_type_t type = get_type(offset);
+static insn_type_t decode_type(uint32_t data) {
+    pthread_once(&decode_once, build_decode_table);
+    const uint8_t* run = decode_l2 + decode_l1[data >> 21].first;
+    for (uint8_t i = 0; i < decode_l1[data >> 21].count; i++) {
+        if ((data & decode_spec[run[i]].mask) == decode_spec[run[i]].value)
+            return decode_spec[run[i]].type;
+    }
+    return unknown;
+}
+
+static uint8_t rn_for_type(insn_type_t type, uint32_t insn) {
     switch (type) {
         case subs:
         case add:
@@ -108,19 +152,14 @@ uint8_t get_rn(uint32_t offset){
         case csel:
         case mov:
         case ccmp:
-            return BIT_RANGE(offset, 5, 9);
+            return BIT_RANGE(insn, 5, 9);
         default:
             return -1;
-            break;
     }
 }
 
-uint8_t get_rd(uint32_t insn) {
-    insn_type_t type = get_type(insn);
+static uint8_t rd_for_type(insn_type_t type, uint32_t insn) {
     switch (type) {
-        case unknown:
-            return -1;
-            break;
         case subs:
         case adrp:
         case adr:
@@ -135,13 +174,11 @@ uint8_t get_rd(uint32_t insn) {
             return (insn % (1<<5));
         default:
             return -1;
-            break;
     }
 }
 
-uint8_t get_rm(uint32_t insn) {
-    insn_type_t type = get_type(insn);
-    switch(type) {
+static uint8_t rm_for_type(insn_type_t type, uint32_t insn) {
+    switch (type) {
         case ccmp:
         case csel:
         case mov:
@@ -149,13 +186,11 @@ uint8_t get_rm(uint32_t insn) {
             return BIT_RANGE(insn, 16, 20);
         default:
             return -1;
-            break;
     }
 }
 
-enum supertype get_supertype(uint32_t insn) {
-    insn_type_t type = get_type(insn);
-    switch(type) {
+static enum supertype supertype_for_type(insn_type_t type) {
+    switch (type) {
         case bl:
         case cbz:
         case cbnz:
@@ -173,6 +208,79 @@ enum supertype get_supertype(uint32_t insn) {
             return supertype_general;
     }
 }
+
+static int64_t sext(uint64_t v, int bits) {
+    return (int64_t)(v << (64 - bits)) >> (64 - bits);
+}
+
+const struct decoded_insn* decode_insn(uint32_t insn, addr_t offset, struct decoded_insn* out) {
+    insn_type_t type = decode_type(insn);
+    out->insn = insn;
+    out->type = type;
+    out->supertype = supertype_for_type(type);
+    out->rd = rd_for_type(type, insn);
+    out->rn = rn_for_type(type, insn);
+    out->rm = rm_for_type(type, insn);
+    out->imm = 0;
+    out->target = 0;
+    switch (type) {
+        case adr:
+            out->imm = sext((BIT_RANGE(insn, 5, 23) << 2) | BIT_RANGE(insn, 29, 30), 21);
+            out->target = offset + out->imm;
+            break;
+        case adrp:
+            out->imm = sext((BIT_RANGE(insn, 5, 23) << 2) | BIT_RANGE(insn, 29, 30), 21) << 12;
+            out->target = (offset & ~0xFFFULL) + out->imm;
+            break;
+        case b:
+        case bl:
+            out->imm = sext(BIT_RANGE(insn, 0, 25), 26) * 4;
+            out->target = offset + out->imm;
+            break;
+        case cbz:
+        case cbnz:
+        case bcond:
+            out->imm = sext(BIT_RANGE(insn, 5, 23), 19) * 4;
+            out->target = offset + out->imm;
+            break;
+        case tbz:
+        case tbnz:
+            out->imm = sext(BIT_RANGE(insn, 5, 18), 14) * 4;
+            out->target = offset + out->imm;
+            break;
+        case add:
+        case sub:
+            out->imm = BIT_RANGE(insn, 10, 21) << (BIT_AT(insn, 22) ? 12 : 0);
+            break;
+        case movz:
+        case movk:
+            out->imm = BIT_RANGE(insn, 5, 20) << (BIT_RANGE(insn, 21, 22) * 16);
+            break;
+        default:
+            break;
+    }
+    return out;
+}
+
+insn_type_t get_type(uint32_t data) {
+    return decode_type(data);
+}
+
+uint8_t get_rn(uint32_t offset){
+    return rn_for_type(decode_type(offset), offset);
+}
+
+uint8_t get_rd(uint32_t insn) {
+    return rd_for_type(decode_type(insn), insn);
+}
+
+uint8_t get_rm(uint32_t insn) {
+    return rm_for_type(decode_type(insn), insn);
+}
+
+enum supertype get_supertype(uint32_t insn) {
+    return supertype_for_type(decode_type(insn));
+}
 // end tihmstar decoding functions
 
 uint32_t get_insn(uint8_t* buf, addr_t offset) {
@@ -213,18 +321,20 @@ int64_t get_addr_for_cbz(addr_t offset, uint32_t insn) {
 }
 
 addr_t get_prev_nth_insn(uint8_t* buf, addr_t offset, int n, insn_type_t type) {
+    struct decoded_insn insn;
     for(int i = 0; i < n; i++) {
         offset -= 4;
-        while(get_type(get_insn(buf,offset)) != type)
+        while(decode_insn(get_insn(buf,offset),offset,&insn)->type != type)
             offset -= 4;
     }
     return offset;
 }
 
 addr_t get_next_nth_insn(uint8_t* buf, addr_t offset, int n, insn_type_t type) {
+    struct decoded_insn insn;
     for(int i = 0; i < n; i++) {
         offset += 4;
-        while(get_type(get_insn(buf,offset)) != type)
+        while(decode_insn(get_insn(buf,offset),offset,&insn)->type != type)
             offset += 4;
     }
     return offset;
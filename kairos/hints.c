@@ -0,0 +1,228 @@
+/*
+ * hints.c - guess patch sites from where earlier iBoot builds had them
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hints.h"
+#include "decoders.h"
+
+struct hints_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t VERS;
+	char kind[16];
+	uint32_t count;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// decoder class of 4 instructions either side; immediates and registers change between builds, the shape mostly doesn't
+static uint64_t site_sig(const struct iboot64_img* iboot_in, addr_t site) {
+	uint64_t sig = 0;
+	for(int k = -4; k < 4; k++) {
+		addr_t at = site + 4 * k;
+		uint8_t type = 0xFF;
+		if(k >= 0 || site >= (addr_t)(-4 * k)) {
+			if(at + 4 <= iboot_in->len)
+				type = (uint8_t)get_type(get_insn(iboot_in->buf,at));
+		}
+		sig = (sig << 8) | type;
+	}
+	return sig;
+}
+
+/*
+ * iBSS, iBEC and iBoot of one build share VERS but not their layout, so the
+ * stage name from the "iBEC for n71ap, Copyright ..." banner is part of the
+ * key. images without one fall back to their size in 64k units
+*/
+#define BANNER_OFFSET 0x200
+
+static void image_kind(const struct iboot64_img* iboot_in, char kind[16]) {
+	const char* banner = (const char*)iboot_in->buf + BANNER_OFFSET;
+	size_t n = 0;
+	if(iboot_in->len > BANNER_OFFSET + 16 + 5) {
+		while(n < 15 && isalnum((unsigned char)banner[n]))
+			n++;
+		if(n && !memcmp(banner + n," for ",5)) {
+			memset(kind,0,16);
+			memcpy(kind,banner,n);
+			return;
+		}
+	}
+	// iBoot images are far below 4 GB; the clamp keeps the size and its "k" within the 16 bytes
+	uint32_t units = (uint32_t)((iboot_in->len < 0xFFFF0000 ? iboot_in->len : 0xFFFF0000) + 0xFFFF) / 0x10000;
+	snprintf(kind,16,"%uk",units * 64);
+}
+
+int hints_open(struct iboot64_img* iboot_in, const char* dir) {
+	struct iboot64_hints* hints = (struct iboot64_hints*)calloc(1,sizeof(struct iboot64_hints));
+	struct hints_header h;
+	if(!hints)
+		return -1;
+	hints->VERS = iboot_in->VERS;
+	image_kind(iboot_in,hints->kind);
+	snprintf(hints->path,sizeof(hints->path),"%s/hints-%u-%s.khn",dir,iboot_in->VERS,hints->kind);
+	iboot_in->hints = hints;
+	FILE* f = fopen(hints->path,"rb");
+	if(!f)
+		return 0;
+	if(fread(&h,sizeof(h),1,f) == 1 && h.magic == HINTS_MAGIC && h.version == HINTS_VERSION &&
+	   h.VERS == hints->VERS && !memcmp(h.kind,hints->kind,sizeof(h.kind)) && h.count == SITE_COUNT) {
+		if(fread(hints->site,sizeof(struct site_hint),SITE_COUNT,f) != SITE_COUNT)
+			memset(hints->site,0,sizeof(hints->site));
+	}
+	fclose(f);
+	return 0;
+}
+
+void hints_close(struct iboot64_img* iboot_in) {
+	struct iboot64_hints* hints = iboot_in->hints;
+	struct hints_header h;
+	char tmp[sizeof(hints->path) + 8];
+	int fd;
+	if(!hints)
+		return;
+	iboot_in->hints = NULL;
+	if(hints->hits || hints->misses)
+		LOG("Patch-site hints: %u hit, %u missed (%llu us probing, %llu us in full scans)\n",hints->hits,hints->misses,
+			(unsigned long long)hints->probe_ns / 1000,(unsigned long long)hints->full_ns / 1000);
+	if(hints->dirty) {
+		// a unique temp file: a boot chain closes several images at once, maybe with the same key
+		snprintf(tmp,sizeof(tmp),"%s.XXXXXX",hints->path);
+		FILE* f = NULL;
+		if((fd = mkstemp(tmp)) >= 0 && !(f = fdopen(fd,"wb"))) {
+			close(fd);
+			unlink(tmp);
+		}
+		if(f) {
+			memset(&h,0,sizeof(h));
+			h.magic = HINTS_MAGIC;
+			h.version = HINTS_VERSION;
+			h.VERS = hints->VERS;
+			memcpy(h.kind,hints->kind,sizeof(h.kind));
+			h.count = SITE_COUNT;
+			int ok = fwrite(&h,sizeof(h),1,f) == 1 && fwrite(hints->site,sizeof(struct site_hint),SITE_COUNT,f) == SITE_COUNT;
+			if(fclose(f) == 0 && ok)
+				rename(tmp,hints->path);
+			else
+				unlink(tmp);
+		}
+	}
+	free(hints);
+}
+
+static bool hint_window(const struct iboot64_img* iboot_in, enum iboot64_site which, addr_t* lo, addr_t* hi) {
+	const struct site_hint* s = &iboot_in->hints->site[which];
+	if(!s->known)
+		return false;
+	addr_t predicted = (addr_t)(((uint64_t)s->rel * iboot_in->len) >> 32) & ~3ULL;
+	*lo = predicted > HINT_WINDOW ? predicted - HINT_WINDOW : 0;
+	*hi = predicted + HINT_WINDOW < iboot_in->len ? predicted + HINT_WINDOW : iboot_in->len;
+	return true;
+}
+
+void hint_learn(struct iboot64_img* iboot_in, enum iboot64_site which, addr_t site) {
+	struct iboot64_hints* hints = iboot_in->hints;
+	if(!hints)
+		return;
+	if(hints->miss_started) { // the caller's full search ends here
+		hints->full_ns += now_ns() - hints->miss_started;
+		hints->miss_started = 0;
+	}
+	if(!site || site >= iboot_in->len)
+		return;
+	struct site_hint s;
+	s.known = 1;
+	s.rel = (uint32_t)(((uint64_t)site << 32) / iboot_in->len);
+	s.sig = site_sig(iboot_in,site);
+	if(memcmp(&s,&hints->site[which],sizeof(s)) != 0) {
+		hints->site[which] = s;
+		hints->dirty = true;
+	}
+}
+
+/*
+ * data ref to what: the first ref xref64() sees inside the window, if it has the right shape.
+ * a later ref in the window is never taken, the full lookup would return the earlier one.
+ * a ref before the window still would, and ruling that out costs as much as the full lookup,
+ * so hints->verify (corpus runs) does that lookup anyway and counts the hits that differ
+*/
+addr_t hint_data_ref(struct iboot64_img* iboot_in, enum iboot64_site which, addr_t what) {
+	struct iboot64_hints* hints = iboot_in->hints;
+	addr_t lo, hi, ref;
+	if(!hints)
+		return iboot64_data_ref(iboot_in,what);
+	uint64_t t0 = now_ns();
+	if(hint_window(iboot_in,which,&lo,&hi)) {
+		ref = xref64(iboot_in->buf,lo,hi,what);
+		if(ref && site_sig(iboot_in,ref) == hints->site[which].sig) {
+			hints->hits++;
+			hints->probe_ns += now_ns() - t0;
+			if(hints->verify && iboot64_data_ref(iboot_in,what) != ref) {
+				WARN("Patch-site hint for site %d is 0x%llx, the full lookup finds 0x%llx\n",which,
+					(unsigned long long)ref,(unsigned long long)iboot64_data_ref(iboot_in,what));
+				hints->diverged++;
+			}
+			return ref;
+		}
+	}
+	hints->misses++;
+	t0 = now_ns();
+	if(!iboot_in->refs && iboot64_build_refs(iboot_in) < 0)
+		WARN("Could not build reference map\n");
+	ref = iboot64_data_ref(iboot_in,what);
+	hints->full_ns += now_ns() - t0;
+	hint_learn(iboot_in,which,ref);
+	return ref;
+}
+
+// B/BL to what in the window that also passes verify; 0 sends the caller to its full search, which should hint_learn() the answer
+addr_t hint_code_ref(struct iboot64_img* iboot_in, enum iboot64_site which, addr_t what, site_verify_t verify) {
+	struct iboot64_hints* hints = iboot_in->hints;
+	addr_t lo, hi;
+	if(!hints)
+		return 0;
+	uint64_t t0 = now_ns();
+	if(hint_window(iboot_in,which,&lo,&hi)) {
+		for(addr_t at = lo; at + 4 <= hi; at += 4) {
+			uint32_t op = get_insn(iboot_in->buf,at);
+			if((op & 0x7C000000) != 0x14000000 || follow_call64(iboot_in->buf,at) != what)
+				continue;
+			if(site_sig(iboot_in,at) == hints->site[which].sig && (!verify || verify(iboot_in->buf,at))) {
+				hints->hits++;
+				hints->probe_ns += now_ns() - t0;
+				return at;
+			}
+		}
+	}
+	hints->misses++;
+	hints->miss_started = now_ns();
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * corpus.h - function declarations and defines for corpus.c
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "kairos.h"
+
+struct corpus_opts {
+	const char* dir;		// decrypted, unpacked iBoot/iBSS/iBEC images, one per file
+	const char* manifest;		// golden output hashes, "<sha256>  <name>" per line like sha256sum; may be NULL
+	bool update_manifest;		// write the manifest from this run instead of checking it
+	const char* json;		// report path, "-" for stdout, NULL for none
+	unsigned threads;		// 0 for one per CPU
+	unsigned iterations;		// patch runs per image for the timings, at least 1
+	kairos_opts patch;
+};
+
+/*
+ * patch every image in the corpus on a pool of threads, compare the outputs
+ * against the manifest and report min/median/p99 per image and per patch.
+ * returns the number of images that failed to patch or did not match, -1 on error
+*/
+int kairos_corpus_run(const struct corpus_opts* opts);
+
+/*
+ * write count synthetic images to dir (created if needed): random filler
+ * around an instruction template for every patch site, so the runner can be
+ * exercised without Apple firmware. the same seed gives the same images
+*/
+int kairos_corpus_synth(const char* dir, unsigned count, uint32_t seed);
@@ -31,6 +31,19 @@ uint64_t BIT_AT(uint64_t v, int pos);
 uint64_t SET_BITS(uint64_t v, int begin);
 // Credit goes to them for the previous declarations
 
+// everything the accessors below know about one instruction, from a single decode
+struct decoded_insn {
+    uint32_t insn;
+    insn_type_t type;
+    enum supertype supertype;
+    uint8_t rd;         // -1 if the form has no such register, like get_rd()
+    uint8_t rn;
+    uint8_t rm;
+    int64_t imm;        // branch/ADR displacement in bytes, ADD/SUB and MOVZ/MOVK immediate
+    addr_t target;      // offset + displacement for PC-relative forms, 0 otherwise
+};
+
+const struct decoded_insn* decode_insn(uint32_t insn, addr_t offset, struct decoded_insn* out);
 insn_type_t get_type(uint32_t data);
 uint8_t get_rn(uint32_t offset);
 uint8_t get_rd(uint32_t insn);
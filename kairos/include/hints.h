@@ -0,0 +1,74 @@
+/*
+ * hints.h - function declarations and defines for hints.c
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "newpatch.h"
+
+#define HINTS_MAGIC 0x746e686b // 'khnt'
+#define HINTS_VERSION 2
+#define HINT_WINDOW 0x4000 // bytes probed on each side of the predicted site
+
+// every lookup in newpatch.c that hints can short-circuit
+enum iboot64_site {
+	SITE_BOOTARGS_XREF,
+	SITE_DEBUG_ENABLED_XREF,
+	SITE_IMG4_XREF,
+	SITE_IMG4_PARTIAL_CALL,
+	SITE_SETENV_WHITELIST_XREF,
+	SITE_ENV_WHITELIST_XREF,
+	SITE_COM_APPLE_SYSTEM_XREF,
+	SITE_COUNT
+};
+
+struct site_hint {
+	uint32_t known;
+	uint32_t rel;		// site offset as a fraction of the image length, 32-bit fixed point
+	uint64_t sig;		// decoder classes of the 8 instructions around the site
+};
+
+/*
+ * what earlier images of the same major iBoot version and kind (iBSS, iBEC,
+ * iBoot... or a size class when the banner is missing) looked like, plus
+ * counters for this run. a probe only answers when the site signature and
+ * the lookup itself both check out in the window, otherwise the full scan runs
+*/
+struct iboot64_hints {
+	char path[1024];
+	uint32_t VERS;
+	char kind[16];
+	struct site_hint site[SITE_COUNT];
+	bool dirty;
+	unsigned hits;
+	unsigned misses;
+	uint64_t probe_ns;	// time spent in successful probes
+	uint64_t full_ns;	// time spent in full lookups after a miss
+	uint64_t miss_started;	// a hint_code_ref() miss whose caller has yet to hint_learn() the answer
+	bool verify;		// also do the full lookup after each hint_data_ref() hit, outside the timings
+	unsigned diverged;	// hits with verify set that the full lookup would have answered differently
+};
+
+typedef bool (*site_verify_t)(uint8_t* buf, addr_t site);
+
+int hints_open(struct iboot64_img* iboot_in, const char* dir);
+void hints_close(struct iboot64_img* iboot_in);
+addr_t hint_data_ref(struct iboot64_img* iboot_in, enum iboot64_site which, addr_t what);
+addr_t hint_code_ref(struct iboot64_img* iboot_in, enum iboot64_site which, addr_t what, site_verify_t verify);
+void hint_learn(struct iboot64_img* iboot_in, enum iboot64_site which, addr_t site);
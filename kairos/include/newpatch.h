@@ -22,6 +22,7 @@
 #pragma once
 #include "patchfinder64.h"
 #include "instructions.h"
+#include "strmatch.h"
 
 #define ENTERING_RECOVERY_CONSOLE "Entering recovery mode, starting command prompt"
 #define KERNELCACHE_PREP_STRING "__PAGEZERO"
@@ -32,21 +33,84 @@
 #define CERT_STRING "Reliance on this"
 #define MEMORY_CAL "Memory CA calibration: SDLL ran out of taps when trying to find left side failing point"
 
+// where patch_boot_args64() put the boot-args text, so a patch recipe can redo it with other boot-args
+struct iboot64_bootargs_slot {
+	bool set;
+	bool large_area;	// text went to the 270-byte area, done for boot-args shorter than 87
+	uint8_t fill;		// fill_len bytes at off are set to this first
+	uint32_t off;
+	uint32_t fill_len;
+	uint32_t written;	// bytes this run wrote there, fill and text together
+};
+
 struct iboot64_img { // from iBoot32Patcher
 	void* buf;
 	size_t len;
 	uint32_t VERS;
 	uint32_t minor_vers;
 	uint64_t base;
+	struct iboot64_anchors* anchors; // optional, from iboot64_find_anchors()
+	struct iboot64_refs* refs; // optional, from iboot64_build_refs()
+	struct iboot64_hints* hints; // optional, from hints_open()
+	struct iboot64_bootargs_slot bootargs_slot;
 } __attribute__((packed));
 
-#define LOG(fmt, ...) printf("[+] " fmt, ##__VA_ARGS__);
-#define WARN(fmt, ...) printf("[!] " fmt, ##__VA_ARGS__);
+// every string the patches start from, located together in one pass by iboot64_find_anchors()
+enum iboot64_anchor {
+	ANCHOR_KERNEL_LOAD,
+	ANCHOR_RECOVERY_CONSOLE,
+	ANCHOR_IBOOT_VERSION,
+	ANCHOR_DEBUG_ENABLED,
+	ANCHOR_IMG4,
+	ANCHOR_DEBUG_UARTS,
+	ANCHOR_COM_APPLE_SYSTEM,
+	ANCHOR_RD_MD0,
+	ANCHOR_DEFAULT_BOOTARGS,
+	ANCHOR_PROGRESS,
+	ANCHOR_OTHER_DEFAULT_BOOTARGS,
+	ANCHOR_CERT,
+	ANCHOR_COUNT
+};
+
+#define BOOTARGS_ZERO_RUN 270
+
+struct iboot64_anchors {
+	size_t off[ANCHOR_COUNT];	// file offset of the first occurrence, STRMATCH_NONE if absent
+	size_t zero_run;		// first run of at least BOOTARGS_ZERO_RUN zero bytes
+	size_t longest_zero_run;
+	size_t longest_zero_run_len;
+};
+
+// every data ref (ADR, ADRP+ADD, LDR literal) and code ref (B/BL) in the image as loaded
+struct iboot64_refs {
+	struct xref_index* data;
+	struct xref_index* code;
+};
+
+// patch log. goes to stdout unless the current thread has a sink, see kairos_patch_chain()
+struct kairos_log {
+	char* buf;
+	size_t len;
+	size_t cap;
+};
+extern __thread struct kairos_log* kairos_log_sink;
+void kairos_logf(const char* fmt, ...);
+
+#define LOG(fmt, ...) kairos_logf("[+] " fmt, ##__VA_ARGS__);
+#define WARN(fmt, ...) kairos_logf("[!] " fmt, ##__VA_ARGS__);
 
 #define GET_IBOOT64_ADDR(iboot_in, x) (x - (uintptr_t) iboot_in->buf) + iboot_in->base
 #define GET_IBOOT_FILE_OFFSET(iboot_in, x) (x - (uintptr_t) iboot_in->buf)
 
 bool has_magic(uint8_t* buf);
+int iboot64_find_anchors(struct iboot64_img* iboot_in);
+void iboot64_free_anchors(struct iboot64_img* iboot_in);
+int iboot64_build_refs(struct iboot64_img* iboot_in);
+void iboot64_free_refs(struct iboot64_img* iboot_in);
+addr_t iboot64_data_ref(struct iboot64_img* iboot_in, addr_t what);
+size_t iboot64_data_refs(struct iboot64_img* iboot_in, addr_t what, addr_t* refs, size_t max);
+addr_t iboot64_code_ref(struct iboot64_img* iboot_in, addr_t start, addr_t end, addr_t what);
+size_t iboot64_callers(struct iboot64_img* iboot_in, addr_t func, addr_t* refs, size_t max);
 int patch_boot_args64(struct iboot64_img* iboot_in, char* bootargs);
 uint64_t get_iboot64_base_address(struct iboot64_img* iboot_in);
 uint32_t get_iboot64_version(struct iboot64_img* iboot_in);
@@ -18,12 +18,36 @@
 
 extern bool auth_ptrs;
 extern bool monolithic_kernel;
+/* set before init_kernel() to index each text range's xrefs on first use */
+extern bool use_xref_index;
+/* set before init_kernel() to map the file instead of reading it */
+extern bool use_kernel_mmap;
+/* set before init_kernel() to index each string section on first use */
+extern bool use_string_index;
+/* set before init_kernel() to map a text range's function starts on first use */
+extern bool use_func_map;
+/* set before pf_open() to keep finder results per image in this directory */
+extern const char *offset_cache_dir;
 
 typedef uint64_t addr_t;
 
 int init_kernel(size_t (*kread)(uint64_t, void *, size_t), uint64_t kernel_base, const char *filename);
 void term_kernel(void);
 
+/*
+ * Reentrant interface.  Each pf_ctx owns its own copy of the image, so
+ * several kernels can be analyzed at once; a context may be shared by any
+ * number of threads.  With offset_cache_dir set, pf_find_*() (for the
+ * PF_FINDERS() list) and pf_run_all() answer from an on-disk cache keyed
+ * by the image digest; pf_close() writes new results back.
+ */
+typedef struct pf_ctx pf_ctx;
+
+pf_ctx *pf_open(const char *filename);
+void pf_close(pf_ctx *ctx);
+bool pf_auth_ptrs(const pf_ctx *ctx);
+bool pf_monolithic_kernel(const pf_ctx *ctx);
+
 enum text_bases {
     text_xnucore_base = 0,
     text_prelink_base,
@@ -136,7 +160,10 @@ uint64_t find_extension_release(void);
 uint64_t find_sfree(void);
 uint64_t find_sb_ustate_create(void);
 uint64_t find_sstrdup(void);
+uint64_t find_kmod_start(void);
 uint64_t find_handler_map(void);
+uint64_t find_policy_conf(void);
+uint64_t find_policy_ops(void);
 uint64_t find_sandbox_handler(const char *name);
 uint64_t find_issue_extension_for_mach_service(void);
 uint64_t find_issue_extension_for_absolute_path(void);
@@ -147,10 +174,158 @@ uint64_t find_IOFree(void);
 
 uint64_t find_symbol(const char *symbol);
 
+/* every argument-less finder, for generating pf_find_*() and lookup tables */
+#define PF_FINDERS(X) \
+    X(gPhysBase) \
+    X(kernel_pmap) \
+    X(amfiret) \
+    X(ret_0) \
+    X(amfi_memcmpstub) \
+    X(sbops) \
+    X(lwvm_mapio_patch) \
+    X(lwvm_mapio_newj) \
+    X(entry) \
+    X(cpacr_write) \
+    X(amfiops) \
+    X(sysbootnonce) \
+    X(trustcache) \
+    X(amficache) \
+    X(allproc) \
+    X(vfs_context_current) \
+    X(vnode_lookup) \
+    X(vnode_put) \
+    X(vnode_getfromfd) \
+    X(vnode_getattr) \
+    X(SHA1Init) \
+    X(SHA1Update) \
+    X(SHA1Final) \
+    X(csblob_entitlements_dictionary_set) \
+    X(kernel_task) \
+    X(kernproc) \
+    X(vnode_recycle) \
+    X(lck_mtx_lock) \
+    X(lck_mtx_unlock) \
+    X(strlen) \
+    X(add_x0_x0_0x40_ret) \
+    X(boottime) \
+    X(zone_map_ref) \
+    X(OSBoolean_True) \
+    X(osunserializexml) \
+    X(smalloc) \
+    X(shenanigans) \
+    X(move_snapshot_to_purgatory) \
+    X(chgproccnt) \
+    X(kauth_cred_ref) \
+    X(apfs_jhash_getvnode) \
+    X(fs_lookup_snapshot_metadata_by_name_and_return_name) \
+    X(fs_lookup_snapshot_metadata_by_name) \
+    X(mount_common) \
+    X(fs_snapshot) \
+    X(vnode_get_snapshot) \
+    X(pmap_load_trust_cache) \
+    X(paciza_pointer__l2tp_domain_module_start) \
+    X(paciza_pointer__l2tp_domain_module_stop) \
+    X(l2tp_domain_inited) \
+    X(sysctl__net_ppp_l2tp) \
+    X(sysctl_unregister_oid) \
+    X(mov_x0_x4__br_x5) \
+    X(mov_x9_x0__br_x1) \
+    X(mov_x10_x3__br_x6) \
+    X(kernel_forge_pacia_gadget) \
+    X(kernel_forge_pacda_gadget) \
+    X(IOUserClient__vtable) \
+    X(IORegistryEntry__getRegistryEntryID) \
+    X(cs_blob_generation_count) \
+    X(cs_find_md) \
+    X(cs_validate_csblob) \
+    X(kalloc_canblock) \
+    X(ubc_cs_blob_allocate_site) \
+    X(kfree) \
+    X(hook_cred_label_update_execve) \
+    X(flow_divert_connect_out) \
+    X(unix_syscall) \
+    X(pthread_kext_register) \
+    X(pthread_callbacks) \
+    X(unix_syscall_return) \
+    X(sysent) \
+    X(proc_find) \
+    X(proc_rele) \
+    X(hook_mount_check_snapshot_revert) \
+    X(syscall_set_profile) \
+    X(syscall_check_sandbox) \
+    X(sandbox_set_container_copyin) \
+    X(platform_set_container) \
+    X(extension_create_file) \
+    X(extension_add) \
+    X(extension_release) \
+    X(sfree) \
+    X(sb_ustate_create) \
+    X(sstrdup) \
+    X(kmod_start) \
+    X(handler_map) \
+    X(policy_conf) \
+    X(policy_ops) \
+    X(issue_extension_for_mach_service) \
+    X(issue_extension_for_absolute_path) \
+    X(copy_path_for_vp) \
+    X(vn_getpath) \
+    X(IOMalloc) \
+    X(IOFree)
+
+#define PF_DECLARE_FINDER(name) uint64_t pf_find_ ##name(pf_ctx *ctx);
+PF_FINDERS(PF_DECLARE_FINDER)
+#undef PF_DECLARE_FINDER
+
+uint64_t pf_find_register_value(pf_ctx *ctx, uint64_t where, int reg);
+uint64_t pf_find_reference(pf_ctx *ctx, uint64_t to, int n, enum text_bases base);
+uint64_t pf_find_strref(pf_ctx *ctx, const char *string, int n, enum string_bases string_base, bool full_match, bool ppl_base);
+uint64_t pf_find_str(pf_ctx *ctx, const char *string);
+uint64_t pf_find_syscall(pf_ctx *ctx, int n);
+uint64_t pf_find_mpo_entry(pf_ctx *ctx, uint64_t offset);
+uint64_t pf_find_hook_policy_syscall(pf_ctx *ctx, int n);
+uint64_t pf_find_sandbox_handler(pf_ctx *ctx, const char *name);
+uint64_t pf_find_symbol(pf_ctx *ctx, const char *symbol);
+const unsigned char *pf_find_mh(pf_ctx *ctx);
+/* name of the closest symbol at or below addr (unslid), or NULL */
+const char *pf_symbolize(pf_ctx *ctx, uint64_t addr, uint64_t *offset);
+
+struct pf_result {
+    const char *name;
+    uint64_t addr;
+};
+
+/*
+ * Runs the named PF_FINDERS() entries on nthreads workers (0 = one per CPU).
+ * results[i] always belongs to names[i]; unknown names yield 0 and make the
+ * call return -1.
+ */
+int pf_run_all(pf_ctx *ctx, const char *const *names, size_t count, unsigned nthreads, struct pf_result *results);
+
+/* the digest the offset cache keys on, for anything else that wants to cache by image */
+void pf_sha256(const void *data, size_t len, uint8_t digest[32]);
+
 addr_t calc64(const uint8_t *buf, addr_t start, addr_t end, int which);
 addr_t follow_call64(const uint8_t *buf, addr_t call);
 addr_t xref64(const uint8_t *buf, addr_t start, addr_t end, addr_t what);
 addr_t bof64(const uint8_t *buf, addr_t start, addr_t where);
 addr_t xref64code(const uint8_t *buf, addr_t start, addr_t end, addr_t what);
 
+struct xref_index;
+struct xref_index *xref64_index(const uint8_t *buf, addr_t start, addr_t end, addr_t limit);
+int xref64_index_lookup(const struct xref_index *idx, addr_t what, addr_t *ref);
+/* B/BL targets only. _next() is exact for any subrange of a code index, but
+ * for a data index only when start is the index start (register state) */
+struct xref_index *xref64code_index(const uint8_t *buf, addr_t start, addr_t end, addr_t limit);
+int xref64_index_next(const struct xref_index *idx, addr_t what, addr_t start, addr_t end, addr_t *ref);
+size_t xref64_index_all(const struct xref_index *idx, addr_t what, addr_t *refs, size_t max);
+void xref64_index_free(struct xref_index *idx);
+
+struct func_map;
+struct func_map *bof64_map(const uint8_t *buf, addr_t start, addr_t end, bool pac);
+int bof64_map_lookup(const struct func_map *map, addr_t where, addr_t *bof);
+int eof64_map_lookup(const struct func_map *map, addr_t where, addr_t *eof);
+void bof64_map_free(struct func_map *map);
+/* end of the function containing where, or 0 without a function map */
+addr_t eof64(const uint8_t *buf, addr_t start, addr_t where);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+/*
+ * recipe.h - function declarations and defines for recipe.c
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "newpatch.h"
+
+#define RECIPE_MAGIC 0x6370726b // 'krpc'
+#define RECIPE_VERSION 1
+
+/*
+ * A patch recipe is everything a patch run changed in one image: the byte
+ * ranges it rewrote, with their original contents, plus where the boot-args
+ * text goes. Keyed by the SHA-256 of the image and of the options that shape
+ * the run, so the same iBSS/iBEC can be patched again without any analysis.
+*/
+struct recipe_edit {
+	uint32_t off;
+	uint32_t len;
+	uint8_t* orig;
+	uint8_t* patched;
+};
+
+struct kairos_recipe {
+	uint8_t digest[32];	// image
+	uint8_t key[32];	// options, see recipe_key()
+	uint32_t VERS;
+	uint32_t minor_vers;
+	struct iboot64_bootargs_slot slot;
+	uint32_t count;
+	struct recipe_edit* edits;
+};
+
+void recipe_key(const char* bootargs, bool bootargsOnly, const char* command, uint64_t commandPtr, bool nvramUnlock, uint8_t key[32]);
+int recipe_diff(struct kairos_recipe* r, const uint8_t* orig, const struct iboot64_img* patched);
+int recipe_apply(const struct kairos_recipe* r, struct iboot64_img* iboot_in, const char* bootargs);
+int recipe_load(struct kairos_recipe* r, const char* dir, const uint8_t digest[32], const uint8_t key[32]);
+int recipe_save(const struct kairos_recipe* r, const char* dir);
+void recipe_free(struct kairos_recipe* r);
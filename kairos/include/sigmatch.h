@@ -0,0 +1,88 @@
+/*
+ * sigmatch.h - function declarations and defines for sigmatch.c
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <stdbool.h>
+#include "decoders.h"
+
+/*
+ * Instruction-sequence signatures.
+ *
+ * A signature is a list of elements, each matching one instruction:
+ *  - an instruction class (insn_type_t from the decoder), or SIG_ANYINSN
+ *  - optionally a raw predicate, (insn & mask) == value, when mask != 0
+ *  - rd/rn/rm: a register number, SIG_ANY, or SIG_CAP(n) which binds the
+ *    register to capture slot n on first use and must match it afterwards
+ *  - gap: up to this many arbitrary instructions may sit between the
+ *    previous element and this one (ignored on the first element)
+ *
+ * e.g. "add x3, sp, #..." then "bl ..." within 4 instructions:
+ *   static const struct sig_elem img4[] = {
+ *       SIG_E(add, 3, 31, SIG_ANY, 0),
+ *       SIG_E(bl, SIG_ANY, SIG_ANY, SIG_ANY, 4),
+ *   };
+ */
+#define SIG_ANY         0xFF
+#define SIG_CAP(n)      (0x80 | (n))
+#define SIG_MAX_CAPS    8
+#define SIG_ANYINSN     ((insn_type_t)0xFF)
+
+struct sig_elem {
+    insn_type_t type;
+    uint32_t mask;
+    uint32_t value;
+    uint8_t rd;
+    uint8_t rn;
+    uint8_t rm;
+    uint8_t gap;
+};
+
+#define SIG_E(t, d, n, m, g)    { (t), 0, 0, (d), (n), (m), (g) }
+#define SIG_M(msk, val, g)      { SIG_ANYINSN, (msk), (val), SIG_ANY, SIG_ANY, SIG_ANY, (g) }
+#define SIG_SKIP(g)             SIG_M(0, 0, g)
+
+struct signature {
+    const char* name;
+    const struct sig_elem* elems;
+    unsigned count;
+};
+
+#define SIGNATURE(nm, arr)      { (nm), (arr), sizeof(arr) / sizeof((arr)[0]) }
+
+struct sig_hit {
+    unsigned sig;                   // index into the table given to sig_compile()
+    addr_t start;                   // offset of the first element
+    addr_t end;                     // offset of the last element
+    uint8_t regs[SIG_MAX_CAPS];     // captured registers, SIG_ANY if unbound
+};
+
+struct sig_matcher;
+
+// callback returns nonzero to stop the scan
+typedef int (*sig_hit_cb)(const struct sig_hit* hit, void* arg);
+
+// the signature table must outlive the matcher; a compiled matcher is read-only and may be shared between threads
+struct sig_matcher* sig_compile(const struct signature* sigs, unsigned count);
+void sig_free(struct sig_matcher* m);
+size_t sig_scan(const struct sig_matcher* m, const uint8_t* buf, addr_t start, addr_t end, sig_hit_cb cb, void* arg);
+bool sig_first(const struct sig_matcher* m, const uint8_t* buf, addr_t start, addr_t end, struct sig_hit* out);
+// the hit that starts latest in [start, end), for walks that used to step backwards
+bool sig_last(const struct sig_matcher* m, const uint8_t* buf, addr_t start, addr_t end, struct sig_hit* out);
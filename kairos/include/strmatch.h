@@ -0,0 +1,47 @@
+/*
+ * strmatch.h - function declarations and defines for strmatch.c
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define STRMATCH_NONE   ((size_t)-1)
+#define STRMATCH_MAX    32
+
+struct strmatch_needle {
+    const void* pat;
+    size_t len;
+};
+
+struct strmatch_result {
+    size_t first[STRMATCH_MAX];     // offset of the first occurrence of each needle, STRMATCH_NONE if absent
+    size_t zero_first;              // start of the first run of at least zero_min zero bytes
+    size_t zero_first_len;
+    size_t zero_longest;            // start of the longest zero run (the earliest one on ties)
+    size_t zero_longest_len;
+};
+
+struct strmatch;
+
+// needles must not be empty; at most STRMATCH_MAX of them. zero_min of 0 disables the zero-run tracking
+struct strmatch* strmatch_compile(const struct strmatch_needle* needles, unsigned count, size_t zero_min);
+void strmatch_free(struct strmatch* m);
+void strmatch_scan(const struct strmatch* m, const uint8_t* buf, size_t len, struct strmatch_result* out);
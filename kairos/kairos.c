@@ -19,22 +19,225 @@
  * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+#include <time.h>
 #include "kairos.h"
 #include "newpatch.h"
+#include "recipe.h"
+#include "hints.h"
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// charge the time since *t to one patch, if anyone asked for timings
+static void patch_time(const kairos_opts* opts, enum kairos_patch which, uint64_t* t) {
+	uint64_t now = now_ns();
+	if(opts->timings)
+		opts->timings->ns[which] += now - *t;
+	*t = now;
+}
+
+// returns the KAIROS_PATCH_FAILED() bits of every requested patch that did not apply
+static int patch_image(struct iboot64_img* iboot_in, const kairos_opts* opts) {
+	int ret = 0;
+	int failed = 0;
+	bool ownAnchors = false;
+	bool ownRefs = false;
+	bool ownHints = false;
+	uint64_t t = now_ns();
+	if(!iboot_in->anchors) {
+		if(iboot64_find_anchors(iboot_in) < 0) // every anchor string in one pass, patches fall back to memmem without it
+			WARN("Could not index anchor strings\n");
+		ownAnchors = true;
+	}
+	LOG("Base address: 0x%llx\n",get_iboot64_base_address(iboot_in));
+	ownRefs = !iboot_in->refs;
+	if(opts->hintDir && !iboot_in->hints) {
+		ownHints = (hints_open(iboot_in,opts->hintDir) == 0);
+		if(ownHints)
+			iboot_in->hints->verify = opts->hintVerify;
+		else
+			WARN("Could not load patch-site hints\n");
+	}
+	// with hints the reference map is only built once a probe misses
+	if(!iboot_in->refs && !iboot_in->hints) {
+		if(iboot64_build_refs(iboot_in) < 0) // xrefs for every patch from one pass, otherwise each one rescans
+			WARN("Could not build reference map\n");
+	}
+	patch_time(opts,KAIROS_PATCH_SETUP,&t);
+	if(has_kernel_load_k(iboot_in)) {
+		LOG("Does have kernel load\n");
+		if(opts->bootargs) {
+			LOG("Patching boot-args...\n");
+			if(patch_boot_args64(iboot_in,(char*)opts->bootargs) < 0) {
+				WARN("Failed to patch boot-args\n");
+				failed |= KAIROS_PATCH_FAILED(KAIROS_PATCH_BOOTARGS);
+			}
+			patch_time(opts,KAIROS_PATCH_BOOTARGS,&t);
+			if(opts->bootargsOnly) {
+				LOG("iOS 7/8/9 detected, only patching boot-args...\n");
+				goto done;
+			}
+		}
+		LOG("Enabling kernel debug...\n");
+		ret = enable_kernel_debug(iboot_in);
+		if(ret < 0) { // won't stop because it is not fatal, but it would really be nice if we had k-debug
+			WARN("Could not enable kernel debug\n");
+			failed |= KAIROS_PATCH_FAILED(KAIROS_PATCH_KDEBUG);
+		}
+		patch_time(opts,KAIROS_PATCH_KDEBUG,&t);
+	}
+	if(has_recovery_console_k(iboot_in)) {
+		if(opts->command && (opts->commandPtr != 0)) { // need to reassign command handler
+			LOG("Changing command handler %s to 0x%llx...\n",opts->command,opts->commandPtr);
+			ret = do_command_handler_patch(iboot_in,(char*)opts->command,opts->commandPtr);
+			if(ret < 0) { // do not exit, just continue without cmdhandler patch
+				WARN("Failed to patch command handler for %s\n",opts->command);
+				failed |= KAIROS_PATCH_FAILED(KAIROS_PATCH_CMDHANDLER);
+			}
+			patch_time(opts,KAIROS_PATCH_CMDHANDLER,&t);
+		}
+		if(opts->nvramUnlock) {
+			LOG("Unlocking nvram...\n");
+			ret = unlock_nvram(iboot_in);
+			if(ret < 0) {
+				WARN("Failed to unlock nvram\n");
+				failed |= KAIROS_PATCH_FAILED(KAIROS_PATCH_NVRAM);
+			}
+			patch_time(opts,KAIROS_PATCH_NVRAM,&t);
+		}
+	}
+	LOG("Patching out RSA signature check...\n");
+	ret = rsa_sigcheck_patch(iboot_in);
+	if(ret < 0) {
+		WARN("Error patching out RSA signature check\n");
+		failed |= KAIROS_PATCH_FAILED(KAIROS_PATCH_RSA);
+	}
+	patch_time(opts,KAIROS_PATCH_RSA,&t);
+done:
+	if(ownAnchors)
+		iboot64_free_anchors(iboot_in);
+	if(ownHints) {
+		if(opts->timings) {
+			opts->timings->hint_hits = iboot_in->hints->hits;
+			opts->timings->hint_misses = iboot_in->hints->misses;
+			opts->timings->hint_probe_ns = iboot_in->hints->probe_ns;
+			opts->timings->hint_full_ns = iboot_in->hints->full_ns;
+			opts->timings->hint_diverged = iboot_in->hints->diverged;
+		}
+		hints_close(iboot_in);
+	}
+	if(ownRefs)
+		iboot64_free_refs(iboot_in);
+	return failed;
+}
+
+static int patch_buffer(struct iboot64_img* iboot_in, const kairos_opts* opts) {
+	struct kairos_recipe recipe;
+	uint8_t* orig = NULL;
+	if(has_magic(iboot_in->buf)) { // make sure we aren't dealing with a packed IMG4 container
+		WARN("Image does not appear to be stripped\n");
+		return -1;
+	}
+	if(!opts->recipeDir)
+		return patch_image(iboot_in,opts);
+	// same image and options as an earlier run: replay what it did instead of finding everything again
+	uint8_t digest[32], key[32];
+	pf_sha256(iboot_in->buf,iboot_in->len,digest);
+	recipe_key(opts->bootargs,opts->bootargsOnly,opts->command,opts->commandPtr,opts->nvramUnlock,key);
+	if(recipe_load(&recipe,opts->recipeDir,digest,key) == 0) {
+		int ret = recipe_apply(&recipe,iboot_in,opts->bootargs);
+		LOG("Cached patch recipe for iBoot-%u.%u has %u edits\n",recipe.VERS,recipe.minor_vers,recipe.count);
+		recipe_free(&recipe);
+		if(ret == 0) {
+			LOG("Applied cached patch recipe\n");
+			return 0;
+		}
+		WARN("Cached patch recipe does not apply, patching from scratch\n");
+	}
+	orig = (uint8_t*)malloc(iboot_in->len);
+	if(orig)
+		memcpy(orig,iboot_in->buf,iboot_in->len);
+	memset(&iboot_in->bootargs_slot,0,sizeof(iboot_in->bootargs_slot));
+	int ret = patch_image(iboot_in,opts);
+	// only a complete run is worth replaying, a partial one would hide its failures next time
+	if(ret == 0 && orig && recipe_diff(&recipe,orig,iboot_in) == 0) {
+		memcpy(recipe.digest,digest,32);
+		memcpy(recipe.key,key,32);
+		if(recipe_save(&recipe,opts->recipeDir) == 0)
+			LOG("Saved patch recipe with %u edits\n",recipe.count);
+		recipe_free(&recipe);
+	}
+	free(orig);
+	return ret;
+}
+
+int kairos_patch_buffer(struct iboot64_img* iboot_in, const kairos_opts* opts) {
+	uint64_t t = now_ns();
+	if(opts->timings)
+		memset(opts->timings,0,sizeof(*opts->timings));
+	int ret = patch_buffer(iboot_in,opts);
+	if(opts->timings)
+		opts->timings->total_ns = now_ns() - t;
+	return ret;
+}
+
+static void* patch_chain_worker(void* arg) {
+	struct kairos_chain_img* item = (struct kairos_chain_img*)arg;
+	struct kairos_log log = { NULL, 0, 0 };
+	kairos_log_sink = &log;
+	item->status = kairos_patch_buffer(item->img,item->opts);
+	kairos_log_sink = NULL;
+	item->log = log.buf;
+	item->logLen = log.len;
+	return NULL;
+}
+
+/*
+ * patch every image of a boot chain (iBSS, iBEC, iBoot...) in memory, one thread each.
+ * returns the number of images that failed; per image status and log are in imgs[]
+*/
+int kairos_patch_chain(struct kairos_chain_img* imgs, unsigned count) {
+	pthread_t* threads = (pthread_t*)calloc(count ? count : 1,sizeof(pthread_t));
+	bool* started = (bool*)calloc(count ? count : 1,sizeof(bool));
+	int failed = 0;
+	if(!threads || !started) {
+		free(threads);
+		free(started);
+		return -1;
+	}
+	for(unsigned i = 0; i < count; i++) {
+		imgs[i].log = NULL;
+		imgs[i].logLen = 0;
+		started[i] = (pthread_create(&threads[i],NULL,patch_chain_worker,&imgs[i]) == 0);
+		if(!started[i]) // no thread to spare, do it here
+			patch_chain_worker(&imgs[i]);
+	}
+	for(unsigned i = 0; i < count; i++) {
+		if(started[i])
+			pthread_join(threads[i],NULL);
+		if(imgs[i].status != 0)
+			failed++;
+	}
+	free(threads);
+	free(started);
+	return failed;
+}
 
 int patchIBXX(char* in, char* out, char* bootArgsInput, int flag) {
 	
 	char* inFile = in;
 	char* outFile = out;
-	char* bootArgs = NULL;
-	char* command_str = NULL;
-	uint64_t command_ptr = 0;
 	struct iboot64_img iboot_in;
-	int ret = 0;
+	kairos_opts opts;
 	memset(&iboot_in, 0, sizeof(iboot_in));
-	bool doNvramUnlock = true;
-
-	bootArgs = bootArgsInput;
+	memset(&opts, 0, sizeof(opts));
+	opts.bootargs = bootArgsInput;
+	opts.bootargsOnly = (flag == 1);
+	opts.nvramUnlock = true;
     
 	// read in image
 	FILE* fp = fopen(inFile,"rb");
@@ -55,55 +258,12 @@ int patchIBXX(char* in, char* out, char* bootArgsInput, int flag) {
 	fclose(fp);
 	// patch
 	LOG("Patching %s\n",inFile);
-	if(has_magic(iboot_in.buf)) { // make sure we aren't dealing with a packed IMG4 container
-		WARN("%s does not appear to be stripped\n",inFile);
+	// failed patches only warn here, as they always have; the image is still written out
+	if(kairos_patch_buffer(&iboot_in,&opts) < 0) {
+		WARN("%s was not patched\n",inFile);
+		free(iboot_in.buf);
 		return -1;
 	}
-	LOG("Base address: 0x%llx\n",get_iboot64_base_address(&iboot_in));
-	if(has_kernel_load_k(&iboot_in)) {
-		LOG("Does have kernel load\n");
-		if(bootArgs) {
-			LOG("Patching boot-args...\n");
-			patch_boot_args64(&iboot_in,bootArgs);
-            if (flag == 1) {
-                LOG("iOS 7/8/9 detected, only patching boot-args...\n");
-                fp = fopen(outFile,"wb+");
-                if(!fp) {
-                    printf("Error opening %s for writing\n",outFile);
-                    free(iboot_in.buf);
-                    return -1;
-                }
-                fwrite(iboot_in.buf,1,iboot_in.len,fp);
-                fflush(fp);
-                fclose(fp);
-                free(iboot_in.buf);
-                LOG("Wrote patched image to %s\n",outFile);
-                return 0;
-            }
-		}
-		LOG("Enabling kernel debug...\n");
-		ret = enable_kernel_debug(&iboot_in);
-		if(ret < 0) // won't fail because it is not fatal, but it would really be nice if we had k-debug
-			WARN("Could not enable kernel debug\n");
-	}
-	if(has_recovery_console_k(&iboot_in)) {
-		if(command_str && (command_ptr != 0)) { // need to reassign command handler
-			LOG("Changing command handler %s to 0x%llx...\n",command_str,command_ptr);
-			ret = do_command_handler_patch(&iboot_in,command_str,command_ptr);
-			if(ret < 0) // do not exit, just continue without cmdhandler patch
-				WARN("Failed to patch command handler for %s\n",command_str);
-		}
-		if(doNvramUnlock) {
-			LOG("Unlocking nvram...\n");
-			ret = unlock_nvram(&iboot_in);
-			if(ret < 0)
-				WARN("Failed to unlock nvram\n");
-		}
-	}
-	LOG("Patching out RSA signature check...\n");
-	ret = rsa_sigcheck_patch(&iboot_in);
-	if(ret < 0)
-		WARN("Error patching out RSA signature check\n");
 	// now write file
 	fp = fopen(outFile,"wb+");
 	if(!fp) {
@@ -9,6 +9,61 @@
 #ifndef kairos_h
 #define kairos_h
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct iboot64_img;
+
+// the patches kairos_patch_buffer() runs, in order
+enum kairos_patch {
+    KAIROS_PATCH_SETUP,     // anchors, base address, reference map
+    KAIROS_PATCH_BOOTARGS,
+    KAIROS_PATCH_KDEBUG,
+    KAIROS_PATCH_CMDHANDLER,
+    KAIROS_PATCH_NVRAM,
+    KAIROS_PATCH_RSA,
+    KAIROS_PATCH_COUNT
+};
+
+// bit in kairos_patch_buffer()'s result for a requested patch that failed
+#define KAIROS_PATCH_FAILED(p)  (1 << (p))
+
+struct kairos_timings {
+    uint64_t ns[KAIROS_PATCH_COUNT];    // 0 for patches that did not run
+    uint64_t total_ns;
+    // patch-site hint counters when hintDir is set, see struct iboot64_hints
+    unsigned hint_hits;
+    unsigned hint_misses;
+    uint64_t hint_probe_ns;
+    uint64_t hint_full_ns;
+    unsigned hint_diverged;             // with hintVerify, hits that differ from the full lookup
+};
+
+typedef struct kairos_opts {
+    const char *bootargs;   // NULL leaves boot-args alone
+    bool bootargsOnly;      // iOS 7/8/9: patch boot-args and nothing else (patchIBXX flag 1)
+    const char *command;    // command handler to repoint to commandPtr, if any
+    uint64_t commandPtr;
+    bool nvramUnlock;
+    const char *recipeDir;  // patch recipe cache, NULL to always analyze the image
+    const char *hintDir;    // patch-site hints learned per iBoot version, NULL to always do full lookups
+    bool hintVerify;        // check every hint hit against the full lookup and count the ones that differ
+    struct kairos_timings *timings; // filled in when set
+} kairos_opts;
+
+// one image of a boot chain; status (as from kairos_patch_buffer()) and log are filled in by kairos_patch_chain()
+struct kairos_chain_img {
+    struct iboot64_img *img;
+    const kairos_opts *opts;
+    int status;
+    char *log;              // patch log, free() when done
+    size_t logLen;
+};
+
 int patchIBXX(char* in, char* out, char* bootArgsInput, int flag);
+// -1 if the image could not be patched at all, else the KAIROS_PATCH_FAILED() bits of the patches that did not apply
+int kairos_patch_buffer(struct iboot64_img *iboot_in, const kairos_opts *opts);
+int kairos_patch_chain(struct kairos_chain_img *imgs, unsigned count);
 
 #endif /* kairos_h */
@@ -20,7 +20,11 @@
 */
 
 #define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
 #include "newpatch.h"
+#include "sigmatch.h"
+#include "hints.h"
 
 #ifdef _WIN32
 void *memmem(const void *haystack, size_t haystack_len, 
@@ -42,6 +46,185 @@ void *memmem(const void *haystack, size_t haystack_len,
 }
 #endif
 
+__thread struct kairos_log* kairos_log_sink = NULL;
+
+void kairos_logf(const char* fmt, ...) {
+	va_list ap;
+	struct kairos_log* log = kairos_log_sink;
+	va_start(ap,fmt);
+	if(!log) {
+		vprintf(fmt,ap);
+		va_end(ap);
+		return;
+	}
+	va_list ap2;
+	va_copy(ap2,ap);
+	int n = vsnprintf(NULL,0,fmt,ap2);
+	va_end(ap2);
+	if(n > 0) {
+		if(log->len + n + 1 > log->cap) {
+			size_t cap = log->cap ? log->cap : 1024;
+			while(log->len + n + 1 > cap)
+				cap *= 2;
+			char* buf = (char*)realloc(log->buf,cap);
+			if(!buf) {
+				va_end(ap);
+				return;
+			}
+			log->buf = buf;
+			log->cap = cap;
+		}
+		vsnprintf(log->buf+log->len,n+1,fmt,ap);
+		log->len += n;
+	}
+	va_end(ap);
+}
+
+#define ANCHOR_STR(s) { s, sizeof(s) - 1 }
+static const struct strmatch_needle iboot64_anchor_needles[ANCHOR_COUNT] = {
+	[ANCHOR_KERNEL_LOAD] = ANCHOR_STR(KERNELCACHE_PREP_STRING),
+	[ANCHOR_RECOVERY_CONSOLE] = ANCHOR_STR(ENTERING_RECOVERY_CONSOLE),
+	[ANCHOR_IBOOT_VERSION] = ANCHOR_STR("iBoot-"),
+	[ANCHOR_DEBUG_ENABLED] = ANCHOR_STR("debug-enabled"),
+	[ANCHOR_IMG4] = ANCHOR_STR("IMG4"),
+	[ANCHOR_DEBUG_UARTS] = ANCHOR_STR("debug-uarts"),
+	[ANCHOR_COM_APPLE_SYSTEM] = { "com.apple.System.", sizeof("com.apple.System.") }, // including the null terminator
+	[ANCHOR_RD_MD0] = ANCHOR_STR("rd=md0"),
+	[ANCHOR_DEFAULT_BOOTARGS] = ANCHOR_STR(DEFAULT_BOOTARGS_STRING),
+	[ANCHOR_PROGRESS] = ANCHOR_STR(" -progress"),
+	[ANCHOR_OTHER_DEFAULT_BOOTARGS] = ANCHOR_STR(OTHER_DEFAULT_BOOTARGS_STRING),
+	[ANCHOR_CERT] = ANCHOR_STR(CERT_STRING),
+};
+
+static struct strmatch* iboot64_anchor_matcher;
+static pthread_once_t iboot64_anchor_once = PTHREAD_ONCE_INIT;
+
+static void build_anchor_matcher(void) {
+	iboot64_anchor_matcher = strmatch_compile(iboot64_anchor_needles, ANCHOR_COUNT, BOOTARGS_ZERO_RUN);
+}
+
+// one pass over the image for every anchor string and the boot-args zero run
+int iboot64_find_anchors(struct iboot64_img* iboot_in) {
+	pthread_once(&iboot64_anchor_once, build_anchor_matcher);
+	if(!iboot64_anchor_matcher)
+		return -1;
+	struct iboot64_anchors* anchors = iboot_in->anchors;
+	if(!anchors)
+		anchors = (struct iboot64_anchors*)malloc(sizeof(struct iboot64_anchors));
+	if(!anchors)
+		return -1;
+	struct strmatch_result res;
+	strmatch_scan(iboot64_anchor_matcher,iboot_in->buf,iboot_in->len,&res);
+	for(int i = 0; i < ANCHOR_COUNT; i++)
+		anchors->off[i] = res.first[i];
+	anchors->zero_run = res.zero_first;
+	anchors->longest_zero_run = res.zero_longest;
+	anchors->longest_zero_run_len = res.zero_longest_len;
+	iboot_in->anchors = anchors;
+	return 0;
+}
+
+void iboot64_free_anchors(struct iboot64_img* iboot_in) {
+	free(iboot_in->anchors);
+	iboot_in->anchors = NULL;
+}
+
+/*
+ * first occurrence of an anchor string. patches write into the image as we go, so an
+ * offset from the initial pass is only trusted while the bytes there are unchanged
+*/
+static void* iboot64_anchor(struct iboot64_img* iboot_in, enum iboot64_anchor which) {
+	const struct strmatch_needle* n = &iboot64_anchor_needles[which];
+	if(iboot_in->anchors) {
+		size_t off = iboot_in->anchors->off[which];
+		if(off == STRMATCH_NONE)
+			return NULL;
+		if(memcmp(iboot_in->buf+off,n->pat,n->len) == 0)
+			return iboot_in->buf+off;
+	}
+	return memmem(iboot_in->buf,iboot_in->len,n->pat,n->len);
+}
+
+static void* iboot64_zero_run(struct iboot64_img* iboot_in) {
+	static const char zeros[BOOTARGS_ZERO_RUN] = {0};
+	if(iboot_in->anchors) {
+		size_t off = iboot_in->anchors->zero_run;
+		if(off == STRMATCH_NONE)
+			return NULL;
+		if(memcmp(iboot_in->buf+off,zeros,BOOTARGS_ZERO_RUN) == 0)
+			return iboot_in->buf+off;
+	}
+	return memmem(iboot_in->buf,iboot_in->len,zeros,BOOTARGS_ZERO_RUN);
+}
+
+// one pass each for data and code refs, shared by every patch in the run
+int iboot64_build_refs(struct iboot64_img* iboot_in) {
+	struct iboot64_refs* refs = (struct iboot64_refs*)calloc(1,sizeof(struct iboot64_refs));
+	if(!refs)
+		return -1;
+	refs->data = xref64_index(iboot_in->buf,0,iboot_in->len,iboot_in->len);
+	refs->code = xref64code_index(iboot_in->buf,0,iboot_in->len,iboot_in->len);
+	if(!refs->data || !refs->code) {
+		xref64_index_free(refs->data);
+		xref64_index_free(refs->code);
+		free(refs);
+		return -1;
+	}
+	iboot64_free_refs(iboot_in);
+	iboot_in->refs = refs;
+	return 0;
+}
+
+void iboot64_free_refs(struct iboot64_img* iboot_in) {
+	if(iboot_in->refs) {
+		xref64_index_free(iboot_in->refs->data);
+		xref64_index_free(iboot_in->refs->code);
+		free(iboot_in->refs);
+		iboot_in->refs = NULL;
+	}
+}
+
+// first data ref to a file offset, as xref64() over the whole image would find it
+addr_t iboot64_data_ref(struct iboot64_img* iboot_in, addr_t what) {
+	addr_t ref = 0;
+	if(iboot_in->refs && xref64_index_lookup(iboot_in->refs->data,what,&ref) == 0)
+		return ref;
+	return xref64(iboot_in->buf,0,iboot_in->len,what);
+}
+
+// all data refs to a file offset; returns how many there are, which may be more than max
+size_t iboot64_data_refs(struct iboot64_img* iboot_in, addr_t what, addr_t* refs, size_t max) {
+	if(!iboot_in->refs)
+		return 0;
+	return xref64_index_all(iboot_in->refs->data,what,refs,max);
+}
+
+/*
+ * next B/BL in [start, end) that lands on what, like xref64code(). patches never write
+ * branches, only overwrite them, so a cached hit just has to still be the same branch
+*/
+addr_t iboot64_code_ref(struct iboot64_img* iboot_in, addr_t start, addr_t end, addr_t what) {
+	addr_t ref = 0;
+	if(!iboot_in->refs)
+		return xref64code(iboot_in->buf,start,end,what);
+	while(xref64_index_next(iboot_in->refs->code,what,start,end,&ref) == 0) {
+		if(!ref)
+			return 0;
+		uint32_t op = get_insn(iboot_in->buf,ref);
+		if((op & 0x7C000000) == 0x14000000 && follow_call64(iboot_in->buf,ref) == what)
+			return ref;
+		start = ref + 4;
+	}
+	return xref64code(iboot_in->buf,start,end,what);
+}
+
+// all B/BL to a function; returns how many there are, which may be more than max
+size_t iboot64_callers(struct iboot64_img* iboot_in, addr_t func, addr_t* refs, size_t max) {
+	if(!iboot_in->refs)
+		return 0;
+	return xref64_index_all(iboot_in->refs->code,func,refs,max);
+}
+
 /* begin functions from iBoot32Patcher by iH8sn0w*/
 bool has_magic(uint8_t* buf) {
 	uint32_t magic;
@@ -53,12 +236,12 @@ bool has_magic(uint8_t* buf) {
 }
 
 bool has_kernel_load_k(struct iboot64_img* iboot_in) {
-	void* debug_enabled_str = memmem(iboot_in->buf, iboot_in->len, KERNELCACHE_PREP_STRING,strlen(KERNELCACHE_PREP_STRING));
+	void* debug_enabled_str = iboot64_anchor(iboot_in,ANCHOR_KERNEL_LOAD);
 	return (bool) (debug_enabled_str != NULL);
 }
 
 bool has_recovery_console_k(struct iboot64_img* iboot_in) {
-	void* entering_recovery_str = memmem(iboot_in->buf, iboot_in->len, ENTERING_RECOVERY_CONSOLE,strlen(ENTERING_RECOVERY_CONSOLE));
+	void* entering_recovery_str = iboot64_anchor(iboot_in,ANCHOR_RECOVERY_CONSOLE);
 	return (bool) (entering_recovery_str != NULL);
 }
 
@@ -81,7 +264,7 @@ uint64_t get_iboot64_base_address(struct iboot64_img* iboot_in) {  // modified f
 /* end functions from iBoot32Patcher */
 
 uint32_t get_iboot64_version(struct iboot64_img* iboot_in) {
-	void* versionString = memmem(iboot_in->buf,iboot_in->len,"iBoot-",strlen("iBoot-"));
+	void* versionString = iboot64_anchor(iboot_in,ANCHOR_IBOOT_VERSION);
 	if(!versionString) {
 		return 0;
 	}
@@ -100,7 +283,17 @@ uint32_t get_iboot64_version(struct iboot64_img* iboot_in) {
 
 uint64_t iboot64_ref(struct iboot64_img* iboot_in, void* pat) {
 	uint64_t new_pat = (uintptr_t) GET_IBOOT64_ADDR(iboot_in, pat);
-	addr_t ref = xref64(iboot_in->buf,0,iboot_in->len,new_pat-iboot_in->base);
+	addr_t ref = iboot64_data_ref(iboot_in,new_pat-iboot_in->base);
+	if(!ref) {
+		return -1;
+	}
+	return ref;
+}
+
+// iboot64_ref() for one of the known patch sites, which hints may answer without a full lookup
+static uint64_t iboot64_site_ref(struct iboot64_img* iboot_in, void* pat, enum iboot64_site which) {
+	uint64_t new_pat = (uintptr_t) GET_IBOOT64_ADDR(iboot_in, pat);
+	addr_t ref = hint_data_ref(iboot_in,which,new_pat-iboot_in->base);
 	if(!ref) {
 		return -1;
 	}
@@ -130,30 +323,102 @@ int change_bootarg_adr_xref_addr(struct iboot64_img* iboot_in, addr_t dest, addr
 	return 0;
 }
 
+/*
+ * Signatures for the walks below. Each table gets its own matcher, all
+ * compiled once on first use and shared by every image afterwards.
+ *
+ * the CSEL that picks the boot-args string after its ADR
+*/
+static const struct sig_elem bootargs_csel[] = {
+	SIG_E(csel, SIG_ANY, SIG_ANY, SIG_ANY, 0),
+};
+static const struct signature bootargs_csel_sigs[] = {
+	SIGNATURE("csel", bootargs_csel),
+};
+
+/*
+ * the conditional branch around the default boot-args, i.e. the closest
+ * branch before the CSEL that is not a call; anything but CBZ/B.cond there
+ * means the layout changed
+*/
+static const struct sig_elem branch_cbz[] = { SIG_E(cbz, SIG_ANY, SIG_ANY, SIG_ANY, 0) };
+static const struct sig_elem branch_bcond[] = { SIG_E(bcond, SIG_ANY, SIG_ANY, SIG_ANY, 0) };
+static const struct sig_elem branch_cbnz[] = { SIG_E(cbnz, SIG_ANY, SIG_ANY, SIG_ANY, 0) };
+static const struct sig_elem branch_tbnz[] = { SIG_E(tbnz, SIG_ANY, SIG_ANY, SIG_ANY, 0) };
+static const struct sig_elem branch_b[] = { SIG_E(b, SIG_ANY, SIG_ANY, SIG_ANY, 0) };
+static const struct signature bootargs_branch_sigs[] = {
+	SIGNATURE("cbz", branch_cbz),
+	SIGNATURE("b.cond", branch_bcond),
+	SIGNATURE("cbnz", branch_cbnz),
+	SIGNATURE("tbnz", branch_tbnz),
+	SIGNATURE("b", branch_b),
+};
+#define BRANCH_WALK_CHUNK 0x400 // bytes scanned per step while walking back
+
+/*
+ * looking for
+ * add x2, sp, #0x...
+ * add x3, sp, #0x...
+ * within the 10 instructions before the IMG4 xref
+*/
+static const struct sig_elem img4_add_x3_sp[] = {
+	SIG_E(add, 3, 0x1f, SIG_ANY, 0),
+};
+static const struct signature img4_ref_sigs[] = {
+	SIGNATURE("add x3, sp", img4_add_x3_sp),
+};
+
+static struct sig_matcher* bootargs_csel_matcher;
+static struct sig_matcher* bootargs_branch_matcher;
+static struct sig_matcher* img4_ref_matcher;
+static pthread_once_t walk_matchers_once = PTHREAD_ONCE_INIT;
+
+static void build_walk_matchers(void) {
+	bootargs_csel_matcher = sig_compile(bootargs_csel_sigs, sizeof(bootargs_csel_sigs) / sizeof(bootargs_csel_sigs[0]));
+	bootargs_branch_matcher = sig_compile(bootargs_branch_sigs, sizeof(bootargs_branch_sigs) / sizeof(bootargs_branch_sigs[0]));
+	img4_ref_matcher = sig_compile(img4_ref_sigs, sizeof(img4_ref_sigs) / sizeof(img4_ref_sigs[0]));
+}
+
 int doFinalBootArgs(struct iboot64_img* iboot_in, addr_t xref, addr_t default_args_loc) {
     if ((iboot_in->VERS >= 6723 && iboot_in->minor_vers >= 100) || iboot_in->VERS >= 7429) // not necessary as of iOS 14.5
 		return 0;
-	uint32_t adrInsn = get_insn(iboot_in->buf,xref);
-	uint8_t rd = get_rd(adrInsn);
+	struct decoded_insn insn;
+	struct sig_hit hit;
+	uint8_t rd = decode_insn(get_insn(iboot_in->buf,xref),xref,&insn)->rd;
+	pthread_once(&walk_matchers_once, build_walk_matchers);
+	if(!bootargs_csel_matcher || !bootargs_branch_matcher)
+		return -1;
 	// find next csel
-	addr_t temp = xref;
-	while(get_type(get_insn(iboot_in->buf,temp)) != csel)
-		temp += 4;
-	uint32_t cselInsn = get_insn(iboot_in->buf,temp);
-	if(get_rn(cselInsn) != rd && get_rm(cselInsn) != rd) {
+	if(!sig_first(bootargs_csel_matcher,iboot_in->buf,xref,iboot_in->len,&hit)) {
+		WARN("Could not find CSEL after boot-args ADR\n");
+		return -1;
+	}
+	addr_t temp = hit.start;
+	decode_insn(get_insn(iboot_in->buf,temp),temp,&insn);
+	if(insn.rn != rd && insn.rm != rd) {
 		WARN("CSEL instruction does not compare the same register as the previous ADR instruction\n");
 		return -1;
 	}
-	uint32_t movInsn = new_mov_register_insn(get_rd(cselInsn),-1,rd,0); // change csel to mov, no conditions here. mov x# boot-arg-addr
+	uint32_t movInsn = new_mov_register_insn(insn.rd,-1,rd,0); // change csel to mov, no conditions here. mov x# boot-arg-addr
 	write_opcode(iboot_in->buf,temp,movInsn);
 	LOG("Changed CSEL to MOV\n");
 	// now we need to look for the bl instruction before this entire method
-	temp -=4; // keep our distance
-	while(get_supertype(get_insn(iboot_in->buf,temp)) != supertype_branch_immediate || get_type(get_insn(iboot_in->buf,temp)) == bl)
-		temp -=4;
+	addr_t end = temp; // keep our distance
+	while(1) {
+		addr_t from = (end > BRANCH_WALK_CHUNK) ? end - BRANCH_WALK_CHUNK : 0;
+		if(sig_last(bootargs_branch_matcher,iboot_in->buf,from,end,&hit))
+			break;
+		if(!from) {
+			WARN("Could not find branch before CSEL\n");
+			return -1;
+		}
+		end = from;
+	}
+	temp = hit.start;
+	decode_insn(get_insn(iboot_in->buf,temp),temp,&insn);
 	int64_t bImmediate = 0;
-	if(get_type(get_insn(iboot_in->buf,temp)) == cbz || get_type(get_insn(iboot_in->buf,temp)) == bcond )
-		bImmediate = get_addr_for_cbz(temp,get_insn(iboot_in->buf,temp));
+	if(insn.type == cbz || insn.type == bcond )
+		bImmediate = get_addr_for_cbz(temp,insn.insn);
 	else {
 		WARN("Something went wrong when finding branch instructions\n");
 		return -1;
@@ -165,12 +430,12 @@ int doFinalBootArgs(struct iboot64_img* iboot_in, addr_t xref, addr_t default_ar
 	// and the csel -> mov insn really seems to do what we want here anyway...
 		if (temp > iboot_in->len)
 			break;
-		if(get_type(get_insn(iboot_in->buf,temp)) != adr)
+		if(decode_insn(get_insn(iboot_in->buf,temp),temp,&insn)->type != adr)
 			temp += 4;
 		else {
-			int64_t oldAddr = get_addr_for_adr(temp,get_insn(iboot_in->buf,temp));
-			uint8_t oldRD = get_rd(get_insn(iboot_in->buf,temp));
-			uint32_t newAdr = replace_adr_addr(temp,get_insn(iboot_in->buf,temp),default_args_loc-(addr_t)iboot_in->buf); // replace with boot-arg location
+			int64_t oldAddr = get_addr_for_adr(temp,insn.insn);
+			uint8_t oldRD = insn.rd;
+			uint32_t newAdr = replace_adr_addr(temp,insn.insn,default_args_loc-(addr_t)iboot_in->buf); // replace with boot-arg location
 			write_opcode(iboot_in->buf,temp,newAdr);
 			LOG("Changed ADR X%d, 0x%llx to ADR X%d, 0x%llx\n",oldRD,((oldAddr-(temp/4))+temp)+iboot_in->base,get_rd(newAdr),(default_args_loc-(addr_t)iboot_in->buf)+iboot_in->base);
 			break;
@@ -190,22 +455,14 @@ void do_kdbg_mov(struct iboot64_img* iboot_in, addr_t xref) {
 }
 
 bool checkIMG4Ref(uint8_t* buf, addr_t xref) {
-	xref -= 4;
-	for(int i = 0; i < 10; i++) {
-		/*
-		 * looking for
-		 * add x2, sp, #0x...
-		 * add x3, sp, #0x...
-		*/
-		if((get_type(get_insn(buf,xref)) == add) && (get_rd(get_insn(buf,xref)) == 3) && (get_rn(get_insn(buf,xref)) == 0x1f)) {
-			return true;
-		}
-		xref -= 4;
-	}
-	return false;
+	pthread_once(&walk_matchers_once, build_walk_matchers);
+	if(!img4_ref_matcher)
+		return false;
+	addr_t from = (xref > 40) ? xref - 40 : 0;
+	return sig_first(img4_ref_matcher, buf, from, xref, NULL);
 }
 
-void do_rsa_sigcheck_patch(struct iboot64_img* iboot_in, addr_t img4Xref ) {
+int do_rsa_sigcheck_patch(struct iboot64_img* iboot_in, addr_t img4Xref ) {
 	addr_t img4refFtop = bof64(iboot_in->buf, 0, img4Xref);
 	LOG("Found beginning of _image4_get_partial at 0x%llx\n",img4refFtop);
 	// older iBoot versions don't work with this patch method
@@ -223,7 +480,7 @@ void do_rsa_sigcheck_patch(struct iboot64_img* iboot_in, addr_t img4Xref ) {
 		if (!movkLoc) {
 			WARN("Could not find MOVK W%llu, #0x4348 instruction for old iBoot\n", BIT_RANGE(movkInsn,0,4));
 			WARN("RSA PATCH FAILED\n");
-			return;
+			return -1;
 		}
 		addr_t movkOffset = (addr_t)GET_IBOOT_FILE_OFFSET(iboot_in,movkLoc);
 		LOG("Found MOVK W%llu, #0x4348 at 0x%llx\n",BIT_RANGE(movkInsn,0,4), movkOffset);
@@ -235,32 +492,38 @@ void do_rsa_sigcheck_patch(struct iboot64_img* iboot_in, addr_t img4Xref ) {
 		write_opcode(iboot_in->buf,funcStart,finalMovInsn); // mov x0, #0
 		write_opcode(iboot_in->buf,funcStart+4,retInsn);    // ret
 		LOG("Did MOV r0, #0 and RET\n");
-		return;
+		return 0;
 	}
 	// jump around
-	addr_t img4GetPartialRef = xref64code(iboot_in->buf, 0, iboot_in->len, img4refFtop);
-	for(int i = 0; i < 20; i++) {
-		if(checkIMG4Ref(iboot_in->buf,img4GetPartialRef))
-			break;
-		img4GetPartialRef = xref64code(iboot_in->buf,img4GetPartialRef+4,iboot_in->len-img4GetPartialRef-4,img4refFtop);
-		if(i == 19) {
-			WARN("Could not find correct xref for _image4_get_partial.\n");
-			WARN("RSA PATCH FAILED\n");
-			return;
+	addr_t img4GetPartialRef = hint_code_ref(iboot_in, SITE_IMG4_PARTIAL_CALL, img4refFtop, checkIMG4Ref);
+	if(!img4GetPartialRef) {
+		img4GetPartialRef = iboot64_code_ref(iboot_in, 0, iboot_in->len, img4refFtop);
+		for(int i = 0; i < 20; i++) {
+			if(checkIMG4Ref(iboot_in->buf,img4GetPartialRef))
+				break;
+			img4GetPartialRef = iboot64_code_ref(iboot_in,img4GetPartialRef+4,iboot_in->len-img4GetPartialRef-4,img4refFtop);
+			if(i == 19) {
+				WARN("Could not find correct xref for _image4_get_partial.\n");
+				WARN("RSA PATCH FAILED\n");
+				return -1;
+			}
 		}
+		hint_learn(iboot_in,SITE_IMG4_PARTIAL_CALL,img4GetPartialRef);
 	}
 	LOG("Found xref to _image4_get_partial at 0x%llx\n",img4GetPartialRef);
 	addr_t getPartialRefFtop = bof64(iboot_in->buf,0,img4GetPartialRef);
 	LOG("Found start of sub_%llx\n",iboot_in->base+getPartialRefFtop);
 	addr_t x2_adr = 0;
 	addr_t x3_adr = 0;
+	struct decoded_insn insn;
 	while(1) {
 		getPartialRefFtop += 4;
-		if(get_type(get_insn(iboot_in->buf,getPartialRefFtop)) == adr && get_rd(get_insn(iboot_in->buf,getPartialRefFtop)) == 2)
+		decode_insn(get_insn(iboot_in->buf,getPartialRefFtop),getPartialRefFtop,&insn);
+		if(insn.type == adr && insn.rd == 2)
 			x2_adr = getPartialRefFtop;
-		else if(get_type(get_insn(iboot_in->buf,getPartialRefFtop)) == adr && get_rd(get_insn(iboot_in->buf,getPartialRefFtop)) == 3)
+		else if(insn.type == adr && insn.rd == 3)
 			x3_adr = getPartialRefFtop;
-		else if(get_type(get_insn(iboot_in->buf,getPartialRefFtop)) == bl) {
+		else if(insn.type == bl) {
 			if(x2_adr && x3_adr)
 				break;
 			else {
@@ -279,7 +542,7 @@ void do_rsa_sigcheck_patch(struct iboot64_img* iboot_in, addr_t img4Xref ) {
         LOG("Call to 0x%llx\n",verifyFunc);
         addr_t crawl = verifyFunc;
         crawl += 4;
-        while(get_type(get_insn(iboot_in->buf,crawl)) != ret) {
+        while(decode_insn(get_insn(iboot_in->buf,crawl),crawl,&insn)->type != ret) {
             crawl += 4;
         }
         LOG("RET found for sub_%llx at 0x%llx\n",verifyFunc+iboot_in->base,crawl);
@@ -296,30 +559,32 @@ void do_rsa_sigcheck_patch(struct iboot64_img* iboot_in, addr_t img4Xref ) {
         write_opcode(iboot_in->buf,verifyFunc+4,retInsn);
     }
 	LOG("Did MOV r0, #0 and RET\n");
+	return 0;
 }
 
 int patch_boot_args64(struct iboot64_img* iboot_in, char* bootargs) {
 	// find current boot-args
 	void* default_loc = NULL;
+	char bootargCpy[271] = { '\0' }; // bootargs may point here until the end, so it lives as long
 	int num = 1;
 	LOG("Image base address at 0x%llx\n",iboot_in->base);
 	if ((iboot_in->VERS >= 6723 && iboot_in->minor_vers >= 100) || iboot_in->VERS >= 7429)
-		default_loc = memmem(iboot_in->buf,iboot_in->len,"rd=md0",strlen("rd=md0"));
+		default_loc = iboot64_anchor(iboot_in,ANCHOR_RD_MD0);
 	else
-		default_loc = memmem(iboot_in->buf,iboot_in->len,DEFAULT_BOOTARGS_STRING,strlen(DEFAULT_BOOTARGS_STRING));
+		default_loc = iboot64_anchor(iboot_in,ANCHOR_DEFAULT_BOOTARGS);
 	if(!default_loc) { // if those are not found, try for the other possible string
 		LOG("Searching for alternate boot-args\n");
         if ((iboot_in->VERS >= 6723 && iboot_in->minor_vers >= 100) || iboot_in->VERS >= 7429)
-			default_loc = memmem(iboot_in->buf,iboot_in->len," -progress",strlen(" -progress"));
+			default_loc = iboot64_anchor(iboot_in,ANCHOR_PROGRESS);
 		else
-			default_loc = memmem(iboot_in->buf,iboot_in->len,OTHER_DEFAULT_BOOTARGS_STRING,strlen(OTHER_DEFAULT_BOOTARGS_STRING));
+			default_loc = iboot64_anchor(iboot_in,ANCHOR_OTHER_DEFAULT_BOOTARGS);
 		if(!default_loc) { // failed, uh oh
 			WARN("Could not find boot-arg string\n");
 			return -1;
 		}
 	}
 	LOG("Found boot-arg string at %p\n",GET_IBOOT_FILE_OFFSET(iboot_in,default_loc));
-	uint64_t default_args_xref = iboot64_ref(iboot_in,default_loc);
+	uint64_t default_args_xref = iboot64_site_ref(iboot_in,default_loc,SITE_BOOTARGS_XREF);
     if ((iboot_in->VERS >= 6723 && iboot_in->minor_vers >= 100) || iboot_in->VERS >= 7429) {
 		LOG("Relocating from 0x%llx...\n",iboot_in->base+default_args_xref);
 		default_args_xref = get_next_nth_insn(iboot_in->buf,default_args_xref,5,nop);
@@ -331,21 +596,21 @@ int patch_boot_args64(struct iboot64_img* iboot_in, char* bootargs) {
 	LOG("Found boot-arg xref at 0x%llx\n",iboot_in->base+default_args_xref);
 	// we only do xref relocation now. its cooler that way
 	if(strlen(bootargs) > 270) {
-		char bootargCpy[271] = { '\0' }; // sorry, gotta shorten it
-		strncpy(bootargCpy,bootargs,270);
+		strncpy(bootargCpy,bootargs,270); // sorry, gotta shorten it
 		bootargs = bootargCpy;
 		num = 0;
 		WARN("Truncated boot-args: %s\n",bootargs);
 	}
 	if(strlen(bootargs) < 87) {  // TODO: fix size stuff here 
 		void* cert_loc = NULL;
-		char zeros[270] = {0};
 		// cryptiiiic boot arg location
 		// https://github.com/Cryptiiiic/liboffsetfinder64/blob/4d034e5102178177e1bf9f5cc024a95651bed22b/liboffsetfinder64/ibootpatchfinder64_base.cpp#L225
 		// so much better than finding random error strings
-		cert_loc = memmem(iboot_in->buf,iboot_in->len,zeros,270);
+		cert_loc = iboot64_zero_run(iboot_in);
 		if(!cert_loc) {
-			cert_loc = memmem(iboot_in->buf,iboot_in->len,CERT_STRING,strlen(CERT_STRING));
+			if(iboot_in->anchors && iboot_in->anchors->longest_zero_run_len)
+				LOG("Longest zero run is only 0x%zx bytes at 0x%zx\n",iboot_in->anchors->longest_zero_run_len,iboot_in->anchors->longest_zero_run);
+			cert_loc = iboot64_anchor(iboot_in,ANCHOR_CERT);
 			if(!cert_loc) {
 				WARN("Could not find long string to override\n");
 				return -1; // no Reliance string or dart_ctrr. update code
@@ -367,19 +632,27 @@ int patch_boot_args64(struct iboot64_img* iboot_in, char* bootargs) {
 		memset(default_loc,' ',strlen(DEFAULT_BOOTARGS_STRING)); // zero out OG boot-arg string
 	}
 	strncpy(default_loc,bootargs,strlen(bootargs)+num); // main part done. also no null terminator. don't like those
+	iboot_in->bootargs_slot.set = true;
+	iboot_in->bootargs_slot.off = (uint32_t)((uint8_t*)default_loc-(uint8_t*)iboot_in->buf);
+	iboot_in->bootargs_slot.large_area = (strlen(bootargs) < 87);
+	iboot_in->bootargs_slot.fill = iboot_in->bootargs_slot.large_area ? 0 : ' ';
+	iboot_in->bootargs_slot.fill_len = iboot_in->bootargs_slot.large_area ? 270 : strlen(DEFAULT_BOOTARGS_STRING);
+	iboot_in->bootargs_slot.written = iboot_in->bootargs_slot.fill_len;
+	if(strlen(bootargs)+num > iboot_in->bootargs_slot.written)
+		iboot_in->bootargs_slot.written = strlen(bootargs)+num;
 	// now to patch up
 	return doFinalBootArgs(iboot_in,default_args_xref,(unsigned long long)default_loc);
 }
 
 int enable_kernel_debug(struct iboot64_img* iboot_in) {
 	void* debugLoc = NULL;
-	debugLoc = memmem(iboot_in->buf,iboot_in->len,"debug-enabled",strlen("debug-enabled"));
+	debugLoc = iboot64_anchor(iboot_in,ANCHOR_DEBUG_ENABLED);
 	if(!debugLoc) {
 		WARN("Could not find debug-enabled string\n");
 		return -1;
 	}
 	LOG("Found debug-enabled string at %p\n",GET_IBOOT_FILE_OFFSET(iboot_in,debugLoc));
-	uint64_t debugEnabledXref = iboot64_ref(iboot_in,debugLoc);
+	uint64_t debugEnabledXref = iboot64_site_ref(iboot_in,debugLoc,SITE_DEBUG_ENABLED_XREF);
 	if(!debugEnabledXref) {
 		WARN("Could not find debug-enabled xref\n");
 		return -1;
@@ -393,20 +666,19 @@ int enable_kernel_debug(struct iboot64_img* iboot_in) {
 
 int rsa_sigcheck_patch(struct iboot64_img* iboot_in) {
 	void* img4Loc = NULL;
-	img4Loc = memmem(iboot_in->buf,iboot_in->len,"IMG4",4);
+	img4Loc = iboot64_anchor(iboot_in,ANCHOR_IMG4);
 	if(!img4Loc) {
 		WARN("Could not find IMG4 string\n");
 		return -1;
 	}
 	LOG("Found IMG4 string at %p\n",GET_IBOOT_FILE_OFFSET(iboot_in,img4Loc));
-	uint64_t img4Ref = iboot64_ref(iboot_in,img4Loc);
+	uint64_t img4Ref = iboot64_site_ref(iboot_in,img4Loc,SITE_IMG4_XREF);
 	if(!img4Ref) {
 		WARN("Could not find IMG4 xref\n");
 		return -1;
 	}
 	LOG("Found IMG4 xref at 0x%llx\n",img4Ref);
-	do_rsa_sigcheck_patch(iboot_in, img4Ref);
-	return 0;
+	return do_rsa_sigcheck_patch(iboot_in, img4Ref);
 }
 
 int do_command_handler_patch(struct iboot64_img* iboot_in, char* command, uintptr_t ptr) { // useful for kicking off iBoot payloads
@@ -438,7 +710,7 @@ int do_command_handler_patch(struct iboot64_img* iboot_in, char* command, uintpt
 }
 
 int unlock_nvram(struct iboot64_img* iboot_in) {
-	void* debuguartLoc = memmem(iboot_in->buf,iboot_in->len,"debug-uarts",strlen("debug-uarts"));
+	void* debuguartLoc = iboot64_anchor(iboot_in,ANCHOR_DEBUG_UARTS);
 	if(!debuguartLoc) {
 		WARN("Unable to find debug-uarts string\n");
 		return -1;
@@ -455,7 +727,7 @@ int unlock_nvram(struct iboot64_img* iboot_in) {
 	while(get_ptr_loc(iboot_in->buf,setenvWhitelist-=8)); // move back until we get 0x0
 	setenvWhitelist+=8; // go back up one to get to start of list
 	LOG("setenv whitelist begins at 0x%llx\n",setenvWhitelist);
-	addr_t blacklistFunc = xref64(iboot_in->buf,0,iboot_in->len,setenvWhitelist);
+	addr_t blacklistFunc = hint_data_ref(iboot_in,SITE_SETENV_WHITELIST_XREF,setenvWhitelist);
 	if(!blacklistFunc) {
 		WARN("Could not find reference to setenv whitelist\n");
 		return -1;
@@ -475,7 +747,7 @@ int unlock_nvram(struct iboot64_img* iboot_in) {
 	while(get_ptr_loc(iboot_in->buf,envWhitelist+=8));
 	envWhitelist += 8;
 	LOG("Found env whitelist at 0x%llx\n",envWhitelist);
-	addr_t blacklistFunc2 = xref64(iboot_in->buf,0,iboot_in->len,envWhitelist);
+	addr_t blacklistFunc2 = hint_data_ref(iboot_in,SITE_ENV_WHITELIST_XREF,envWhitelist);
 	if(!blacklistFunc2) {
 		WARN("Could not find reference to env whitelist\n");
 		return -1;
@@ -489,14 +761,14 @@ int unlock_nvram(struct iboot64_img* iboot_in) {
 	LOG("Forcing sub_%llx to return immediately\n",blacklistFunc2Begin+iboot_in->base);
 	write_opcode(iboot_in->buf,blacklistFunc2Begin,movZeroZero);
 	write_opcode(iboot_in->buf,blacklistFunc2Begin+4,retInsn);
-	void* comAppleSystemLoc = memmem(iboot_in->buf,iboot_in->len,"com.apple.System.",strlen("com.apple.System.")+1);
-	// strlen() + 1 because we are including the null terminator in the search 
+	void* comAppleSystemLoc = iboot64_anchor(iboot_in,ANCHOR_COM_APPLE_SYSTEM);
+	// the anchor includes the null terminator in the search
 	if(!comAppleSystemLoc) {
 		WARN("Could not find string \"com.apple.System.\"\n");
 		return -1;
 	}
 	LOG("Found \"com.apple.System.\" string at %p\n",GET_IBOOT64_ADDR(iboot_in,comAppleSystemLoc));
-	addr_t comAppleSystemRef = iboot64_ref(iboot_in,comAppleSystemLoc);
+	addr_t comAppleSystemRef = iboot64_site_ref(iboot_in,comAppleSystemLoc,SITE_COM_APPLE_SYSTEM_XREF);
 	if(!comAppleSystemLoc) {
 		WARN("Could not find reference to \"com.apple.System.\"\n");
 		return -1;
@@ -8,32 +8,178 @@
 
 #include "patchfinder64.h"
 
-bool auth_ptrs = false;
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 typedef uint64_t addr_t;
-static addr_t kerndumpbase = -1;
-static addr_t xnucore_base = 0;
-static addr_t xnucore_size = 0;
-static addr_t ppl_base = 0;
-static addr_t ppl_size = 0;
-static addr_t prelink_base = 0;
-static addr_t prelink_size = 0;
-static addr_t cstring_base = 0;
-static addr_t cstring_size = 0;
-static addr_t pstring_base = 0;
-static addr_t pstring_size = 0;
-static addr_t oslstring_base = 0;
-static addr_t oslstring_size = 0;
-static addr_t data_base = 0;
-static addr_t data_size = 0;
-static addr_t data_const_base = 0;
-static addr_t data_const_size = 0;
-static addr_t const_base = 0;
-static addr_t const_size = 0;
-static addr_t kernel_entry = 0;
-static void *kernel_mh = 0;
-static addr_t kernel_delta = 0;
+
+bool auth_ptrs = false;
 bool monolithic_kernel = false;
+bool use_xref_index = false;
+bool use_kernel_mmap = false;
+bool use_string_index = false;
+bool use_func_map = false;
+const char *offset_cache_dir = NULL;
+
+/*
+ * Each lazily built index has a lock, so that pf_run_all() workers asking
+ * for the same one wait for a single build.  Windows runs no workers.
+ */
+#ifndef _WIN32
+typedef pthread_mutex_t pf_lock_t;
+#define PF_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define pf_lock_init(l)     pthread_mutex_init((l), NULL)
+#define pf_lock_destroy(l)  pthread_mutex_destroy(l)
+#define pf_lock(l)          pthread_mutex_lock(l)
+#define pf_unlock(l)        pthread_mutex_unlock(l)
+#else
+typedef int pf_lock_t;
+#define PF_LOCK_INITIALIZER 0
+#define pf_lock_init(l)     ((void)(l))
+#define pf_lock_destroy(l)  ((void)(l))
+#define pf_lock(l)          ((void)(l))
+#define pf_unlock(l)        ((void)(l))
+#endif
+
+/*
+ * Everything init_kernel() learns about an image lives in a pf_ctx.  The
+ * finders below still read it through the old global names, which resolve
+ * against the calling thread's current context: the default one for the
+ * legacy API, or whichever pf_ctx a pf_find_*() wrapper installed.
+ */
+struct pf_ctx {
+    uint8_t *kernel;
+    size_t kernel_size;
+    size_t kernel_mapped;
+    addr_t kerndumpbase;
+    addr_t xnucore_base;
+    addr_t xnucore_size;
+    addr_t ppl_base;
+    addr_t ppl_size;
+    addr_t prelink_base;
+    addr_t prelink_size;
+    addr_t cstring_base;
+    addr_t cstring_size;
+    addr_t pstring_base;
+    addr_t pstring_size;
+    addr_t oslstring_base;
+    addr_t oslstring_size;
+    addr_t data_base;
+    addr_t data_size;
+    addr_t data_const_base;
+    addr_t data_const_size;
+    addr_t const_base;
+    addr_t const_size;
+    addr_t kernel_entry;
+    void *kernel_mh;
+    addr_t kernel_delta;
+    bool auth_ptrs;
+    bool monolithic_kernel;
+    struct xref_index *xnucore_xrefs;
+    struct xref_index *prelink_xrefs;
+    struct xref_index *ppl_xrefs;
+    struct str_index *cstring_strs;
+    struct str_index *oslstring_strs;
+    struct str_index *const_strs;
+    struct sym_table *kernel_syms;
+    struct func_map *xnucore_funcs;
+    struct func_map *prelink_funcs;
+    pf_lock_t xnucore_xrefs_lock;
+    pf_lock_t prelink_xrefs_lock;
+    pf_lock_t ppl_xrefs_lock;
+    pf_lock_t cstring_strs_lock;
+    pf_lock_t oslstring_strs_lock;
+    pf_lock_t const_strs_lock;
+    pf_lock_t xnucore_funcs_lock;
+    pf_lock_t prelink_funcs_lock;
+    struct pf_cache *offset_cache;
+    /* finder results other finders keep asking for, as offsets into kernel */
+    addr_t smalloc_memo;
+    addr_t pthread_callbacks_memo;
+    addr_t handler_map_memo;
+    addr_t policy_conf_memo;
+    addr_t sfree_memo;
+    addr_t sysent_memo;
+};
+
+static struct pf_ctx pf_default = {
+    .kerndumpbase = -1,
+    .xnucore_xrefs_lock = PF_LOCK_INITIALIZER,
+    .prelink_xrefs_lock = PF_LOCK_INITIALIZER,
+    .ppl_xrefs_lock = PF_LOCK_INITIALIZER,
+    .cstring_strs_lock = PF_LOCK_INITIALIZER,
+    .oslstring_strs_lock = PF_LOCK_INITIALIZER,
+    .const_strs_lock = PF_LOCK_INITIALIZER,
+    .xnucore_funcs_lock = PF_LOCK_INITIALIZER,
+    .prelink_funcs_lock = PF_LOCK_INITIALIZER,
+};
+static __thread struct pf_ctx *pf_cur = &pf_default;
+
+static void
+export_kernel_flags(const struct pf_ctx *ctx)
+{
+    /* the legacy globals mirror the default context */
+    auth_ptrs = ctx->auth_ptrs;
+    monolithic_kernel = ctx->monolithic_kernel;
+}
+
+bool
+pf_auth_ptrs(const pf_ctx *ctx)
+{
+    return ctx->auth_ptrs;
+}
 
+bool
+pf_monolithic_kernel(const pf_ctx *ctx)
+{
+    return ctx->monolithic_kernel;
+}
+
+#define kernel              (pf_cur->kernel)
+#define kernel_size         (pf_cur->kernel_size)
+#define kernel_mapped       (pf_cur->kernel_mapped)
+#define kerndumpbase        (pf_cur->kerndumpbase)
+#define xnucore_base        (pf_cur->xnucore_base)
+#define xnucore_size        (pf_cur->xnucore_size)
+#define ppl_base            (pf_cur->ppl_base)
+#define ppl_size            (pf_cur->ppl_size)
+#define prelink_base        (pf_cur->prelink_base)
+#define prelink_size        (pf_cur->prelink_size)
+#define cstring_base        (pf_cur->cstring_base)
+#define cstring_size        (pf_cur->cstring_size)
+#define pstring_base        (pf_cur->pstring_base)
+#define pstring_size        (pf_cur->pstring_size)
+#define oslstring_base      (pf_cur->oslstring_base)
+#define oslstring_size      (pf_cur->oslstring_size)
+#define data_base           (pf_cur->data_base)
+#define data_size           (pf_cur->data_size)
+#define data_const_base     (pf_cur->data_const_base)
+#define data_const_size     (pf_cur->data_const_size)
+#define const_base          (pf_cur->const_base)
+#define const_size          (pf_cur->const_size)
+#define kernel_entry        (pf_cur->kernel_entry)
+#define kernel_mh           (pf_cur->kernel_mh)
+#define kernel_delta        (pf_cur->kernel_delta)
+#define auth_ptrs           (pf_cur->auth_ptrs)
+#define monolithic_kernel   (pf_cur->monolithic_kernel)
+#define xnucore_xrefs       (pf_cur->xnucore_xrefs)
+#define prelink_xrefs       (pf_cur->prelink_xrefs)
+#define ppl_xrefs           (pf_cur->ppl_xrefs)
+#define cstring_strs        (pf_cur->cstring_strs)
+#define oslstring_strs      (pf_cur->oslstring_strs)
+#define const_strs          (pf_cur->const_strs)
+#define kernel_syms         (pf_cur->kernel_syms)
+#define xnucore_funcs       (pf_cur->xnucore_funcs)
+#define prelink_funcs       (pf_cur->prelink_funcs)
+#define offset_cache        (pf_cur->offset_cache)
+
+/* workers of pf_run_all() may race to fill a memo; they all store the same value */
+#define MEMO_GET(name)      __atomic_load_n(&pf_cur->name ##_memo, __ATOMIC_RELAXED)
+#define MEMO_SET(name, val) __atomic_store_n(&pf_cur->name ##_memo, (val), __ATOMIC_RELAXED)
+
+/* the lock guarding the first build of an index slot */
+#define INDEX_LOCK(name)    (&pf_cur->name ##_lock)
 
 #define IS64(image) (*(uint8_t *)(image) & 1)
 
@@ -225,18 +371,397 @@ static int DecodeMov(uint32_t opcode, uint64_t total, int first, uint64_t *newva
     return -1;
 }
 
+/* vector scan ***************************************************************/
+
+/*
+ * The instruction searches all come down to "first word in a range with
+ * (word & mask) == value", for one or a few mask/value pairs.  The vector
+ * variants only answer "is there any hit in this block"; a block with a hit
+ * is resolved word by word.  The variant is picked once, from what the CPU
+ * reports at runtime.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCAN64_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__arm64__)
+#define SCAN64_NEON
+#include <arm_neon.h>
+#endif
+
+#define SCAN64_MAX_PATS 8
+
+struct insn_pat {
+    uint32_t value;
+    uint32_t mask;
+};
+
+typedef int (*scan64_fn)(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at);
+typedef unsigned (*scan64_mask_fn)(const uint8_t *p, const struct insn_pat *pats, unsigned npats);
+
+struct scan64_impl {
+    const char *name;
+    scan64_fn fwd;      /* first hit in lo, lo + 4, ... < hi */
+    scan64_fn back;     /* last hit in hi, hi - 4, ... >= lo */
+    scan64_mask_fn mask;    /* bit n set if word n of 16 at p hits */
+};
+
+static int
+insn_match(uint32_t op, const struct insn_pat *pats, unsigned npats)
+{
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        if ((op & pats[k].mask) == pats[k].value) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+scan64_fwd_scalar(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    for (; lo < hi; lo += 4) {
+        if (insn_match(*(uint32_t *)(buf + lo), pats, npats)) {
+            *at = lo;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned
+scan64_mask_scalar(const uint8_t *p, const struct insn_pat *pats, unsigned npats)
+{
+    unsigned bits = 0;
+    unsigned n;
+    for (n = 0; n < 16; n++) {
+        bits |= insn_match(((uint32_t *)p)[n], pats, npats) << n;
+    }
+    return bits;
+}
+
+static int
+scan64_back_scalar(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    for (; hi >= lo; hi -= 4) {
+        if (insn_match(*(uint32_t *)(buf + hi), pats, npats)) {
+            *at = hi;
+            return 1;
+        }
+        if (hi < 4) {
+            break;
+        }
+    }
+    return 0;
+}
+
+#ifdef SCAN64_X86
+/* 8 words per iteration */
+static int
+scan64_any_sse2(const uint8_t *p, const __m128i *m, const __m128i *v, unsigned npats)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i hit = _mm_setzero_si128();
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi32(_mm_and_si128(a, m[k]), v[k]));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi32(_mm_and_si128(b, m[k]), v[k]));
+    }
+    return _mm_movemask_epi8(hit);
+}
+
+static int
+scan64_fwd_sse2(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    __m128i m[SCAN64_MAX_PATS], v[SCAN64_MAX_PATS];
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        m[k] = _mm_set1_epi32(pats[k].mask);
+        v[k] = _mm_set1_epi32(pats[k].value);
+    }
+    for (; lo + 32 <= hi; lo += 32) {
+        if (scan64_any_sse2(buf + lo, m, v, npats)) {
+            return scan64_fwd_scalar(buf, lo, lo + 32, pats, npats, at);
+        }
+    }
+    return scan64_fwd_scalar(buf, lo, hi, pats, npats, at);
+}
+
+static int
+scan64_back_sse2(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    __m128i m[SCAN64_MAX_PATS], v[SCAN64_MAX_PATS];
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        m[k] = _mm_set1_epi32(pats[k].mask);
+        v[k] = _mm_set1_epi32(pats[k].value);
+    }
+    while (hi >= lo + 28) {
+        if (scan64_any_sse2(buf + hi - 28, m, v, npats)) {
+            return scan64_back_scalar(buf, hi - 28, hi, pats, npats, at);
+        }
+        if (hi < 32) {
+            return 0;
+        }
+        hi -= 32;
+    }
+    return scan64_back_scalar(buf, lo, hi, pats, npats, at);
+}
+
+static unsigned
+scan64_mask_sse2(const uint8_t *p, const struct insn_pat *pats, unsigned npats)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(p + 48));
+    __m128i ha = _mm_setzero_si128(), hb = ha, hc = ha, hd = ha;
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        __m128i m = _mm_set1_epi32(pats[k].mask);
+        __m128i v = _mm_set1_epi32(pats[k].value);
+        ha = _mm_or_si128(ha, _mm_cmpeq_epi32(_mm_and_si128(a, m), v));
+        hb = _mm_or_si128(hb, _mm_cmpeq_epi32(_mm_and_si128(b, m), v));
+        hc = _mm_or_si128(hc, _mm_cmpeq_epi32(_mm_and_si128(c, m), v));
+        hd = _mm_or_si128(hd, _mm_cmpeq_epi32(_mm_and_si128(d, m), v));
+    }
+    return _mm_movemask_ps(_mm_castsi128_ps(ha)) |
+           _mm_movemask_ps(_mm_castsi128_ps(hb)) << 4 |
+           _mm_movemask_ps(_mm_castsi128_ps(hc)) << 8 |
+           _mm_movemask_ps(_mm_castsi128_ps(hd)) << 12;
+}
+
+/* 16 words per iteration */
+__attribute__((target("avx2"))) static int
+scan64_any_avx2(const uint8_t *p, const __m256i *m, const __m256i *v, unsigned npats)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i hit = _mm256_setzero_si256();
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(_mm256_and_si256(a, m[k]), v[k]));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(_mm256_and_si256(b, m[k]), v[k]));
+    }
+    return !_mm256_testz_si256(hit, hit);
+}
+
+__attribute__((target("avx2"))) static int
+scan64_fwd_avx2(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    __m256i m[SCAN64_MAX_PATS], v[SCAN64_MAX_PATS];
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        m[k] = _mm256_set1_epi32(pats[k].mask);
+        v[k] = _mm256_set1_epi32(pats[k].value);
+    }
+    for (; lo + 64 <= hi; lo += 64) {
+        if (scan64_any_avx2(buf + lo, m, v, npats)) {
+            return scan64_fwd_scalar(buf, lo, lo + 64, pats, npats, at);
+        }
+    }
+    return scan64_fwd_scalar(buf, lo, hi, pats, npats, at);
+}
+
+__attribute__((target("avx2"))) static int
+scan64_back_avx2(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    __m256i m[SCAN64_MAX_PATS], v[SCAN64_MAX_PATS];
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        m[k] = _mm256_set1_epi32(pats[k].mask);
+        v[k] = _mm256_set1_epi32(pats[k].value);
+    }
+    while (hi >= lo + 60) {
+        if (scan64_any_avx2(buf + hi - 60, m, v, npats)) {
+            return scan64_back_scalar(buf, hi - 60, hi, pats, npats, at);
+        }
+        if (hi < 64) {
+            return 0;
+        }
+        hi -= 64;
+    }
+    return scan64_back_scalar(buf, lo, hi, pats, npats, at);
+}
+
+__attribute__((target("avx2"))) static unsigned
+scan64_mask_avx2(const uint8_t *p, const struct insn_pat *pats, unsigned npats)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i ha = _mm256_setzero_si256(), hb = ha;
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        __m256i m = _mm256_set1_epi32(pats[k].mask);
+        __m256i v = _mm256_set1_epi32(pats[k].value);
+        ha = _mm256_or_si256(ha, _mm256_cmpeq_epi32(_mm256_and_si256(a, m), v));
+        hb = _mm256_or_si256(hb, _mm256_cmpeq_epi32(_mm256_and_si256(b, m), v));
+    }
+    return _mm256_movemask_ps(_mm256_castsi256_ps(ha)) |
+           _mm256_movemask_ps(_mm256_castsi256_ps(hb)) << 8;
+}
+#endif
+
+#ifdef SCAN64_NEON
+/* 16 words per iteration */
+static int
+scan64_any_neon(const uint8_t *p, const uint32x4_t *m, const uint32x4_t *v, unsigned npats)
+{
+    const uint32_t *w = (const uint32_t *)p;
+    uint32x4_t a = vld1q_u32(w);
+    uint32x4_t b = vld1q_u32(w + 4);
+    uint32x4_t c = vld1q_u32(w + 8);
+    uint32x4_t d = vld1q_u32(w + 12);
+    uint32x4_t hit = vdupq_n_u32(0);
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        hit = vorrq_u32(hit, vceqq_u32(vandq_u32(a, m[k]), v[k]));
+        hit = vorrq_u32(hit, vceqq_u32(vandq_u32(b, m[k]), v[k]));
+        hit = vorrq_u32(hit, vceqq_u32(vandq_u32(c, m[k]), v[k]));
+        hit = vorrq_u32(hit, vceqq_u32(vandq_u32(d, m[k]), v[k]));
+    }
+    return vmaxvq_u32(hit) != 0;
+}
+
+static int
+scan64_fwd_neon(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    uint32x4_t m[SCAN64_MAX_PATS], v[SCAN64_MAX_PATS];
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        m[k] = vdupq_n_u32(pats[k].mask);
+        v[k] = vdupq_n_u32(pats[k].value);
+    }
+    for (; lo + 64 <= hi; lo += 64) {
+        if (scan64_any_neon(buf + lo, m, v, npats)) {
+            return scan64_fwd_scalar(buf, lo, lo + 64, pats, npats, at);
+        }
+    }
+    return scan64_fwd_scalar(buf, lo, hi, pats, npats, at);
+}
+
+static int
+scan64_back_neon(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    uint32x4_t m[SCAN64_MAX_PATS], v[SCAN64_MAX_PATS];
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        m[k] = vdupq_n_u32(pats[k].mask);
+        v[k] = vdupq_n_u32(pats[k].value);
+    }
+    while (hi >= lo + 60) {
+        if (scan64_any_neon(buf + hi - 60, m, v, npats)) {
+            return scan64_back_scalar(buf, hi - 60, hi, pats, npats, at);
+        }
+        if (hi < 64) {
+            return 0;
+        }
+        hi -= 64;
+    }
+    return scan64_back_scalar(buf, lo, hi, pats, npats, at);
+}
+
+static unsigned
+scan64_mask_neon(const uint8_t *p, const struct insn_pat *pats, unsigned npats)
+{
+    static const uint32_t lanes[4] = { 1, 2, 4, 8 };
+    const uint32_t *w = (const uint32_t *)p;
+    uint32x4_t a = vld1q_u32(w);
+    uint32x4_t b = vld1q_u32(w + 4);
+    uint32x4_t c = vld1q_u32(w + 8);
+    uint32x4_t d = vld1q_u32(w + 12);
+    uint32x4_t ha = vdupq_n_u32(0), hb = ha, hc = ha, hd = ha;
+    uint32x4_t bit = vld1q_u32(lanes);
+    unsigned k;
+    for (k = 0; k < npats; k++) {
+        uint32x4_t m = vdupq_n_u32(pats[k].mask);
+        uint32x4_t v = vdupq_n_u32(pats[k].value);
+        ha = vorrq_u32(ha, vceqq_u32(vandq_u32(a, m), v));
+        hb = vorrq_u32(hb, vceqq_u32(vandq_u32(b, m), v));
+        hc = vorrq_u32(hc, vceqq_u32(vandq_u32(c, m), v));
+        hd = vorrq_u32(hd, vceqq_u32(vandq_u32(d, m), v));
+    }
+    return vaddvq_u32(vandq_u32(ha, bit)) |
+           vaddvq_u32(vandq_u32(hb, bit)) << 4 |
+           vaddvq_u32(vandq_u32(hc, bit)) << 8 |
+           vaddvq_u32(vandq_u32(hd, bit)) << 12;
+}
+#endif
+
+static const struct scan64_impl scan64_impls[] = {
+    { "scalar", scan64_fwd_scalar, scan64_back_scalar, scan64_mask_scalar },
+#ifdef SCAN64_X86
+    { "sse2", scan64_fwd_sse2, scan64_back_sse2, scan64_mask_sse2 },
+    { "avx2", scan64_fwd_avx2, scan64_back_avx2, scan64_mask_avx2 },
+#endif
+#ifdef SCAN64_NEON
+    { "neon", scan64_fwd_neon, scan64_back_neon, scan64_mask_neon },
+#endif
+};
+
+static int
+scan64_supported(const struct scan64_impl *impl)
+{
+#ifdef SCAN64_X86
+    if (impl->fwd == scan64_fwd_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)impl;
+    return 1;
+}
+
+static const struct scan64_impl *scan64_chosen;
+
+static void
+scan64_choose(void)
+{
+    /* the table is ordered from slowest to fastest */
+    unsigned i = sizeof(scan64_impls) / sizeof(scan64_impls[0]) - 1;
+    while (i > 0 && !scan64_supported(&scan64_impls[i])) {
+        i--;
+    }
+    scan64_chosen = &scan64_impls[i];
+}
+
+static const struct scan64_impl *
+scan64_select(void)
+{
+#ifndef _WIN32
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, scan64_choose);
+#else
+    /* pf_run_all() starts no workers here */
+    if (!scan64_chosen) {
+        scan64_choose();
+    }
+#endif
+    return scan64_chosen;
+}
+
+static int
+scan64(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    return scan64_select()->fwd(buf, lo, hi, pats, npats, at);
+}
+
+static int
+scan64_back(const uint8_t *buf, addr_t lo, addr_t hi, const struct insn_pat *pats, unsigned npats, addr_t *at)
+{
+    return scan64_select()->back(buf, lo, hi, pats, npats, at);
+}
+
 /* patchfinder ***************************************************************/
 
 addr_t
 step64(const uint8_t *buf, addr_t start, size_t length, uint32_t what, uint32_t mask)
 {
-    addr_t end = start + length;
-    while (start < end) {
-        uint32_t x = *(uint32_t *)(buf + start);
-        if ((x & mask) == what) {
-            return start;
-        }
-        start += 4;
+    struct insn_pat pat = { what, mask };
+    addr_t at;
+    if (scan64(buf, start, start + length, &pat, 1, &at)) {
+        return at;
     }
     return 0;
 }
@@ -244,13 +769,11 @@ step64(const uint8_t *buf, addr_t start, size_t length, uint32_t what, uint32_t
 addr_t
 step64_back(const uint8_t *buf, addr_t start, size_t length, uint32_t what, uint32_t mask)
 {
+    struct insn_pat pat = { what, mask };
     addr_t end = start - length;
-    while (start >= end) {
-        uint32_t x = *(uint32_t *)(buf + start);
-        if ((x & mask) == what) {
-            return start;
-        }
-        start -= 4;
+    addr_t at;
+    if (end <= start && scan64_back(buf, end, start, &pat, 1, &at)) {
+        return at;
     }
     return 0;
 }
@@ -261,12 +784,73 @@ step_adrp_to_reg(const uint8_t *buf, addr_t start, size_t length, int reg)
     return step64(buf, start, length, 0x90000000 | (reg&0x1F), 0x9F00001F);
 }
 
+static int
+bof64_at(const uint8_t *buf, addr_t start, addr_t where, addr_t *bof)
+{
+    /* does the prologue heuristic fire at where?  bof64() answers with the
+     * first hit walking backwards, bof64_map() records all of them */
+    uint32_t op = *(uint32_t *)(buf + where);
+    if ((op & 0xFFC003FF) == 0x910003FD) {
+        unsigned delta = (op >> 10) & 0xFFF;
+        //printf("0x%llx: ADD X29, SP, #0x%x\n", where + kerndumpbase, delta);
+        if ((delta & 0xF) == 0) {
+            addr_t prev = where - ((delta >> 4) + 1) * 4;
+            uint32_t au = *(uint32_t *)(buf + prev);
+            //printf("0x%llx: (%llx & %llx) == %llx\n", prev + kerndumpbase, au, 0x3BC003E0, au & 0x3BC003E0);
+            if ((au & 0x3BC003E0) == 0x298003E0) {
+                //printf("%x: STP x, y, [SP,#-imm]!\n", prev);
+                *bof = prev;
+                return 1;
+            } else if ((au & 0x7F8003FF) == 0x510003FF) {
+                //printf("%x: SUB SP, SP, #imm\n", prev);
+                *bof = prev;
+                return 1;
+            }
+            for (addr_t diff = 4; diff < delta/4+4; diff+=4) {
+                uint32_t ai = *(uint32_t *)(buf + where - diff);
+                // SUB SP, SP, #imm
+                //printf("0x%llx: (%llx & %llx) == %llx\n", where - diff + kerndumpbase, ai, 0x3BC003E0, ai & 0x3BC003E0);
+                if ((ai & 0x7F8003FF) == 0x510003FF) {
+                    *bof = where - diff;
+                    return 1;
+                }
+                // Not stp and not str
+                if (((ai & 0xFFC003E0) != 0xA90003E0) && (ai&0xFFC001F0) != 0xF90001E0) {
+                    break;
+                }
+            }
+            // try something else
+            while (where > start) {
+                where -= 4;
+                au = *(uint32_t *)(buf + where);
+                // SUB SP, SP, #imm
+                if ((au & 0xFFC003FF) == 0xD10003FF && ((au >> 10) & 0xFFF) == delta + 0x10) {
+                    *bof = where;
+                    return 1;
+                }
+                // STP x, y, [SP,#imm]
+                if ((au & 0xFFC003E0) != 0xA90003E0) {
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static const struct func_map *current_func_map(const uint8_t *buf, addr_t start);
+
 addr_t
 bof64(const uint8_t *buf, addr_t start, addr_t where)
 {
+    addr_t bof;
+    const struct func_map *map = current_func_map(buf, start);
     if (auth_ptrs) {
         for (; where >= start; where -= 4) {
             uint32_t op = *(uint32_t *)(buf + where);
+            if (map && bof64_map_lookup(map, where, &bof) == 0) {
+                return bof;
+            }
             if (op == 0xD503237F) {
                 return where;
             }
@@ -274,48 +858,11 @@ bof64(const uint8_t *buf, addr_t start, addr_t where)
         return 0;
     }
     for (; where >= start; where -= 4) {
-        uint32_t op = *(uint32_t *)(buf + where);
-        if ((op & 0xFFC003FF) == 0x910003FD) {
-            unsigned delta = (op >> 10) & 0xFFF;
-            //printf("0x%llx: ADD X29, SP, #0x%x\n", where + kerndumpbase, delta);
-            if ((delta & 0xF) == 0) {
-                addr_t prev = where - ((delta >> 4) + 1) * 4;
-                uint32_t au = *(uint32_t *)(buf + prev);
-                //printf("0x%llx: (%llx & %llx) == %llx\n", prev + kerndumpbase, au, 0x3BC003E0, au & 0x3BC003E0);
-                if ((au & 0x3BC003E0) == 0x298003E0) {
-                    //printf("%x: STP x, y, [SP,#-imm]!\n", prev);
-                    return prev;
-                } else if ((au & 0x7F8003FF) == 0x510003FF) {
-                    //printf("%x: SUB SP, SP, #imm\n", prev);
-                    return prev;
-                }
-                for (addr_t diff = 4; diff < delta/4+4; diff+=4) {
-                    uint32_t ai = *(uint32_t *)(buf + where - diff);
-                    // SUB SP, SP, #imm
-                    //printf("0x%llx: (%llx & %llx) == %llx\n", where - diff + kerndumpbase, ai, 0x3BC003E0, ai & 0x3BC003E0);
-                    if ((ai & 0x7F8003FF) == 0x510003FF) {
-                        return where - diff;
-                    }
-                    // Not stp and not str
-                    if (((ai & 0xFFC003E0) != 0xA90003E0) && (ai&0xFFC001F0) != 0xF90001E0) {
-                        break;
-                    }
-                }
-                // try something else
-                while (where > start) {
-                    where -= 4;
-                    au = *(uint32_t *)(buf + where);
-                    // SUB SP, SP, #imm
-                    if ((au & 0xFFC003FF) == 0xD10003FF && ((au >> 10) & 0xFFF) == delta + 0x10) {
-                        return where;
-                    }
-                    // STP x, y, [SP,#imm]
-                    if ((au & 0xFFC003E0) != 0xA90003E0) {
-                        where += 4;
-                        break;
-                    }
-                }
-            }
+        if (map && bof64_map_lookup(map, where, &bof) == 0) {
+            return bof;
+        }
+        if (bof64_at(buf, start, where, &bof)) {
+            return bof;
         }
     }
     return 0;
@@ -324,13 +871,48 @@ bof64(const uint8_t *buf, addr_t start, addr_t where)
 addr_t
 xref64(const uint8_t *buf, addr_t start, addr_t end, addr_t what)
 {
+    /* every instruction xref64() gives meaning to; anything else can only
+     * hit by re-reading a register that already holds what */
+    static const struct insn_pat defs[] = {
+        { 0x90000000, 0x9F000000 },     // ADRP
+        { 0x91000000, 0xFF000000 },     // ADD
+        { 0xF9400000, 0xF9C00000 },     // LDR
+        { 0x10000000, 0x9F000000 },     // ADR
+        { 0x58000000, 0xFF000000 },     // LDR =
+        { 0x94000000, 0xFC000000 },     // BL
+    };
+    const unsigned ndefs = sizeof(defs) / sizeof(defs[0]);
+    const struct scan64_impl *scan = scan64_select();
+    unsigned bits = 0;  /* candidates from i on, one bit per word */
     addr_t i;
     uint64_t value[32];
+    /* only ADRP sets a register without checking it right away, so unless
+     * what is page aligned (or 0, which every register starts out as) the
+     * first hit is always on one of the above */
+    bool sparse = (what & 0xFFF) != 0;
 
     memset(value, 0, sizeof(value));
 
     end &= ~3;
     for (i = start & ~3; i < end; i += 4) {
+        if (sparse) {
+            unsigned skip;
+            while (!bits && i + 64 <= end) {
+                bits = scan->mask(buf + i, defs, ndefs);
+                if (!bits) {
+                    i += 64;
+                }
+            }
+            if (!bits) {
+                if (!scan->fwd(buf, i, end, defs, ndefs, &i)) {
+                    break;
+                }
+                bits = 1;
+            }
+            skip = __builtin_ctz(bits);
+            i += skip * 4;
+            bits >>= skip + 1;
+        }
         uint32_t op = *(uint32_t *)(buf + i);
         unsigned reg = op & 0x1F;
 
@@ -406,25 +988,122 @@ xref64code(const uint8_t *buf, addr_t start, addr_t end, addr_t what)
 {
     addr_t i;
 
+    static const struct insn_pat branch = { 0x14000000, 0x7C000000 };
+
     end &= ~3;
-    for (i = start & ~3; i < end; i += 4) {
-        uint32_t op = *(uint32_t *)(buf + i);
-        if ((op & 0x7C000000) == 0x14000000) {
-            addr_t where = follow_call64(buf, i);
-            //printf("%llx: B[L] 0x%llx\n", i + kerndumpbase, kerndumpbase + where);
-            if (where == what) {
-                return i;
-            }
+    for (i = start & ~3; scan64(buf, i, end, &branch, 1, &i); i += 4) {
+        addr_t where = follow_call64(buf, i);
+        //printf("%llx: B[L] 0x%llx\n", i + kerndumpbase, kerndumpbase + where);
+        if (where == what) {
+            return i;
         }
     }
     return 0;
 }
 
-addr_t
-calc64(const uint8_t *buf, addr_t start, addr_t end, int which)
+/* xref index ****************************************************************/
+
+/*
+ * One pass of the xref64() emulator over [start, end) that remembers every
+ * value it would have compared against, so the first xref64() hit for any
+ * target becomes a binary search.  Only values inside [1, limit) are kept.
+ * Hits that merely re-read a register (as opposed to defining it) can only
+ * come first for page-aligned targets, so those are the only ones recorded.
+ */
+
+struct xref_entry {
+    uint32_t to;
+    uint32_t from;
+};
+
+struct xref_index {
+    addr_t start;
+    addr_t end;
+    addr_t limit;
+    size_t count;
+    struct xref_entry *refs;    /* sorted by (to, from) */
+};
+
+static int
+xref_index_push(struct xref_index *idx, size_t *cap, addr_t to, addr_t from, addr_t limit)
+{
+    if (to == 0 || to >= limit) {
+        return 0;
+    }
+    if (idx->count == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 0x10000;
+        struct xref_entry *n = realloc(idx->refs, ncap * sizeof(*n));
+        if (!n) {
+            return -1;
+        }
+        idx->refs = n;
+        *cap = ncap;
+    }
+    idx->refs[idx->count].to = (uint32_t)to;
+    idx->refs[idx->count].from = (uint32_t)from;
+    idx->count++;
+    return 0;
+}
+
+static int
+xref_index_sort(struct xref_index *idx)
+{
+    /* entries are appended in address order, so a stable LSD radix sort on
+     * the target alone leaves them ordered by (to, from) */
+    struct xref_entry *tmp;
+    size_t *count;
+    unsigned pass;
+    size_t i;
+
+    if (idx->count < 2) {
+        return 0;
+    }
+    tmp = malloc(idx->count * sizeof(*tmp));
+    count = malloc(0x10000 * sizeof(*count));
+    if (!tmp || !count) {
+        free(tmp);
+        free(count);
+        return -1;
+    }
+    for (pass = 0; pass < 32; pass += 16) {
+        size_t sum = 0;
+        memset(count, 0, 0x10000 * sizeof(*count));
+        for (i = 0; i < idx->count; i++) {
+            count[(idx->refs[i].to >> pass) & 0xFFFF]++;
+        }
+        for (i = 0; i < 0x10000; i++) {
+            size_t c = count[i];
+            count[i] = sum;
+            sum += c;
+        }
+        for (i = 0; i < idx->count; i++) {
+            tmp[count[(idx->refs[i].to >> pass) & 0xFFFF]++] = idx->refs[i];
+        }
+        memcpy(idx->refs, tmp, idx->count * sizeof(*tmp));
+    }
+    free(tmp);
+    free(count);
+    return 0;
+}
+
+struct xref_index *
+xref64_index(const uint8_t *buf, addr_t start, addr_t end, addr_t limit)
 {
     addr_t i;
     uint64_t value[32];
+    size_t cap = 0;
+    struct xref_index *idx;
+
+    if (limit > 0xFFFFFFFF) {
+        limit = 0xFFFFFFFF;
+    }
+    idx = calloc(1, sizeof(*idx));
+    if (!idx) {
+        return NULL;
+    }
+    idx->start = start;
+    idx->end = end;
+    idx->limit = limit;
 
     memset(value, 0, sizeof(value));
 
@@ -432,64 +1111,658 @@ calc64(const uint8_t *buf, addr_t start, addr_t end, int which)
     for (i = start & ~3; i < end; i += 4) {
         uint32_t op = *(uint32_t *)(buf + i);
         unsigned reg = op & 0x1F;
+        int defined = 1;
+
+        /* keep in sync with xref64() */
         if ((op & 0x9F000000) == 0x90000000) {
             signed adr = ((op & 0x60000000) >> 18) | ((op & 0xFFFFE0) << 8);
-            //printf("%llx: ADRP X%d, 0x%llx\n", i, reg, ((long long)adr << 1) + (i & ~0xFFF));
             value[reg] = ((long long)adr << 1) + (i & ~0xFFF);
-        /*} else if ((op & 0xFFE0FFE0) == 0xAA0003E0) {
-            unsigned rd = op & 0x1F;
-            unsigned rm = (op >> 16) & 0x1F;
-            //printf("%llx: MOV X%d, X%d\n", i, rd, rm);
-            value[rd] = value[rm];*/
+            continue;
         } else if ((op & 0xFF000000) == 0x91000000) {
             unsigned rn = (op >> 5) & 0x1F;
+            if (rn == 0x1f) {
+                value[reg] = 0;
+                continue;
+            }
             unsigned shift = (op >> 22) & 3;
             unsigned imm = (op >> 10) & 0xFFF;
             if (shift == 1) {
                 imm <<= 12;
             } else {
-                //assert(shift == 0);
                 if (shift > 1) continue;
             }
-            //printf("%llx: ADD X%d, X%d, 0x%x\n", i, reg, rn, imm);
             value[reg] = value[rn] + imm;
         } else if ((op & 0xF9C00000) == 0xF9400000) {
             unsigned rn = (op >> 5) & 0x1F;
             unsigned imm = ((op >> 10) & 0xFFF) << 3;
-            //printf("%llx: LDR X%d, [X%d, 0x%x]\n", i, reg, rn, imm);
-            if (!imm) continue;         // XXX not counted as true xref
-            value[reg] = value[rn] + imm;   // XXX address, not actual value
-        } else if ((op & 0xF9C00000) == 0xF9000000) {
-            unsigned rn = (op >> 5) & 0x1F;
-            unsigned imm = ((op >> 10) & 0xFFF) << 3;
-            //printf("%llx: STR X%d, [X%d, 0x%x]\n", i, reg, rn, imm);
-            if (!imm) continue;         // XXX not counted as true xref
-            value[rn] = value[rn] + imm;    // XXX address, not actual value
+            if (!imm) continue;
+            value[reg] = value[rn] + imm;
         } else if ((op & 0x9F000000) == 0x10000000) {
             signed adr = ((op & 0x60000000) >> 18) | ((op & 0xFFFFE0) << 8);
-            //printf("%llx: ADR X%d, 0x%llx\n", i, reg, ((long long)adr >> 11) + i);
             value[reg] = ((long long)adr >> 11) + i;
         } else if ((op & 0xFF000000) == 0x58000000) {
             unsigned adr = (op & 0xFFFFE0) >> 3;
-            //printf("%llx: LDR X%d, =0x%llx\n", i, reg, adr + i);
-            value[reg] = adr + i;       // XXX address, not actual value
-        } else if ((op & 0xF9C00000) == 0xb9400000) { // 32bit
-            unsigned rn = (op >> 5) & 0x1F;
-            unsigned imm = ((op >> 10) & 0xFFF) << 2;
-            if (!imm) continue;            // XXX not counted as true xref
-            value[reg] = value[rn] + imm;    // XXX address, not actual value
+            value[reg] = adr + i;
+        } else {
+            defined = 0;
+            if ((op & 0xFC000000) == 0x94000000) {
+                signed imm = (op & 0x3FFFFFF) << 2;
+                if (op & 0x2000000) {
+                    imm |= 0xf << 28;
+                }
+                unsigned adr = (unsigned)(i + imm);
+                if (xref_index_push(idx, &cap, adr, i, limit)) {
+                    goto fail;
+                }
+            }
+        }
+        if (reg != 0x1f && (defined || (value[reg] & 0xFFF) == 0)) {
+            if (xref_index_push(idx, &cap, value[reg], i, limit)) {
+                goto fail;
+            }
         }
     }
-    return value[which];
+    if (xref_index_sort(idx)) {
+        goto fail;
+    }
+    return idx;
+
+fail:
+    xref64_index_free(idx);
+    return NULL;
 }
 
-addr_t
-calc64mov(const uint8_t *buf, addr_t start, addr_t end, int which)
+void
+xref64_index_free(struct xref_index *idx)
 {
-    addr_t i;
-    uint64_t value[32];
+    if (idx) {
+        free(idx->refs);
+        free(idx);
+    }
+}
 
-    memset(value, 0, sizeof(value));
+int
+xref64_index_lookup(const struct xref_index *idx, addr_t what, addr_t *ref)
+{
+    /* returns -1 if the index cannot answer for this target, in which case
+     * the caller must fall back to xref64() */
+    size_t lo = 0, hi;
+
+    if (!idx || what == 0 || what >= idx->limit) {
+        return -1;
+    }
+    hi = idx->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->refs[mid].to < what) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < idx->count && idx->refs[lo].to == what) {
+        *ref = idx->refs[lo].from;
+    } else {
+        *ref = 0;
+    }
+    return 0;
+}
+
+/*
+ * B/BL only: every branch in [start, end) keyed by its target.  Unlike the
+ * data refs these carry no register state, so any subrange query is exact.
+ */
+struct xref_index *
+xref64code_index(const uint8_t *buf, addr_t start, addr_t end, addr_t limit)
+{
+    static const struct insn_pat branch = { 0x14000000, 0x7C000000 };
+    addr_t i;
+    size_t cap = 0;
+    struct xref_index *idx;
+
+    if (limit > 0xFFFFFFFF) {
+        limit = 0xFFFFFFFF;
+    }
+    idx = calloc(1, sizeof(*idx));
+    if (!idx) {
+        return NULL;
+    }
+    idx->start = start;
+    idx->end = end;
+    idx->limit = limit;
+
+    end &= ~3;
+    for (i = start & ~3; scan64(buf, i, end, &branch, 1, &i); i += 4) {
+        if (xref_index_push(idx, &cap, follow_call64(buf, i), i, limit)) {
+            xref64_index_free(idx);
+            return NULL;
+        }
+    }
+    if (xref_index_sort(idx)) {
+        xref64_index_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+static size_t
+xref_index_lower_bound(const struct xref_index *idx, addr_t what, addr_t from)
+{
+    size_t lo = 0, hi = idx->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct xref_entry *e = &idx->refs[mid];
+        if (e->to < what || (e->to == what && e->from < from)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int
+xref64_index_next(const struct xref_index *idx, addr_t what, addr_t start, addr_t end, addr_t *ref)
+{
+    /* first entry for what in [start, end); -1 if outside what the index covers */
+    size_t i;
+
+    if (!idx || what == 0 || what >= idx->limit || start < idx->start || end > idx->end) {
+        return -1;
+    }
+    i = xref_index_lower_bound(idx, what, start);
+    if (i < idx->count && idx->refs[i].to == what && idx->refs[i].from < end) {
+        *ref = idx->refs[i].from;
+    } else {
+        *ref = 0;
+    }
+    return 0;
+}
+
+size_t
+xref64_index_all(const struct xref_index *idx, addr_t what, addr_t *refs, size_t max)
+{
+    /* every entry for what in address order; returns the total, which may exceed max */
+    size_t i, n = 0;
+
+    if (!idx || what == 0 || what >= idx->limit) {
+        return 0;
+    }
+    for (i = xref_index_lower_bound(idx, what, 0); i < idx->count && idx->refs[i].to == what; i++, n++) {
+        if (n < max) {
+            refs[n] = idx->refs[i].from;
+        }
+    }
+    return n;
+}
+
+/* function map **************************************************************/
+
+/*
+ * Every place bof64() could stop at within [start, end), found in one pass,
+ * so a backwards scan becomes a binary search.  Only valid for queries that
+ * use the same start, since the prologue heuristic may look back up to it.
+ * The set of function starts (bof64() answers plus BL targets) also gives
+ * the end of a function: the next start after it.
+ */
+
+struct func_bof {
+    uint32_t at;
+    uint32_t bof;
+};
+
+struct func_map {
+    addr_t start;
+    addr_t end;
+    bool pac;
+    size_t count;
+    struct func_bof *bofs;      /* sorted by at */
+    size_t nstarts;
+    uint32_t *starts;           /* sorted, unique */
+};
+
+static int
+func_map_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int
+func_map_push_start(struct func_map *map, size_t *cap, addr_t at)
+{
+    if (map->nstarts == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 0x4000;
+        uint32_t *n = realloc(map->starts, ncap * sizeof(*n));
+        if (!n) {
+            return -1;
+        }
+        map->starts = n;
+        *cap = ncap;
+    }
+    map->starts[map->nstarts++] = (uint32_t)at;
+    return 0;
+}
+
+struct func_map *
+bof64_map(const uint8_t *buf, addr_t start, addr_t end, bool pac)
+{
+    addr_t i;
+    size_t cap = 0, scap = 0;
+    size_t j, k;
+    struct func_map *map;
+
+    if (end > 0xFFFFFFFF) {
+        return NULL;
+    }
+    map = calloc(1, sizeof(*map));
+    if (!map) {
+        return NULL;
+    }
+    map->start = start;
+    map->end = end;
+    map->pac = pac;
+
+    end &= ~3;
+    for (i = start; i < end; i += 4) {
+        uint32_t op = *(uint32_t *)(buf + i);
+        addr_t bof;
+        int hit;
+        if (pac) {
+            hit = (op == 0xD503237F);
+            bof = i;
+        } else {
+            hit = bof64_at(buf, start, i, &bof);
+        }
+        if (hit) {
+            if (map->count == cap) {
+                size_t ncap = cap ? cap * 2 : 0x4000;
+                struct func_bof *n = realloc(map->bofs, ncap * sizeof(*n));
+                if (!n) {
+                    goto fail;
+                }
+                map->bofs = n;
+                cap = ncap;
+            }
+            map->bofs[map->count].at = (uint32_t)i;
+            map->bofs[map->count].bof = (uint32_t)bof;
+            map->count++;
+            if (bof >= start && func_map_push_start(map, &scap, bof)) {
+                goto fail;
+            }
+        }
+        if ((op & 0xFC000000) == 0x94000000) {
+            addr_t target = follow_call64(buf, i);
+            if (target >= start && target < end && func_map_push_start(map, &scap, target)) {
+                goto fail;
+            }
+        }
+    }
+
+    if (map->nstarts) {
+        qsort(map->starts, map->nstarts, sizeof(*map->starts), func_map_cmp);
+        for (j = k = 1; j < map->nstarts; j++) {
+            if (map->starts[j] != map->starts[k - 1]) {
+                map->starts[k++] = map->starts[j];
+            }
+        }
+        map->nstarts = k;
+    }
+    return map;
+
+fail:
+    bof64_map_free(map);
+    return NULL;
+}
+
+void
+bof64_map_free(struct func_map *map)
+{
+    if (map) {
+        free(map->bofs);
+        free(map->starts);
+        free(map);
+    }
+}
+
+int
+bof64_map_lookup(const struct func_map *map, addr_t where, addr_t *bof)
+{
+    /* returns -1 if the map does not cover where */
+    size_t lo = 0, hi;
+
+    if (!map || where < map->start || where >= map->end) {
+        return -1;
+    }
+    hi = map->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->bofs[mid].at <= where) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *bof = lo ? map->bofs[lo - 1].bof : 0;
+    return 0;
+}
+
+int
+eof64_map_lookup(const struct func_map *map, addr_t where, addr_t *eof)
+{
+    /* the first function start past where, or the end of the range */
+    size_t lo = 0, hi;
+
+    if (!map || where < map->start || where >= map->end) {
+        return -1;
+    }
+    hi = map->nstarts;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->starts[mid] <= where) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *eof = lo < map->nstarts ? map->starts[lo] : map->end;
+    return 0;
+}
+
+static const struct func_map *lazy_func_map(struct func_map **slot, pf_lock_t *lock, addr_t base, addr_t size);
+
+static const struct func_map *
+current_func_map(const uint8_t *buf, addr_t start)
+{
+    const struct func_map *map = NULL;
+    if (buf != kernel) {
+        return NULL;
+    }
+    if (start == xnucore_base) {
+        map = lazy_func_map(&xnucore_funcs, INDEX_LOCK(xnucore_funcs), xnucore_base, xnucore_size);
+    } else if (start == prelink_base) {
+        map = lazy_func_map(&prelink_funcs, INDEX_LOCK(prelink_funcs), prelink_base, prelink_size);
+    }
+    if (map && map->pac == auth_ptrs) {
+        return map;
+    }
+    return NULL;
+}
+
+addr_t
+eof64(const uint8_t *buf, addr_t start, addr_t where)
+{
+    addr_t eof;
+    if (eof64_map_lookup(current_func_map(buf, start), where, &eof) != 0) {
+        return 0;
+    }
+    return eof;
+}
+
+/* string index **************************************************************/
+
+/*
+ * Every NUL-terminated string in a section, keyed twice: an open-addressed
+ * hash on the contents for exact matches, and an array sorted by contents
+ * for prefix matches.  Both answer with the lowest address, which is what
+ * the memmem scan in find_strref() would have stopped at.
+ */
+
+struct str_entry {
+    uint32_t off;
+    uint32_t len;
+};
+
+struct str_index {
+    addr_t start;
+    addr_t end;
+    size_t count;
+    struct str_entry *strs;     /* in address order */
+    struct str_entry *sorted;   /* by (contents, address) */
+    uint32_t *hash;             /* 1 + first index with those contents */
+    uint32_t mask;
+};
+
+static __thread const uint8_t *str_index_buf;
+
+static uint32_t
+str_hash(const uint8_t *s, size_t len)
+{
+    uint32_t h = 2166136261U;
+    while (len--) {
+        h = (h ^ *s++) * 16777619U;
+    }
+    return h;
+}
+
+static int
+str_cmp(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+    int rv = memcmp(a, b, alen < blen ? alen : blen);
+    if (rv) {
+        return rv;
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+static int
+str_sort_cmp(const void *a, const void *b)
+{
+    const struct str_entry *x = a;
+    const struct str_entry *y = b;
+    int rv = str_cmp(str_index_buf + x->off, x->len, str_index_buf + y->off, y->len);
+    if (rv) {
+        return rv;
+    }
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+static void
+str_index_free(struct str_index *idx)
+{
+    if (idx) {
+        free(idx->strs);
+        free(idx->sorted);
+        free(idx->hash);
+        free(idx);
+    }
+}
+
+static struct str_index *
+str_index_build(const uint8_t *buf, addr_t start, addr_t end)
+{
+    struct str_index *idx;
+    size_t cap = 0;
+    size_t i, n;
+    addr_t p;
+
+    if (end <= start || end > 0xFFFFFFFF) {
+        return NULL;
+    }
+    idx = calloc(1, sizeof(*idx));
+    if (!idx) {
+        return NULL;
+    }
+    idx->start = start;
+    idx->end = end;
+
+    /* empty strings are never looked up, so only non-empty ones are kept */
+    for (p = start; p < end; ) {
+        const uint8_t *s = buf + p;
+        const uint8_t *z = memchr(s, 0, end - p);
+        size_t len = z ? (size_t)(z - s) : end - p;
+        if (len) {
+            if (idx->count == cap) {
+                size_t ncap = cap ? cap * 2 : 0x4000;
+                struct str_entry *e = realloc(idx->strs, ncap * sizeof(*e));
+                if (!e) {
+                    goto fail;
+                }
+                idx->strs = e;
+                cap = ncap;
+            }
+            idx->strs[idx->count].off = (uint32_t)p;
+            idx->strs[idx->count].len = (uint32_t)len;
+            idx->count++;
+        }
+        p += len + 1;
+    }
+
+    n = 1;
+    while (n < idx->count * 2) {
+        n <<= 1;
+    }
+    idx->mask = n - 1;
+    idx->hash = calloc(n, sizeof(*idx->hash));
+    idx->sorted = malloc((idx->count + 1) * sizeof(*idx->sorted));
+    if (!idx->hash || !idx->sorted) {
+        goto fail;
+    }
+
+    for (i = 0; i < idx->count; i++) {
+        const struct str_entry *e = &idx->strs[i];
+        uint32_t h = str_hash(buf + e->off, e->len) & idx->mask;
+        while (idx->hash[h]) {
+            const struct str_entry *o = &idx->strs[idx->hash[h] - 1];
+            if (o->len == e->len && !memcmp(buf + o->off, buf + e->off, e->len)) {
+                break;
+            }
+            h = (h + 1) & idx->mask;
+        }
+        if (!idx->hash[h]) {
+            idx->hash[h] = i + 1;
+        }
+    }
+
+    memcpy(idx->sorted, idx->strs, idx->count * sizeof(*idx->sorted));
+    str_index_buf = buf;
+    qsort(idx->sorted, idx->count, sizeof(*idx->sorted), str_sort_cmp);
+    str_index_buf = NULL;
+    return idx;
+
+fail:
+    str_index_free(idx);
+    return NULL;
+}
+
+static addr_t
+str_index_lookup(const struct str_index *idx, const uint8_t *buf, const char *string, bool full_match)
+{
+    /* returns the offset of the first string that equals (or starts with)
+     * string, or 0 if there is none */
+    size_t len = strlen(string);
+    size_t lo = 0, hi = idx->count;
+    addr_t best = 0;
+
+    if (full_match) {
+        uint32_t h = str_hash((const uint8_t *)string, len) & idx->mask;
+        while (idx->hash[h]) {
+            const struct str_entry *e = &idx->strs[idx->hash[h] - 1];
+            if (e->len == len && !memcmp(buf + e->off, string, len)) {
+                /* a string running off the end of the section is only a
+                 * match if the byte past it happens to be a NUL */
+                if (strcmp((char *)buf + e->off, string) == 0) {
+                    return e->off;
+                }
+                return 0;
+            }
+            h = (h + 1) & idx->mask;
+        }
+        return 0;
+    }
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct str_entry *e = &idx->sorted[mid];
+        if (str_cmp(buf + e->off, e->len, (const uint8_t *)string, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < idx->count; lo++) {
+        const struct str_entry *e = &idx->sorted[lo];
+        if (e->len < len || memcmp(buf + e->off, string, len)) {
+            break;
+        }
+        if (!best || e->off < best) {
+            best = e->off;
+        }
+    }
+    return best;
+}
+
+addr_t
+calc64(const uint8_t *buf, addr_t start, addr_t end, int which)
+{
+    addr_t i;
+    uint64_t value[32];
+
+    memset(value, 0, sizeof(value));
+
+    end &= ~3;
+    for (i = start & ~3; i < end; i += 4) {
+        uint32_t op = *(uint32_t *)(buf + i);
+        unsigned reg = op & 0x1F;
+        if ((op & 0x9F000000) == 0x90000000) {
+            signed adr = ((op & 0x60000000) >> 18) | ((op & 0xFFFFE0) << 8);
+            //printf("%llx: ADRP X%d, 0x%llx\n", i, reg, ((long long)adr << 1) + (i & ~0xFFF));
+            value[reg] = ((long long)adr << 1) + (i & ~0xFFF);
+        /*} else if ((op & 0xFFE0FFE0) == 0xAA0003E0) {
+            unsigned rd = op & 0x1F;
+            unsigned rm = (op >> 16) & 0x1F;
+            //printf("%llx: MOV X%d, X%d\n", i, rd, rm);
+            value[rd] = value[rm];*/
+        } else if ((op & 0xFF000000) == 0x91000000) {
+            unsigned rn = (op >> 5) & 0x1F;
+            unsigned shift = (op >> 22) & 3;
+            unsigned imm = (op >> 10) & 0xFFF;
+            if (shift == 1) {
+                imm <<= 12;
+            } else {
+                //assert(shift == 0);
+                if (shift > 1) continue;
+            }
+            //printf("%llx: ADD X%d, X%d, 0x%x\n", i, reg, rn, imm);
+            value[reg] = value[rn] + imm;
+        } else if ((op & 0xF9C00000) == 0xF9400000) {
+            unsigned rn = (op >> 5) & 0x1F;
+            unsigned imm = ((op >> 10) & 0xFFF) << 3;
+            //printf("%llx: LDR X%d, [X%d, 0x%x]\n", i, reg, rn, imm);
+            if (!imm) continue;         // XXX not counted as true xref
+            value[reg] = value[rn] + imm;   // XXX address, not actual value
+        } else if ((op & 0xF9C00000) == 0xF9000000) {
+            unsigned rn = (op >> 5) & 0x1F;
+            unsigned imm = ((op >> 10) & 0xFFF) << 3;
+            //printf("%llx: STR X%d, [X%d, 0x%x]\n", i, reg, rn, imm);
+            if (!imm) continue;         // XXX not counted as true xref
+            value[rn] = value[rn] + imm;    // XXX address, not actual value
+        } else if ((op & 0x9F000000) == 0x10000000) {
+            signed adr = ((op & 0x60000000) >> 18) | ((op & 0xFFFFE0) << 8);
+            //printf("%llx: ADR X%d, 0x%llx\n", i, reg, ((long long)adr >> 11) + i);
+            value[reg] = ((long long)adr >> 11) + i;
+        } else if ((op & 0xFF000000) == 0x58000000) {
+            unsigned adr = (op & 0xFFFFE0) >> 3;
+            //printf("%llx: LDR X%d, =0x%llx\n", i, reg, adr + i);
+            value[reg] = adr + i;       // XXX address, not actual value
+        } else if ((op & 0xF9C00000) == 0xb9400000) { // 32bit
+            unsigned rn = (op >> 5) & 0x1F;
+            unsigned imm = ((op >> 10) & 0xFFF) << 2;
+            if (!imm) continue;            // XXX not counted as true xref
+            value[reg] = value[rn] + imm;    // XXX address, not actual value
+        }
+    }
+    return value[which];
+}
+
+addr_t
+calc64mov(const uint8_t *buf, addr_t start, addr_t end, int which)
+{
+    addr_t i;
+    uint64_t value[32];
+
+    memset(value, 0, sizeof(value));
 
     end &= ~3;
     for (i = start & ~3; i < end; i += 4) {
@@ -610,14 +1883,167 @@ static ssize_t win_pread(int fd, void* buf, size_t count, addr_t offset) {
 #define SYS_getpgid 151
 #else
 #define PREAD pread
+#define HAVE_MMAP
+#include <sys/mman.h>
 #endif
 #endif
 
-static uint8_t *kernel = NULL;
-static size_t kernel_size = 0;
+#ifdef HAVE_MMAP
+/*
+ * Map the image instead of reading it: reserve the whole VM span as
+ * anonymous zero pages, then map each segment's file range over its slot.
+ * Segments whose file and VM offsets are not both page aligned, and the
+ * partial page at the end of a segment, are read in as before.
+ */
 
-int
-init_kernel(size_t (*kread)(uint64_t, void *, size_t), addr_t kernel_base, const char *filename)
+static size_t
+map_kernel_span(size_t size)
+{
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    void *p;
+    size = (size + pgsz - 1) & ~(pgsz - 1);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    kernel = p;
+    return size;
+}
+
+static int
+map_kernel_segment(FHANDLE fd, const struct segment_command_64 *seg, addr_t min)
+{
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    size_t off = seg->vmaddr - min;
+    size_t len = 0;
+    if (((off | seg->fileoff) & (pgsz - 1)) == 0) {
+        len = seg->filesize & ~(pgsz - 1);
+        if (len && mmap(kernel + off, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, seg->fileoff) == MAP_FAILED) {
+            return -1;
+        }
+    }
+    if (len < seg->filesize) {
+        size_t sz = PREAD(fd, kernel + off + len, seg->filesize - len, seg->fileoff + len);
+        if (sz != seg->filesize - len) {
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+static void free_sym_table(void);
+static void pf_cache_open(void);
+static void pf_cache_close(void);
+
+/*
+ * The indices are built the first time a lookup needs one, so a run the
+ * offset cache answers completely never scans the image.  One worker builds
+ * each under the slot's lock while the others wait for it.
+ */
+
+static void
+index_locks_init(struct pf_ctx *ctx)
+{
+    pf_lock_init(&ctx->xnucore_xrefs_lock);
+    pf_lock_init(&ctx->prelink_xrefs_lock);
+    pf_lock_init(&ctx->ppl_xrefs_lock);
+    pf_lock_init(&ctx->cstring_strs_lock);
+    pf_lock_init(&ctx->oslstring_strs_lock);
+    pf_lock_init(&ctx->const_strs_lock);
+    pf_lock_init(&ctx->xnucore_funcs_lock);
+    pf_lock_init(&ctx->prelink_funcs_lock);
+}
+
+static void
+index_locks_destroy(struct pf_ctx *ctx)
+{
+    pf_lock_destroy(&ctx->xnucore_xrefs_lock);
+    pf_lock_destroy(&ctx->prelink_xrefs_lock);
+    pf_lock_destroy(&ctx->ppl_xrefs_lock);
+    pf_lock_destroy(&ctx->cstring_strs_lock);
+    pf_lock_destroy(&ctx->oslstring_strs_lock);
+    pf_lock_destroy(&ctx->const_strs_lock);
+    pf_lock_destroy(&ctx->xnucore_funcs_lock);
+    pf_lock_destroy(&ctx->prelink_funcs_lock);
+}
+
+static const struct func_map *
+lazy_func_map(struct func_map **slot, pf_lock_t *lock, addr_t base, addr_t size)
+{
+    struct func_map *map = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!map && use_func_map && size) {
+        pf_lock(lock);
+        map = *slot;
+        if (!map) {
+            map = bof64_map(kernel, base, base + size, auth_ptrs);
+            __atomic_store_n(slot, map, __ATOMIC_RELEASE);
+        }
+        pf_unlock(lock);
+    }
+    return map;
+}
+
+static void
+free_func_maps(void)
+{
+    bof64_map_free(xnucore_funcs);
+    bof64_map_free(prelink_funcs);
+    xnucore_funcs = prelink_funcs = NULL;
+}
+
+static const struct xref_index *
+lazy_xref_index(struct xref_index **slot, pf_lock_t *lock, addr_t base, addr_t size)
+{
+    struct xref_index *idx = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!idx && use_xref_index && size) {
+        pf_lock(lock);
+        idx = *slot;
+        if (!idx) {
+            idx = xref64_index(kernel, base, base + size, kernel_size);
+            __atomic_store_n(slot, idx, __ATOMIC_RELEASE);
+        }
+        pf_unlock(lock);
+    }
+    return idx;
+}
+
+static void
+free_xref_indices(void)
+{
+    xref64_index_free(xnucore_xrefs);
+    xref64_index_free(prelink_xrefs);
+    xref64_index_free(ppl_xrefs);
+    xnucore_xrefs = prelink_xrefs = ppl_xrefs = NULL;
+}
+
+static const struct str_index *
+lazy_str_index(struct str_index **slot, pf_lock_t *lock, addr_t base, addr_t size)
+{
+    struct str_index *strs = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!strs && use_string_index && size) {
+        pf_lock(lock);
+        strs = *slot;
+        if (!strs) {
+            strs = str_index_build(kernel, base, base + size);
+            __atomic_store_n(slot, strs, __ATOMIC_RELEASE);
+        }
+        pf_unlock(lock);
+    }
+    return strs;
+}
+
+static void
+free_str_indices(void)
+{
+    str_index_free(cstring_strs);
+    str_index_free(oslstring_strs);
+    str_index_free(const_strs);
+    cstring_strs = oslstring_strs = const_strs = NULL;
+}
+
+static int
+load_kernel(size_t (*kread)(uint64_t, void *, size_t), addr_t kernel_base, const char *filename)
 {
     size_t rv;
     uint8_t buf[0x4000];
@@ -764,7 +2190,16 @@ init_kernel(size_t (*kread)(uint64_t, void *, size_t), addr_t kernel_base, const
 
         kernel_mh = kernel + kernel_base - min;
     } else {
+#ifdef HAVE_MMAP
+        if (use_kernel_mmap) {
+            kernel_mapped = map_kernel_span(kernel_size);
+        }
+        if (!kernel_mapped) {
+            kernel = calloc(1, kernel_size);
+        }
+#else
         kernel = calloc(1, kernel_size);
+#endif
         if (!kernel) {
             CLOSE(fd);
             return -1;
@@ -775,12 +2210,25 @@ init_kernel(size_t (*kread)(uint64_t, void *, size_t), addr_t kernel_base, const
             const struct load_command *cmd = (struct load_command *)q;
             if (cmd->cmd == LC_SEGMENT_64) {
                 const struct segment_command_64 *seg = (struct segment_command_64 *)q;
-                size_t sz = PREAD(fd, kernel + seg->vmaddr - min, seg->filesize, seg->fileoff);
-                if (sz != seg->filesize) {
-                    CLOSE(fd);
-                    free(kernel);
-                    kernel = NULL;
-                    return -1;
+#ifdef HAVE_MMAP
+                if (kernel_mapped) {
+                    if (map_kernel_segment(fd, seg, min) != 0) {
+                        CLOSE(fd);
+                        munmap(kernel, kernel_mapped);
+                        kernel_mapped = 0;
+                        kernel = NULL;
+                        return -1;
+                    }
+                } else
+#endif
+                {
+                    size_t sz = PREAD(fd, kernel + seg->vmaddr - min, seg->filesize, seg->fileoff);
+                    if (sz != seg->filesize) {
+                        CLOSE(fd);
+                        free(kernel);
+                        kernel = NULL;
+                        return -1;
+                    }
                 }
                 if (!kernel_mh) {
                     kernel_mh = kernel + seg->vmaddr - min;
@@ -796,18 +2244,95 @@ init_kernel(size_t (*kread)(uint64_t, void *, size_t), addr_t kernel_base, const
 
         CLOSE(fd);
     }
+
     return 0;
 }
 
-void
-term_kernel(void)
+static void
+unload_kernel(void)
 {
+    free_xref_indices();
+    free_str_indices();
+    free_sym_table();
+    free_func_maps();
+    pf_cur->smalloc_memo = pf_cur->pthread_callbacks_memo = pf_cur->handler_map_memo = 0;
+    pf_cur->policy_conf_memo = pf_cur->sfree_memo = pf_cur->sysent_memo = 0;
+#ifdef HAVE_MMAP
+    if (kernel_mapped) {
+        munmap(kernel, kernel_mapped);
+        kernel_mapped = 0;
+        kernel = NULL;
+    }
+#endif
     if (kernel != NULL) {
         free(kernel);
         kernel = NULL;
     }
 }
 
+int
+init_kernel(size_t (*kread)(uint64_t, void *, size_t), addr_t kernel_base, const char *filename)
+{
+    int rv;
+    struct pf_ctx *saved = pf_cur;
+    pf_cur = &pf_default;
+    rv = load_kernel(kread, kernel_base, filename);
+    export_kernel_flags(&pf_default);
+    pf_cur = saved;
+    return rv;
+}
+
+void
+term_kernel(void)
+{
+    struct pf_ctx *saved = pf_cur;
+    pf_cur = &pf_default;
+    unload_kernel();
+    pf_cur = saved;
+}
+
+pf_ctx *
+pf_open(const char *filename)
+{
+    int rv;
+    struct pf_ctx *saved = pf_cur;
+    struct pf_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    index_locks_init(ctx);
+    pf_cur = ctx;
+    kerndumpbase = -1;
+    rv = load_kernel(NULL, 0, filename);
+    if (rv != 0) {
+        unload_kernel();
+    } else if (offset_cache_dir) {
+        pf_cache_open();
+    }
+    pf_cur = saved;
+    if (rv != 0) {
+        index_locks_destroy(ctx);
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void
+pf_close(pf_ctx *ctx)
+{
+    struct pf_ctx *saved = pf_cur;
+    if (!ctx) {
+        return;
+    }
+    pf_cur = ctx;
+    pf_cache_close();
+    unload_kernel();
+    pf_cur = saved;
+    index_locks_destroy(ctx);
+    free(ctx);
+}
+
 addr_t
 find_register_value(addr_t where, int reg)
 {
@@ -861,8 +2386,28 @@ find_reference(addr_t to, int n, enum text_bases text_base)
     if (n <= 0) {
         n = 1;
     }
-    end = base + size;
-    to -= kerndumpbase;
+    end = base + size;
+    to -= kerndumpbase;
+
+    /* the index only knows the first hit; later ones restart the scan with
+     * cleared registers, exactly as the loop below always did */
+    const struct xref_index *idx = NULL;
+    if (base == xnucore_base && size == xnucore_size) {
+        idx = lazy_xref_index(&xnucore_xrefs, INDEX_LOCK(xnucore_xrefs), xnucore_base, xnucore_size);
+    } else if (base == prelink_base && size == prelink_size) {
+        idx = lazy_xref_index(&prelink_xrefs, INDEX_LOCK(prelink_xrefs), prelink_base, prelink_size);
+    } else if (base == ppl_base && size == ppl_size) {
+        idx = lazy_xref_index(&ppl_xrefs, INDEX_LOCK(ppl_xrefs), ppl_base, ppl_size);
+    }
+    if (xref64_index_lookup(idx, to, &ref) == 0) {
+        if (!ref) {
+            return 0;
+        }
+        if (--n == 0) {
+            return ref + kerndumpbase;
+        }
+        base = ref + 4;
+    }
     do {
         ref = xref64(kernel, base, end, to);
         if (!ref) {
@@ -874,17 +2419,19 @@ find_reference(addr_t to, int n, enum text_bases text_base)
 }
 
 addr_t
-find_strref(const char *string, int n, enum string_bases string_base, bool full_match, bool ppl_base)
+find_strref(const char *string, int n, enum string_bases string_base, bool full_match, bool in_ppl)
 {
     uint8_t *str;
     addr_t base;
     addr_t size;
-    enum text_bases text_base = ppl_base?text_ppl_base:text_xnucore_base;
+    const struct str_index *strs = NULL;
+    enum text_bases text_base = in_ppl?text_ppl_base:text_xnucore_base;
 
     switch (string_base) {
         case string_base_const:
             base = const_base;
             size = const_size;
+            strs = lazy_str_index(&const_strs, INDEX_LOCK(const_strs), const_base, const_size);
             break;
         case string_base_data:
             base = data_base;
@@ -893,18 +2440,32 @@ find_strref(const char *string, int n, enum string_bases string_base, bool full_
         case string_base_oslstring:
             base = oslstring_base;
             size = oslstring_size;
+            strs = lazy_str_index(&oslstring_strs, INDEX_LOCK(oslstring_strs), oslstring_base, oslstring_size);
             break;
         case string_base_pstring:
             base = pstring_base;
             size = pstring_size;
+            /* __PRELINK_TEXT is mostly code, so it is only covered when it
+             * is an alias for __cstring on monolithic kernels */
+            if (base == cstring_base && size == cstring_size) {
+                strs = lazy_str_index(&cstring_strs, INDEX_LOCK(cstring_strs), cstring_base, cstring_size);
+            }
             text_base = text_prelink_base;
             break;
         case string_base_cstring:
         default:
             base = cstring_base;
             size = cstring_size;
+            strs = lazy_str_index(&cstring_strs, INDEX_LOCK(cstring_strs), cstring_base, cstring_size);
             break;
     }
+    if (strs && *string) {
+        addr_t off = str_index_lookup(strs, kernel, string, full_match);
+        if (!off) {
+            return 0;
+        }
+        return find_reference(off + kerndumpbase, n, text_base);
+    }
     addr_t off = 0;
     while ((str = boyermoore_horspool_memmem(kernel + base + off, size - off, (uint8_t *)string, strlen(string)))) {
         // Only match the beginning of strings
@@ -1120,7 +2681,26 @@ find_cpacr_write(void)
 addr_t
 find_str(const char *string)
 {
-    uint8_t *str = boyermoore_horspool_memmem(kernel, kernel_size, (uint8_t *)string, strlen(string));
+    size_t len = strlen(string);
+    addr_t end = kernel_size;
+    uint8_t *str;
+    if (len) {
+        /* the first indexed string starting with it bounds the scan; an
+         * earlier hit may still sit anywhere else in the image */
+        const struct str_index *all[] = {
+            lazy_str_index(&cstring_strs, INDEX_LOCK(cstring_strs), cstring_base, cstring_size),
+            lazy_str_index(&oslstring_strs, INDEX_LOCK(oslstring_strs), oslstring_base, oslstring_size),
+            lazy_str_index(&const_strs, INDEX_LOCK(const_strs), const_base, const_size),
+        };
+        unsigned i;
+        for (i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+            addr_t off = all[i] ? str_index_lookup(all[i], kernel, string, false) : 0;
+            if (off && off + len < end) {
+                end = off + len;
+            }
+        }
+    }
+    str = boyermoore_horspool_memmem(kernel, end, (uint8_t *)string, len);
     if (!str) {
         return 0;
     }
@@ -2039,7 +3619,7 @@ addr_t find_osunserializexml(void)
 
 addr_t find_smalloc(void)
 {
-    static uint64_t start=0;
+    addr_t start = MEMO_GET(smalloc);
     if (start) return start + kerndumpbase;
 
     addr_t ref = find_strref("sandbox memory allocation failure", 1, string_base_pstring, false, false);
@@ -2054,6 +3634,7 @@ addr_t find_smalloc(void)
     if (!start) {
         return 0;
     }
+    MEMO_SET(smalloc, start);
 
     return start + kerndumpbase;
 }
@@ -2158,7 +3739,7 @@ addr_t find_pthread_kext_register(void)
 addr_t find_pthread_callbacks(void)
 {
     // Cache this one //
-    static addr_t addr = 0;
+    addr_t addr = MEMO_GET(pthread_callbacks);
     if (addr) {
         return addr + kerndumpbase;
     }
@@ -2174,6 +3755,7 @@ addr_t find_pthread_callbacks(void)
 
     addr = calc64(kernel, ref, ref + 8, 8);
     if (!addr) return 0;
+    MEMO_SET(pthread_callbacks, addr);
     return addr + kerndumpbase;
 }
 
@@ -2201,7 +3783,7 @@ addr_t find_kmod_start(void)
 
 addr_t find_handler_map(void)
 {
-    static addr_t addr = 0;
+    addr_t addr = MEMO_GET(handler_map);
     if (addr) return addr + kerndumpbase;
 
     addr_t kmod_start = find_kmod_start();
@@ -2224,6 +3806,7 @@ addr_t find_handler_map(void)
 
     addr = calc64(kernel, add-0x10, add, rn);
     if (!addr) return 0;
+    MEMO_SET(handler_map, addr);
     return addr + kerndumpbase;
 }
 
@@ -2337,12 +3920,14 @@ addr_t find_IOFree(void)
 
 addr_t find_policy_ops(void)
 {
-    static struct mac_policy_conf *conf = NULL;
-    if (!conf) {
+    addr_t policy_conf = MEMO_GET(policy_conf);
+    if (!policy_conf) {
         addr_t policy_conf_ref = find_policy_conf();
         if (!policy_conf_ref) return 0;
-        conf = (struct mac_policy_conf *)(policy_conf_ref - kerndumpbase + kernel);
+        policy_conf = policy_conf_ref - kerndumpbase;
+        MEMO_SET(policy_conf, policy_conf);
     }
+    const struct mac_policy_conf *conf = (const struct mac_policy_conf *)(kernel + policy_conf);
 
     addr_t ops = conf->mpc_ops;
     if (!ops) return 0;
@@ -2495,7 +4080,7 @@ addr_t find_extension_release(void)
 
 addr_t find_sfree(void)
 {
-    static addr_t func=0;
+    addr_t func = MEMO_GET(sfree);
     if (func) return func + kerndumpbase;
 
     addr_t extension_release = find_extension_release();
@@ -2507,6 +4092,7 @@ addr_t find_sfree(void)
 
     func = follow_call64(kernel, call);
     if (!func) return 0;
+    MEMO_SET(sfree, func);
     return func + kerndumpbase;
 }
 
@@ -2540,7 +4126,7 @@ addr_t find_sstrdup(void)
 
 addr_t find_sysent(void)
 {
-    static addr_t sysent = 0;
+    addr_t sysent = MEMO_GET(sysent);
     if (sysent) return sysent + kerndumpbase;
 
     addr_t unix_syscall_return = find_unix_syscall_return();
@@ -2554,6 +4140,7 @@ addr_t find_sysent(void)
 
     sysent = calc64(kernel, unix_syscall_return, csel-12, reg);
     if (!sysent) return 0;
+    MEMO_SET(sysent, sysent);
 
     return sysent + kerndumpbase;
 }
@@ -3144,195 +4731,886 @@ addr_t find_cs_validate_csblob() {
     if (!addr) {
         return 0;
     }
-    
-    return addr + kerndumpbase;
+    
+    return addr + kerndumpbase;
+}
+
+addr_t find_kalloc_canblock() {
+    
+    uint32_t bytes[] = {
+        0xaa0003f3, // mov x19, x0
+        0xf9400274, // ldr x20, [x19]
+        0xf11fbe9f  // cmp x20, #0x7ef
+    };
+    
+    uint64_t addr = (uint64_t)boyermoore_horspool_memmem((unsigned char *)((uint64_t)kernel + xnucore_base), xnucore_size, (const unsigned char *)bytes, sizeof(bytes));
+    if (!addr) {
+        return 0;
+    }
+    addr -= (uint64_t)kernel;
+    
+    addr = bof64(kernel, xnucore_base, addr);
+    if (!addr) {
+        return 0;
+    }
+    
+    return addr + kerndumpbase;
+}
+
+addr_t find_ubc_cs_blob_allocate_site() {
+    uint32_t bytes[] = {
+        0xd2adfc0d,
+        0xf2c0002d
+    };
+    
+    uint64_t addr = (uint64_t)boyermoore_horspool_memmem((unsigned char *)((uint64_t)kernel + xnucore_base), xnucore_size, (const unsigned char *)bytes, sizeof(bytes));
+    if (!addr) {
+        return 0;
+    }
+    addr -= (uint64_t)kernel;
+    
+    uint64_t kalloc = find_kalloc_canblock();
+    if (!kalloc) {
+        return 0;
+    }
+    
+    do {
+        addr = step64(kernel, addr + 4, 1000, INSN_CALL);
+        if (!addr) {
+            return 0;
+        }
+    } while (follow_call64(kernel, addr) + kerndumpbase != kalloc);
+    
+    addr = step64_back(kernel, addr, 20, INSN_ADRP);
+    if (!addr) {
+        return 0;
+    }
+    
+    addr = calc64(kernel, addr, addr + 8, 2);
+    if (!addr) {
+        return 0;
+    }
+    
+    return addr + kerndumpbase;
+}
+
+addr_t find_kfree() {
+    
+    uint32_t bytes[] = {
+        0xaa0103f3,
+        0xaa0003f4,
+        0xf11fbe7f
+    };
+    
+    uint64_t addr = (uint64_t)boyermoore_horspool_memmem((unsigned char *)((uint64_t)kernel + xnucore_base), xnucore_size, (const unsigned char *)bytes, sizeof(bytes));
+    if (!addr) {
+        return 0;
+    }
+    addr -= (uint64_t)kernel;
+    
+    addr = bof64(kernel, xnucore_base, addr);
+    if (!addr) {
+        return 0;
+    }
+    
+    return addr + kerndumpbase;
+}
+
+addr_t find_hook_cred_label_update_execve() {
+    addr_t ref = find_strref("only launchd is allowed to spawn untrusted binaries", 1, string_base_pstring, false, false);
+    
+    if (!ref) {
+        return 0;
+    }
+    
+    ref -= kerndumpbase;
+    
+    uint64_t start = bof64(kernel, prelink_base, ref);
+    
+    if (!start) {
+        return 0;
+    }
+    
+    return start + kerndumpbase;
+}
+
+addr_t find_flow_divert_connect_out() {
+    addr_t ref = find_strref("(%u): Sending saved connect packet\n", 1, string_base_oslstring, false, false);
+    
+    if (!ref) {
+        return 0;
+    }
+    
+    ref -= kerndumpbase;
+    
+    uint64_t start = bof64(kernel, xnucore_base, ref);
+    
+    if (!start) {
+        return 0;
+    }
+    
+    return start + kerndumpbase;
+}
+/*
+ *
+ *
+ *
+ */
+
+#ifndef NOT_DARWIN
+#include <mach-o/nlist.h>
+#else
+#include "mach-o_nlist.h"
+#endif
+
+
+/*
+ * The symbol table is indexed on first use: a hash from name to the first
+ * matching nlist_64 (which is what the old linear scan returned), and the
+ * same entries sorted by address for pf_symbolize().  Concurrent finders
+ * may race to build it; the loser frees its copy.
+ */
+
+struct sym_entry {
+    addr_t addr;
+    const char *name;
+};
+
+struct sym_table {
+    size_t count;
+    struct sym_entry *syms;     /* in symtab order */
+    struct sym_entry *sorted;   /* by address */
+    uint32_t *hash;             /* 1 + first index with that name */
+    uint32_t mask;
+};
+
+static uint32_t
+sym_hash(const char *s)
+{
+    uint32_t h = 2166136261U;
+    while (*s) {
+        h = (h ^ (uint8_t)*s++) * 16777619U;
+    }
+    return h;
+}
+
+static int
+sym_sort_cmp(const void *a, const void *b)
+{
+    const struct sym_entry *x = a;
+    const struct sym_entry *y = b;
+    if (x->addr != y->addr) {
+        return (x->addr > y->addr) - (x->addr < y->addr);
+    }
+    return (x->name > y->name) - (x->name < y->name);
+}
+
+static void
+sym_table_free(struct sym_table *tab)
+{
+    if (tab) {
+        free(tab->syms);
+        free(tab->sorted);
+        free(tab->hash);
+        free(tab);
+    }
+}
+
+static struct sym_table *
+sym_table_build(void)
+{
+    unsigned i;
+    const struct mach_header *hdr = kernel_mh;
+    const uint8_t *q;
+    struct sym_table *tab;
+    size_t cap = 0;
+    size_t j, n;
+
+    if (!IS64(hdr)) {
+        return NULL;
+    }
+    tab = calloc(1, sizeof(*tab));
+    if (!tab) {
+        return NULL;
+    }
+
+    q = (uint8_t *)(hdr + 1) + 4;
+    for (i = 0; i < hdr->ncmds; i++) {
+        const struct load_command *cmd = (struct load_command *)q;
+        if (cmd->cmd == LC_SYMTAB) {
+            const struct symtab_command *sym = (struct symtab_command *)q;
+            const char *stroff = (const char *)kernel + sym->stroff + kernel_delta;
+            const struct nlist_64 *s = (struct nlist_64 *)(kernel + sym->symoff + kernel_delta);
+            uint32_t k;
+            for (k = 0; k < sym->nsyms; k++) {
+                if (s[k].n_type & N_STAB) {
+                    continue;
+                }
+                if (s[k].n_value && (s[k].n_type & N_TYPE) != N_INDR) {
+                    if (tab->count == cap) {
+                        size_t ncap = cap ? cap * 2 : 0x4000;
+                        struct sym_entry *e = realloc(tab->syms, ncap * sizeof(*e));
+                        if (!e) {
+                            goto fail;
+                        }
+                        tab->syms = e;
+                        cap = ncap;
+                    }
+                    tab->syms[tab->count].addr = s[k].n_value;
+                    tab->syms[tab->count].name = stroff + s[k].n_un.n_strx;
+                    tab->count++;
+                }
+            }
+        }
+        q = q + cmd->cmdsize;
+    }
+
+    n = 1;
+    while (n < tab->count * 2) {
+        n <<= 1;
+    }
+    tab->mask = n - 1;
+    tab->hash = calloc(n, sizeof(*tab->hash));
+    tab->sorted = malloc((tab->count + 1) * sizeof(*tab->sorted));
+    if (!tab->hash || !tab->sorted) {
+        goto fail;
+    }
+    for (j = 0; j < tab->count; j++) {
+        uint32_t h = sym_hash(tab->syms[j].name) & tab->mask;
+        while (tab->hash[h] && strcmp(tab->syms[tab->hash[h] - 1].name, tab->syms[j].name)) {
+            h = (h + 1) & tab->mask;
+        }
+        if (!tab->hash[h]) {
+            tab->hash[h] = j + 1;
+        }
+    }
+    memcpy(tab->sorted, tab->syms, tab->count * sizeof(*tab->sorted));
+    qsort(tab->sorted, tab->count, sizeof(*tab->sorted), sym_sort_cmp);
+    return tab;
+
+fail:
+    sym_table_free(tab);
+    return NULL;
+}
+
+static const struct sym_table *
+get_sym_table(void)
+{
+    struct sym_table *tab = __atomic_load_n(&kernel_syms, __ATOMIC_ACQUIRE);
+    if (!tab) {
+        tab = sym_table_build();
+        if (!tab) {
+            return NULL;
+        }
+        if (!__sync_bool_compare_and_swap(&kernel_syms, NULL, tab)) {
+            sym_table_free(tab);
+            tab = kernel_syms;
+        }
+    }
+    return tab;
+}
+
+static void
+free_sym_table(void)
+{
+    sym_table_free(kernel_syms);
+    kernel_syms = NULL;
+}
+
+addr_t
+find_symbol(const char *symbol)
+{
+    const struct sym_table *tab;
+    uint32_t h;
+
+    if (!symbol) {
+        return 0;
+    }
+
+/* XXX will only work on a decrypted kernel */
+    if (!kernel_delta) {
+        return 0;
+    }
+
+    tab = get_sym_table();
+    if (!tab) {
+        return 0;
+    }
+    h = sym_hash(symbol) & tab->mask;
+    while (tab->hash[h]) {
+        const struct sym_entry *e = &tab->syms[tab->hash[h] - 1];
+        if (!strcmp(symbol, e->name)) {
+            /* XXX this is an unslid address */
+            return e->addr;
+        }
+        h = (h + 1) & tab->mask;
+    }
+    return 0;
+}
+
+static const char *
+symbolize(addr_t addr, addr_t *offset)
+{
+    const struct sym_table *tab;
+    size_t lo = 0, hi;
+
+    if (!kernel_delta) {
+        return NULL;
+    }
+    tab = get_sym_table();
+    if (!tab) {
+        return NULL;
+    }
+    hi = tab->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tab->sorted[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    if (offset) {
+        *offset = addr - tab->sorted[lo - 1].addr;
+    }
+    return tab->sorted[lo - 1].name;
+}
+
+/* offset cache **************************************************************/
+
+/*
+ * With offset_cache_dir set, pf_open() hashes the image (SHA-256 of every
+ * loaded segment, which covers whatever a finder can read) and loads what
+ * the previous run stored in <dir>/<digest>.pfc.  The pf_find_*() wrappers
+ * and pf_run_all() answer from it and remember new results, which
+ * pf_close() writes back.  Files with another version or digest are simply
+ * ignored, and then overwritten.
+ */
+
+#define PF_CACHE_MAGIC   0x636f6670    /* 'pfoc' */
+/* bump whenever a finder may return something different for the same image */
+#define PF_CACHE_VERSION 3
+
+typedef addr_t (*pf_finder_t)(void);
+
+enum {
+#define PF_FINDER_ID(name) PF_ID_ ##name,
+    PF_FINDERS(PF_FINDER_ID)
+#undef PF_FINDER_ID
+    PF_NFINDERS
+};
+
+static const struct {
+    const char *name;
+    pf_finder_t fn;
+} pf_finders[] = {
+#define PF_FINDER_ENTRY(name) { #name, find_ ##name },
+    PF_FINDERS(PF_FINDER_ENTRY)
+#undef PF_FINDER_ENTRY
+};
+
+static int
+pf_lookup_finder(const char *name)
+{
+    int i;
+    for (i = 0; i < PF_NFINDERS; i++) {
+        if (!strcmp(pf_finders[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct pf_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t digest[32];
+    uint32_t count;
+};
+
+struct pf_cache_entry {
+    char name[56];
+    uint64_t addr;
+};
+
+struct pf_cache {
+    char path[1024];
+    addr_t addr[PF_NFINDERS];
+    uint8_t known[PF_NFINDERS];
+    uint8_t digest[32];
+    bool dirty;
+};
+
+#ifndef NOT_DARWIN
+#include <CommonCrypto/CommonDigest.h>
+#define SHA256_CTX      CC_SHA256_CTX
+#define SHA256_Init     CC_SHA256_Init
+#define SHA256_Update(c, p, n) CC_SHA256_Update(c, p, (CC_LONG)(n))
+#define SHA256_Final    CC_SHA256_Final
+#else
+/* no CommonCrypto here, so carry a plain FIPS 180-4 implementation */
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+} SHA256_CTX;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(SHA256_CTX *c, const uint8_t *p)
+{
+    uint32_t w[64], a, b, cc, d, e, f, g, h;
+    unsigned i;
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+    e = c->h[4]; f = c->h[5]; g = c->h[6]; h = c->h[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g; g = f; f = e; e = d + t1;
+        d = cc; cc = b; b = a; a = t1 + t2;
+    }
+    c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+    c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
 }
 
-addr_t find_kalloc_canblock() {
-    
-    uint32_t bytes[] = {
-        0xaa0003f3, // mov x19, x0
-        0xf9400274, // ldr x20, [x19]
-        0xf11fbe9f  // cmp x20, #0x7ef
+static void
+SHA256_Init(SHA256_CTX *c)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
     };
-    
-    uint64_t addr = (uint64_t)boyermoore_horspool_memmem((unsigned char *)((uint64_t)kernel + xnucore_base), xnucore_size, (const unsigned char *)bytes, sizeof(bytes));
-    if (!addr) {
-        return 0;
-    }
-    addr -= (uint64_t)kernel;
-    
-    addr = bof64(kernel, xnucore_base, addr);
-    if (!addr) {
-        return 0;
+    memcpy(c->h, iv, sizeof(iv));
+    c->len = 0;
+}
+
+static void
+SHA256_Update(SHA256_CTX *c, const void *data, size_t n)
+{
+    const uint8_t *p = data;
+    while (n) {
+        size_t used = c->len & 63;
+        size_t take = 64 - used < n ? 64 - used : n;
+        memcpy(c->buf + used, p, take);
+        c->len += take;
+        p += take;
+        n -= take;
+        if ((c->len & 63) == 0) {
+            sha256_block(c, c->buf);
+        }
     }
-    
-    return addr + kerndumpbase;
 }
 
-addr_t find_ubc_cs_blob_allocate_site() {
-    uint32_t bytes[] = {
-        0xd2adfc0d,
-        0xf2c0002d
-    };
-    
-    uint64_t addr = (uint64_t)boyermoore_horspool_memmem((unsigned char *)((uint64_t)kernel + xnucore_base), xnucore_size, (const unsigned char *)bytes, sizeof(bytes));
-    if (!addr) {
-        return 0;
+static void
+SHA256_Final(uint8_t *md, SHA256_CTX *c)
+{
+    uint64_t bits = c->len * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t n = ((c->len & 63) < 56 ? 56 : 120) - (c->len & 63);
+    unsigned i;
+    for (i = 0; i < 8; i++) {
+        pad[n + i] = (uint8_t)(bits >> (56 - 8 * i));
     }
-    addr -= (uint64_t)kernel;
-    
-    uint64_t kalloc = find_kalloc_canblock();
-    if (!kalloc) {
-        return 0;
+    SHA256_Update(c, pad, n + 8);
+    for (i = 0; i < 32; i++) {
+        md[i] = (uint8_t)(c->h[i / 4] >> (24 - 8 * (i % 4)));
     }
-    
-    do {
-        addr = step64(kernel, addr + 4, 1000, INSN_CALL);
-        if (!addr) {
-            return 0;
+}
+#endif
+
+void
+pf_sha256(const void *data, size_t len, uint8_t digest[32])
+{
+    SHA256_CTX c;
+    SHA256_Init(&c);
+    SHA256_Update(&c, data, len);
+    SHA256_Final(digest, &c);
+}
+
+static void
+image_digest(uint8_t digest[32])
+{
+    /*
+     * The whole span, header included: finders follow pointers into any
+     * segment, so a digest of the header and __TEXT_EXEC alone would serve
+     * stale offsets for an image whose strings or data changed.  With
+     * use_kernel_mmap this faults in every page of the image once: a cache
+     * hit costs one sequential read and hash of the whole file.
+     */
+    pf_sha256(kernel, kernel_size, digest);
+}
+
+static void
+pf_cache_open(void)
+{
+    struct pf_cache *cache = calloc(1, sizeof(*cache));
+    struct pf_cache_header h;
+    struct pf_cache_entry e;
+    char hex[65];
+    FILE *f;
+    unsigned i;
+
+    if (!cache) {
+        return;
+    }
+    image_digest(cache->digest);
+    for (i = 0; i < 32; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", cache->digest[i]);
+    }
+    snprintf(cache->path, sizeof(cache->path), "%s/%s.pfc", offset_cache_dir, hex);
+    offset_cache = cache;
+
+    f = fopen(cache->path, "rb");
+    if (!f) {
+        return;
+    }
+    if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == PF_CACHE_MAGIC && h.version == PF_CACHE_VERSION &&
+        !memcmp(h.digest, cache->digest, sizeof(h.digest))) {
+        for (i = 0; i < h.count && fread(&e, sizeof(e), 1, f) == 1; i++) {
+            int id;
+            e.name[sizeof(e.name) - 1] = '\0';
+            id = pf_lookup_finder(e.name);
+            if (id >= 0) {
+                cache->addr[id] = e.addr;
+                cache->known[id] = 1;
+            }
         }
-    } while (follow_call64(kernel, addr) + kerndumpbase != kalloc);
-    
-    addr = step64_back(kernel, addr, 20, INSN_ADRP);
-    if (!addr) {
-        return 0;
-    }
-    
-    addr = calc64(kernel, addr, addr + 8, 2);
-    if (!addr) {
-        return 0;
     }
-    
-    return addr + kerndumpbase;
+    fclose(f);
 }
 
-addr_t find_kfree() {
-    
-    uint32_t bytes[] = {
-        0xaa0103f3,
-        0xaa0003f4,
-        0xf11fbe7f
-    };
-    
-    uint64_t addr = (uint64_t)boyermoore_horspool_memmem((unsigned char *)((uint64_t)kernel + xnucore_base), xnucore_size, (const unsigned char *)bytes, sizeof(bytes));
-    if (!addr) {
-        return 0;
+/*
+ * A unique temp file next to the cache file: two processes, or two pf_ctx
+ * on the same image, may close at once and must not write into each
+ * other's copy before the rename.
+ */
+static FILE *
+pf_cache_tmpfile(char *tmp, size_t size, const char *path)
+{
+    FILE *f = NULL;
+    int fd;
+    snprintf(tmp, size, "%s.XXXXXX", path);
+#ifndef _WIN32
+    if ((fd = mkstemp(tmp)) >= 0 && !(f = fdopen(fd, "wb"))) {
+        close(fd);
+        unlink(tmp);
     }
-    addr -= (uint64_t)kernel;
-    
-    addr = bof64(kernel, xnucore_base, addr);
-    if (!addr) {
-        return 0;
+#else
+    if (_mktemp_s(tmp, strlen(tmp) + 1) == 0 && (fd = _open(tmp, _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, 0644)) >= 0 &&
+        !(f = _fdopen(fd, "wb"))) {
+        _close(fd);
+        unlink(tmp);
     }
-    
-    return addr + kerndumpbase;
+#endif
+    return f;
 }
 
-addr_t find_hook_cred_label_update_execve() {
-    addr_t ref = find_strref("only launchd is allowed to spawn untrusted binaries", 1, string_base_pstring, false, false);
-    
-    if (!ref) {
-        return 0;
-    }
-    
-    ref -= kerndumpbase;
-    
-    uint64_t start = bof64(kernel, prelink_base, ref);
-    
-    if (!start) {
-        return 0;
+static void
+pf_cache_close(void)
+{
+    struct pf_cache *cache = offset_cache;
+    struct pf_cache_header h;
+    char tmp[sizeof(cache->path) + 8];
+    FILE *f;
+    int i;
+
+    if (!cache) {
+        return;
+    }
+    offset_cache = NULL;
+    if (cache->dirty) {
+        f = pf_cache_tmpfile(tmp, sizeof(tmp), cache->path);
+        if (f) {
+            int ok;
+            memset(&h, 0, sizeof(h));
+            h.magic = PF_CACHE_MAGIC;
+            h.version = PF_CACHE_VERSION;
+            memcpy(h.digest, cache->digest, sizeof(h.digest));
+            for (i = 0; i < PF_NFINDERS; i++) {
+                h.count += cache->known[i];
+            }
+            ok = fwrite(&h, sizeof(h), 1, f) == 1;
+            for (i = 0; ok && i < PF_NFINDERS; i++) {
+                struct pf_cache_entry e;
+                if (!cache->known[i]) {
+                    continue;
+                }
+                memset(&e, 0, sizeof(e));
+                strncpy(e.name, pf_finders[i].name, sizeof(e.name) - 1);
+                e.addr = cache->addr[i];
+                ok = fwrite(&e, sizeof(e), 1, f) == 1;
+            }
+            if (fclose(f) == 0 && ok) {
+                rename(tmp, cache->path);
+            } else {
+                unlink(tmp);
+            }
+        }
     }
-    
-    return start + kerndumpbase;
+    free(cache);
 }
 
-addr_t find_flow_divert_connect_out() {
-    addr_t ref = find_strref("(%u): Sending saved connect packet\n", 1, string_base_oslstring, false, false);
-    
-    if (!ref) {
-        return 0;
+static addr_t
+pf_cached(int id)
+{
+    /* runs with pf_cur set to the context being queried, possibly on several workers at once */
+    struct pf_cache *cache = offset_cache;
+    addr_t addr;
+    if (cache && __atomic_load_n(&cache->known[id], __ATOMIC_ACQUIRE)) {
+        return __atomic_load_n(&cache->addr[id], __ATOMIC_RELAXED);
     }
-    
-    ref -= kerndumpbase;
-    
-    uint64_t start = bof64(kernel, xnucore_base, ref);
-    
-    if (!start) {
-        return 0;
+    addr = pf_finders[id].fn();
+    if (cache) {
+        __atomic_store_n(&cache->addr[id], addr, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->known[id], 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&cache->dirty, true, __ATOMIC_RELAXED);
     }
-    
-    return start + kerndumpbase;
+    return addr;
 }
-/*
- *
- *
- *
- */
 
-#ifndef NOT_DARWIN
-#include <mach-o/nlist.h>
-#else
-#include "mach-o_nlist.h"
-#endif
+/* pf_ctx wrappers ***********************************************************/
+
+#define PF_WITH(ctx, type, expr) do { \
+    struct pf_ctx *saved = pf_cur; \
+    type rv; \
+    pf_cur = (ctx); \
+    rv = (expr); \
+    pf_cur = saved; \
+    return rv; \
+} while (false)
 
+#define PF_DEFINE_FINDER(name) \
+addr_t \
+pf_find_ ##name(pf_ctx *ctx) \
+{ \
+    PF_WITH(ctx, addr_t, pf_cached(PF_ID_ ##name)); \
+}
+PF_FINDERS(PF_DEFINE_FINDER)
+#undef PF_DEFINE_FINDER
 
 addr_t
-find_symbol(const char *symbol)
+pf_find_register_value(pf_ctx *ctx, addr_t where, int reg)
 {
-    if (!symbol) {
-        return 0;
-    }
-    
-    unsigned i;
-    const struct mach_header *hdr = kernel_mh;
-    const uint8_t *q;
-    int is64 = 0;
+    PF_WITH(ctx, addr_t, find_register_value(where, reg));
+}
 
-    if (IS64(hdr)) {
-        is64 = 4;
+addr_t
+pf_find_reference(pf_ctx *ctx, addr_t to, int n, enum text_bases base)
+{
+    PF_WITH(ctx, addr_t, find_reference(to, n, base));
+}
+
+addr_t
+pf_find_strref(pf_ctx *ctx, const char *string, int n, enum string_bases string_base, bool full_match, bool in_ppl)
+{
+    PF_WITH(ctx, addr_t, find_strref(string, n, string_base, full_match, in_ppl));
+}
+
+addr_t
+pf_find_str(pf_ctx *ctx, const char *string)
+{
+    PF_WITH(ctx, addr_t, find_str(string));
+}
+
+addr_t
+pf_find_syscall(pf_ctx *ctx, int n)
+{
+    PF_WITH(ctx, addr_t, find_syscall(n));
+}
+
+addr_t
+pf_find_mpo_entry(pf_ctx *ctx, addr_t offset)
+{
+    PF_WITH(ctx, addr_t, find_mpo_entry(offset));
+}
+
+addr_t
+pf_find_hook_policy_syscall(pf_ctx *ctx, int n)
+{
+    PF_WITH(ctx, addr_t, find_hook_policy_syscall(n));
+}
+
+addr_t
+pf_find_sandbox_handler(pf_ctx *ctx, const char *name)
+{
+    PF_WITH(ctx, addr_t, find_sandbox_handler(name));
+}
+
+addr_t
+pf_find_symbol(pf_ctx *ctx, const char *symbol)
+{
+    PF_WITH(ctx, addr_t, find_symbol(symbol));
+}
+
+const unsigned char *
+pf_find_mh(pf_ctx *ctx)
+{
+    PF_WITH(ctx, const unsigned char *, find_mh());
+}
+
+const char *
+pf_symbolize(pf_ctx *ctx, addr_t addr, addr_t *offset)
+{
+    PF_WITH(ctx, const char *, symbolize(addr, offset));
+}
+
+/* parallel driver ***********************************************************/
+
+struct pf_job {
+    pf_ctx *ctx;
+    const char *const *names;
+    struct pf_result *results;
+    size_t count;
+    size_t next;
+};
+
+static void *
+pf_worker(void *arg)
+{
+    struct pf_job *job = arg;
+    size_t i;
+    pf_cur = job->ctx;
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+        int id = pf_lookup_finder(job->names[i]);
+        job->results[i].name = job->names[i];
+        job->results[i].addr = id >= 0 ? pf_cached(id) : 0;
     }
+    return NULL;
+}
 
-/* XXX will only work on a decrypted kernel */
-    if (!kernel_delta) {
-        return 0;
+int
+pf_run_all(pf_ctx *ctx, const char *const *names, size_t count, unsigned nthreads, struct pf_result *results)
+{
+    struct pf_job job;
+    size_t i;
+    int rv = 0;
+
+    for (i = 0; i < count; i++) {
+        if (pf_lookup_finder(names[i]) < 0) {
+            rv = -1;
+        }
     }
 
-    /* XXX I should cache these.  ohwell... */
-    q = (uint8_t *)(hdr + 1) + is64;
-    for (i = 0; i < hdr->ncmds; i++) {
-        const struct load_command *cmd = (struct load_command *)q;
-        if (cmd->cmd == LC_SYMTAB) {
-            const struct symtab_command *sym = (struct symtab_command *)q;
-            const char *stroff = (const char *)kernel + sym->stroff + kernel_delta;
-            if (is64) {
-                uint32_t k;
-                const struct nlist_64 *s = (struct nlist_64 *)(kernel + sym->symoff + kernel_delta);
-                for (k = 0; k < sym->nsyms; k++) {
-                    if (s[k].n_type & N_STAB) {
-                        continue;
-                    }
-                    if (s[k].n_value && (s[k].n_type & N_TYPE) != N_INDR) {
-                        if (!strcmp(symbol, stroff + s[k].n_un.n_strx)) {
-                            /* XXX this is an unslid address */
-                            return s[k].n_value;
-                        }
-                    }
+    job.ctx = ctx;
+    job.names = names;
+    job.results = results;
+    job.count = count;
+    job.next = 0;
+
+#ifndef _WIN32
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (unsigned)ncpu : 1;
+    }
+    if (nthreads > count) {
+        nthreads = (unsigned)count;
+    }
+    if (nthreads > 1) {
+        pthread_t *threads = calloc(nthreads, sizeof(*threads));
+        unsigned started = 0;
+        if (threads) {
+            for (started = 0; started < nthreads; started++) {
+                if (pthread_create(&threads[started], NULL, pf_worker, &job) != 0) {
+                    break;
                 }
             }
+            for (i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            free(threads);
+        }
+        if (started > 0) {
+            return rv;
         }
-        q = q + cmd->cmdsize;
     }
-    return 0;
+#endif
+    /* single thread, or no thread could be started */
+    struct pf_ctx *saved = pf_cur;
+    pf_worker(&job);
+    pf_cur = saved;
+    return rv;
 }
 
 #ifdef HAVE_MAIN
 
+#include <sys/stat.h>
+#include <time.h>
+
+static void
+bench_scan64(const uint8_t *buf, addr_t start, addr_t end)
+{
+    /* a word that should not occur, so every pass covers the whole range */
+    static const struct insn_pat none = { 0x00000001, 0xFFFFFFFF };
+    static const struct insn_pat defs[] = {
+        { 0x90000000, 0x9F000000 },
+        { 0x91000000, 0xFF000000 },
+        { 0xF9400000, 0xF9C00000 },
+        { 0x10000000, 0x9F000000 },
+        { 0x58000000, 0xFF000000 },
+        { 0x94000000, 0xFC000000 },
+    };
+    const unsigned passes = 16;
+    size_t i;
+    unsigned j;
+
+    for (i = 0; i < sizeof(scan64_impls) / sizeof(scan64_impls[0]); i++) {
+        const struct scan64_impl *impl = &scan64_impls[i];
+        clock_t t0, t1, t2;
+        unsigned runs = 0;
+        addr_t at, pos;
+        if (!scan64_supported(impl)) {
+            continue;
+        }
+        t0 = clock();
+        for (j = 0; j < passes; j++) {
+            impl->fwd(buf, start, end, &none, 1, &at);
+        }
+        t1 = clock();
+        for (j = 0; j < passes; j++) {
+            for (pos = start; pos + 64 <= end; pos += 64) {
+                runs += __builtin_popcount(impl->mask(buf + pos, defs, sizeof(defs) / sizeof(defs[0])));
+            }
+        }
+        t2 = clock();
+        printf("%-6s step64 %8.1f MB/s, xref64 prefilter %8.1f MB/s (%u candidates/pass)\n", impl->name,
+               (double)(end - start) * passes / 1e6 / ((double)(t1 - t0) / CLOCKS_PER_SEC + 1e-9),
+               (double)(end - start) * passes / 1e6 / ((double)(t2 - t1) / CLOCKS_PER_SEC + 1e-9),
+               runs / passes);
+    }
+}
+
 int
 main(int argc, char **argv)
 {
+    bool bench = false;
+    bool cache = true;
+    char cache_dir[1024];
+    int arg;
+
     if (argc < 2) {
-        printf("Usage: patchfinder64 _decompressed_kernel_image_\n");
+        printf("Usage: patchfinder64 _decompressed_kernel_image_ [--bench] [--no-cache]\n");
         printf("iOS ARM64 kernel patchfinder\n");
         exit(EXIT_FAILURE);
     }
@@ -3340,27 +5618,57 @@ main(int argc, char **argv)
         printf("%s: %s\n", argv[1], strerror(errno));
         exit(EXIT_FAILURE);
     }
-    int rv;
-    addr_t kernel_base = 0;
-    const addr_t vm_kernel_slide = 0;
-    if (init_kernel(NULL, kernel_base, argv[1]) != 0) {
+    for (arg = 2; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--bench")) {
+            bench = true;
+        } else if (!strcmp(argv[arg], "--no-cache")) {
+            /* PASS/FAIL straight from the finders, after changing one */
+            cache = false;
+        }
+    }
+    if (cache) {
+        /* $PF_CACHE_DIR, or ~/.patchfinder64 */
+        const char *dir = getenv("PF_CACHE_DIR");
+        const char *home = getenv("HOME");
+        if (dir) {
+            snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+        } else {
+            snprintf(cache_dir, sizeof(cache_dir), "%s/.patchfinder64", home ? home : ".");
+        }
+#ifndef _WIN32
+        mkdir(cache_dir, 0755);
+#endif
+        offset_cache_dir = cache_dir;
+    }
+    use_xref_index = true;
+    use_string_index = true;
+    use_func_map = true;
+    pf_ctx *ctx = pf_open(argv[1]);
+    if (!ctx) {
         printf("Failed to prepare kernel\n");
         exit(EXIT_FAILURE);
     }
 
-#define FIND(name) do { \
-    addr_t patchfinder_offset = find_ ##name (); \
-    printf("%s: PF=0x%llx - %s\n", #name, patchfinder_offset, (patchfinder_offset != 0 && patchfinder_offset != kerndumpbase)? "PASS" : "FAIL"); \
-} while(false)
-#define CHECK(name) do { \
-    addr_t actual_offset = find_symbol("_" #name); \
-    if (actual_offset == 0) { \
-        FIND(name); \
-    } else { \
-        addr_t patchfinder_offset = find_ ##name (); \
-        printf("%s: PF=0x%llx - AS=0x%llx - %s\n", #name, patchfinder_offset, actual_offset, ((actual_offset==0?patchfinder_offset!=0:patchfinder_offset == actual_offset) ? "PASS" : "FAIL")); \
+    if (bench) {
+        pf_cur = ctx;
+        bench_scan64(kernel, xnucore_base, xnucore_base + xnucore_size);
+        pf_cur = &pf_default;
+        pf_close(ctx);
+        return EXIT_SUCCESS;
+    }
+
+    /* collect the finders first, run them in parallel, then report in order */
+    const char *names[PF_NFINDERS];
+    struct pf_result results[PF_NFINDERS];
+    size_t count = 0, i;
+    /* PF_ID_ rejects names that are not finders; only a repeated name could overflow */
+#define CHECK(finder) do { \
+    if (count == PF_NFINDERS) { \
+        printf("CHECK(" #finder "): more checks than finders\n"); \
+        exit(EXIT_FAILURE); \
     } \
-} while(false)
+    names[count++] = pf_finders[PF_ID_ ##finder].name; \
+} while (false)
     
     CHECK(syscall_check_sandbox);
     CHECK(IOMalloc);
@@ -3415,7 +5723,7 @@ main(int argc, char **argv)
     CHECK(mount_common);
     CHECK(fs_snapshot);
     CHECK(vnode_get_snapshot);
-    if (auth_ptrs) {
+    if (pf_auth_ptrs(ctx)) {
         CHECK(paciza_pointer__l2tp_domain_module_start);
         CHECK(paciza_pointer__l2tp_domain_module_stop);
         CHECK(l2tp_domain_inited);
@@ -3438,8 +5746,33 @@ main(int argc, char **argv)
     CHECK(kfree);
     CHECK(hook_cred_label_update_execve);
     CHECK(flow_divert_connect_out);
-    
-    term_kernel();
+
+    pf_run_all(ctx, names, count, 0, results);
+
+    pf_cur = ctx;
+    for (i = 0; i < count; i++) {
+        char symbol[128];
+        addr_t patchfinder_offset = results[i].addr;
+        snprintf(symbol, sizeof(symbol), "_%s", results[i].name);
+        addr_t actual_offset = find_symbol(symbol);
+        if (actual_offset == 0) {
+            printf("%s: PF=0x%llx - %s\n", results[i].name, patchfinder_offset, (patchfinder_offset != 0 && patchfinder_offset != kerndumpbase)? "PASS" : "FAIL");
+        } else {
+            const char *found = NULL;
+            addr_t delta = 0;
+            if (patchfinder_offset != actual_offset) {
+                found = symbolize(patchfinder_offset, &delta);
+            }
+            if (found) {
+                printf("%s: PF=0x%llx (%s+0x%llx) - AS=0x%llx - FAIL\n", results[i].name, patchfinder_offset, found, delta, actual_offset);
+            } else {
+                printf("%s: PF=0x%llx - AS=0x%llx - %s\n", results[i].name, patchfinder_offset, actual_offset, ((actual_offset==0?patchfinder_offset!=0:patchfinder_offset == actual_offset) ? "PASS" : "FAIL"));
+            }
+        }
+    }
+    pf_cur = &pf_default;
+
+    pf_close(ctx);
     return EXIT_SUCCESS;
 }
 
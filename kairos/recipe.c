@@ -0,0 +1,275 @@
+/*
+ * recipe.c - record a patch run once, replay it on the same image without analysis
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "recipe.h"
+
+// unchanged bytes between two edits closer than this are folded into one edit
+#define RECIPE_MERGE_GAP 8
+
+struct recipe_header {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t digest[32];
+	uint8_t key[32];
+	uint32_t VERS;
+	uint32_t minor_vers;
+	struct iboot64_bootargs_slot slot;
+	uint32_t count;
+};
+
+struct recipe_edit_header {
+	uint32_t off;
+	uint32_t len;
+};
+
+// boot-args as patch_boot_args64() ends up writing them
+static size_t bootargs_len(const char* bootargs, int* num) {
+	size_t len = strlen(bootargs);
+	*num = 1;
+	if(len > 270) {
+		len = 270;
+		*num = 0;
+	}
+	return len;
+}
+
+void recipe_key(const char* bootargs, bool bootargsOnly, const char* command, uint64_t commandPtr, bool nvramUnlock, uint8_t key[32]) {
+	char desc[512];
+	int num = 1;
+	// the boot-args text itself is a parameter of the recipe, only its size class changes what gets patched
+	int large = bootargs ? (bootargs_len(bootargs,&num) < 87) : 0;
+	snprintf(desc,sizeof(desc),"bootargs=%d large=%d only=%d nvram=%d cmd=%s ptr=0x%llx",
+		bootargs != NULL,large,bootargs && bootargsOnly,nvramUnlock,
+		(command && commandPtr) ? command : "",(command && commandPtr) ? (unsigned long long)commandPtr : 0ULL);
+	pf_sha256(desc,strlen(desc),key);
+}
+
+static int push_edit(struct kairos_recipe* r, uint32_t* cap, const uint8_t* orig, const uint8_t* patched, uint32_t off, uint32_t len) {
+	if(r->count == *cap) {
+		uint32_t ncap = *cap ? *cap * 2 : 16;
+		struct recipe_edit* n = (struct recipe_edit*)realloc(r->edits,ncap*sizeof(struct recipe_edit));
+		if(!n)
+			return -1;
+		r->edits = n;
+		*cap = ncap;
+	}
+	struct recipe_edit* e = &r->edits[r->count];
+	e->off = off;
+	e->len = len;
+	e->orig = (uint8_t*)malloc(len);
+	e->patched = (uint8_t*)malloc(len);
+	if(!e->orig || !e->patched) {
+		free(e->orig);
+		free(e->patched);
+		return -1;
+	}
+	memcpy(e->orig,orig+off,len);
+	memcpy(e->patched,patched+off,len);
+	r->count++;
+	return 0;
+}
+
+static bool in_slot(const struct iboot64_bootargs_slot* slot, size_t i) {
+	return slot->set && i >= slot->off && i < (size_t)slot->off + slot->written;
+}
+
+// everything that differs between orig and the patched image, except the boot-args text
+int recipe_diff(struct kairos_recipe* r, const uint8_t* orig, const struct iboot64_img* patched) {
+	const uint8_t* now = (const uint8_t*)patched->buf;
+	const struct iboot64_bootargs_slot slotCopy = patched->bootargs_slot; // iboot64_img is packed
+	const struct iboot64_bootargs_slot* slot = &slotCopy;
+	size_t len = patched->len;
+	uint32_t cap = 0;
+	size_t i = 0;
+	r->VERS = patched->VERS;
+	r->minor_vers = patched->minor_vers;
+	r->slot = *slot;
+	r->count = 0;
+	r->edits = NULL;
+	while(i < len) {
+		if(orig[i] == now[i] || in_slot(slot,i)) {
+			i++;
+			continue;
+		}
+		// grow the edit over short unchanged stretches, but never into the boot-args text
+		size_t start = i, end = i + 1;
+		for(i++; i < len && i - end < RECIPE_MERGE_GAP && !in_slot(slot,i); i++) {
+			if(orig[i] != now[i])
+				end = i + 1;
+		}
+		i = end;
+		if(push_edit(r,&cap,orig,now,(uint32_t)start,(uint32_t)(end-start)) < 0) {
+			recipe_free(r);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// checks every edit against the image before writing anything; -1 leaves the image untouched
+int recipe_apply(const struct kairos_recipe* r, struct iboot64_img* iboot_in, const char* bootargs) {
+	uint8_t* buf = (uint8_t*)iboot_in->buf;
+	size_t textLen = 0;
+	int num = 1;
+	if(r->slot.set) {
+		if(!bootargs)
+			return -1;
+		textLen = bootargs_len(bootargs,&num);
+		if((textLen < 87) != r->slot.large_area)
+			return -1;
+		if((size_t)r->slot.off + r->slot.fill_len > iboot_in->len || (size_t)r->slot.off + textLen + num > iboot_in->len)
+			return -1;
+	}
+	for(uint32_t i = 0; i < r->count; i++) {
+		const struct recipe_edit* e = &r->edits[i];
+		if((size_t)e->off + e->len > iboot_in->len || memcmp(buf+e->off,e->orig,e->len) != 0) {
+			WARN("Patch recipe does not match image at 0x%x\n",e->off);
+			return -1;
+		}
+	}
+	for(uint32_t i = 0; i < r->count; i++)
+		memcpy(buf+r->edits[i].off,r->edits[i].patched,r->edits[i].len);
+	if(r->slot.set) {
+		memset(buf+r->slot.off,r->slot.fill,r->slot.fill_len);
+		memcpy(buf+r->slot.off,bootargs,textLen);
+		if(num)
+			buf[r->slot.off+textLen] = '\0';
+		iboot_in->bootargs_slot = r->slot;
+	}
+	iboot_in->VERS = r->VERS;
+	iboot_in->minor_vers = r->minor_vers;
+	return 0;
+}
+
+static void recipe_path(char* path, size_t size, const char* dir, const uint8_t digest[32], const uint8_t key[32]) {
+	char hex[65 + 17];
+	for(int i = 0; i < 32; i++)
+		snprintf(hex+2*i,3,"%02x",digest[i]);
+	hex[64] = '-';
+	for(int i = 0; i < 8; i++)
+		snprintf(hex+65+2*i,3,"%02x",key[i]);
+	snprintf(path,size,"%s/%s.krc",dir,hex);
+}
+
+int recipe_load(struct kairos_recipe* r, const char* dir, const uint8_t digest[32], const uint8_t key[32]) {
+	char path[1024];
+	struct recipe_header h;
+	uint32_t cap = 0;
+	memset(r,0,sizeof(*r));
+	recipe_path(path,sizeof(path),dir,digest,key);
+	FILE* f = fopen(path,"rb");
+	if(!f)
+		return -1;
+	if(fread(&h,sizeof(h),1,f) != 1 || h.magic != RECIPE_MAGIC || h.version != RECIPE_VERSION ||
+	   memcmp(h.digest,digest,32) != 0 || memcmp(h.key,key,32) != 0) {
+		fclose(f);
+		return -1;
+	}
+	memcpy(r->digest,h.digest,32);
+	memcpy(r->key,h.key,32);
+	r->VERS = h.VERS;
+	r->minor_vers = h.minor_vers;
+	r->slot = h.slot;
+	for(uint32_t i = 0; i < h.count; i++) {
+		struct recipe_edit_header eh;
+		if(fread(&eh,sizeof(eh),1,f) != 1 || !eh.len || eh.len > (1 << 24))
+			goto fail;
+		if(r->count == cap) {
+			uint32_t ncap = cap ? cap * 2 : 16;
+			struct recipe_edit* n = (struct recipe_edit*)realloc(r->edits,ncap*sizeof(struct recipe_edit));
+			if(!n)
+				goto fail;
+			r->edits = n;
+			cap = ncap;
+		}
+		struct recipe_edit* e = &r->edits[r->count];
+		e->off = eh.off;
+		e->len = eh.len;
+		e->orig = (uint8_t*)malloc(eh.len);
+		e->patched = (uint8_t*)malloc(eh.len);
+		if(!e->orig || !e->patched) {
+			free(e->orig);
+			free(e->patched);
+			goto fail;
+		}
+		r->count++;
+		if(fread(e->orig,1,eh.len,f) != eh.len || fread(e->patched,1,eh.len,f) != eh.len)
+			goto fail;
+	}
+	fclose(f);
+	return 0;
+fail:
+	fclose(f);
+	recipe_free(r);
+	return -1;
+}
+
+int recipe_save(const struct kairos_recipe* r, const char* dir) {
+	char path[1024];
+	char tmp[sizeof(path) + 8];
+	struct recipe_header h;
+	recipe_path(path,sizeof(path),dir,r->digest,r->key);
+	// a unique temp file: two processes may save the same recipe at once
+	snprintf(tmp,sizeof(tmp),"%s.XXXXXX",path);
+	int fd = mkstemp(tmp);
+	if(fd < 0)
+		return -1;
+	FILE* f = fdopen(fd,"wb");
+	if(!f) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	memset(&h,0,sizeof(h));
+	h.magic = RECIPE_MAGIC;
+	h.version = RECIPE_VERSION;
+	memcpy(h.digest,r->digest,32);
+	memcpy(h.key,r->key,32);
+	h.VERS = r->VERS;
+	h.minor_vers = r->minor_vers;
+	h.slot = r->slot;
+	h.count = r->count;
+	int ok = fwrite(&h,sizeof(h),1,f) == 1;
+	for(uint32_t i = 0; ok && i < r->count; i++) {
+		struct recipe_edit_header eh = { r->edits[i].off, r->edits[i].len };
+		ok = fwrite(&eh,sizeof(eh),1,f) == 1 &&
+		     fwrite(r->edits[i].orig,1,eh.len,f) == eh.len &&
+		     fwrite(r->edits[i].patched,1,eh.len,f) == eh.len;
+	}
+	if(fclose(f) == 0 && ok && rename(tmp,path) == 0)
+		return 0;
+	unlink(tmp);
+	return -1;
+}
+
+void recipe_free(struct kairos_recipe* r) {
+	for(uint32_t i = 0; i < r->count; i++) {
+		free(r->edits[i].orig);
+		free(r->edits[i].patched);
+	}
+	free(r->edits);
+	r->edits = NULL;
+	r->count = 0;
+}
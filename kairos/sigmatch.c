@@ -0,0 +1,254 @@
+/*
+ * sigmatch.c - single-pass matching of many instruction-sequence signatures
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "sigmatch.h"
+
+#define SIG_NTYPES (ccmp + 1)
+
+/*
+ * Compiled form. Every word is decoded exactly once; the root of the
+ * automaton is a per-class table of signatures whose first element can
+ * start on that class (plus the ones whose first element is class-agnostic),
+ * so a word that starts nothing costs one decode and one empty lookup no
+ * matter how many signatures are loaded. Partial matches then run as a set
+ * of threads, NFA style, each waiting for its next element within its gap.
+ */
+struct sig_matcher {
+    const struct signature* sigs;
+    unsigned count;
+    unsigned* roots;                    // signature indices, grouped by first-element class
+    unsigned root_first[SIG_NTYPES + 1];
+    unsigned root_count[SIG_NTYPES + 1]; // last bucket is SIG_ANYINSN
+};
+
+struct sig_thread {
+    unsigned sig;
+    unsigned next;                      // element to match next
+    addr_t start;
+    addr_t deadline;                    // last offset the next element may sit at
+    uint8_t regs[SIG_MAX_CAPS];
+};
+
+static unsigned root_bucket(insn_type_t type) {
+    return ((unsigned)type < SIG_NTYPES) ? (unsigned)type : SIG_NTYPES;
+}
+
+struct sig_matcher* sig_compile(const struct signature* sigs, unsigned count) {
+    struct sig_matcher* m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+    m->sigs = sigs;
+    m->count = count;
+    m->roots = malloc((count ? count : 1) * sizeof(*m->roots));
+    if (!m->roots) {
+        free(m);
+        return NULL;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (!sigs[i].count)
+            continue;
+        m->root_count[root_bucket(sigs[i].elems[0].type)]++;
+    }
+    unsigned n = 0;
+    for (unsigned b = 0; b <= SIG_NTYPES; b++) {
+        m->root_first[b] = n;
+        n += m->root_count[b];
+        m->root_count[b] = 0;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (!sigs[i].count)
+            continue;
+        unsigned b = root_bucket(sigs[i].elems[0].type);
+        m->roots[m->root_first[b] + m->root_count[b]++] = i;
+    }
+    return m;
+}
+
+void sig_free(struct sig_matcher* m) {
+    if (m) {
+        free(m->roots);
+        free(m);
+    }
+}
+
+static bool match_reg(uint8_t want, uint8_t have, uint8_t* regs) {
+    if (want == SIG_ANY)
+        return true;
+    if (!(want & 0x80))
+        return want == have;
+    if (have == 0xFF)
+        return false;
+    uint8_t* slot = &regs[want & (SIG_MAX_CAPS - 1)];
+    if (*slot == SIG_ANY) {
+        *slot = have;
+        return true;
+    }
+    return *slot == have;
+}
+
+// on success regs holds the bindings made by this element; on failure it is garbage
+static bool match_elem(const struct sig_elem* e, const struct decoded_insn* insn, uint8_t* regs) {
+    if (e->type != SIG_ANYINSN && e->type != insn->type)
+        return false;
+    if (e->mask && (insn->insn & e->mask) != e->value)
+        return false;
+    return match_reg(e->rd, insn->rd, regs) &&
+           match_reg(e->rn, insn->rn, regs) &&
+           match_reg(e->rm, insn->rm, regs);
+}
+
+struct thread_set {
+    struct sig_thread* v;
+    size_t n, cap;
+};
+
+/*
+ * Queue a thread for the next word. Two threads that agree on everything
+ * but their deadline would match the same words from here on and report
+ * the same hits, so they are merged into one that keeps the later deadline;
+ * without this, gaps make the set (and the hits) grow with every word.
+ */
+static int thread_add(struct thread_set* s, const struct sig_thread* t) {
+    for (size_t i = 0; i < s->n; i++) {
+        struct sig_thread* o = &s->v[i];
+        if (o->sig == t->sig && o->next == t->next && o->start == t->start &&
+            !memcmp(o->regs, t->regs, sizeof(o->regs))) {
+            if (t->deadline > o->deadline)
+                o->deadline = t->deadline;
+            return 0;
+        }
+    }
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 64;
+        struct sig_thread* v = realloc(s->v, cap * sizeof(*v));
+        if (!v)
+            return -1;
+        s->v = v;
+        s->cap = cap;
+    }
+    s->v[s->n++] = *t;
+    return 0;
+}
+
+/*
+ * Advance (sig, elem) past an instruction at `at`: either report a hit or
+ * queue a thread for the following element. Returns nonzero to stop.
+ */
+static int step_thread(const struct sig_matcher* m, struct thread_set* out, unsigned sig, unsigned elem,
+                       addr_t start, addr_t at, const uint8_t* regs, sig_hit_cb cb, void* arg, size_t* hits) {
+    const struct signature* s = &m->sigs[sig];
+    if (elem + 1 == s->count) {
+        struct sig_hit hit;
+        hit.sig = sig;
+        hit.start = start;
+        hit.end = at;
+        memcpy(hit.regs, regs, sizeof(hit.regs));
+        (*hits)++;
+        return cb ? cb(&hit, arg) : 0;
+    }
+    struct sig_thread t;
+    t.sig = sig;
+    t.next = elem + 1;
+    t.start = start;
+    t.deadline = at + 4 + 4 * (addr_t)s->elems[elem + 1].gap;
+    memcpy(t.regs, regs, sizeof(t.regs));
+    return thread_add(out, &t);
+}
+
+size_t sig_scan(const struct sig_matcher* m, const uint8_t* buf, addr_t start, addr_t end, sig_hit_cb cb, void* arg) {
+    struct thread_set cur = { NULL, 0, 0 }, nxt = { NULL, 0, 0 };
+    size_t hits = 0;
+    int stop = 0;
+    if (!m || !buf)
+        return 0;
+    start &= ~3ULL;
+    for (addr_t at = start; at + 4 <= end && !stop; at += 4) {
+        struct decoded_insn insn;
+        uint32_t word;
+        memcpy(&word, buf + at, sizeof(word));
+        decode_insn(word, at, &insn);
+
+        nxt.n = 0;
+        for (size_t i = 0; i < cur.n && !stop; i++) {
+            struct sig_thread* t = &cur.v[i];
+            uint8_t regs[SIG_MAX_CAPS];
+            memcpy(regs, t->regs, sizeof(regs));
+            if (match_elem(&m->sigs[t->sig].elems[t->next], &insn, regs))
+                stop = step_thread(m, &nxt, t->sig, t->next, t->start, at, regs, cb, arg, &hits);
+            // the same thread may still skip this word if its gap allows
+            if (!stop && at < t->deadline)
+                stop = thread_add(&nxt, t);
+        }
+
+        unsigned buckets[2] = { root_bucket(insn.type), SIG_NTYPES };
+        for (int k = 0; k < 2 && !stop; k++) {
+            if (k && buckets[0] == SIG_NTYPES)
+                break;
+            const unsigned* r = m->roots + m->root_first[buckets[k]];
+            for (unsigned i = 0; i < m->root_count[buckets[k]] && !stop; i++) {
+                uint8_t regs[SIG_MAX_CAPS];
+                memset(regs, SIG_ANY, sizeof(regs));
+                if (match_elem(&m->sigs[r[i]].elems[0], &insn, regs))
+                    stop = step_thread(m, &nxt, r[i], 0, at, at, regs, cb, arg, &hits);
+            }
+        }
+
+        struct thread_set tmp = cur;
+        cur = nxt;
+        nxt = tmp;
+    }
+    free(cur.v);
+    free(nxt.v);
+    return hits;
+}
+
+static int first_hit_cb(const struct sig_hit* hit, void* arg) {
+    *(struct sig_hit*)arg = *hit;
+    return 1;
+}
+
+bool sig_first(const struct sig_matcher* m, const uint8_t* buf, addr_t start, addr_t end, struct sig_hit* out) {
+    struct sig_hit hit;
+    if (!sig_scan(m, buf, start, end, first_hit_cb, &hit))
+        return false;
+    if (out)
+        *out = hit;
+    return true;
+}
+
+static int last_hit_cb(const struct sig_hit* hit, void* arg) {
+    struct sig_hit* last = arg;
+    if (hit->start >= last->start)
+        *last = *hit;
+    return 0;
+}
+
+bool sig_last(const struct sig_matcher* m, const uint8_t* buf, addr_t start, addr_t end, struct sig_hit* out) {
+    struct sig_hit hit;
+    hit.start = 0;
+    if (!sig_scan(m, buf, start, end, last_hit_cb, &hit))
+        return false;
+    if (out)
+        *out = hit;
+    return true;
+}
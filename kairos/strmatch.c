@@ -0,0 +1,169 @@
+/*
+ * strmatch.c - find many byte strings, and long zero runs, in one pass
+ *
+ * Copyright 2020 dayt0n
+ *
+ * This file is part of kairos.
+ *
+ * kairos is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kairos is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kairos.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "strmatch.h"
+
+/*
+ * Aho-Corasick with the failure links folded into a dense 256-way
+ * transition table, so the scan loop is one load per byte. The anchor
+ * sets we use are a few hundred bytes of needles in total, which keeps
+ * the table well under a megabyte.
+ */
+struct strmatch {
+    unsigned count;
+    size_t lens[STRMATCH_MAX];
+    size_t zero_min;
+    uint32_t nstates;
+    uint32_t* delta;        // nstates * 256
+    uint32_t* out;          // needles ending at each state, failure chain included
+};
+
+struct strmatch* strmatch_compile(const struct strmatch_needle* needles, unsigned count, size_t zero_min) {
+    if (count > STRMATCH_MAX)
+        return NULL;
+    size_t total = 1;
+    for (unsigned i = 0; i < count; i++) {
+        if (!needles[i].len)
+            return NULL;
+        total += needles[i].len;
+    }
+    struct strmatch* m = calloc(1, sizeof(*m));
+    uint32_t* fail = calloc(total, sizeof(*fail));
+    uint32_t* queue = malloc(total * sizeof(*queue));
+    if (m) {
+        m->delta = calloc(total * 256, sizeof(*m->delta));
+        m->out = calloc(total, sizeof(*m->out));
+    }
+    if (!m || !fail || !queue || !m->delta || !m->out) {
+        free(fail);
+        free(queue);
+        strmatch_free(m);
+        return NULL;
+    }
+    m->count = count;
+    m->zero_min = zero_min;
+
+    // trie; 0 is the root and doubles as "no edge" while building
+    uint32_t n = 1;
+    for (unsigned i = 0; i < count; i++) {
+        const uint8_t* p = needles[i].pat;
+        uint32_t s = 0;
+        for (size_t k = 0; k < needles[i].len; k++) {
+            uint32_t* e = &m->delta[s * 256 + p[k]];
+            if (!*e)
+                *e = n++;
+            s = *e;
+        }
+        m->out[s] |= 1u << i;
+        m->lens[i] = needles[i].len;
+    }
+    m->nstates = n;
+
+    // breadth first: fill missing edges from the failure state
+    uint32_t head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        uint32_t t = m->delta[c];
+        if (t) {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        m->out[s] |= m->out[fail[s]];
+        for (int c = 0; c < 256; c++) {
+            uint32_t* e = &m->delta[s * 256 + c];
+            if (*e) {
+                fail[*e] = m->delta[fail[s] * 256 + c];
+                queue[tail++] = *e;
+            } else {
+                *e = m->delta[fail[s] * 256 + c];
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return m;
+}
+
+void strmatch_free(struct strmatch* m) {
+    if (m) {
+        free(m->delta);
+        free(m->out);
+        free(m);
+    }
+}
+
+static void close_zero_run(const struct strmatch* m, struct strmatch_result* r, size_t start, size_t len) {
+    if (!len)
+        return;
+    if (r->zero_first == STRMATCH_NONE && len >= m->zero_min) {
+        r->zero_first = start;
+        r->zero_first_len = len;
+    }
+    if (len > r->zero_longest_len) {
+        r->zero_longest = start;
+        r->zero_longest_len = len;
+    }
+}
+
+void strmatch_scan(const struct strmatch* m, const uint8_t* buf, size_t len, struct strmatch_result* r) {
+    for (unsigned i = 0; i < STRMATCH_MAX; i++)
+        r->first[i] = STRMATCH_NONE;
+    r->zero_first = r->zero_longest = STRMATCH_NONE;
+    r->zero_first_len = r->zero_longest_len = 0;
+    if (!m || !buf)
+        return;
+
+    uint32_t pending = m->count < 32 ? (1u << m->count) - 1 : ~0u;
+    uint32_t s = 0;
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+        if (m->zero_min) {
+            if (!c) {
+                run++;
+            } else {
+                close_zero_run(m, r, i - run, run);
+                run = 0;
+            }
+        }
+        if (!pending) {
+            if (!m->zero_min)
+                break;
+            continue;
+        }
+        s = m->delta[s * 256 + c];
+        uint32_t hit = m->out[s] & pending;
+        if (hit) {
+            pending &= ~hit;
+            do {
+                unsigned k = __builtin_ctz(hit);
+                r->first[k] = i + 1 - m->lens[k];
+                hit &= hit - 1;
+            } while (hit);
+        }
+    }
+    if (m->zero_min)
+        close_zero_run(m, r, len - run, run);
+}